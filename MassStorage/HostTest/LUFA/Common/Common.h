@@ -0,0 +1,15 @@
+/** \file
+ *
+ *  Host stand-in for the LUFA common header: only the attributes the firmware libraries use.
+ */
+
+#ifndef _HOST_LUFA_COMMON_H_
+#define _HOST_LUFA_COMMON_H_
+
+	/* Defines: */
+		#define ATTR_NON_NULL_PTR_ARG(...) __attribute__ ((nonnull (__VA_ARGS__)))
+		#define ATTR_CONST                 __attribute__ ((const))
+		#define ATTR_ALWAYS_INLINE         __attribute__ ((always_inline))
+		#define ATTR_WARN_UNUSED_RESULT    __attribute__ ((warn_unused_result))
+
+#endif
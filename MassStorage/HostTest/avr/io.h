@@ -0,0 +1,20 @@
+/** \file
+ *
+ *  Host stand-in for <avr/io.h>: the Timer 1 registers the firmware libraries touch, as plain variables
+ *  defined by the test program.
+ */
+
+#ifndef _HOST_AVR_IO_H_
+#define _HOST_AVR_IO_H_
+
+	/* Includes: */
+		#include <stdint.h>
+
+	/* Defines: */
+		#define CS10                       0
+
+	/* Global Variables: */
+		extern volatile uint8_t  TCCR1B;
+		extern volatile uint16_t TCNT1;
+
+#endif
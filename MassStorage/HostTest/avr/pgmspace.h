@@ -0,0 +1,19 @@
+/** \file
+ *
+ *  Host stand-in for <avr/pgmspace.h>: flash is ordinary memory on the host.
+ */
+
+#ifndef _HOST_AVR_PGMSPACE_H_
+#define _HOST_AVR_PGMSPACE_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <string.h>
+
+	/* Defines: */
+		#define PROGMEM
+		#define PSTR(s)                    (s)
+		#define pgm_read_byte(Address)     (*(const uint8_t*)(Address))
+		#define memcpy_P(Dest, Src, Length) memcpy((Dest), (Src), (Length))
+
+#endif
@@ -0,0 +1,369 @@
+/** \file
+ *
+ *  AES-128 block cipher with CMAC (RFC 4493) and counter mode, sized for the AVR. Only the forward
+ *  cipher is implemented since both modes use encryption in both directions. The S-box is kept in
+ *  flash and read with LPM, which on the AVR takes the same number of cycles for every address, and
+ *  no branch depends on key or data, so the run time of every routine here depends only on the
+ *  length of its input.
+ */
+
+#include "AES128.h"
+
+#include <string.h>
+
+/** CPU cycles taken by one block encryption, as measured by the last \ref AES128_SelfTest(). */
+uint16_t AES128_BlockCycles;
+
+/** AES forward S-box, FIPS-197 figure 7. */
+static const uint8_t SBox[256] PROGMEM =
+	{
+		0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+		0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+		0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+		0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+		0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+		0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+		0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+		0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+		0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+		0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+		0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+		0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+		0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+		0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+		0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+		0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+	};
+
+#define SBOX(x)   pgm_read_byte(&SBox[(x)])
+
+/** Multiplies a field element by x in GF(2^8), without branching on the value. */
+static inline uint8_t XTime(const uint8_t Value)
+{
+	return (uint8_t)((Value << 1) ^ (0x1B & -(Value >> 7)));
+}
+
+/** Doubles a 128-bit big-endian value in GF(2^128), as used to derive the CMAC subkeys. */
+static void AES128_Double(const uint8_t* In, uint8_t* Out)
+{
+	uint8_t Carry = 0;
+
+	for (int8_t i = (AES128_BLOCK_SIZE - 1); i >= 0; i--)
+	{
+		uint8_t Byte = In[i];
+
+		Out[i] = (uint8_t)((Byte << 1) | Carry);
+		Carry  = (Byte >> 7);
+	}
+
+	Out[AES128_BLOCK_SIZE - 1] ^= (0x87 & -Carry);
+}
+
+static inline void AES128_XorBlock(uint8_t* Dest, const uint8_t* Src)
+{
+	for (uint8_t i = 0; i < AES128_BLOCK_SIZE; i++)
+	  Dest[i] ^= Src[i];
+}
+
+/** Expands the given 128-bit key into the context's round key schedule only. This is enough for
+ *  \ref AES128_EncryptBlock() and \ref AES128_CTR(), and saves a block encryption over \ref AES128_Init()
+ *  when a key is replaced often.
+ *
+ *  \param[out] Context  AES context to initialize
+ *  \param[in]  Key      16 byte cipher key
+ */
+void AES128_SetKey(AES128_Context_t* Context, const uint8_t* Key)
+{
+	uint8_t* RoundKeys = Context->RoundKeys;
+	uint8_t  RCon      = 0x01;
+
+	memcpy(RoundKeys, Key, AES128_BLOCK_SIZE);
+
+	for (uint8_t i = AES128_BLOCK_SIZE; i < sizeof(Context->RoundKeys); i += 4)
+	{
+		uint8_t t0 = RoundKeys[i - 4];
+		uint8_t t1 = RoundKeys[i - 3];
+		uint8_t t2 = RoundKeys[i - 2];
+		uint8_t t3 = RoundKeys[i - 1];
+
+		if (!(i % AES128_BLOCK_SIZE))
+		{
+			/* RotWord, SubWord and the round constant, once per round key */
+			uint8_t Temp = t0;
+
+			t0 = SBOX(t1) ^ RCon;
+			t1 = SBOX(t2);
+			t2 = SBOX(t3);
+			t3 = SBOX(Temp);
+
+			RCon = XTime(RCon);
+		}
+
+		RoundKeys[i + 0] = RoundKeys[i - 16] ^ t0;
+		RoundKeys[i + 1] = RoundKeys[i - 15] ^ t1;
+		RoundKeys[i + 2] = RoundKeys[i - 14] ^ t2;
+		RoundKeys[i + 3] = RoundKeys[i - 13] ^ t3;
+	}
+}
+
+/** Expands the given 128-bit key into the context's round key schedule and derives the CMAC subkeys.
+ *
+ *  \param[out] Context  AES context to initialize
+ *  \param[in]  Key      16 byte cipher key
+ */
+void AES128_Init(AES128_Context_t* Context, const uint8_t* Key)
+{
+	AES128_SetKey(Context, Key);
+
+	/* CMAC subkeys: L = E(0), K1 = 2L, K2 = 4L */
+	memset(Context->K1, 0x00, AES128_BLOCK_SIZE);
+	AES128_EncryptBlock(Context, Context->K1);
+	AES128_Double(Context->K1, Context->K1);
+	AES128_Double(Context->K1, Context->K2);
+}
+
+/** Encrypts a single 16 byte block in place.
+ *
+ *  \param[in]     Context  Initialized AES context
+ *  \param[in,out] Block    Plaintext on entry, ciphertext on return
+ */
+void AES128_EncryptBlock(const AES128_Context_t* Context, uint8_t* Block)
+{
+	const uint8_t* RoundKey = Context->RoundKeys;
+	uint8_t        Temp;
+
+	AES128_XorBlock(Block, RoundKey);
+
+	for (uint8_t Round = 1; Round <= AES128_ROUNDS; Round++)
+	{
+		RoundKey += AES128_BLOCK_SIZE;
+
+		/* SubBytes and ShiftRows together; the state is stored column by column */
+		Block[0]  = SBOX(Block[0]);
+		Block[4]  = SBOX(Block[4]);
+		Block[8]  = SBOX(Block[8]);
+		Block[12] = SBOX(Block[12]);
+
+		Temp      = Block[1];
+		Block[1]  = SBOX(Block[5]);
+		Block[5]  = SBOX(Block[9]);
+		Block[9]  = SBOX(Block[13]);
+		Block[13] = SBOX(Temp);
+
+		Temp      = Block[2];
+		Block[2]  = SBOX(Block[10]);
+		Block[10] = SBOX(Temp);
+		Temp      = Block[6];
+		Block[6]  = SBOX(Block[14]);
+		Block[14] = SBOX(Temp);
+
+		Temp      = Block[15];
+		Block[15] = SBOX(Block[11]);
+		Block[11] = SBOX(Block[7]);
+		Block[7]  = SBOX(Block[3]);
+		Block[3]  = SBOX(Temp);
+
+		if (Round != AES128_ROUNDS)
+		{
+			/* MixColumns */
+			for (uint8_t Column = 0; Column < AES128_BLOCK_SIZE; Column += 4)
+			{
+				uint8_t a0 = Block[Column + 0];
+				uint8_t a1 = Block[Column + 1];
+				uint8_t a2 = Block[Column + 2];
+				uint8_t a3 = Block[Column + 3];
+				uint8_t t  = a0 ^ a1 ^ a2 ^ a3;
+
+				Block[Column + 0] = a0 ^ t ^ XTime(a0 ^ a1);
+				Block[Column + 1] = a1 ^ t ^ XTime(a1 ^ a2);
+				Block[Column + 2] = a2 ^ t ^ XTime(a2 ^ a3);
+				Block[Column + 3] = a3 ^ t ^ XTime(a3 ^ a0);
+			}
+		}
+
+		AES128_XorBlock(Block, RoundKey);
+	}
+}
+
+/** Absorbs whole message blocks into a CMAC chaining value, so that a common message prefix can be processed
+ *  ahead of time. The chaining value must start zeroed, and the blocks given here must not include the last
+ *  block of the message, which is always left for \ref AES128_CMAC_Final().
+ *
+ *  \param[in]     Context  Initialized AES context
+ *  \param[in,out] Chain    16 byte CMAC chaining value
+ *  \param[in]     Data     Message blocks to absorb
+ *  \param[in]     Blocks   Number of 16 byte blocks in Data
+ */
+void AES128_CMAC_Absorb(const AES128_Context_t* Context, uint8_t* Chain, const uint8_t* Data, uint8_t Blocks)
+{
+	while (Blocks--)
+	{
+		AES128_XorBlock(Chain, Data);
+		AES128_EncryptBlock(Context, Chain);
+
+		Data += AES128_BLOCK_SIZE;
+	}
+}
+
+/** Absorbs the rest of a message into a CMAC chaining value and turns it into the tag.
+ *
+ *  \param[in]     Context  Initialized AES context
+ *  \param[in,out] Chain    CMAC chaining value on entry, 16 byte tag on return
+ *  \param[in]     Data     Remainder of the message, may be NULL if Length is zero
+ *  \param[in]     Length   Length of the remainder in bytes
+ */
+void AES128_CMAC_Final(const AES128_Context_t* Context, uint8_t* Chain, const uint8_t* Data, uint16_t Length)
+{
+	while (Length > AES128_BLOCK_SIZE)
+	{
+		AES128_CMAC_Absorb(Context, Chain, Data, 1);
+
+		Data   += AES128_BLOCK_SIZE;
+		Length -= AES128_BLOCK_SIZE;
+	}
+
+	/* Last block: complete blocks use K1, short (or empty) ones are padded with 10* and use K2 */
+	for (uint8_t i = 0; i < Length; i++)
+	  Chain[i] ^= Data[i];
+
+	if (Length == AES128_BLOCK_SIZE)
+	{
+		AES128_XorBlock(Chain, Context->K1);
+	}
+	else
+	{
+		Chain[Length] ^= 0x80;
+		AES128_XorBlock(Chain, Context->K2);
+	}
+
+	AES128_EncryptBlock(Context, Chain);
+}
+
+/** Computes the AES-CMAC (RFC 4493) of a message.
+ *
+ *  \param[in]  Context  Initialized AES context
+ *  \param[in]  Data     Message to authenticate, may be NULL if Length is zero
+ *  \param[in]  Length   Length of the message in bytes
+ *  \param[out] MAC      16 byte tag
+ */
+void AES128_CMAC(const AES128_Context_t* Context, const uint8_t* Data, uint16_t Length, uint8_t* MAC)
+{
+	memset(MAC, 0x00, AES128_BLOCK_SIZE);
+	AES128_CMAC_Final(Context, MAC, Data, Length);
+}
+
+/** Generates a counter mode key stream. The counter block starts at the given IV and its last two bytes
+ *  are incremented (big-endian) for each following block.
+ *
+ *  \param[in]  Context  Initialized AES context
+ *  \param[in]  IV       16 byte initial counter block
+ *  \param[out] Out      Key stream output
+ *  \param[in]  Length   Number of key stream bytes to generate
+ */
+void AES128_CTR(const AES128_Context_t* Context, const uint8_t* IV, uint8_t* Out, uint16_t Length)
+{
+	uint8_t  Counter[AES128_BLOCK_SIZE];
+	uint8_t  Stream[AES128_BLOCK_SIZE];
+	uint16_t Index = ((uint16_t)IV[AES128_BLOCK_SIZE - 2] << 8) | IV[AES128_BLOCK_SIZE - 1];
+
+	memcpy(Counter, IV, AES128_BLOCK_SIZE);
+
+	while (Length)
+	{
+		uint8_t BytesInBlock = (Length < AES128_BLOCK_SIZE) ? Length : AES128_BLOCK_SIZE;
+
+		Counter[AES128_BLOCK_SIZE - 2] = (Index >> 8);
+		Counter[AES128_BLOCK_SIZE - 1] = (Index & 0xFF);
+
+		memcpy(Stream, Counter, AES128_BLOCK_SIZE);
+		AES128_EncryptBlock(Context, Stream);
+		memcpy(Out, Stream, BytesInBlock);
+
+		Out    += BytesInBlock;
+		Length -= BytesInBlock;
+		Index++;
+	}
+}
+
+/** Compares two buffers in time that depends only on their length.
+ *
+ *  \return Boolean true if the buffers hold the same bytes, false otherwise
+ */
+bool AES128_Equal(const uint8_t* A, const uint8_t* B, uint16_t Length)
+{
+	uint8_t Difference = 0;
+
+	while (Length--)
+	  Difference |= (*(A++) ^ *(B++));
+
+	return (Difference == 0);
+}
+
+/** Known answer vectors: FIPS-197 appendix C.1, then RFC 4493 section 4 examples 1 to 3. */
+static const uint8_t FIPSKey[16]     PROGMEM = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                                0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static const uint8_t FIPSPlain[16]   PROGMEM = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                                                0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+static const uint8_t FIPSCipher[16]  PROGMEM = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+                                                0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+static const uint8_t CMACKey[16]     PROGMEM = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                                0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const uint8_t CMACMessage[40] PROGMEM = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+                                                0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                                                0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+                                                0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                                                0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11};
+static const uint8_t CMACTags[3][16] PROGMEM =
+	{
+		{0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46},
+		{0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c},
+		{0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27},
+	};
+
+/** Checks the cipher and CMAC against the published test vectors, and leaves the number of CPU cycles
+ *  taken by one block encryption (measured on Timer 1 running at the CPU clock) in \ref AES128_BlockCycles.
+ *
+ *  \return Boolean true if every vector matched, false otherwise
+ */
+bool AES128_SelfTest(void)
+{
+	static const uint8_t CMACLengths[3] = {0, 16, 40};
+
+	AES128_Context_t Context;
+	uint8_t          Key[AES128_BLOCK_SIZE];
+	uint8_t          Block[AES128_BLOCK_SIZE];
+	uint8_t          Expected[AES128_BLOCK_SIZE];
+	uint8_t          Message[sizeof(CMACMessage)];
+	bool             Passed;
+	uint8_t          SavedTCCR1B = TCCR1B;
+	uint16_t         Start;
+
+	memcpy_P(Key, FIPSKey, sizeof(Key));
+	memcpy_P(Block, FIPSPlain, sizeof(Block));
+	memcpy_P(Expected, FIPSCipher, sizeof(Expected));
+	AES128_Init(&Context, Key);
+
+	/* Time the known answer block itself, so the measurement is never optimized away. The counter is not
+	 * reset, as Timer 1 may already be free-running for another user. */
+	TCCR1B = (1 << CS10);
+	Start  = TCNT1;
+	AES128_EncryptBlock(&Context, Block);
+	AES128_BlockCycles = (TCNT1 - Start);
+	TCCR1B = SavedTCCR1B;
+
+	Passed = AES128_Equal(Block, Expected, AES128_BLOCK_SIZE);
+
+	memcpy_P(Key, CMACKey, sizeof(Key));
+	memcpy_P(Message, CMACMessage, sizeof(Message));
+	AES128_Init(&Context, Key);
+
+	for (uint8_t i = 0; i < sizeof(CMACLengths); i++)
+	{
+		memcpy_P(Expected, CMACTags[i], sizeof(Expected));
+		AES128_CMAC(&Context, Message, CMACLengths[i], Block);
+
+		Passed &= AES128_Equal(Block, Expected, AES128_BLOCK_SIZE);
+	}
+
+	return Passed;
+}
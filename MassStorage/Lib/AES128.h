@@ -0,0 +1,52 @@
+/** \file
+ *
+ *  Header file for AES128.c.
+ */
+
+#ifndef _AES128_H_
+#define _AES128_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/pgmspace.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Size of an AES block and key, in bytes. */
+		#define AES128_BLOCK_SIZE          16
+
+		/** Number of rounds for a 128-bit key. */
+		#define AES128_ROUNDS              10
+
+	/* Type Defines: */
+		/** Type define for an expanded AES-128 key, together with the two CMAC subkeys derived from it. */
+		typedef struct
+		{
+			uint8_t RoundKeys[(AES128_ROUNDS + 1) * AES128_BLOCK_SIZE]; /**< Expanded encryption key schedule */
+			uint8_t K1[AES128_BLOCK_SIZE]; /**< CMAC subkey used when the last block is complete */
+			uint8_t K2[AES128_BLOCK_SIZE]; /**< CMAC subkey used when the last block is padded */
+		} AES128_Context_t;
+
+	/* Global Variables: */
+		extern uint16_t AES128_BlockCycles;
+
+	/* Function Prototypes: */
+		void AES128_SetKey(AES128_Context_t* Context, const uint8_t* Key) ATTR_NON_NULL_PTR_ARG(1, 2);
+		void AES128_Init(AES128_Context_t* Context, const uint8_t* Key) ATTR_NON_NULL_PTR_ARG(1, 2);
+		void AES128_EncryptBlock(const AES128_Context_t* Context, uint8_t* Block) ATTR_NON_NULL_PTR_ARG(1, 2);
+		void AES128_CMAC_Absorb(const AES128_Context_t* Context, uint8_t* Chain, const uint8_t* Data,
+		                        uint8_t Blocks) ATTR_NON_NULL_PTR_ARG(1, 2);
+		void AES128_CMAC_Final(const AES128_Context_t* Context, uint8_t* Chain, const uint8_t* Data,
+		                       uint16_t Length) ATTR_NON_NULL_PTR_ARG(1, 2);
+		void AES128_CMAC(const AES128_Context_t* Context, const uint8_t* Data, uint16_t Length,
+		                 uint8_t* MAC) ATTR_NON_NULL_PTR_ARG(1, 4);
+		void AES128_CTR(const AES128_Context_t* Context, const uint8_t* IV, uint8_t* Out,
+		                uint16_t Length) ATTR_NON_NULL_PTR_ARG(1, 2, 3);
+		bool AES128_Equal(const uint8_t* A, const uint8_t* B, uint16_t Length) ATTR_NON_NULL_PTR_ARG(1, 2);
+		bool AES128_SelfTest(void);
+
+#endif
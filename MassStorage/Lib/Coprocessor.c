@@ -0,0 +1,155 @@
+/** \file
+ *
+ *  Offload of the WRP write session hash to an atmega328 running the coprocessor mode of the atmega328 sketch. The
+ *  328 sits on the SPI bus shared with the SD card, behind its own chip select, and tells when it can take the next
+ *  frame on a ready line. Written data is staged here and sent a SHA-256 message block at a time; the 328 compresses
+ *  each block while this side carries on with USB and the card, and the digest is collected when the session ends.
+ *
+ *  Frames are only ever sent while the SD card is deselected, between the card transfers of sd_raw. The SPI clock
+ *  the card runs at is saved and restored around each frame. If the 328 stops answering, the session digest is
+ *  reported as unavailable, so the session fails instead of committing unchecked data.
+ */
+
+#if defined(WRP_COPROCESSOR)
+
+#include "Coprocessor.h"
+
+/** Written data not yet sent to the coprocessor. */
+static uint8_t Staged[COPROCESSOR_FRAME_SIZE];
+static uint8_t StagedLength;
+
+/** Set once the coprocessor has failed to become ready during the current hash. */
+static bool    Failed;
+
+/** Waits for the coprocessor's ready line, giving up after \ref COPROCESSOR_READY_POLLS polls.
+ *
+ *  \return Boolean true if the coprocessor is ready, false otherwise
+ */
+static bool Coprocessor_WaitReady(void)
+{
+	for (uint16_t Polls = 0; Polls < COPROCESSOR_READY_POLLS; Polls++)
+	{
+		if (COPROCESSOR_READY_PIN & COPROCESSOR_READY_BIT)
+		  return true;
+	}
+
+	Failed = true;
+	return false;
+}
+
+static uint8_t Coprocessor_Transfer(const uint8_t Byte)
+{
+	SPDR = Byte;
+	while (!(SPSR & (1 << SPIF)));
+	return SPDR;
+}
+
+/** Sends one frame to the coprocessor once it is ready.
+ *
+ *  \param[in] Command  Frame command, a COPROCESSOR_CMD_* value
+ *  \param[in] Data     Payload of a COPROCESSOR_CMD_HASH_DATA frame, NULL for the other commands
+ *  \param[in] Length   Length of the payload in bytes
+ */
+static void Coprocessor_SendFrame(const uint8_t Command, const uint8_t* Data, const uint8_t Length)
+{
+	if (Failed || !(Coprocessor_WaitReady()))
+	  return;
+
+	uint8_t SavedSPCR = SPCR;
+	uint8_t SavedSPSR = SPSR;
+
+	SPCR = COPROCESSOR_SPCR;
+	SPSR &= ~(1 << SPI2X);
+	COPROCESSOR_CS_PORT &= ~COPROCESSOR_CS_BIT;
+
+	Coprocessor_Transfer(Command);
+	if (Data != NULL)
+	{
+		Coprocessor_Transfer(Length);
+		for (uint8_t i = 0; i < Length; i++)
+		  Coprocessor_Transfer(Data[i]);
+	}
+
+	COPROCESSOR_CS_PORT |= COPROCESSOR_CS_BIT;
+	SPCR = SavedSPCR;
+	SPSR = SavedSPSR;
+}
+
+/** Configures the coprocessor's chip select and ready lines. The SPI bus itself is set up by sd_raw. */
+void Coprocessor_Init(void)
+{
+	COPROCESSOR_CS_PORT  |= COPROCESSOR_CS_BIT;
+	COPROCESSOR_CS_DDR   |= COPROCESSOR_CS_BIT;
+	COPROCESSOR_READY_DDR &= ~COPROCESSOR_READY_BIT;
+}
+
+/** Starts a new SHA-256 on the coprocessor. */
+void Coprocessor_HashInit(void)
+{
+	StagedLength = 0;
+	Failed       = false;
+
+	Coprocessor_SendFrame(COPROCESSOR_CMD_HASH_INIT, NULL, 0);
+}
+
+/** Adds data to the SHA-256 running on the coprocessor. Data is sent on a message block at a time, so most calls
+ *  return without touching the bus.
+ *
+ *  \param[in] Data    Data to hash
+ *  \param[in] Length  Length of the data in bytes
+ */
+void Coprocessor_HashUpdate(const uint8_t* Data, const uint8_t Length)
+{
+	for (uint8_t i = 0; i < Length; i++)
+	{
+		Staged[StagedLength++] = Data[i];
+
+		if (StagedLength == COPROCESSOR_FRAME_SIZE)
+		{
+			Coprocessor_SendFrame(COPROCESSOR_CMD_HASH_DATA, Staged, COPROCESSOR_FRAME_SIZE);
+			StagedLength = 0;
+		}
+	}
+}
+
+/** Finishes the SHA-256 running on the coprocessor and reads its digest back.
+ *
+ *  \param[out] Digest  SHA-256 of all data passed to \ref Coprocessor_HashUpdate() since \ref Coprocessor_HashInit()
+ *
+ *  \return Boolean true if the digest was read, false if the coprocessor failed to answer at any point of the hash
+ */
+bool Coprocessor_HashFinal(uint8_t* Digest)
+{
+	if (StagedLength)
+	  Coprocessor_SendFrame(COPROCESSOR_CMD_HASH_DATA, Staged, StagedLength);
+	StagedLength = 0;
+
+	Coprocessor_SendFrame(COPROCESSOR_CMD_HASH_FINAL, NULL, 0);
+
+	/* The ready line rises again once the digest is loaded for the next frame to clock out */
+	if (Failed || !(Coprocessor_WaitReady()))
+	  return false;
+
+	uint8_t SavedSPCR = SPCR;
+	uint8_t SavedSPSR = SPSR;
+
+	SPCR = COPROCESSOR_SPCR;
+	SPSR &= ~(1 << SPI2X);
+	COPROCESSOR_CS_PORT &= ~COPROCESSOR_CS_BIT;
+	_delay_us(10);
+
+	/* The slave can't buffer what it sends, so leave it time to drive MISO and to load each byte */
+	for (uint8_t i = 0; i < 32; i++)
+	{
+		Digest[i] = Coprocessor_Transfer(0xFF);
+		_delay_us(10);
+	}
+
+	COPROCESSOR_CS_PORT |= COPROCESSOR_CS_BIT;
+	SPCR = SavedSPCR;
+	SPSR = SavedSPSR;
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,61 @@
+/** \file
+ *
+ *  Header file for Coprocessor.c.
+ */
+
+#ifndef _COPROCESSOR_H_
+#define _COPROCESSOR_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <util/delay.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Chip select of the coprocessor on the SPI bus shared with the SD card, active low. */
+		#if !defined(COPROCESSOR_CS_BIT)
+			#define COPROCESSOR_CS_DDR         DDRB
+			#define COPROCESSOR_CS_PORT        PORTB
+			#define COPROCESSOR_CS_BIT         (1 << 5)
+		#endif
+
+		/** Ready line driven by the coprocessor, high when it can take the next frame or its result is waiting. */
+		#if !defined(COPROCESSOR_READY_BIT)
+			#define COPROCESSOR_READY_DDR      DDRB
+			#define COPROCESSOR_READY_PIN      PINB
+			#define COPROCESSOR_READY_BIT      (1 << 4)
+		#endif
+
+		/** SPI control register value used while talking to the coprocessor. The coprocessor is a slave that
+		 *  stores every byte from an interrupt, so the clock is kept at f_OSC / 16 to leave it time to do so.
+		 */
+		#if !defined(COPROCESSOR_SPCR)
+			#define COPROCESSOR_SPCR           ((1 << SPE) | (1 << MSTR) | (1 << SPR0))
+		#endif
+
+		/** Number of polls of the ready line before the coprocessor is given up on, about 20ms; several times the
+		 *  time the coprocessor takes to hash a full frame.
+		 */
+		#define COPROCESSOR_READY_POLLS        60000
+
+		/** Frame commands of the coprocessor protocol. Each frame is sent with the chip select held low; a frame
+		 *  may only start once the ready line is high. These must match the atmega328 sketch.
+		 */
+		#define COPROCESSOR_CMD_HASH_INIT      0x01 /**< Start a new SHA-256 */
+		#define COPROCESSOR_CMD_HASH_DATA      0x02 /**< Length byte (1 to COPROCESSOR_FRAME_SIZE), then that many bytes */
+		#define COPROCESSOR_CMD_HASH_FINAL     0x03 /**< Finish the SHA-256; the next frame clocks out the digest */
+
+		/** Largest payload of a COPROCESSOR_CMD_HASH_DATA frame, one SHA-256 message block. */
+		#define COPROCESSOR_FRAME_SIZE         64
+
+	/* Function Prototypes: */
+		void Coprocessor_Init(void);
+		void Coprocessor_HashInit(void);
+		void Coprocessor_HashUpdate(const uint8_t* Data, const uint8_t Length) ATTR_NON_NULL_PTR_ARG(1);
+		bool Coprocessor_HashFinal(uint8_t* Digest) ATTR_NON_NULL_PTR_ARG(1);
+
+#endif
@@ -0,0 +1,371 @@
+/** \file
+ *
+ *  FAT32-aware write protection of individual files and directories. The host only ever writes blocks, so the guard
+ *  reads the volume's boot sector and FAT from the card and turns each protected object (identified by its first
+ *  cluster and the block holding its directory entry) into the runs of blocks its cluster chain occupies. Each
+ *  WRITE (10) is then checked against that small cache, and refused if it would touch a protected object's data or
+ *  directory entry. Directory entries are guarded a block at a time, so the other entries sharing that block are
+ *  protected with it.
+ *
+ *  The cache is only rebuilt when it may have gone out of date: a write to a FAT sector that holds an entry of a
+ *  protected chain (in any copy of the FAT) marks it stale, and the chains are walked again once that write is
+ *  done, while the device is idle or at the latest before the next write is checked. A write to the reserved
+ *  region, as when the card is reformatted, also makes the guard read the boot sector again.
+ *
+ *  While objects are protected and no FAT32 volume can be found on the card (as part way through reformatting it),
+ *  every write is refused until the host clears the objects.
+ *
+ *  The FAT itself is not protected by the guard, so a host can still unlink a protected file's clusters from its
+ *  chain; use the LBA write policy to protect the FAT where that matters.
+ *
+ *  Only built when WRP_FILE_GUARD is defined.
+ */
+
+#include "FileGuard.h"
+#include "SDCardManager.h"
+
+#if defined(WRP_FILE_GUARD)
+
+/** Protected objects, as last set by the host. */
+static uint8_t           StoredCount EEMEM = 0;
+static FileGuardObject_t StoredObjects[FILE_GUARD_MAX_OBJECTS] EEMEM;
+
+static uint8_t           ObjectCount;
+static FileGuardObject_t Objects[FILE_GUARD_MAX_OBJECTS];
+
+/** Cached runs of blocks of the protected cluster chains. */
+static uint8_t           ExtentCount;
+static FileGuardExtent_t Extents[FILE_GUARD_EXTENTS];
+
+/** Volume layout, in blocks of the card, read from the boot sector. */
+static uint32_t          VolumeStart;
+static uint32_t          FATStart;
+static uint32_t          FATSize;
+static uint32_t          DataStart;
+static uint32_t          ClusterCount;
+static uint8_t           FATCount;
+static uint8_t           ClusterShift;
+
+/** Cache state, one of the FILE_GUARD_STATE_* values, and whether the layout must be read again first. */
+static uint8_t           State;
+static bool              LayoutStale;
+
+/** Number of writes refused by the guard, and of times the cluster chain cache was rebuilt. */
+uint32_t FileGuard_Rejects;
+uint32_t FileGuard_Rebuilds;
+
+/** Timer 1 cycles taken by the last call to \ref FileGuard_Check(), not counting any rebuild it had to do first. */
+uint16_t FileGuard_CheckCycles;
+
+/** Reads a little-endian 32-bit field of an on-disk structure. */
+static uint32_t FileGuard_ReadLE32(const uint8_t* Data)
+{
+	return (((uint32_t)Data[3] << 24) | ((uint32_t)Data[2] << 16) | ((uint16_t)Data[1] << 8) | Data[0]);
+}
+
+/** Reads a big-endian 32-bit field of an object sent by the host. */
+static uint32_t FileGuard_ReadBE32(const uint8_t* Data)
+{
+	return (((uint32_t)Data[0] << 24) | ((uint32_t)Data[1] << 16) | ((uint16_t)Data[2] << 8) | Data[3]);
+}
+
+/** Reads the boot sector of the FAT32 volume at the given block into the layout variables.
+ *
+ *  \return FILE_GUARD_STATE_READY if the block holds a usable FAT32 boot sector, FILE_GUARD_STATE_NO_VOLUME if it
+ *          does not, or FILE_GUARD_STATE_STALE if it could not be read
+ */
+static uint8_t FileGuard_ReadBootSector(const uint32_t Block)
+{
+	uint8_t BootSector[48];
+
+	if (!(SDCardManager_ReadData(Block, 0, BootSector, sizeof(BootSector))))
+	  return FILE_GUARD_STATE_STALE;
+
+	uint16_t BytesPerSector    = (((uint16_t)BootSector[12] << 8) | BootSector[11]);
+	uint8_t  SectorsPerCluster = BootSector[13];
+	uint16_t ReservedSectors   = (((uint16_t)BootSector[15] << 8) | BootSector[14]);
+	uint16_t FATSize16         = (((uint16_t)BootSector[23] << 8) | BootSector[22]);
+	uint32_t TotalSectors      = FileGuard_ReadLE32(&BootSector[32]);
+
+	/* Only 512 byte sectors and power of two cluster sizes map simply onto the card's blocks */
+	if ((BytesPerSector != 512) || !(SectorsPerCluster) || (SectorsPerCluster & (SectorsPerCluster - 1)) ||
+	    !(ReservedSectors) || !(BootSector[16]) || FATSize16)
+	{
+		return FILE_GUARD_STATE_NO_VOLUME;
+	}
+
+	VolumeStart  = Block;
+	FATStart     = (Block + ReservedSectors);
+	FATSize      = FileGuard_ReadLE32(&BootSector[36]);
+	FATCount     = BootSector[16];
+	DataStart    = (FATStart + ((uint32_t)FATCount * FATSize));
+
+	for (ClusterShift = 0; (1 << ClusterShift) != SectorsPerCluster; ClusterShift++);
+
+	if (!(FATSize) || (TotalSectors <= (DataStart - Block)))
+	  return FILE_GUARD_STATE_NO_VOLUME;
+
+	ClusterCount = ((TotalSectors - (DataStart - Block)) >> ClusterShift);
+
+	return FILE_GUARD_STATE_READY;
+}
+
+/** Finds the FAT32 volume, either at the start of the card or in the first partition of its MBR.
+ *
+ *  \return FILE_GUARD_STATE_READY if a FAT32 volume was found, FILE_GUARD_STATE_NO_VOLUME if there is none, or
+ *          FILE_GUARD_STATE_STALE if the card could not be read
+ */
+static uint8_t FileGuard_ReadLayout(void)
+{
+	uint8_t Partition[16];
+	uint8_t Found = FileGuard_ReadBootSector(0);
+
+	if (Found != FILE_GUARD_STATE_NO_VOLUME)
+	  return Found;
+
+	if (!(SDCardManager_ReadData(0, 446, Partition, sizeof(Partition))))
+	  return FILE_GUARD_STATE_STALE;
+
+	if ((Partition[4] != 0x0B) && (Partition[4] != 0x0C))
+	  return FILE_GUARD_STATE_NO_VOLUME;
+
+	return FileGuard_ReadBootSector(FileGuard_ReadLE32(&Partition[8]));
+}
+
+/** Walks the cluster chains of all protected objects and caches them as runs of blocks. A read error leaves the cache
+ *  stale, so that the next check or idle task tries again.
+ */
+static void FileGuard_Rebuild(void)
+{
+	ExtentCount = 0;
+	State       = FILE_GUARD_STATE_READY;
+	FileGuard_Rebuilds++;
+
+	if (LayoutStale)
+	{
+		State = FileGuard_ReadLayout();
+
+		if (State != FILE_GUARD_STATE_READY)
+		  return;
+
+		LayoutStale = false;
+	}
+
+	for (uint8_t i = 0; i < ObjectCount; i++)
+	{
+		uint32_t Cluster  = Objects[i].FirstCluster;
+		uint32_t RunStart = Cluster;
+		uint32_t Steps    = 0;
+
+		/* A chain longer than the volume has clusters must loop, so the count also bounds a corrupt FAT */
+		while ((Cluster >= 2) && (Cluster < (ClusterCount + 2)) && (Steps++ < ClusterCount))
+		{
+			uint8_t  Entry[4];
+			uint32_t Next;
+
+			if (!(SDCardManager_ReadData(FATStart + (Cluster >> 7), ((Cluster & 0x7F) << 2), Entry, sizeof(Entry))))
+			{
+				State = FILE_GUARD_STATE_STALE;
+				return;
+			}
+
+			Next = (FileGuard_ReadLE32(Entry) & 0x0FFFFFFF);
+
+			/* Close the run at the end of the chain or where it jumps */
+			if (Next != (Cluster + 1))
+			{
+				if (ExtentCount == FILE_GUARD_EXTENTS)
+				{
+					State = FILE_GUARD_STATE_OVERFLOW;
+					return;
+				}
+
+				Extents[ExtentCount].FirstBlock = (DataStart + ((RunStart - 2) << ClusterShift));
+				Extents[ExtentCount].EndBlock   = (DataStart + ((Cluster - 1) << ClusterShift));
+				ExtentCount++;
+
+				RunStart = Next;
+			}
+
+			Cluster = Next;
+		}
+	}
+}
+
+/** Loads the protected objects from EEPROM and builds the cluster chain cache. Call once the card is initialized. */
+void FileGuard_Init(void)
+{
+	ObjectCount = eeprom_read_byte(&StoredCount);
+
+	if (ObjectCount > FILE_GUARD_MAX_OBJECTS)
+	  ObjectCount = 0;
+
+	eeprom_read_block(Objects, StoredObjects, sizeof(Objects));
+
+	LayoutStale = true;
+	FileGuard_Rebuild();
+}
+
+/** Idle-time work: rebuilds the cluster chain cache if a write has made it stale. */
+void FileGuard_Task(void)
+{
+	if (State == FILE_GUARD_STATE_STALE)
+	  FileGuard_Rebuild();
+}
+
+/** Checks a WRITE (10) against the protected objects, and marks the cache stale if the write reaches a FAT sector
+ *  holding part of a protected chain.
+ *
+ *  \param[in] BlockAddress  First block to be written
+ *  \param[in] TotalBlocks   Number of blocks to be written
+ *
+ *  \return Boolean true if the write touches no protected object, false otherwise
+ */
+bool FileGuard_Check(const uint32_t BlockAddress, const uint16_t TotalBlocks)
+{
+	uint32_t End = (BlockAddress + TotalBlocks);
+
+	if (!(ObjectCount))
+	  return true;
+
+	/* The write that made the cache stale is finished by now, so the FAT can be walked again */
+	if (State == FILE_GUARD_STATE_STALE)
+	  FileGuard_Rebuild();
+
+	uint16_t Start   = TCNT1;
+	bool     Allowed = true;
+
+	/* A cache still stale after the rebuild could not be read, so nothing is known to be safe */
+	if ((State == FILE_GUARD_STATE_NO_VOLUME) || (State == FILE_GUARD_STATE_STALE))
+	{
+		Allowed = false;
+	}
+	else if (State == FILE_GUARD_STATE_OVERFLOW)
+	{
+		Allowed = (End <= DataStart);
+	}
+	else
+	{
+		for (uint8_t i = 0; i < ExtentCount; i++)
+		{
+			if ((BlockAddress < Extents[i].EndBlock) && (End > Extents[i].FirstBlock))
+			  Allowed = false;
+		}
+	}
+
+	for (uint8_t i = 0; i < ObjectCount; i++)
+	{
+		if (Objects[i].EntryBlock && (Objects[i].EntryBlock >= BlockAddress) && (Objects[i].EntryBlock < End))
+		  Allowed = false;
+	}
+
+	if (Allowed && (BlockAddress < DataStart) && (End > VolumeStart))
+	{
+		if (BlockAddress < FATStart)
+		{
+			/* The boot sector may be changing, so find the volume again once the write is done */
+			LayoutStale = true;
+			State       = FILE_GUARD_STATE_STALE;
+		}
+		else
+		{
+			/* Each FAT sector holds the entries of 128 clusters; compare those written with each cached run */
+			uint32_t FirstSector = (BlockAddress - FATStart);
+			uint32_t EndSector   = ((End < DataStart) ? End : DataStart) - FATStart;
+
+			for (uint8_t i = 0; i < ExtentCount; i++)
+			{
+				uint32_t RunFirst = ((((Extents[i].FirstBlock - DataStart) >> ClusterShift) + 2) >> 7);
+				uint32_t RunLast  = ((((Extents[i].EndBlock - 1 - DataStart) >> ClusterShift) + 2) >> 7);
+
+				for (uint8_t Copy = 0; Copy < FATCount; Copy++)
+				{
+					uint32_t CopyStart = ((uint32_t)Copy * FATSize);
+
+					if ((FirstSector <= (CopyStart + RunLast)) && (EndSector > (CopyStart + RunFirst)))
+					  State = FILE_GUARD_STATE_STALE;
+				}
+			}
+
+			/* An overflowed cache may be fixed by a change to any chain */
+			if (State == FILE_GUARD_STATE_OVERFLOW)
+			  State = FILE_GUARD_STATE_STALE;
+		}
+	}
+
+	if (!(Allowed))
+	  FileGuard_Rejects++;
+
+	FileGuard_CheckCycles = (TCNT1 - Start);
+
+	return Allowed;
+}
+
+/** Returns the number of protected objects. */
+uint8_t FileGuard_GetObjectCount(void)
+{
+	return ObjectCount;
+}
+
+/** Reads one protected object in the form exchanged with the host.
+ *
+ *  \param[in]  Index   Index of the object, below \ref FileGuard_GetObjectCount()
+ *  \param[out] Object  FILE_GUARD_OBJECT_SIZE bytes: first cluster, directory entry block (both big-endian)
+ */
+void FileGuard_GetObject(const uint8_t Index, uint8_t* Object)
+{
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		Object[i]     = (Objects[Index].FirstCluster >> (24 - (i * 8)));
+		Object[i + 4] = (Objects[Index].EntryBlock   >> (24 - (i * 8)));
+	}
+}
+
+/** Returns the state of the cluster chain cache, one of the FILE_GUARD_STATE_* values. */
+uint8_t FileGuard_GetState(void)
+{
+	return State;
+}
+
+/** Returns the number of runs of blocks in the cluster chain cache. */
+uint8_t FileGuard_GetExtentCount(void)
+{
+	return ExtentCount;
+}
+
+/** Replaces the protected objects and rebuilds the cluster chain cache for them.
+ *
+ *  \param[in] NewObjects  Count objects of FILE_GUARD_OBJECT_SIZE bytes, see \ref FileGuard_GetObject()
+ *  \param[in] Count       Number of objects, at most FILE_GUARD_MAX_OBJECTS
+ *
+ *  \return Boolean true if the objects were stored, false if there are too many or one has no valid first cluster
+ */
+bool FileGuard_SetObjects(const uint8_t* NewObjects, const uint8_t Count)
+{
+	if (Count > FILE_GUARD_MAX_OBJECTS)
+	  return false;
+
+	for (uint8_t i = 0; i < Count; i++)
+	{
+		if (FileGuard_ReadBE32(&NewObjects[i * FILE_GUARD_OBJECT_SIZE]) < 2)
+		  return false;
+	}
+
+	for (uint8_t i = 0; i < Count; i++)
+	{
+		Objects[i].FirstCluster = FileGuard_ReadBE32(&NewObjects[i * FILE_GUARD_OBJECT_SIZE]);
+		Objects[i].EntryBlock   = FileGuard_ReadBE32(&NewObjects[(i * FILE_GUARD_OBJECT_SIZE) + 4]);
+	}
+
+	ObjectCount = Count;
+
+	eeprom_update_block(Objects, StoredObjects, sizeof(Objects));
+	eeprom_update_byte(&StoredCount, Count);
+
+	LayoutStale = true;
+	FileGuard_Rebuild();
+
+	return true;
+}
+
+#endif
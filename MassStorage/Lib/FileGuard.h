@@ -0,0 +1,74 @@
+/** \file
+ *
+ *  Header file for FileGuard.c.
+ */
+
+#ifndef _FILE_GUARD_H_
+#define _FILE_GUARD_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/eeprom.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Largest number of files and directories that can be protected. Each takes 8 bytes of RAM and of EEPROM. */
+		#if !defined(FILE_GUARD_MAX_OBJECTS)
+			#define FILE_GUARD_MAX_OBJECTS     4
+		#endif
+
+		/** Number of runs of contiguous clusters cached for the protected objects, 8 bytes of RAM each. A protected
+		 *  object fragmented into more runs than fit makes the guard refuse every write to the data region.
+		 */
+		#if !defined(FILE_GUARD_EXTENTS)
+			#define FILE_GUARD_EXTENTS         16
+		#endif
+
+		/** Size of one protected object as exchanged with the host: first cluster (4), block holding its directory
+		 *  entry (4), both big-endian.
+		 */
+		#define FILE_GUARD_OBJECT_SIZE         8
+
+		/** State of the cluster chain cache, as returned by \ref FileGuard_GetState(). */
+		#define FILE_GUARD_STATE_READY         0 /**< Cache matches the FAT */
+		#define FILE_GUARD_STATE_STALE         1 /**< A FAT sector holding a protected chain was written since, or the card could not be read */
+		#define FILE_GUARD_STATE_OVERFLOW      2 /**< A protected chain has more runs than FILE_GUARD_EXTENTS */
+		#define FILE_GUARD_STATE_NO_VOLUME     3 /**< No FAT32 volume found on the card */
+
+	/* Type Defines: */
+		/** Type define for a protected file or directory: the start of its cluster chain, and the block holding its
+		 *  directory entry (zero for none, as for the root directory).
+		 */
+		typedef struct
+		{
+			uint32_t FirstCluster; /**< First cluster of the object's data */
+			uint32_t EntryBlock; /**< Block of the card holding the object's directory entry */
+		} FileGuardObject_t;
+
+		/** Type define for a cached run of contiguous clusters of a protected object, as blocks of the card. */
+		typedef struct
+		{
+			uint32_t FirstBlock; /**< First block of the run */
+			uint32_t EndBlock; /**< One past the last block of the run */
+		} FileGuardExtent_t;
+
+	/* Global Variables: */
+		extern uint32_t FileGuard_Rejects;
+		extern uint32_t FileGuard_Rebuilds;
+		extern uint16_t FileGuard_CheckCycles;
+
+	/* Function Prototypes: */
+		void FileGuard_Init(void);
+		void FileGuard_Task(void);
+		bool FileGuard_Check(const uint32_t BlockAddress, const uint16_t TotalBlocks);
+		uint8_t FileGuard_GetObjectCount(void);
+		void FileGuard_GetObject(const uint8_t Index, uint8_t* Object) ATTR_NON_NULL_PTR_ARG(2);
+		uint8_t FileGuard_GetState(void);
+		uint8_t FileGuard_GetExtentCount(void);
+		bool FileGuard_SetObjects(const uint8_t* NewObjects, const uint8_t Count);
+
+#endif
@@ -0,0 +1,90 @@
+/** \file
+ *
+ *  Storage backend for the SD card attached to this processor's SPI bus, through sd_raw.
+ */
+
+#include "SDCardManager.h"
+#include "sd_raw.h"
+
+/** Chunk of a block on its way between the card and the data endpoints. */
+static uint8_t Buffer[16];
+
+static void LocalStorage_Init(void)
+{
+	while(!sd_raw_init())
+		printf_P(PSTR("MMC/SD initialization failed\r\n"));
+}
+
+static uint32_t LocalStorage_GetNbBlocks(void)
+{
+	struct sd_raw_info disk_info;
+
+	if(!sd_raw_get_info(&disk_info))
+	{
+		printf_P(PSTR("Error reading SD card info\r\n"));
+		return 0;
+	}
+
+	return disk_info.capacity / 512;
+}
+
+static bool LocalStorage_ReadBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+{
+	while (TotalBlocks)
+	{
+		/* Read a data block from the SD card */
+		if (!(sd_raw_read_interval(BlockAddress * VIRTUAL_MEMORY_BLOCK_SIZE, Buffer, 16, 512,
+		                           &SDCardManager_ReadBlockHandler, NULL)))
+		{
+			return false;
+		}
+
+		/* Decrement the blocks remaining counter */
+		BlockAddress++;
+		TotalBlocks--;
+	}
+
+	return true;
+}
+
+static bool LocalStorage_WriteBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+{
+	while (TotalBlocks)
+	{
+		if (!(sd_raw_write_interval(BlockAddress * VIRTUAL_MEMORY_BLOCK_SIZE, Buffer, VIRTUAL_MEMORY_BLOCK_SIZE,
+		                            &SDCardManager_WriteBlockHandler, NULL)))
+		{
+			return false;
+		}
+
+		/* Check if the current command is being aborted by the host */
+		if (IsMassStoreReset)
+		  return false;
+
+		/* Decrement the blocks remaining counter and reset the sub block counter */
+		BlockAddress++;
+		TotalBlocks--;
+	}
+
+	return true;
+}
+
+static bool LocalStorage_ReadData(uint32_t BlockAddress, uint16_t Offset, uint8_t* Data, uint16_t Length)
+{
+	return sd_raw_read(((offset_t)BlockAddress << 9) + Offset, Data, Length);
+}
+
+static bool LocalStorage_Sync(void)
+{
+	return sd_raw_sync();
+}
+
+const StorageBackend_t LocalStorage =
+	{
+		.Init        = LocalStorage_Init,
+		.GetNbBlocks = LocalStorage_GetNbBlocks,
+		.ReadBlocks  = LocalStorage_ReadBlocks,
+		.WriteBlocks = LocalStorage_WriteBlocks,
+		.ReadData    = LocalStorage_ReadData,
+		.Sync        = LocalStorage_Sync,
+	};
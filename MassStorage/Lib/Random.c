@@ -0,0 +1,303 @@
+/** \file
+ *
+ *  Entropy collection and random number generation for the WRP challenges.
+ *
+ *  Three noise sources are sampled against Timer 1, which free-runs at the CPU clock: the watchdog
+ *  oscillator (its interrupt arrives with RC jitter relative to the crystal), the host's USB
+ *  start-of-frame packets (timed by the host's clock) and the least significant bits of the internal
+ *  temperature sensor. Samples are hashed into a SHA-256 pool and credited with a conservative number
+ *  of bits each; a full pool reseeds an AES-128 CTR_DRBG (NIST SP 800-90A, without derivation function),
+ *  which produces the actual output. A seed kept in EEPROM is mixed in at start-up, uncredited, so a
+ *  device never starts from the same state twice.
+ */
+
+#include "Random.h"
+
+#include <string.h>
+
+/** Interrupt sample queue entry. */
+typedef struct
+{
+	uint8_t Sample;
+	uint8_t Source;
+} RandomSample_t;
+
+/** Bits, in 1/16 bit units, credited to the pool for a sample of each source. */
+static const uint8_t SourceCredit[] = {RANDOM_CREDIT_WDT, RANDOM_CREDIT_SOF, RANDOM_CREDIT_ADC};
+
+/** Samples queued by the interrupt handlers, drained by \ref Random_Task(). */
+static volatile RandomSample_t SampleQueue[RANDOM_SAMPLE_QUEUE_SIZE];
+static volatile uint8_t        SampleQueueIn;
+static volatile uint8_t        SampleQueueOut;
+
+/** Entropy pool and the number of bits, in 1/16 bit units, credited to it since it was last emptied. */
+static SHA256_Context_t EntropyPool;
+static uint16_t         PoolCredit;
+
+/** CTR_DRBG working state. */
+static AES128_Context_t DRBGKey;
+static uint8_t          DRBGValue[AES128_BLOCK_SIZE];
+static bool             Seeded;
+static uint8_t          RequestsSinceReseed;
+
+/** Seed carried over to the next start-up, and whether it has been refreshed since this one. */
+static uint8_t          SeedFile[AES128_BLOCK_SIZE] EEMEM;
+static bool             SeedFileRefreshed;
+
+/** Number of times the generator has been (re)seeded from the pool. */
+uint32_t Random_Reseeds;
+
+/** Timer 1 cycles taken by the last challenge sized (32 byte) request to \ref Random_Generate(). */
+uint16_t Random_GenerateCycles;
+
+/** Watchdog interrupt, used only as a noise source: its RC oscillator drifts against the crystal. */
+ISR(WDT_vect)
+{
+	Random_AddSample(TCNT1, RANDOM_SOURCE_WDT);
+}
+
+/** Increments the 128-bit big-endian DRBG counter. */
+static void Random_IncrementValue(void)
+{
+	for (int8_t i = (AES128_BLOCK_SIZE - 1); i >= 0; i--)
+	{
+		if (++DRBGValue[i])
+		  break;
+	}
+}
+
+/** CTR_DRBG update function, mixing in 32 bytes of provided data (or none, if NULL) and rekeying. */
+static void Random_Update(const uint8_t* Provided)
+{
+	uint8_t Temp[2 * AES128_BLOCK_SIZE];
+
+	for (uint8_t Offset = 0; Offset < sizeof(Temp); Offset += AES128_BLOCK_SIZE)
+	{
+		Random_IncrementValue();
+		memcpy(&Temp[Offset], DRBGValue, AES128_BLOCK_SIZE);
+		AES128_EncryptBlock(&DRBGKey, &Temp[Offset]);
+	}
+
+	if (Provided != NULL)
+	{
+		for (uint8_t i = 0; i < sizeof(Temp); i++)
+		  Temp[i] ^= Provided[i];
+	}
+
+	AES128_SetKey(&DRBGKey, Temp);
+	memcpy(DRBGValue, &Temp[AES128_BLOCK_SIZE], AES128_BLOCK_SIZE);
+	memset(Temp, 0x00, sizeof(Temp));
+}
+
+/** Adds a sample to the pool, crediting it according to its source. */
+static void Random_Absorb(const uint8_t Sample, const uint8_t Source)
+{
+	uint8_t Entry[2] = {Sample, Source};
+
+	SHA256_Update(&EntropyPool, Entry, sizeof(Entry));
+
+	if (PoolCredit < (RANDOM_RESEED_BITS * 16))
+	  PoolCredit += SourceCredit[Source];
+}
+
+/** Folds the pool into the generator and starts a new pool. */
+static void Random_Reseed(void)
+{
+	uint8_t Seed[SHA256_DIGEST_SIZE];
+
+	SHA256_Final(&EntropyPool, Seed);
+	Random_Update(Seed);
+	memset(Seed, 0x00, sizeof(Seed));
+
+	SHA256_Init(&EntropyPool);
+	PoolCredit          = 0;
+	RequestsSinceReseed = 0;
+	Seeded              = true;
+	Random_Reseeds++;
+
+	/* Refresh the stored seed once per start-up, to limit EEPROM wear */
+	if (!(SeedFileRefreshed))
+	{
+		Random_Generate(Seed, AES128_BLOCK_SIZE);
+		eeprom_update_block(Seed, SeedFile, AES128_BLOCK_SIZE);
+		memset(Seed, 0x00, sizeof(Seed));
+
+		SeedFileRefreshed = true;
+	}
+}
+
+/** Starts the noise sources and the pool. Must be called with interrupts disabled. */
+void Random_Init(void)
+{
+	uint8_t Seed[AES128_BLOCK_SIZE];
+
+	/* Timer 1 free-running at the CPU clock, the reference all noise is measured against */
+	TCCR1A = 0;
+	TCCR1B = (1 << CS10);
+
+	/* Watchdog in interrupt-only mode with the shortest (16ms) period */
+	WDTCSR = ((1 << WDCE) | (1 << WDE));
+	WDTCSR = (1 << WDIE);
+
+	/* Internal temperature sensor against the 2.56V reference, slowest ADC clock */
+	ADMUX  = ((1 << REFS1) | (1 << REFS0) | (1 << MUX2) | (1 << MUX1) | (1 << MUX0));
+	ADCSRB = (1 << MUX5);
+	ADCSRA = ((1 << ADEN) | (1 << ADSC) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0));
+
+	SHA256_Init(&EntropyPool);
+
+	eeprom_read_block(Seed, SeedFile, sizeof(Seed));
+	SHA256_Update(&EntropyPool, Seed, sizeof(Seed));
+	memset(Seed, 0x00, sizeof(Seed));
+
+	/* CTR_DRBG instantiation starts from an all-zero key and counter */
+	AES128_SetKey(&DRBGKey, DRBGValue);
+}
+
+/** Queues a noise sample. Only to be called from interrupt handlers, which do not nest; the main loop is the
+ *  only consumer of the queue. Samples are dropped while the queue is full.
+ *
+ *  \param[in] Sample  Low byte of Timer 1 at the time of the event
+ *  \param[in] Source  One of the RANDOM_SOURCE_* values
+ */
+void Random_AddSample(const uint8_t Sample, const uint8_t Source)
+{
+	uint8_t Next = ((SampleQueueIn + 1) % RANDOM_SAMPLE_QUEUE_SIZE);
+
+	if (Next == SampleQueueOut)
+	  return;
+
+	SampleQueue[SampleQueueIn].Sample = Sample;
+	SampleQueue[SampleQueueIn].Source = Source;
+	SampleQueueIn = Next;
+}
+
+/** Idle-time work: absorbs queued and ADC samples into the pool, advances the pool hash, and reseeds the
+ *  generator when the pool is full and either the generator is unseeded or has served enough requests.
+ *  Sampling stops once the pool is full, so a seeded, idle device spends almost no time here.
+ */
+void Random_Task(void)
+{
+	while (SampleQueueOut != SampleQueueIn)
+	{
+		Random_Absorb(SampleQueue[SampleQueueOut].Sample, SampleQueue[SampleQueueOut].Source);
+		SampleQueueOut = ((SampleQueueOut + 1) % RANDOM_SAMPLE_QUEUE_SIZE);
+	}
+
+	if (PoolCredit < (RANDOM_RESEED_BITS * 16))
+	{
+		if (!(ADCSRA & (1 << ADSC)))
+		{
+			uint8_t Sample = ADCL;
+			(void)ADCH;
+
+			Random_Absorb(Sample, RANDOM_SOURCE_ADC);
+			ADCSRA |= (1 << ADSC);
+		}
+	}
+	else if (!(Seeded) || (RequestsSinceReseed >= RANDOM_RESEED_INTERVAL))
+	{
+		Random_Reseed();
+		return;
+	}
+
+	SHA256_Step(&EntropyPool);
+}
+
+/** Indicates if the generator has been seeded with a full pool since start-up.
+ *
+ *  \return Boolean true if \ref Random_Generate() can be used, false otherwise
+ */
+bool Random_IsSeeded(void)
+{
+	return Seeded;
+}
+
+/** Returns the number of entropy bits currently credited to the pool. */
+uint16_t Random_GetPoolBits(void)
+{
+	return (PoolCredit / 16);
+}
+
+/** Fills a buffer from the generator: one AES block per 16 bytes, plus the two block update that erases
+ *  the state the output was made from.
+ *
+ *  \param[out] Out     Buffer to fill
+ *  \param[in]  Length  Number of bytes, at most RANDOM_MAX_REQUEST
+ *
+ *  \return Boolean true on success, false if the generator is not seeded or the request is too large
+ */
+bool Random_Generate(uint8_t* Out, uint16_t Length)
+{
+	uint16_t Start  = TCNT1;
+	bool     Timed  = (Length == 32);
+	uint8_t  Block[AES128_BLOCK_SIZE];
+
+	if (!(Seeded) || (Length > RANDOM_MAX_REQUEST))
+	  return false;
+
+	while (Length)
+	{
+		uint8_t Bytes = (Length < AES128_BLOCK_SIZE) ? Length : AES128_BLOCK_SIZE;
+
+		Random_IncrementValue();
+		memcpy(Block, DRBGValue, AES128_BLOCK_SIZE);
+		AES128_EncryptBlock(&DRBGKey, Block);
+		memcpy(Out, Block, Bytes);
+
+		Out    += Bytes;
+		Length -= Bytes;
+	}
+
+	Random_Update(NULL);
+	memset(Block, 0x00, sizeof(Block));
+
+	if (RequestsSinceReseed < 0xFF)
+	  RequestsSinceReseed++;
+
+	if (Timed)
+	  Random_GenerateCycles = (TCNT1 - Start);
+
+	return true;
+}
+
+/** Takes one raw sample from the given noise source, for off-device entropy estimation. Samples returned
+ *  here are not credited to the pool. Samples of other sources met along the way are absorbed as usual.
+ *
+ *  \param[in]  Source  One of the RANDOM_SOURCE_* values
+ *  \param[out] Sample  The sample, if one was available
+ *
+ *  \return Boolean true if a sample was returned, false if none is available yet
+ */
+bool Random_GetRawSample(const uint8_t Source, uint8_t* Sample)
+{
+	if (Source == RANDOM_SOURCE_ADC)
+	{
+		if (ADCSRA & (1 << ADSC))
+		  return false;
+
+		*Sample = ADCL;
+		(void)ADCH;
+
+		ADCSRA |= (1 << ADSC);
+		return true;
+	}
+
+	while (SampleQueueOut != SampleQueueIn)
+	{
+		uint8_t QueuedSample = SampleQueue[SampleQueueOut].Sample;
+		uint8_t QueuedSource = SampleQueue[SampleQueueOut].Source;
+
+		SampleQueueOut = ((SampleQueueOut + 1) % RANDOM_SAMPLE_QUEUE_SIZE);
+
+		if (QueuedSource == Source)
+		{
+			*Sample = QueuedSample;
+			return true;
+		}
+
+		Random_Absorb(QueuedSample, QueuedSource);
+	}
+
+	return false;
+}
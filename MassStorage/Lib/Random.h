@@ -0,0 +1,60 @@
+/** \file
+ *
+ *  Header file for Random.c.
+ */
+
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/interrupt.h>
+		#include <avr/eeprom.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Common/Common.h>
+
+		#include "AES128.h"
+		#include "SHA256.h"
+
+	/* Defines: */
+		/** Noise source of a sample, see \ref Random_AddSample(). */
+		#define RANDOM_SOURCE_WDT          0
+		#define RANDOM_SOURCE_SOF          1
+		#define RANDOM_SOURCE_ADC          2
+
+		/** Number of entropy bits, in 1/16 bit units, credited for one sample of each source. These are deliberately
+		 *  low; the host tool wrp_random estimates the real per-sample min-entropy of each source from a raw dump.
+		 */
+		#define RANDOM_CREDIT_WDT          16
+		#define RANDOM_CREDIT_SOF          2
+		#define RANDOM_CREDIT_ADC          1
+
+		/** Entropy, in bits, that must be credited to the pool before it is folded into the generator. */
+		#define RANDOM_RESEED_BITS         256
+
+		/** Number of \ref Random_Generate() requests after which a full pool is folded into the generator again. */
+		#define RANDOM_RESEED_INTERVAL     64
+
+		/** Number of pending noise samples that the interrupt handlers can queue before samples are dropped. */
+		#define RANDOM_SAMPLE_QUEUE_SIZE   16
+
+		/** Largest request served by one call to \ref Random_Generate(). */
+		#define RANDOM_MAX_REQUEST         512
+
+	/* Global Variables: */
+		extern uint32_t Random_Reseeds;
+		extern uint16_t Random_GenerateCycles;
+
+	/* Function Prototypes: */
+		void Random_Init(void);
+		void Random_Task(void);
+		void Random_AddSample(const uint8_t Sample, const uint8_t Source);
+		bool Random_IsSeeded(void);
+		uint16_t Random_GetPoolBits(void);
+		bool Random_Generate(uint8_t* Out, uint16_t Length) ATTR_NON_NULL_PTR_ARG(1);
+		bool Random_GetRawSample(const uint8_t Source, uint8_t* Sample) ATTR_NON_NULL_PTR_ARG(2);
+
+#endif
@@ -0,0 +1,988 @@
+/** \file
+ *
+ *  Storage backend for the SD card of an atmega328 node running the atmega328 sketch, reached over this processor's
+ *  USART. The link protocol is described in the sketch: every message is a COBS frame with a CRC-16 and the tag of
+ *  its request, and data travels in numbered 64 byte chunks, so a damaged chunk is asked for again on its own.
+ *
+ *  Requests are pipelined over whole SCSI transfers. A read is one request for all of its blocks: the node streams
+ *  them back while each completed block goes out to the host, the next one arriving in the receive buffer meanwhile.
+ *  A write is one request too; the next block is taken from the host as soon as the node holds all of the previous
+ *  one, so the host's data flows while the node's card programs. Only one block is kept here, in \ref Block, which is
+ *  why the node reports the blocks it holds in full with its credits.
+ *
+ *  Chunks that run-length code shorter go as REMOTE_PACKED frames, and blocks of a single byte value, such as the
+ *  zeros filling most disk images, as a REMOTE_FILL frame of a few bytes; the node does the same with what it sends.
+ *  \ref RemoteStorage_BlockBytes and \ref RemoteStorage_FrameBytes count how well that goes.
+ *
+ *  The USART is the one the debug output otherwise uses, so that output is lost in this mode.
+ *
+ *  With \ref REMOTE_STORAGE_NODES above one the blocks are striped across several nodes sharing the USART as a bus,
+ *  \ref REMOTE_STORAGE_STRIPE blocks to a node before the next one takes over. Every node is sent its request at
+ *  the start of a transfer and then handed the bus one stripe unit at a time, so while one node has it the others
+ *  read their next block into their card's cache or program the blocks they took. The nodes can only take turns on
+ *  the one USART, so together they go as fast as the link does rather than each adding its own.
+ */
+
+#if defined(WRP_REMOTE_STORAGE)
+
+#include "SDCardManager.h"
+
+/** Return values of \ref RemoteStorage_ReceiveFrame() besides a payload length. */
+#define FRAME_DAMAGED   -1
+#define FRAME_QUIET     -2
+
+/** Type define for the request of a transfer to one node. The blocks of a transfer that fall to one node are
+ *  consecutive on its card, so each node gets a single request, which is then handed the bus a stripe unit at a time.
+ */
+typedef struct
+{
+	uint8_t  Tag; /**< Tag of the request, with the node's address */
+	uint32_t BlockAddress; /**< First block of the request on the node's card */
+	uint16_t TotalBlocks; /**< Blocks of the request, 0 if the transfer has none on the node */
+	uint16_t BlocksDone; /**< Blocks of the request transferred so far */
+} RemoteStorage_Request_t;
+
+/** Type define for a position in a transfer striped across the nodes. */
+typedef struct
+{
+	uint8_t  Node; /**< Node holding the next block */
+	uint32_t Row; /**< Stripe units of every node before the one holding the next block */
+	uint16_t UnitLeft; /**< Blocks left in the stripe unit of the next block */
+} RemoteStorage_Stripe_t;
+
+/** Bytes received from the node, stored by the USART receive interrupt. */
+static RingBuff_t Received;
+
+/** Frame being decoded, then the payload of the last frame received, and the decoder's state. */
+static uint8_t  Frame[REMOTE_FRAME_MAX];
+static uint8_t  FrameLength;
+static uint8_t  FrameCode;
+static uint8_t  FrameCodeLeft;
+static bool     FrameOverrun;
+
+/** Block of the current request: gathered here on reads, kept here for retransmits on writes. */
+static uint8_t  Block[VIRTUAL_MEMORY_BLOCK_SIZE];
+
+/** Chunk of \ref Block run-length coded for a REMOTE_PACKED frame. */
+static uint8_t  Packed[REMOTE_CHUNK];
+
+/** Block bytes sent and received in data frames, and the payload bytes of those frames. */
+uint32_t RemoteStorage_BlockBytes;
+uint32_t RemoteStorage_FrameBytes;
+
+/** Address of the block in \ref Block if it holds a whole block read by \ref RemoteStorage_ReadData(). */
+static uint32_t BlockAddressHeld;
+static bool     BlockHeld;
+
+/** Sequence number in the tag of the last request sent to each node. */
+static uint8_t  Tags[REMOTE_STORAGE_NODES];
+
+/** Request of the current transfer to each node, for its share of the blocks. */
+static RemoteStorage_Request_t Requests[REMOTE_STORAGE_NODES];
+
+ISR(USART1_RX_vect, ISR_BLOCK)
+{
+	uint8_t ReceivedByte = UDR1;
+
+	/* Frames lost to a full buffer are asked for again like any other damaged frame */
+	if (!(RingBuffer_IsFull(&Received)))
+	  RingBuffer_Insert(&Received, ReceivedByte);
+}
+
+static void RemoteStorage_SendByte(const uint8_t Byte)
+{
+	while (!(UCSR1A & (1 << UDRE1)));
+	UDR1 = Byte;
+}
+
+/** Byte of a frame being sent, which is made of a header, data and the CRC of both, one after the other. */
+static inline uint8_t RemoteStorage_FrameByte(const uint8_t* Header, const uint8_t HeaderLength, const uint8_t* Data,
+                                              const uint8_t DataLength, const uint8_t* CRC, const uint8_t Index)
+{
+	if (Index < HeaderLength)
+	  return Header[Index];
+	else if (Index < (HeaderLength + DataLength))
+	  return Data[Index - HeaderLength];
+	else
+	  return CRC[Index - HeaderLength - DataLength];
+}
+
+/** Sends a frame made of a header and, optionally, data following it. The frame's CRC is appended and the whole
+ *  COBS-encoded on the fly, so a data frame is sent straight out of \ref Block.
+ *
+ *  \param[in] Header        First bytes of the payload
+ *  \param[in] HeaderLength  Length of the header in bytes
+ *  \param[in] Data          Rest of the payload, NULL if the header is all of it
+ *  \param[in] DataLength    Length of the data in bytes
+ */
+static void RemoteStorage_SendFrame(const uint8_t* Header, const uint8_t HeaderLength, const uint8_t* Data,
+                                    const uint8_t DataLength)
+{
+	uint8_t  Length = (HeaderLength + DataLength + 2);
+	uint16_t CRC    = 0xFFFF;
+	uint8_t  Start  = 0;
+
+	for (uint8_t i = 0; i < HeaderLength; i++)
+	  CRC = _crc_ccitt_update(CRC, Header[i]);
+	for (uint8_t i = 0; i < DataLength; i++)
+	  CRC = _crc_ccitt_update(CRC, Data[i]);
+
+	uint8_t CRCBytes[2] = {(CRC & 0xFF), (CRC >> 8)};
+
+	/* Each run of non-zero bytes goes out behind its length + 1, in place of the zero ending it */
+	for (;;)
+	{
+		uint8_t End = Start;
+
+		while ((End < Length) && RemoteStorage_FrameByte(Header, HeaderLength, Data, DataLength, CRCBytes, End))
+		  End++;
+
+		RemoteStorage_SendByte(End - Start + 1);
+		for (uint8_t i = Start; i < End; i++)
+		  RemoteStorage_SendByte(RemoteStorage_FrameByte(Header, HeaderLength, Data, DataLength, CRCBytes, i));
+
+		if (End == Length)
+		  break;
+
+		Start = (End + 1);
+	}
+
+	RemoteStorage_SendByte(0x00);
+}
+
+/** Decodes the next frame from the node into \ref Frame.
+ *
+ *  \return Length of the frame's payload, FRAME_DAMAGED if it failed its CRC or FRAME_QUIET if nothing arrived for
+ *          \ref REMOTE_STORAGE_QUIET_POLLS polls; a frame cut short by the timeout carries on with the next call
+ */
+static int16_t RemoteStorage_ReceiveFrame(void)
+{
+	uint16_t Polls = 0;
+
+	for (;;)
+	{
+		if (RingBuffer_IsEmpty(&Received))
+		{
+			if (++Polls == REMOTE_STORAGE_QUIET_POLLS)
+			  return FRAME_QUIET;
+
+			_delay_us(10);
+			continue;
+		}
+
+		uint8_t Byte = RingBuffer_Remove(&Received);
+		Polls = 0;
+
+		if (!(Byte))
+		{
+			uint8_t Length  = FrameLength;
+			bool    Bad     = (FrameOverrun || FrameCodeLeft);
+			bool    Started = (FrameCode != 0);
+
+			FrameLength   = 0;
+			FrameCode     = 0;
+			FrameCodeLeft = 0;
+			FrameOverrun  = false;
+
+			/* A delimiter with nothing before it is not a frame */
+			if (!(Started))
+			  continue;
+
+			if (Bad || (Length < 3))
+			  return FRAME_DAMAGED;
+
+			uint16_t CRC = 0xFFFF;
+			for (uint8_t i = 0; i < (Length - 2); i++)
+			  CRC = _crc_ccitt_update(CRC, Frame[i]);
+
+			if ((Frame[Length - 2] != (CRC & 0xFF)) || (Frame[Length - 1] != (CRC >> 8)))
+			  return FRAME_DAMAGED;
+
+			return (Length - 2);
+		}
+
+		if (FrameCodeLeft)
+		{
+			FrameCodeLeft--;
+		}
+		else
+		{
+			/* A code byte: the run before it ended with a zero unless it was the first or a full one */
+			bool Zero = (FrameCode && (FrameCode != 0xFF));
+
+			FrameCode     = Byte;
+			FrameCodeLeft = (Byte - 1);
+
+			if (!(Zero))
+			  continue;
+
+			Byte = 0x00;
+		}
+
+		if (FrameLength < sizeof(Frame))
+		  Frame[FrameLength++] = Byte;
+		else
+		  FrameOverrun = true;
+	}
+}
+
+/** Run-length codes a chunk for a REMOTE_PACKED frame, as the node's link_pack() does.
+ *
+ *  \param[in]  Data  Chunk to code
+ *  \param[out] Runs  Coded chunk, shorter than a chunk
+ *
+ *  \return Length of the coded chunk, 0 if it would hardly be shorter than the chunk
+ */
+static uint8_t RemoteStorage_Pack(const uint8_t* Data, uint8_t* Runs)
+{
+	uint8_t Length  = 0;
+	uint8_t Literal = 0xFF; /* Count byte of the literal run being added to */
+	uint8_t i       = 0;
+
+	while (i < REMOTE_CHUNK)
+	{
+		uint8_t Byte = Data[i];
+		uint8_t Run  = 1;
+
+		if (Length >= (REMOTE_CHUNK - 2))
+		  return 0;
+
+		while (((i + Run) < REMOTE_CHUNK) && (Data[i + Run] == Byte))
+		  Run++;
+
+		if (Run >= REMOTE_RUN_MIN)
+		{
+			Runs[Length++] = (REMOTE_RUN + Run - REMOTE_RUN_MIN);
+			Runs[Length++] = Byte;
+			Literal        = 0xFF;
+			i             += Run;
+		}
+		else
+		{
+			/* The count byte reaches 0 with the first byte of the run */
+			if (Literal == 0xFF)
+			{
+				Literal        = Length;
+				Runs[Length++] = 0xFF;
+			}
+
+			Runs[Literal]++;
+			Runs[Length++] = Byte;
+			i++;
+		}
+	}
+
+	return Length;
+}
+
+/** Decodes the runs of a REMOTE_PACKED frame into a chunk.
+ *
+ *  \param[in]  Runs    Coded chunk
+ *  \param[in]  Length  Length of the coded chunk in bytes
+ *  \param[out] Data    Chunk to decode into
+ *
+ *  \return Boolean true if the runs made up exactly one chunk, false otherwise
+ */
+static bool RemoteStorage_Unpack(const uint8_t* Runs, const uint8_t Length, uint8_t* Data)
+{
+	uint8_t Filled = 0;
+	uint8_t i      = 0;
+
+	while (i < Length)
+	{
+		uint8_t Count = Runs[i++];
+
+		if (Count >= REMOTE_RUN)
+		{
+			Count = (Count - REMOTE_RUN + REMOTE_RUN_MIN);
+
+			if ((i == Length) || ((Filled + Count) > REMOTE_CHUNK))
+			  return false;
+
+			memset(&Data[Filled], Runs[i++], Count);
+		}
+		else
+		{
+			Count++;
+
+			if (((i + Count) > Length) || ((Filled + Count) > REMOTE_CHUNK))
+			  return false;
+
+			memcpy(&Data[Filled], &Runs[i], Count);
+			i += Count;
+		}
+
+		Filled += Count;
+	}
+
+	return (Filled == REMOTE_CHUNK);
+}
+
+/** Checks whether the frame from the node in \ref Frame carries block data, as a REMOTE_DATA, REMOTE_PACKED or
+ *  REMOTE_FILL frame.
+ */
+static bool RemoteStorage_IsData(const int16_t Length)
+{
+	switch (Frame[0])
+	{
+		case REMOTE_DATA:
+			return (Length == REMOTE_DATA_LENGTH);
+		case REMOTE_PACKED:
+			return (Length > 5);
+		case REMOTE_FILL:
+			return (Length == 5);
+		default:
+			return false;
+	}
+}
+
+/** Stores the data of a data frame from the node in \ref Block.
+ *
+ *  \return Chunks of the block the frame held, none if its runs did not decode
+ */
+static uint8_t RemoteStorage_TakeData(const int16_t Length)
+{
+	uint8_t Chunk = Frame[4];
+
+	switch (Frame[0])
+	{
+		case REMOTE_FILL:
+			memset(Block, Frame[4], VIRTUAL_MEMORY_BLOCK_SIZE);
+			return 0xFF;
+		case REMOTE_PACKED:
+			return RemoteStorage_Unpack(&Frame[5], (Length - 5), &Block[Chunk * REMOTE_CHUNK]) ? (1 << Chunk) : 0;
+		default:
+			memcpy(&Block[Chunk * REMOTE_CHUNK], &Frame[5], REMOTE_CHUNK);
+			return (1 << Chunk);
+	}
+}
+
+/** Checks whether all bytes of \ref Block are the same, so the block can go as a REMOTE_FILL frame. */
+static bool RemoteStorage_IsFill(void)
+{
+	for (uint16_t Offset = 1; Offset < VIRTUAL_MEMORY_BLOCK_SIZE; Offset++)
+	{
+		if (Block[Offset] != Block[0])
+		  return false;
+	}
+
+	return true;
+}
+
+static uint8_t RemoteStorage_NextTag(const uint8_t Node)
+{
+	uint8_t Sequence = (Tags[Node] + 1);
+
+	/* On a bus the top bits of a tag are the address of the node */
+	if (REMOTE_STORAGE_BUS)
+	  Sequence &= ((1 << REMOTE_NODE_SHIFT) - 1);
+
+	/* The node starts out with tag 0 as its last write */
+	if (!(Sequence))
+	  Sequence = 1;
+
+	Tags[Node] = Sequence;
+	return ((Node << REMOTE_NODE_SHIFT) | Sequence);
+}
+
+static void RemoteStorage_SendCommand(const uint8_t Type, const uint8_t RequestTag, const uint32_t BlockAddress,
+                                      const uint16_t TotalBlocks)
+{
+	uint8_t Command[8] = {Type, RequestTag, (BlockAddress & 0xFF), ((BlockAddress >> 8) & 0xFF),
+	                      ((BlockAddress >> 16) & 0xFF), (BlockAddress >> 24), (TotalBlocks & 0xFF),
+	                      (TotalBlocks >> 8)};
+
+	RemoteStorage_SendFrame(Command, sizeof(Command), NULL, 0);
+}
+
+/** Hands the bus to the node of a request, for the blocks from \ref RemoteStorage_Request_t.BlocksDone to End. */
+static void RemoteStorage_SendGrant(const RemoteStorage_Request_t* Request, const uint16_t End)
+{
+	uint8_t Grant[6] = {REMOTE_GRANT, Request->Tag, (Request->BlocksDone & 0xFF), (Request->BlocksDone >> 8),
+	                    (End & 0xFF), (End >> 8)};
+
+	RemoteStorage_SendFrame(Grant, sizeof(Grant), NULL, 0);
+}
+
+static void RemoteStorage_SendNAK(const uint8_t RequestTag, const uint16_t BlockIndex, const uint8_t Chunk)
+{
+	uint8_t NAK[5] = {REMOTE_NAK, RequestTag, (BlockIndex & 0xFF), (BlockIndex >> 8), Chunk};
+
+	RemoteStorage_SendFrame(NAK, sizeof(NAK), NULL, 0);
+}
+
+/** Asks the node again for every chunk of a block not received yet. */
+static void RemoteStorage_SendMissingNAKs(const uint8_t RequestTag, const uint16_t BlockIndex, const uint8_t Chunks)
+{
+	for (uint8_t Chunk = 0; Chunk < REMOTE_CHUNKS; Chunk++)
+	{
+		if (!(Chunks & (1 << Chunk)))
+		  RemoteStorage_SendNAK(RequestTag, BlockIndex, Chunk);
+	}
+}
+
+/** Sends a request without blocks and waits for the node to answer it, sending it again while the link is quiet.
+ *
+ *  \param[in] Type        Type of the request
+ *  \param[in] RequestTag  Tag of the request
+ *
+ *  \return Length of the node's SD_SUCCESS reply, left in \ref Frame, or -1 if it failed or did not answer
+ */
+static int16_t RemoteStorage_Query(const uint8_t Type, const uint8_t RequestTag)
+{
+	uint8_t Command[2] = {Type, RequestTag};
+
+	for (uint8_t Quiet = 0; Quiet < REMOTE_STORAGE_RETRIES; Quiet++)
+	{
+		RemoteStorage_SendFrame(Command, sizeof(Command), NULL, 0);
+
+		for (;;)
+		{
+			int16_t Length = RemoteStorage_ReceiveFrame();
+
+			if (Length == FRAME_QUIET)
+			  break;
+
+			if ((Length < 2) || (Frame[1] != RequestTag))
+			  continue;
+
+			if (Frame[0] == REMOTE_SUCCESS)
+			  return Length;
+			else if (Frame[0] == REMOTE_ERROR)
+			  return -1;
+		}
+	}
+
+	return -1;
+}
+
+/** Sets a stripe position to the given block of the striped medium. */
+static void RemoteStorage_StripeStart(RemoteStorage_Stripe_t* const Stripe, const uint32_t BlockAddress)
+{
+	uint32_t Unit = (BlockAddress / REMOTE_STORAGE_STRIPE);
+
+	Stripe->Node     = (Unit % REMOTE_STORAGE_NODES);
+	Stripe->Row      = (Unit / REMOTE_STORAGE_NODES);
+	Stripe->UnitLeft = (REMOTE_STORAGE_STRIPE - (BlockAddress % REMOTE_STORAGE_STRIPE));
+}
+
+/** Returns the blocks of a transfer that go to one node in a row from a stripe position, moving the position past
+ *  them. A single node has them all.
+ */
+static uint16_t RemoteStorage_StripeNext(RemoteStorage_Stripe_t* const Stripe, const uint16_t BlocksLeft)
+{
+	if (!(REMOTE_STORAGE_BUS) || (BlocksLeft < Stripe->UnitLeft))
+	{
+		Stripe->UnitLeft -= BlocksLeft;
+		return BlocksLeft;
+	}
+
+	uint16_t Blocks = Stripe->UnitLeft;
+
+	if (++Stripe->Node == REMOTE_STORAGE_NODES)
+	{
+		Stripe->Node = 0;
+		Stripe->Row++;
+	}
+
+	Stripe->UnitLeft = REMOTE_STORAGE_STRIPE;
+	return Blocks;
+}
+
+/** Splits a transfer into a request for each node holding some of its blocks and sends them. On a bus the nodes
+ *  wait for the bus before sending anything back, but start on their cards right away.
+ *
+ *  \param[in] Type          REMOTE_READ_BLOCKS or REMOTE_WRITE_BLOCKS
+ *  \param[in] BlockAddress  First block of the transfer
+ *  \param[in] TotalBlocks   Number of blocks of the transfer
+ */
+static void RemoteStorage_SendRequests(const uint8_t Type, const uint32_t BlockAddress, const uint16_t TotalBlocks)
+{
+	RemoteStorage_Stripe_t Stripe;
+	uint16_t               BlocksLeft = TotalBlocks;
+
+	for (uint8_t Node = 0; Node < REMOTE_STORAGE_NODES; Node++)
+	{
+		Requests[Node].TotalBlocks = 0;
+		Requests[Node].BlocksDone  = 0;
+	}
+
+	RemoteStorage_StripeStart(&Stripe, BlockAddress);
+
+	while (BlocksLeft)
+	{
+		RemoteStorage_Request_t* Request   = &Requests[Stripe.Node];
+		uint32_t                 NodeBlock = ((Stripe.Row * REMOTE_STORAGE_STRIPE) + REMOTE_STORAGE_STRIPE -
+		                                      Stripe.UnitLeft);
+
+		/* A single node has the blocks at the same addresses */
+		if (!(Request->TotalBlocks))
+		  Request->BlockAddress = (REMOTE_STORAGE_BUS ? NodeBlock : BlockAddress);
+
+		uint16_t Blocks = RemoteStorage_StripeNext(&Stripe, BlocksLeft);
+
+		Request->TotalBlocks += Blocks;
+		BlocksLeft           -= Blocks;
+	}
+
+	for (uint8_t Node = 0; Node < REMOTE_STORAGE_NODES; Node++)
+	{
+		RemoteStorage_Request_t* Request = &Requests[Node];
+
+		if (!(Request->TotalBlocks))
+		  continue;
+
+		Request->Tag = RemoteStorage_NextTag(Node);
+		RemoteStorage_SendCommand(Type, Request->Tag, Request->BlockAddress, Request->TotalBlocks);
+	}
+}
+
+/** Receives the next blocks of a read request. Each block is gathered in \ref Block, whatever order its chunks
+ *  arrive in; chunks of later blocks have to wait, so they are dropped and asked for again.
+ *
+ *  \param[in,out] Request  Request the blocks belong to
+ *  \param[in]     Blocks   Number of blocks to receive, which on a bus are granted to the node first
+ *  \param[in]     ToHost   Whether each block is sent to the host once complete, or only left in \ref Block
+ *
+ *  \return Boolean true if all blocks were received, false if the node failed or stopped answering
+ */
+static bool RemoteStorage_ReceiveBlocks(RemoteStorage_Request_t* const Request, const uint16_t Blocks,
+                                        const bool ToHost)
+{
+	uint8_t  RequestTag = Request->Tag;
+	uint16_t BlockIndex = Request->BlocksDone;
+	uint16_t End        = (BlockIndex + Blocks);
+	uint8_t  Chunks     = 0; /* Chunks of BlockIndex in Block */
+	uint8_t  Seen       = 0; /* Chunks of BlockIndex before this one were received or asked for again */
+	uint8_t  Frames     = 0;
+	uint8_t  Asked      = 0; /* Frames when the missing chunks of BlockIndex were last asked for */
+	uint8_t  Quiet      = 0;
+	bool     Started    = false;
+	bool     AskedAgain = false;
+
+	if (REMOTE_STORAGE_BUS)
+	  RemoteStorage_SendGrant(Request, End);
+
+	while (BlockIndex < End)
+	{
+		if (IsMassStoreReset)
+		  return false;
+
+		int16_t Length = RemoteStorage_ReceiveFrame();
+
+		if (Length == FRAME_QUIET)
+		{
+			if (++Quiet == REMOTE_STORAGE_RETRIES)
+			  return false;
+
+			/* Nothing at all came back, so the command or the grant may have been lost */
+			if (!(Started))
+			{
+				RemoteStorage_SendCommand(REMOTE_READ_BLOCKS, RequestTag, Request->BlockAddress, Request->TotalBlocks);
+
+				if (REMOTE_STORAGE_BUS)
+				  RemoteStorage_SendGrant(Request, End);
+			}
+			else
+			{
+				RemoteStorage_SendMissingNAKs(RequestTag, BlockIndex, Chunks);
+				AskedAgain = true;
+			}
+
+			Asked = Frames;
+			continue;
+		}
+
+		if ((Length < 2) || (Frame[1] != RequestTag))
+		  continue;
+
+		if (Frame[0] == REMOTE_ERROR)
+		  return false;
+
+		/* A filled block counts as its last chunk */
+		uint16_t FrameBlock = (Frame[2] | (Frame[3] << 8));
+		uint8_t  Chunk      = ((Frame[0] == REMOTE_FILL) ? (REMOTE_CHUNKS - 1) : Frame[4]);
+
+		if (!(RemoteStorage_IsData(Length)) || (FrameBlock >= End) || (Chunk >= REMOTE_CHUNKS) ||
+		    (FrameBlock < BlockIndex))
+		{
+			continue;
+		}
+
+		Started = true;
+		Quiet   = 0;
+		Frames++;
+
+		RemoteStorage_BlockBytes += ((Frame[0] == REMOTE_FILL) ? VIRTUAL_MEMORY_BLOCK_SIZE : REMOTE_CHUNK);
+		RemoteStorage_FrameBytes += Length;
+
+		if (FrameBlock > BlockIndex)
+		{
+			RemoteStorage_SendNAK(RequestTag, FrameBlock, Chunk);
+			AskedAgain = true;
+
+			/* The rest of the block should have come before it; if the node is still going past a hole, what it
+			 * sent again for it was lost too */
+			if ((Seen < REMOTE_CHUNKS) || ((uint8_t)(Frames - Asked) > (2 * REMOTE_WINDOW)))
+			{
+				RemoteStorage_SendMissingNAKs(RequestTag, BlockIndex, Chunks);
+				Seen  = REMOTE_CHUNKS;
+				Asked = Frames;
+			}
+
+			continue;
+		}
+
+		if (!(Chunks & (1 << Chunk)))
+		  Chunks |= RemoteStorage_TakeData(Length);
+
+		/* Chunks skipped over were lost on the way */
+		for (; Seen < Chunk; Seen++)
+		{
+			if (!(Chunks & (1 << Seen)))
+			{
+				RemoteStorage_SendNAK(RequestTag, BlockIndex, Seen);
+				AskedAgain = true;
+				Asked      = Frames;
+			}
+		}
+
+		if (Chunk >= Seen)
+		  Seen = (Chunk + 1);
+
+		if (Chunks != 0xFF)
+		  continue;
+
+		if (ToHost)
+		{
+			for (uint16_t Offset = 0; Offset < VIRTUAL_MEMORY_BLOCK_SIZE; Offset += 16)
+			{
+				if (!(SDCardManager_ReadBlockHandler(&Block[Offset], 0, NULL)))
+				  return false;
+			}
+		}
+
+		BlockIndex++;
+		Chunks = 0;
+		Seen   = 0;
+	}
+
+	/* A chunk asked for twice may still be on its way, and the next node must not talk over it */
+	if (REMOTE_STORAGE_BUS && AskedAgain)
+	{
+		while (RemoteStorage_ReceiveFrame() != FRAME_QUIET);
+	}
+
+	Request->BlocksDone = End;
+	return true;
+}
+
+/** Reads blocks from the nodes, in order.
+ *
+ *  \param[in] BlockAddress  First block to read
+ *  \param[in] TotalBlocks   Number of blocks to read
+ *  \param[in] ToHost        Whether each block is sent to the host once complete, or only left in \ref Block
+ *
+ *  \return Boolean true if all blocks were read, false if a node failed or stopped answering
+ */
+static bool RemoteStorage_Read(const uint32_t BlockAddress, const uint16_t TotalBlocks, const bool ToHost)
+{
+	RemoteStorage_Stripe_t Stripe;
+	uint16_t               BlocksLeft = TotalBlocks;
+
+	BlockHeld = false;
+	RemoteStorage_SendRequests(REMOTE_READ_BLOCKS, BlockAddress, TotalBlocks);
+	RemoteStorage_StripeStart(&Stripe, BlockAddress);
+
+	while (BlocksLeft)
+	{
+		RemoteStorage_Request_t* Request = &Requests[Stripe.Node];
+		uint16_t                 Blocks  = RemoteStorage_StripeNext(&Stripe, BlocksLeft);
+
+		if (!(RemoteStorage_ReceiveBlocks(Request, Blocks, ToHost)))
+		  return false;
+
+		BlocksLeft -= Blocks;
+	}
+
+	return true;
+}
+
+/** Sets up the USART for the link. The nodes are only spoken to once the first request comes. */
+static void RemoteStorage_Init(void)
+{
+	RingBuffer_InitBuffer(&Received);
+
+	UBRR1  = (((F_CPU / 8) + (REMOTE_STORAGE_BAUD / 2)) / REMOTE_STORAGE_BAUD - 1);
+	UCSR1A = (1 << U2X1);
+	UCSR1C = ((1 << UCSZ11) | (1 << UCSZ10));
+	UCSR1B = ((1 << RXCIE1) | (1 << RXEN1) | (1 << TXEN1));
+}
+
+static uint32_t RemoteStorage_GetNbBlocks(void)
+{
+	uint32_t NodeBlocks = 0xFFFFFFFF;
+
+	for (uint8_t Node = 0; Node < REMOTE_STORAGE_NODES; Node++)
+	{
+		/* The reply is a struct sd_raw_info, whose 64-bit capacity is at offset 17 */
+		if (RemoteStorage_Query(REMOTE_GET_INFO, RemoteStorage_NextTag(Node)) != 31)
+		  return 0;
+
+		const uint8_t* Capacity = &Frame[2 + 17];
+		uint32_t       Blocks   = (((uint32_t)Capacity[5] << 31) | ((uint32_t)Capacity[4] << 23) |
+		                           ((uint32_t)Capacity[3] << 15) | ((uint32_t)Capacity[2] << 7) | (Capacity[1] >> 1));
+
+		if (Blocks < NodeBlocks)
+		  NodeBlocks = Blocks;
+	}
+
+	/* Striped, every node holds as many whole stripe units as the smallest card has room for */
+	if (REMOTE_STORAGE_BUS)
+	  NodeBlocks -= (NodeBlocks % REMOTE_STORAGE_STRIPE);
+
+	return (NodeBlocks * REMOTE_STORAGE_NODES);
+}
+
+static bool RemoteStorage_ReadBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+{
+	return RemoteStorage_Read(BlockAddress, TotalBlocks, true);
+}
+
+/** Sends the next blocks of a write request from the host to its node. A block is only taken from the host once the
+ *  node holds all of the previous one, which stays in \ref Block until then for any chunk the node asks for again.
+ *
+ *  \param[in,out] Request  Request the blocks belong to
+ *  \param[in]     Blocks   Number of blocks to send, which on a bus are granted to the node first
+ *
+ *  \return Boolean true if the node took all blocks (and, for a single node, wrote the request to its card), false
+ *          otherwise
+ */
+static bool RemoteStorage_SendBlocks(RemoteStorage_Request_t* const Request, const uint16_t Blocks)
+{
+	uint8_t  RequestTag = Request->Tag;
+	uint16_t First      = Request->BlocksDone;
+	uint16_t End        = (First + Blocks);
+	uint16_t Sent       = 0; /* Frames sent, as the node counts them */
+	uint16_t Consumed   = 0; /* Frames the node has taken from its receive ring */
+	uint16_t NodeBlocks = First; /* Blocks the node holds in full */
+	uint16_t NextBlock  = First; /* Next block to take from the host; the one before is in Block */
+	uint8_t  Pending    = 0; /* Chunks of Block to send */
+	uint8_t  Quiet      = 0;
+	bool     Started    = false;
+	bool     Filled     = false; /* Whether all bytes of Block are the same */
+
+	if (REMOTE_STORAGE_BUS)
+	  RemoteStorage_SendGrant(Request, End);
+
+	for (;;)
+	{
+		if (IsMassStoreReset)
+		  return false;
+
+		if (Started && !(Pending) && (NextBlock < End) && (NodeBlocks == NextBlock))
+		{
+			for (uint16_t Offset = 0; Offset < VIRTUAL_MEMORY_BLOCK_SIZE; Offset += 16)
+			{
+				if (!(SDCardManager_WriteBlockHandler(&Block[Offset], 0, NULL)))
+				  return false;
+			}
+
+			NextBlock++;
+			Pending = 0xFF;
+			Filled  = RemoteStorage_IsFill();
+		}
+
+		while (Pending && ((int16_t)(Sent - Consumed) < REMOTE_WINDOW))
+		{
+			/* A block of one byte value goes whole, unless the node asks for single chunks of it */
+			if ((Pending == 0xFF) && Filled)
+			{
+				uint8_t Fill[5] = {REMOTE_FILL, RequestTag, ((NextBlock - 1) & 0xFF), ((NextBlock - 1) >> 8), Block[0]};
+
+				RemoteStorage_SendFrame(Fill, sizeof(Fill), NULL, 0);
+				RemoteStorage_BlockBytes += VIRTUAL_MEMORY_BLOCK_SIZE;
+				RemoteStorage_FrameBytes += sizeof(Fill);
+
+				Pending = 0;
+				Sent++;
+				continue;
+			}
+
+			uint8_t Chunk = 0;
+
+			while (!(Pending & (1 << Chunk)))
+			  Chunk++;
+
+			uint8_t Header[5] = {REMOTE_DATA, RequestTag, ((NextBlock - 1) & 0xFF), ((NextBlock - 1) >> 8), Chunk};
+
+			const uint8_t* Data   = &Block[Chunk * REMOTE_CHUNK];
+			uint8_t        Length = RemoteStorage_Pack(Data, Packed);
+
+			if (Length)
+			{
+				Header[0] = REMOTE_PACKED;
+				Data      = Packed;
+			}
+			else
+			{
+				Length = REMOTE_CHUNK;
+			}
+
+			RemoteStorage_SendFrame(Header, sizeof(Header), Data, Length);
+			RemoteStorage_BlockBytes += REMOTE_CHUNK;
+			RemoteStorage_FrameBytes += (sizeof(Header) + Length);
+
+			Pending &= ~(1 << Chunk);
+			Sent++;
+		}
+
+		int16_t Length = RemoteStorage_ReceiveFrame();
+
+		if (Length == FRAME_QUIET)
+		{
+			if (++Quiet == REMOTE_STORAGE_RETRIES)
+			  return false;
+
+			/* Either the command, the grant or the final status went missing; the node counts every frame it takes,
+			 * and answers a grant with its count */
+			if (!(Started))
+			{
+				RemoteStorage_SendCommand(REMOTE_WRITE_BLOCKS, RequestTag, Request->BlockAddress, Request->TotalBlocks);
+				Sent++;
+			}
+
+			if (REMOTE_STORAGE_BUS)
+			{
+				RemoteStorage_SendGrant(Request, End);
+				Sent++;
+			}
+			else if (Started && (NodeBlocks == End))
+			{
+				uint8_t Status[2] = {REMOTE_STATUS, RequestTag};
+
+				RemoteStorage_SendFrame(Status, sizeof(Status), NULL, 0);
+				Sent++;
+			}
+
+			continue;
+		}
+
+		if ((Length < 2) || (Frame[1] != RequestTag))
+		  continue;
+
+		switch (Frame[0])
+		{
+			case REMOTE_CREDIT:
+				if (Length != 7)
+				  break;
+
+				Consumed   = (Frame[2] | (Frame[3] << 8));
+				NodeBlocks = (Frame[5] | (Frame[6] << 8));
+
+				/* With resync set the node's ring is empty, so everything sent has been counted */
+				if (!(Started) || Frame[4])
+				  Sent = Consumed;
+
+				Started = true;
+				Quiet   = 0;
+
+				/* On a bus the node programs what it holds while the next node has the bus */
+				if (REMOTE_STORAGE_BUS && (NodeBlocks >= End))
+				{
+					Request->BlocksDone = End;
+					return true;
+				}
+
+				break;
+			case REMOTE_NAK:
+				if ((Length == 5) && (NextBlock > First) && ((Frame[2] | (Frame[3] << 8)) == (NextBlock - 1)) &&
+				    (Frame[4] < REMOTE_CHUNKS))
+				{
+					Pending |= (1 << Frame[4]);
+				}
+
+				Quiet = 0;
+				break;
+			case REMOTE_SUCCESS:
+				Request->BlocksDone = End;
+				return true;
+			case REMOTE_ERROR:
+				return false;
+		}
+	}
+}
+
+/** Writes blocks from the host to the nodes, in order.
+ *
+ *  \param[in] BlockAddress  First block to write
+ *  \param[in] TotalBlocks   Number of blocks to write
+ *
+ *  \return Boolean true if the nodes wrote all blocks to their cards, false otherwise
+ */
+static bool RemoteStorage_WriteBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+{
+	RemoteStorage_Stripe_t Stripe;
+	uint16_t               BlocksLeft = TotalBlocks;
+
+	BlockHeld = false;
+	RemoteStorage_SendRequests(REMOTE_WRITE_BLOCKS, BlockAddress, TotalBlocks);
+	RemoteStorage_StripeStart(&Stripe, BlockAddress);
+
+	while (BlocksLeft)
+	{
+		RemoteStorage_Request_t* Request = &Requests[Stripe.Node];
+		uint16_t                 Blocks  = RemoteStorage_StripeNext(&Stripe, BlocksLeft);
+
+		if (!(RemoteStorage_SendBlocks(Request, Blocks)))
+		  return false;
+
+		BlocksLeft -= Blocks;
+	}
+
+	/* On a bus the nodes only report how their writes ended when asked, once all of them have their blocks */
+	if (REMOTE_STORAGE_BUS)
+	{
+		for (uint8_t Node = 0; Node < REMOTE_STORAGE_NODES; Node++)
+		{
+			if (Requests[Node].TotalBlocks && (RemoteStorage_Query(REMOTE_STATUS, Requests[Node].Tag) < 0))
+			  return false;
+		}
+	}
+
+	return true;
+}
+
+static bool RemoteStorage_ReadData(uint32_t BlockAddress, uint16_t Offset, uint8_t* Buffer, uint16_t Length)
+{
+	/* Reads of the file guard walk a FAT sector an entry at a time, so the last block read stays at hand */
+	if (!(BlockHeld) || (BlockAddressHeld != BlockAddress))
+	{
+		if (!(RemoteStorage_Read(BlockAddress, 1, false)))
+		  return false;
+
+		BlockAddressHeld = BlockAddress;
+		BlockHeld        = true;
+	}
+
+	memcpy(Buffer, &Block[Offset], Length);
+	return true;
+}
+
+static bool RemoteStorage_Sync(void)
+{
+	/* Writes only complete once the node has synced its card */
+	return true;
+}
+
+const StorageBackend_t RemoteStorage =
+	{
+		.Init        = RemoteStorage_Init,
+		.GetNbBlocks = RemoteStorage_GetNbBlocks,
+		.ReadBlocks  = RemoteStorage_ReadBlocks,
+		.WriteBlocks = RemoteStorage_WriteBlocks,
+		.ReadData    = RemoteStorage_ReadData,
+		.Sync        = RemoteStorage_Sync,
+	};
+
+#endif
@@ -0,0 +1,106 @@
+/** \file
+ *
+ *  Header file for RemoteStorage.c.
+ */
+
+#ifndef _REMOTE_STORAGE_H_
+#define _REMOTE_STORAGE_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/interrupt.h>
+		#include <util/delay.h>
+		#include <util/crc16.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+		#include <string.h>
+
+		#include <LUFA/Common/Common.h>
+
+		#include "StorageBackend.h"
+		#include "LightweightRingBuff.h"
+
+	/* Preprocessor Checks: */
+		#if defined(WRP_REMOTE_STORAGE) && defined(WRP_COPROCESSOR)
+			#error The coprocessor relies on sd_raw to set up the SPI bus, which is not used with remote storage.
+		#endif
+
+		#if defined(REMOTE_STORAGE_NODES) && ((REMOTE_STORAGE_NODES < 1) || (REMOTE_STORAGE_NODES > 8))
+			#error REMOTE_STORAGE_NODES must be between 1 and 8, the nodes a tag can address.
+		#endif
+
+	/* Defines: */
+		/** Baud rate of the link to the node, which must match LINK_BAUD in the atmega328 sketch. Both ends run their
+		 *  USART at double speed, where 1 and 2 Mbaud are exact at 16MHz.
+		 */
+		#if !defined(REMOTE_STORAGE_BAUD)
+			#define REMOTE_STORAGE_BAUD          1000000
+		#endif
+
+		/** Nodes the blocks are striped across. A single node has the link to itself; several share it as a bus, each
+		 *  built with LINK_NODE set to its place in the stripe, from 0.
+		 */
+		#if !defined(REMOTE_STORAGE_NODES)
+			#define REMOTE_STORAGE_NODES         1
+		#endif
+
+		/** Blocks of a stripe unit, the consecutive blocks kept on one node before the next node takes over. */
+		#if !defined(REMOTE_STORAGE_STRIPE)
+			#define REMOTE_STORAGE_STRIPE        8
+		#endif
+
+		/** Whether the nodes share the link and have to be handed the bus in turn. */
+		#define REMOTE_STORAGE_BUS               (REMOTE_STORAGE_NODES > 1)
+
+		/** Polls of the receive buffer, 10us apart, before the link counts as quiet, about the node's own
+		 *  LINK_TIMEOUT_MS. Missing chunks are asked for again each time the link goes quiet.
+		 */
+		#define REMOTE_STORAGE_QUIET_POLLS       2000
+
+		/** Quiet periods in a row after which a request is given up on and the SCSI command fails. */
+		#define REMOTE_STORAGE_RETRIES           25
+
+		/** Message types of the link protocol, described in the atmega328 sketch. */
+		#define REMOTE_ERROR                     0
+		#define REMOTE_GET_INFO                  3
+		#define REMOTE_SUCCESS                   4
+		#define REMOTE_READ_BLOCKS               8
+		#define REMOTE_WRITE_BLOCKS              9
+		#define REMOTE_CREDIT                    10
+		#define REMOTE_DATA                      11
+		#define REMOTE_NAK                       12
+		#define REMOTE_STATUS                    13
+		#define REMOTE_GRANT                     14
+		#define REMOTE_PACKED                    15
+		#define REMOTE_FILL                      16
+		#define REMOTE_GET_STATS                 17
+
+		/** Position of the node address in a tag on a bus. */
+		#define REMOTE_NODE_SHIFT                5
+
+		/** Bytes of block data carried by one data frame, and data frames per block. */
+		#define REMOTE_CHUNK                     64
+		#define REMOTE_CHUNKS                    (512 / REMOTE_CHUNK)
+
+		/** Payload of a data frame: type, tag, block (2), chunk, data. */
+		#define REMOTE_DATA_LENGTH               (REMOTE_CHUNK + 5)
+
+		/** Largest decoded frame, a data frame and its CRC. */
+		#define REMOTE_FRAME_MAX                 (REMOTE_DATA_LENGTH + 2)
+
+		/** Frames that may be in flight beyond the node's count, which its receive ring always has room for. */
+		#define REMOTE_WINDOW                    REMOTE_CHUNKS
+
+		/** Run-length coding of a chunk in a REMOTE_PACKED frame: a byte below REMOTE_RUN is followed by that many
+		 *  bytes plus one as they are, and one from REMOTE_RUN by a byte repeating it - REMOTE_RUN + REMOTE_RUN_MIN
+		 *  times.
+		 */
+		#define REMOTE_RUN                       0x80
+		#define REMOTE_RUN_MIN                   3
+
+	/* Global Variables: */
+		extern uint32_t RemoteStorage_BlockBytes;
+		extern uint32_t RemoteStorage_FrameBytes;
+
+#endif
@@ -129,10 +129,119 @@ bool SCSI_DecodeSCSICommand(void)
 			CommandBlock.DataTransferLength = 0;
 			break;
 		case SCSI_WRP_REQ_CHALLENGE:
-			send_challenge();
+			if (!(Random_IsSeeded()))
+			{
+				/* Challenges cannot be made until enough entropy has been collected */
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+				               SCSI_ASENSE_LOGICAL_UNIT_NOT_READY,
+				               SCSI_ASENSEQ_BECOMING_READY);
+				break;
+			}
+
+			if (!(receive_challenge_request()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+				               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+			}
+
 			break;
 		case SCSI_WRP_RESPONSE:
-			verify_challenge_response();
+			if (!(verify_challenge_response()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_MISCOMPARE,
+				               SCSI_ASENSE_MISCOMPARE_DURING_VERIFY,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+			}
+
+			break;
+		case SCSI_WRP_BATCH_RESPONSE:
+			if (!(verify_batch_response()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_MISCOMPARE,
+				               SCSI_ASENSE_MISCOMPARE_DURING_VERIFY,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+			}
+
+			break;
+		case SCSI_WRP_GET_REPLY:
+			if (!(send_reply()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+				               SCSI_ASENSE_COMMAND_SEQUENCE_ERROR,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+			}
+
+			break;
+		case SCSI_WRP_AUTH_WRITE:
+			SCSI_Command_WRP_AuthWrite();
+			break;
+		case SCSI_WRP_COMMIT:
+			if (!(commit_write()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_MISCOMPARE,
+				               SCSI_ASENSE_MISCOMPARE_DURING_VERIFY,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+			}
+
+			break;
+		case SCSI_WRP_BATCH_LIST:
+			if (!(receive_batch_list()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+				               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+				break;
+			}
+
+			CommandBlock.DataTransferLength = 0;
+			break;
+		case SCSI_WRP_SET_POLICY:
+			if (!(set_policy()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+				               SCSI_ASENSE_INVALID_FIELD_IN_PARAMETER_LIST,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+			}
+
+			break;
+		case SCSI_WRP_GET_POLICY:
+			send_policy();
+			break;
+		#if defined(WRP_FILE_GUARD)
+		case SCSI_WRP_SET_FILE_GUARD:
+			if (!(set_file_guard()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+				               SCSI_ASENSE_INVALID_FIELD_IN_PARAMETER_LIST,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+			}
+
+			break;
+		case SCSI_WRP_GET_FILE_GUARD:
+			send_file_guard();
+			break;
+		#endif
+		case SCSI_WRP_STATS:
+			send_stats();
+			break;
+		case SCSI_WRP_RANDOM:
+			if (CommandBlock.SCSICommandData[1] > (RANDOM_SOURCE_ADC + 1))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+				               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+				               SCSI_ASENSEQ_NO_QUALIFIER);
+				break;
+			}
+			else if (!(CommandBlock.SCSICommandData[1]) && !(Random_IsSeeded()))
+			{
+				SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+				               SCSI_ASENSE_LOGICAL_UNIT_NOT_READY,
+				               SCSI_ASENSEQ_BECOMING_READY);
+				break;
+			}
+
+			send_random();
 			break;
 		default:
 			/* Update the SENSE key to reflect the invalid command */
@@ -249,8 +358,8 @@ static void SCSI_Command_Send_Diagnostic(void)
 		return;
 	}
 	
-	/* Check to see if all attached Dataflash ICs are functional */
-	if (!(SDCardManager_CheckDataflashOperation()))
+	/* Check to see if all attached Dataflash ICs are functional, and that the WRP cipher matches its test vectors */
+	if (!(SDCardManager_CheckDataflashOperation()) || !(AES128_SelfTest()))
 	{
 		/* Update SENSE key with a hardware error condition and return command fail */
 		SCSI_SET_SENSE(SCSI_SENSE_KEY_HARDWARE_ERROR,
@@ -264,6 +373,69 @@ static void SCSI_Command_Send_Diagnostic(void)
 	CommandBlock.DataTransferLength = 0;
 }
 
+/** Checks a write against the LBA write policy and the file guard (when built with WRP_FILE_GUARD), which refuse
+ *  the writes they forbid whatever tokens the host holds.
+ *
+ *  \param[in] BlockAddress  First block to be written
+ *  \param[in] TotalBlocks   Number of blocks to be written
+ *
+ *  \return Boolean true if the write may go ahead, false if it was refused (with the SENSE data set)
+ */
+static bool SCSI_CheckWriteProtection(const uint32_t BlockAddress, const uint16_t TotalBlocks)
+{
+	if (!(WritePolicy_Check(BlockAddress, TotalBlocks)))
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+		               SCSI_ASENSE_WRITE_PROTECTED,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	#if defined(WRP_FILE_GUARD)
+	if (!(FileGuard_Check(BlockAddress, TotalBlocks)))
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+		               SCSI_ASENSE_WRITE_PROTECTED,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+	#endif
+
+	return true;
+}
+
+/** Checks a write against the write protection (see \ref SCSI_CheckWriteProtection()) and then the WRP write token
+ *  table. Writes that no live token covers are only refused when the firmware is built with WRP_ENFORCE_WRITE_TOKENS,
+ *  otherwise they are just counted.
+ *
+ *  \param[in]  BlockAddress  First block to be written
+ *  \param[in]  TotalBlocks   Number of blocks to be written
+ *  \param[out] TokenMatch    Token to charge once the blocks are written, see \ref WriteTokens_ChargeMatch()
+ *
+ *  \return Boolean true if the write may go ahead, false if it was refused (with the SENSE data set)
+ */
+static bool SCSI_CheckWriteAccess(const uint32_t BlockAddress, const uint16_t TotalBlocks, uint8_t* const TokenMatch)
+{
+	if (!(SCSI_CheckWriteProtection(BlockAddress, TotalBlocks)))
+	  return false;
+
+	*TokenMatch = WriteTokens_Check(BlockAddress, TotalBlocks);
+	if (*TokenMatch)
+	  return true;
+
+	#if defined(WRP_ENFORCE_WRITE_TOKENS)
+	SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+	               SCSI_ASENSE_WRITE_PROTECTED,
+	               SCSI_ASENSEQ_NO_QUALIFIER);
+
+	return false;
+	#else
+	return true;
+	#endif
+}
+
 /** Command processing for an issued SCSI READ (10) or WRITE (10) command. This command reads in the block start address
  *  and total number of blocks to process, then calls the appropriate low-level dataflash routine to handle the actual
  *  reading and writing of the data.
@@ -273,7 +445,9 @@ static void SCSI_Command_Send_Diagnostic(void)
 static void SCSI_Command_ReadWrite_10(const bool IsDataRead)
 {
 	uint32_t BlockAddress;
+	uint32_t PolicyAddress;
 	uint16_t TotalBlocks;
+	uint8_t  TokenMatch = 0;
 	
 	/* Load in the 32-bit block address (SCSI uses big-endian, so have to do it byte-by-byte) */
 	((uint8_t*)&BlockAddress)[3] = CommandBlock.SCSICommandData[2];
@@ -296,17 +470,114 @@ static void SCSI_Command_ReadWrite_10(const bool IsDataRead)
 		return;
 	}
 
+	/* Writes must be covered by a write token granted by a WRP challenge response */
+	if ((IsDataRead == DATA_WRITE) && !(SCSI_CheckWriteAccess(BlockAddress, TotalBlocks, &TokenMatch)))
+	  return;
+
+	/* The write policy works on addresses within the LUN */
+	PolicyAddress = BlockAddress;
+
 	#if (TOTAL_LUNS > 1)
 	/* Adjust the given block address to the real media address based on the selected LUN */
 	BlockAddress += ((uint32_t)CommandBlock.LUN * LUN_MEDIA_BLOCKS);
 	#endif
 	
 	/* Determine if the packet is a READ (10) or WRITE (10) command, call appropriate function */
-	if (IsDataRead == DATA_READ)
-	  SDCardManager_ReadBlocks(BlockAddress, TotalBlocks);
-	else
-	  SDCardManager_WriteBlocks(BlockAddress, TotalBlocks);
+	if (!((IsDataRead == DATA_READ) ? SDCardManager_ReadBlocks(BlockAddress, TotalBlocks) :
+	                                  SDCardManager_WriteBlocks(BlockAddress, TotalBlocks)))
+	{
+		/* The medium failed part way, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return;
+	}
+
+	/* Only a write that reached the medium is charged to its token and moves the append pointers */
+	if (IsDataRead == DATA_WRITE)
+	{
+		WriteTokens_ChargeMatch(TokenMatch, TotalBlocks);
+		WritePolicy_Advance(PolicyAddress, TotalBlocks);
+	}
 
 	/* Update the bytes transferred counter and succeed the command */
 	CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
 }
+
+/** Command processing for an issued WRP authenticated write. The command block is laid out as for WRITE (10), and the
+ *  data is the message ID and token of the write (see \ref begin_auth_write()) followed by the blocks. The blocks are
+ *  hashed as they are written and must hash to the message ID, so one command does the work of a WRITE (10) and a
+ *  SCSI_WRP_COMMIT.
+ */
+static void SCSI_Command_WRP_AuthWrite(void)
+{
+	uint32_t BlockAddress;
+	uint32_t PolicyAddress;
+	uint16_t TotalBlocks;
+	uint8_t  TokenSlot;
+	uint8_t  MessageID[SHA256_DIGEST_SIZE];
+
+	/* Load in the 32-bit block address (SCSI uses big-endian, so have to do it byte-by-byte) */
+	((uint8_t*)&BlockAddress)[3] = CommandBlock.SCSICommandData[2];
+	((uint8_t*)&BlockAddress)[2] = CommandBlock.SCSICommandData[3];
+	((uint8_t*)&BlockAddress)[1] = CommandBlock.SCSICommandData[4];
+	((uint8_t*)&BlockAddress)[0] = CommandBlock.SCSICommandData[5];
+
+	/* Load in the 16-bit total blocks (SCSI uses big-endian, so have to do it byte-by-byte) */
+	((uint8_t*)&TotalBlocks)[1]  = CommandBlock.SCSICommandData[7];
+	((uint8_t*)&TotalBlocks)[0]  = CommandBlock.SCSICommandData[8];
+
+	/* Check if the block address is outside the maximum allowable value for the LUN */
+	if (BlockAddress >= LUN_MEDIA_BLOCKS)
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return;
+	}
+
+	/* Read the header and check its token before anything is charged to a token or the write policy */
+	if (!(begin_auth_write(BlockAddress, TotalBlocks, MessageID, &TokenSlot)))
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+		               SCSI_ASENSE_WRITE_PROTECTED,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return;
+	}
+
+	if (!(SCSI_CheckWriteProtection(BlockAddress, TotalBlocks)))
+	  return;
+
+	/* The write goes ahead: only now replace any open session */
+	open_auth_write(MessageID);
+	PolicyAddress = BlockAddress;
+
+	#if (TOTAL_LUNS > 1)
+	/* Adjust the given block address to the real media address based on the selected LUN */
+	BlockAddress += ((uint32_t)CommandBlock.LUN * LUN_MEDIA_BLOCKS);
+	#endif
+
+	/* A session whose blocks did not all reach the medium cannot hash to its message ID, so it is left to fail */
+	if (!(SDCardManager_WriteBlocks(BlockAddress, TotalBlocks)))
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return;
+	}
+
+	CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
+	WriteTokens_Charge(TokenSlot, TotalBlocks);
+	WritePolicy_Advance(PolicyAddress, TotalBlocks);
+
+	if (!(commit_write()))
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MISCOMPARE,
+		               SCSI_ASENSE_MISCOMPARE_DURING_VERIFY,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+	}
+}
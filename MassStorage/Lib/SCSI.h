@@ -144,6 +144,9 @@
 			static void SCSI_Command_Read_Capacity_10(void);
 			static void SCSI_Command_Send_Diagnostic(void);
 			static void SCSI_Command_ReadWrite_10(const bool IsDataRead);
+			static bool SCSI_CheckWriteProtection(const uint32_t BlockAddress, const uint16_t TotalBlocks);
+			static bool SCSI_CheckWriteAccess(const uint32_t BlockAddress, const uint16_t TotalBlocks, uint8_t* const TokenMatch);
+			static void SCSI_Command_WRP_AuthWrite(void);
 		#endif
 		
 #endif
@@ -71,19 +71,33 @@
 		#define SCSI_ASENSE_NO_ADDITIONAL_INFORMATION          0x00
 		#define SCSI_ASENSE_LOGICAL_UNIT_NOT_READY             0x04
 		#define SCSI_ASENSE_INVALID_FIELD_IN_CDB               0x24
+		#define SCSI_ASENSE_INVALID_FIELD_IN_PARAMETER_LIST    0x26
 		#define SCSI_ASENSE_WRITE_PROTECTED                    0x27
 		#define SCSI_ASENSE_FORMAT_ERROR                       0x31
+		#define SCSI_ASENSE_MISCOMPARE_DURING_VERIFY           0x1D
 		#define SCSI_ASENSE_INVALID_COMMAND                    0x20
 		#define SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE 0x21
+		#define SCSI_ASENSE_COMMAND_SEQUENCE_ERROR             0x2C
 		#define SCSI_ASENSE_MEDIUM_NOT_PRESENT                 0x3A
 
 		#define SCSI_ASENSEQ_NO_QUALIFIER                      0x00
+		#define SCSI_ASENSEQ_BECOMING_READY                    0x01
 		#define SCSI_ASENSEQ_FORMAT_COMMAND_FAILED             0x01
 		#define SCSI_ASENSEQ_INITIALIZING_COMMAND_REQUIRED     0x02
 		#define SCSI_ASENSEQ_OPERATION_IN_PROGRESS             0x07
 
+/*
+ * WRP vendor commands. Material too large for the 16 byte command block
+ * travels in the data phase. Commands that take data in leave their reply
+ * to be read with SCSI_WRP_GET_REPLY.
+ */
+
         #define SCSI_WRP_REQ_CHALLENGE                         0xAA
 /*
+ * Data-out:
+ * - Message ID (32 bytes)
+ * - Grant (16 bytes)
+ * Reply:
  * - Message ID (32 bytes)
  * - Challenge (32 bytes)
  * - Verification code (96 bytes)
@@ -91,8 +105,114 @@
 
         #define SCSI_WRP_RESPONSE                              0xCC
 /*
+ * Data-out:
+ * - Message ID (32 bytes)
+ * - Challenge (32 bytes)
+ * - Response (32 bytes)
+ * - Verification code (96 bytes)
+ * - Grant (16 bytes)
+ * Fails with MISCOMPARE sense if the response is wrong. Reply:
  * - Message ID (32 bytes)
  * - Token (32 bytes)
+ */
+
+        #define SCSI_WRP_GET_REPLY                             0xAC
+/*
+ * Data-in: the reply held for the last command above (or batch response),
+ * starting with that command's opcode. Fails with COMMAND SEQUENCE ERROR
+ * sense if there is none or the data-in phase is too short for it.
+ */
+
+        #define SCSI_WRP_AUTH_WRITE                            0xCA
+/*
+ * Command block as for WRITE (10). Data-out:
+ * - Message ID (32 bytes)
+ * - Token (32 bytes) for the message ID
+ * - The blocks to write
+ * Fails with DATA PROTECT sense, before anything is written, if the token
+ * is wrong, and with MISCOMPARE sense if the blocks do not hash to the
+ * message ID.
+ */
+
+        #define SCSI_WRP_COMMIT                                0xCD
+/*
+ * No data. Passes if the SHA-256 of everything written since the last
+ * successful SCSI_WRP_RESPONSE equals its message ID, otherwise fails
+ * with MISCOMPARE sense.
+ * In a batch session, data-out is the message ID of the payload being
+ * committed (32 bytes), and the SHA-256 is of what was written since the
+ * previous commit. The last commit of the batch also fails unless the
+ * committed message IDs chain to the batch ID.
+ */
+
+        #define SCSI_WRP_BATCH_LIST                            0xAB
+/*
+ * Data-out: 1 to BATCH_MAX_MESSAGES message IDs (32 bytes each). Their
+ * chain, B(i) = SHA-256(B(i-1) || message ID i) from B(0) = 0, is the batch
+ * ID, which is then used as the message ID of a SCSI_WRP_REQ_CHALLENGE.
+ */
+
+        #define SCSI_WRP_BATCH_RESPONSE                        0xCB
+/*
+ * Same input as SCSI_WRP_RESPONSE, for the challenge issued on a batch ID.
+ * Reply:
+ * - Batch ID (32 bytes)
+ * - Number of messages (1 byte)
+ * - Token for each message, in list order (32 bytes each)
+ */
+
+        #define SCSI_WRP_STATS                                 0xCE
+/*
+ * - WRP_Stats_t counters (little-endian), truncated to the allocation length
+ */
+
+        #define SCSI_WRP_RANDOM                                0xCF
+/*
+ * - Generator output or raw noise samples (source in byte 1), allocation
+ *   length in bytes 7-8
+ */
+
+        #define SCSI_WRP_SET_POLICY                            0xC9
+/*
+ * Data-out:
+ * - Message ID (32 bytes): SHA-256 of the table
+ * - Token (32 bytes) for the message ID
+ * - Table: number of ranges (2 bytes), then first block (4 bytes) and
+ *   policy (1 byte) of each range, sorted, the first starting at block 0
+ * Fails with INVALID FIELD IN PARAMETER LIST sense if the token is wrong
+ * or the table size does not match its count, leaving the old table, or
+ * if the table is out of order or does not hash to the message ID, leaving
+ * no table (SCSI_WRP_GET_POLICY then reports zero ranges, and every write
+ * is refused).
+ */
+
+        #define SCSI_WRP_GET_POLICY                            0xC8
+/*
+ * - The write policy table, as sent to SCSI_WRP_SET_POLICY, truncated to
+ *   the allocation length
+ */
+
+        #define SCSI_WRP_SET_FILE_GUARD                        0xC7
+/*
+ * Only with WRP_FILE_GUARD. Data-out:
+ * - Message ID (32 bytes): SHA-256 of the list
+ * - Token (32 bytes) for the message ID
+ * - List: number of objects (1 byte), then the first cluster and the block
+ *   holding the directory entry (4 bytes each) of each protected file or
+ *   directory
+ * Fails with INVALID FIELD IN PARAMETER LIST sense, leaving the old list,
+ * if the token or list is wrong.
+ */
+
+        #define SCSI_WRP_GET_FILE_GUARD                        0xC6
+/*
+ * Only with WRP_FILE_GUARD.
+ * - Number of objects (1 byte)
+ * - Cluster chain cache state (1 byte): 0 ready, 1 stale, 2 too
+ *   fragmented (data region read-only), 3 no FAT32 volume (all writes
+ *   refused)
+ * - Number of cached runs of blocks (1 byte)
+ * - The objects, as sent to SCSI_WRP_SET_FILE_GUARD
  */
 
 #endif
@@ -38,35 +38,31 @@
 
 #define  INCLUDE_FROM_SDCARDMANAGER_C
 #include "SDCardManager.h"
-#include "sd_raw.h"
 #include <LUFA/Drivers/Board/LEDs.h>
 
-static struct sd_raw_info disk_info;
 static uint32_t CachedTotalBlocks = 0;
-static uint8_t Buffer[16];
+
+#if !defined(WRP_COPROCESSOR)
+/** Running SHA-256 of the data written during the current WRP write session. */
+static SHA256_Context_t WriteHash;
+#endif
+
+/** Set while a WRP write session is open, so that written data is fed into WriteHash. */
+static bool WriteHashActive = false;
 
 void SDCardManager_Init(void)
 {
 	//LEDs_SetAllLEDs(LEDS_NO_LEDS);
-	while(!sd_raw_init())
-		printf_P(PSTR("MMC/SD initialization failed\r\n"));
+	STORAGE_BACKEND.Init();
 }
 
 uint32_t SDCardManager_GetNbBlocks(void)
 {
-	uint32_t TotalBlocks = 0;
-	
 	if (CachedTotalBlocks != 0)
 		return CachedTotalBlocks;
 		
-	if(!sd_raw_get_info(&disk_info))
-	{
-		printf_P(PSTR("Error reading SD card info\r\n"));
-		return 0;
-	}
-
-	CachedTotalBlocks = disk_info.capacity / 512;
-	//printf_P(PSTR("SD blocks: %li\r\n"), TotalBlocks);
+	CachedTotalBlocks = STORAGE_BACKEND.GetNbBlocks();
+	//printf_P(PSTR("SD blocks: %li\r\n"), CachedTotalBlocks);
 	
 	return CachedTotalBlocks;
 }
@@ -85,6 +81,14 @@ uintptr_t SDCardManager_WriteBlockHandler(uint8_t* buffer, offset_t offset, void
 	{
 		/* Clear the current endpoint bank */
 		Endpoint_ClearOUT();
+
+		#if !defined(WRP_COPROCESSOR)
+		/* Advance the write session hash while the host sends the next packet */
+		if (WriteHashActive)
+		{
+			while (!(Endpoint_IsReadWriteAllowed()) && SHA256_Step(&WriteHash));
+		}
+		#endif
 		
 		/* Wait until the host has sent another packet */
 		if (Endpoint_WaitUntilReady())
@@ -108,36 +112,35 @@ uintptr_t SDCardManager_WriteBlockHandler(uint8_t* buffer, offset_t offset, void
 	buffer[13] = Endpoint_Read_Byte();
 	buffer[14] = Endpoint_Read_Byte();
 	buffer[15] = Endpoint_Read_Byte();
+
+	if (WriteHashActive)
+	{
+		#if defined(WRP_COPROCESSOR)
+		Coprocessor_HashUpdate(buffer, 16);
+		#else
+		SHA256_Update(&WriteHash, buffer, 16);
+		#endif
+	}
 	
 	return 16;
 }
 
-void SDCardManager_WriteBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+bool SDCardManager_WriteBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
 {
-	bool     UsingSecondBuffer   = false;
-
 	printf_P(PSTR("W %li %i\r\n"), BlockAddress, TotalBlocks);
 
 	/* Wait until endpoint is ready before continuing */
 	if (Endpoint_WaitUntilReady())
-	  return;
+	  return false;
 	
-	while (TotalBlocks)
-	{
-		sd_raw_write_interval(BlockAddress *  VIRTUAL_MEMORY_BLOCK_SIZE, Buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &SDCardManager_WriteBlockHandler, NULL);
-		
-		/* Check if the current command is being aborted by the host */
-		if (IsMassStoreReset)
-		  return;
-			
-		/* Decrement the blocks remaining counter and reset the sub block counter */
-		BlockAddress++;
-		TotalBlocks--;
-	}
+	if (!(STORAGE_BACKEND.WriteBlocks(BlockAddress, TotalBlocks)))
+	  return false;
 
 	/* If the endpoint is empty, clear it ready for the next packet from the host */
 	if (!(Endpoint_IsReadWriteAllowed()))
 	  Endpoint_ClearOUT();
+
+	return true;
 }
 
 /** Reads blocks (OS blocks, not Dataflash pages) from the storage medium, the board dataflash IC(s), into
@@ -187,30 +190,86 @@ uint8_t SDCardManager_ReadBlockHandler(uint8_t* buffer, offset_t offset, void* p
 	return 1;
 }
 
-void SDCardManager_ReadBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+bool SDCardManager_ReadBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
 {
-	uint16_t CurrPage          = BlockAddress;
-	uint16_t CurrPageByte      = 0;
-
 	printf_P(PSTR("R %li %i\r\n"), BlockAddress, TotalBlocks);
 	
 	/* Wait until endpoint is ready before continuing */
 	if (Endpoint_WaitUntilReady())
-	  return;
+	  return false;
 	
-	while (TotalBlocks)
-	{
-		/* Read a data block from the SD card */
-		sd_raw_read_interval(BlockAddress * VIRTUAL_MEMORY_BLOCK_SIZE, Buffer, 16, 512, &SDCardManager_ReadBlockHandler, NULL);
-		
-		/* Decrement the blocks remaining counter */
-		BlockAddress++;
-		TotalBlocks--;
-	}
+	if (!(STORAGE_BACKEND.ReadBlocks(BlockAddress, TotalBlocks)))
+	  return false;
 	
 	/* If the endpoint is full, send its contents to the host */
 	if (!(Endpoint_IsReadWriteAllowed()))
 	  Endpoint_ClearIN();
+
+	return true;
+}
+
+/** Reads part of a block for the firmware's own use, bypassing the data endpoints.
+ *
+ *  \param[in]  BlockAddress  Block to read from
+ *  \param[in]  Offset        Offset of the data within the block
+ *  \param[out] Buffer        Buffer to read the data into
+ *  \param[in]  Length        Number of bytes to read, not crossing the end of the block
+ *
+ *  \return Boolean true if the data was read, false otherwise
+ */
+bool SDCardManager_ReadData(const uint32_t BlockAddress, const uint16_t Offset, uint8_t* Buffer, const uint16_t Length)
+{
+	return STORAGE_BACKEND.ReadData(BlockAddress, Offset, Buffer, Length);
+}
+
+/** Opens a WRP write session: every byte written from now on is hashed, in the order it arrives from the host,
+ *  until \ref SDCardManager_EndWriteHash() is called.
+ */
+void SDCardManager_BeginWriteHash(void)
+{
+	#if defined(WRP_COPROCESSOR)
+	Coprocessor_HashInit();
+	#else
+	SHA256_Init(&WriteHash);
+	#endif
+	WriteHashActive = true;
+}
+
+/** Closes the WRP write session, making sure all of its data has reached the card.
+ *
+ *  \param[out] Digest  SHA-256 of the data written during the session
+ *
+ *  \return Boolean true if a session was open, its data reached the medium and its digest is known, false otherwise
+ */
+bool SDCardManager_EndWriteHash(uint8_t* Digest)
+{
+	if (!(WriteHashActive))
+	  return false;
+
+	WriteHashActive = false;
+
+	if (!(STORAGE_BACKEND.Sync()))
+	  return false;
+
+	#if defined(WRP_COPROCESSOR)
+	return Coprocessor_HashFinal(Digest);
+	#else
+	SHA256_Final(&WriteHash, Digest);
+
+	return true;
+	#endif
+}
+
+/** Called by sd_raw while the card is busy programming a block. The write session hash is advanced by one step
+ *  per poll, which hides its compression time behind the card's own. The card is selected here, so nothing is done
+ *  when the hash runs on the coprocessor, which shares its bus.
+ */
+void SDCardManager_CardBusy(void)
+{
+	#if !defined(WRP_COPROCESSOR)
+	if (WriteHashActive)
+	  SHA256_Step(&WriteHash);
+	#endif
 }
 
 /** Performs a simple test on the attached Dataflash IC(s) to ensure that they are working.
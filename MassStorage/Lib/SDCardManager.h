@@ -11,6 +11,11 @@
 		
 		#include "MassStorage.h"
 		#include "Descriptors.h"
+		#include "SHA256.h"
+		#include "Coprocessor.h"
+		#include "StorageBackend.h"
+		#include "RemoteStorage.h"
+		#include "sd_raw.h"
 
 		#include <LUFA/Common/Common.h>
 		#include <LUFA/Drivers/USB/USB.h>
@@ -22,16 +27,39 @@
 		#define VIRTUAL_MEMORY_BLOCK_SIZE           512
 		#define WRITE_BUFFER_SIZE					512
 
+		/** Backend holding the blocks served to the host: the SD card on this board, the card of an atmega328
+		 *  node on the serial port when WRP_REMOTE_STORAGE is defined, or two SD cards on this board striped
+		 *  together when WRP_STRIPED_STORAGE is defined.
+		 */
+		#if !defined(STORAGE_BACKEND)
+			#if defined(WRP_REMOTE_STORAGE) && defined(WRP_STRIPED_STORAGE)
+				#error WRP_REMOTE_STORAGE and WRP_STRIPED_STORAGE select different backends.
+			#elif defined(WRP_REMOTE_STORAGE)
+				#define STORAGE_BACKEND             RemoteStorage
+			#elif defined(WRP_STRIPED_STORAGE)
+				#define STORAGE_BACKEND             StripedStorage
+			#else
+				#define STORAGE_BACKEND             LocalStorage
+			#endif
+		#endif
+
 	/* Function Prototypes: */
 		void SDCardManager_Init(void);
 		uint32_t SDCardManager_GetNbBlocks(void);
-		void SDCardManager_WriteBlocks(const uint32_t BlockAddress, uint16_t TotalBlocks);
-		void SDCardManager_ReadBlocks(uint32_t BlockAddress, uint16_t TotalBlocks);
+		bool SDCardManager_WriteBlocks(const uint32_t BlockAddress, uint16_t TotalBlocks);
+		bool SDCardManager_ReadBlocks(uint32_t BlockAddress, uint16_t TotalBlocks);
+		bool SDCardManager_ReadData(const uint32_t BlockAddress, const uint16_t Offset, uint8_t* Buffer,
+		                            const uint16_t Length) ATTR_NON_NULL_PTR_ARG(3);
+		uintptr_t SDCardManager_WriteBlockHandler(uint8_t* buffer, offset_t offset, void* p);
+		uint8_t SDCardManager_ReadBlockHandler(uint8_t* buffer, offset_t offset, void* p);
 		void SDCardManager_WriteBlocks_RAM(const uint32_t BlockAddress, uint16_t TotalBlocks,
 		                                      uint8_t* BufferPtr) ATTR_NON_NULL_PTR_ARG(3);
 		void SDCardManagerManager_ReadBlocks_RAM(const uint32_t BlockAddress, uint16_t TotalBlocks,
 		                                     uint8_t* BufferPtr) ATTR_NON_NULL_PTR_ARG(3);
 		void SDCardManager_ResetDataflashProtections(void);
 		bool SDCardManager_CheckDataflashOperation(void);
+		void SDCardManager_BeginWriteHash(void);
+		bool SDCardManager_EndWriteHash(uint8_t* Digest) ATTR_NON_NULL_PTR_ARG(1);
+		void SDCardManager_CardBusy(void);
 		
 #endif
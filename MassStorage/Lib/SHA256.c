@@ -0,0 +1,209 @@
+/** \file
+ *
+ *  Incremental SHA-256 (FIPS 180-4). The compression function is split into steps of
+ *  \ref SHA256_STEP_ROUNDS rounds so that callers can run it from their busy-wait loops (endpoint
+ *  and SD card polling) instead of stalling the data path: \ref SHA256_Update() only starts a
+ *  compression, and \ref SHA256_Step() advances it. A compression still pending when the next block
+ *  completes is finished on the spot, so the result never depends on how often Step is called.
+ */
+
+#include "SHA256.h"
+
+#include <string.h>
+
+/** Round constants, FIPS 180-4 section 4.2.2. */
+static const uint32_t RoundConstants[64] PROGMEM =
+	{
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+
+/** Initial hash value, FIPS 180-4 section 5.3.3. */
+static const uint32_t InitialState[8] PROGMEM =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+#define ROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+/** Loads the full input buffer into the message schedule and starts compressing it. */
+static void SHA256_BeginBlock(SHA256_Context_t* Context)
+{
+	const uint8_t* Block = Context->Buffer;
+
+	/* Never overwrite the schedule of a block that has not been finished yet */
+	while (SHA256_Step(Context));
+
+	for (uint8_t i = 0; i < 16; i++, Block += 4)
+	{
+		Context->Schedule[i] = (((uint32_t)Block[0] << 24) | ((uint32_t)Block[1] << 16) |
+		                        ((uint32_t)Block[2] << 8)  |  (uint32_t)Block[3]);
+	}
+
+	memcpy(Context->Work, Context->State, sizeof(Context->Work));
+
+	Context->Fill  = 0;
+	Context->Round = 0;
+}
+
+/** Resets a context to hash a new message.
+ *
+ *  \param[out] Context  Context to initialize
+ */
+void SHA256_Init(SHA256_Context_t* Context)
+{
+	memcpy_P(Context->State, InitialState, sizeof(Context->State));
+
+	Context->Length = 0;
+	Context->Fill   = 0;
+	Context->Round  = 64;
+}
+
+/** Appends data to the message. A compression is started whenever a 64 byte block completes, but most of
+ *  its work is left for \ref SHA256_Step().
+ *
+ *  \param[in,out] Context  Context to update
+ *  \param[in]     Data     Message bytes
+ *  \param[in]     Length   Number of bytes in Data
+ */
+void SHA256_Update(SHA256_Context_t* Context, const uint8_t* Data, uint16_t Length)
+{
+	Context->Length += Length;
+
+	while (Length)
+	{
+		uint8_t Space = (SHA256_BLOCK_SIZE - Context->Fill);
+		uint8_t Bytes = (Length < Space) ? Length : Space;
+
+		memcpy(&Context->Buffer[Context->Fill], Data, Bytes);
+
+		Context->Fill += Bytes;
+		Data          += Bytes;
+		Length        -= Bytes;
+
+		if (Context->Fill == SHA256_BLOCK_SIZE)
+		  SHA256_BeginBlock(Context);
+	}
+}
+
+/** Runs the next \ref SHA256_STEP_ROUNDS rounds of the pending compression, if any.
+ *
+ *  \param[in,out] Context  Context to advance
+ *
+ *  \return Boolean true if compression work is still pending after this step, false otherwise
+ */
+bool SHA256_Step(SHA256_Context_t* Context)
+{
+	uint32_t* W = Context->Schedule;
+	uint8_t   Round = Context->Round;
+
+	if (Round == 64)
+	  return false;
+
+	uint32_t a = Context->Work[0], b = Context->Work[1], c = Context->Work[2], d = Context->Work[3];
+	uint32_t e = Context->Work[4], f = Context->Work[5], g = Context->Work[6], h = Context->Work[7];
+
+	for (uint8_t End = (Round + SHA256_STEP_ROUNDS); Round < End; Round++)
+	{
+		uint32_t Wt;
+
+		if (Round < 16)
+		{
+			Wt = W[Round];
+		}
+		else
+		{
+			uint32_t W15 = W[(Round - 15) & 15];
+			uint32_t W2  = W[(Round - 2) & 15];
+
+			Wt = W[Round & 15] += ((ROTR(W2, 17) ^ ROTR(W2, 19) ^ (W2 >> 10)) + W[(Round - 7) & 15] +
+			                       (ROTR(W15, 7) ^ ROTR(W15, 18) ^ (W15 >> 3)));
+		}
+
+		uint32_t T1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+		              pgm_read_dword(&RoundConstants[Round]) + Wt;
+		uint32_t T2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + T1;
+		d = c;
+		c = b;
+		b = a;
+		a = T1 + T2;
+	}
+
+	Context->Round = Round;
+
+	if (Round == 64)
+	{
+		Context->State[0] += a;
+		Context->State[1] += b;
+		Context->State[2] += c;
+		Context->State[3] += d;
+		Context->State[4] += e;
+		Context->State[5] += f;
+		Context->State[6] += g;
+		Context->State[7] += h;
+
+		return false;
+	}
+
+	Context->Work[0] = a; Context->Work[1] = b; Context->Work[2] = c; Context->Work[3] = d;
+	Context->Work[4] = e; Context->Work[5] = f; Context->Work[6] = g; Context->Work[7] = h;
+
+	return true;
+}
+
+/** Pads the message, finishes all pending work and writes out the digest. The context must be
+ *  re-initialized before it is used again.
+ *
+ *  \param[in,out] Context  Context to finalize
+ *  \param[out]    Digest   32 byte message digest
+ */
+void SHA256_Final(SHA256_Context_t* Context, uint8_t* Digest)
+{
+	uint32_t MessageLength = Context->Length;
+	uint8_t  LengthField[8];
+	uint8_t  PadByte  = 0x80;
+	uint8_t  PadBytes = (Context->Fill < 56) ? (56 - Context->Fill) : (120 - Context->Fill);
+
+	/* The bit length is a 64-bit big-endian field; the byte count fits in 32 bits */
+	LengthField[0] = 0;
+	LengthField[1] = 0;
+	LengthField[2] = 0;
+	LengthField[3] = (MessageLength >> 29);
+	LengthField[4] = (MessageLength >> 21);
+	LengthField[5] = (MessageLength >> 13);
+	LengthField[6] = (MessageLength >> 5);
+	LengthField[7] = (MessageLength << 3);
+
+	/* 0x80 and then zeros, a byte at a time, which saves a block of padding in SRAM */
+	do
+	{
+		SHA256_Update(Context, &PadByte, 1);
+		PadByte = 0x00;
+	}
+	while (--PadBytes);
+
+	SHA256_Update(Context, LengthField, sizeof(LengthField));
+
+	while (SHA256_Step(Context));
+
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		uint32_t Word = Context->State[i];
+
+		*(Digest++) = (Word >> 24);
+		*(Digest++) = (Word >> 16);
+		*(Digest++) = (Word >> 8);
+		*(Digest++) = Word;
+	}
+}
@@ -0,0 +1,51 @@
+/** \file
+ *
+ *  Header file for SHA256.c.
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/pgmspace.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Size of a SHA-256 digest, in bytes. */
+		#define SHA256_DIGEST_SIZE         32
+
+		/** Size of a SHA-256 message block, in bytes. */
+		#define SHA256_BLOCK_SIZE          64
+
+		/** Number of compression rounds run by each call to \ref SHA256_Step(). A smaller value gives finer
+		 *  grained interleaving with I/O waits at the cost of more call overhead; it must divide 64.
+		 */
+		#define SHA256_STEP_ROUNDS         8
+
+	/* Type Defines: */
+		/** Type define for an incremental SHA-256 computation. A completed message block is moved into the message
+		 *  schedule straight away, so the input buffer can refill while that block is still being compressed.
+		 */
+		typedef struct
+		{
+			uint32_t State[8]; /**< Chaining value */
+			uint32_t Work[8]; /**< Working variables a to h of the compression in progress */
+			uint32_t Schedule[16]; /**< Rolling message schedule of the compression in progress */
+			uint8_t  Buffer[SHA256_BLOCK_SIZE]; /**< Partially filled next message block */
+			uint32_t Length; /**< Total number of message bytes hashed so far */
+			uint8_t  Fill; /**< Number of bytes in Buffer */
+			uint8_t  Round; /**< Next round of the compression in progress, 64 when none is pending */
+		} SHA256_Context_t;
+
+	/* Function Prototypes: */
+		void SHA256_Init(SHA256_Context_t* Context) ATTR_NON_NULL_PTR_ARG(1);
+		void SHA256_Update(SHA256_Context_t* Context, const uint8_t* Data, uint16_t Length) ATTR_NON_NULL_PTR_ARG(1);
+		bool SHA256_Step(SHA256_Context_t* Context) ATTR_NON_NULL_PTR_ARG(1);
+		void SHA256_Final(SHA256_Context_t* Context, uint8_t* Digest) ATTR_NON_NULL_PTR_ARG(1, 2);
+
+#endif
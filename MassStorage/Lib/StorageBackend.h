@@ -0,0 +1,34 @@
+/** \file
+ *
+ *  Interface between SDCardManager and the medium it serves to the host.
+ */
+
+#ifndef _STORAGE_BACKEND_H_
+#define _STORAGE_BACKEND_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+	/* Type Defines: */
+		/** Type define for a storage backend. Block transfers move their data through the mass storage data endpoints
+		 *  a 16 byte chunk at a time, with \ref SDCardManager_ReadBlockHandler() and
+		 *  \ref SDCardManager_WriteBlockHandler(), so the backend never holds more of a transfer than it needs itself.
+		 */
+		typedef struct
+		{
+			void     (*Init)(void); /**< Sets up the medium, waiting for it to become usable */
+			uint32_t (*GetNbBlocks)(void); /**< Returns the number of blocks of the medium, 0 on error */
+			bool     (*ReadBlocks)(uint32_t BlockAddress, uint16_t TotalBlocks); /**< Sends blocks to the host */
+			bool     (*WriteBlocks)(uint32_t BlockAddress, uint16_t TotalBlocks); /**< Stores blocks from the host */
+			bool     (*ReadData)(uint32_t BlockAddress, uint16_t Offset, uint8_t* Buffer,
+			                     uint16_t Length); /**< Reads part of one block for the firmware itself */
+			bool     (*Sync)(void); /**< Returns once all written data is on the medium */
+		} StorageBackend_t;
+
+	/* External Variables: */
+		extern const StorageBackend_t LocalStorage;
+		extern const StorageBackend_t RemoteStorage;
+		extern const StorageBackend_t StripedStorage;
+
+#endif
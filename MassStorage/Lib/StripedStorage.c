@@ -0,0 +1,146 @@
+/** \file
+ *
+ *  Storage backend striping the blocks across two SD cards on this processor's SPI bus, through sd_raw. The cards
+ *  take turns every \ref STRIPED_STORAGE_STRIPE blocks, so a write leaves one card programming its block while the
+ *  next block goes to the other, and the wait for a card's programming is only paid when it is addressed again.
+ *
+ *  The second card's chip select is select_card_1() in sd_raw_config.h. Each card keeps its own sd_raw block cache,
+ *  so this mode takes another 512 bytes of SRAM.
+ */
+
+#if defined(WRP_STRIPED_STORAGE)
+
+#include "SDCardManager.h"
+#include "sd_raw.h"
+
+/** Blocks of a stripe unit, the consecutive blocks kept on one card before the other takes over. A single block
+ *  lets every block of a transfer overlap with the programming of the one before.
+ */
+#if !defined(STRIPED_STORAGE_STRIPE)
+	#define STRIPED_STORAGE_STRIPE   1
+#endif
+
+/** Chunk of a block on its way between the cards and the data endpoints. */
+static uint8_t Buffer[16];
+
+/** Makes the card holding the given block of the medium the one sd_raw works on.
+ *
+ *  \param[in] BlockAddress  Block of the medium
+ *
+ *  \return Address of the block on its card
+ */
+static uint32_t StripedStorage_Map(uint32_t BlockAddress)
+{
+	uint32_t Unit = BlockAddress / STRIPED_STORAGE_STRIPE;
+
+	sd_raw_use(Unit % SD_RAW_CARDS);
+
+	return (Unit / SD_RAW_CARDS) * STRIPED_STORAGE_STRIPE + (BlockAddress % STRIPED_STORAGE_STRIPE);
+}
+
+static void StripedStorage_Init(void)
+{
+	for (uint8_t Card = 0; Card < SD_RAW_CARDS; Card++)
+	{
+		sd_raw_use(Card);
+
+		while(!sd_raw_init())
+			printf_P(PSTR("MMC/SD %d initialization failed\r\n"), Card);
+	}
+}
+
+static uint32_t StripedStorage_GetNbBlocks(void)
+{
+	uint32_t CardBlocks = 0xFFFFFFFF;
+
+	/* Every card holds the same number of stripe units, as many as the smallest one has room for */
+	for (uint8_t Card = 0; Card < SD_RAW_CARDS; Card++)
+	{
+		struct sd_raw_info disk_info;
+
+		sd_raw_use(Card);
+
+		if(!sd_raw_get_info(&disk_info))
+		{
+			printf_P(PSTR("Error reading SD card %d info\r\n"), Card);
+			return 0;
+		}
+
+		if ((disk_info.capacity / 512) < CardBlocks)
+		  CardBlocks = disk_info.capacity / 512;
+	}
+
+	return (CardBlocks / STRIPED_STORAGE_STRIPE) * STRIPED_STORAGE_STRIPE * SD_RAW_CARDS;
+}
+
+static bool StripedStorage_ReadBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+{
+	while (TotalBlocks)
+	{
+		/* Read a data block from the card holding it */
+		if (!(sd_raw_read_interval((offset_t)StripedStorage_Map(BlockAddress) * VIRTUAL_MEMORY_BLOCK_SIZE, Buffer,
+		                           16, 512, &SDCardManager_ReadBlockHandler, NULL)))
+		{
+			return false;
+		}
+
+		/* Decrement the blocks remaining counter */
+		BlockAddress++;
+		TotalBlocks--;
+	}
+
+	return true;
+}
+
+static bool StripedStorage_WriteBlocks(uint32_t BlockAddress, uint16_t TotalBlocks)
+{
+	while (TotalBlocks)
+	{
+		/* The card is left programming the block, while the next one goes to the other card */
+		if (!(sd_raw_write_interval((offset_t)StripedStorage_Map(BlockAddress) * VIRTUAL_MEMORY_BLOCK_SIZE, Buffer,
+		                            VIRTUAL_MEMORY_BLOCK_SIZE, &SDCardManager_WriteBlockHandler, NULL)))
+		{
+			return false;
+		}
+
+		/* Check if the current command is being aborted by the host */
+		if (IsMassStoreReset)
+		  return false;
+
+		/* Decrement the blocks remaining counter and reset the sub block counter */
+		BlockAddress++;
+		TotalBlocks--;
+	}
+
+	return true;
+}
+
+static bool StripedStorage_ReadData(uint32_t BlockAddress, uint16_t Offset, uint8_t* Data, uint16_t Length)
+{
+	return sd_raw_read(((offset_t)StripedStorage_Map(BlockAddress) << 9) + Offset, Data, Length);
+}
+
+static bool StripedStorage_Sync(void)
+{
+	for (uint8_t Card = 0; Card < SD_RAW_CARDS; Card++)
+	{
+		sd_raw_use(Card);
+
+		if (!(sd_raw_sync()))
+		  return false;
+	}
+
+	return true;
+}
+
+const StorageBackend_t StripedStorage =
+	{
+		.Init        = StripedStorage_Init,
+		.GetNbBlocks = StripedStorage_GetNbBlocks,
+		.ReadBlocks  = StripedStorage_ReadBlocks,
+		.WriteBlocks = StripedStorage_WriteBlocks,
+		.ReadData    = StripedStorage_ReadData,
+		.Sync        = StripedStorage_Sync,
+	};
+
+#endif
@@ -0,0 +1,354 @@
+/** \file
+ *
+ *  LBA write protection policy. The card is divided into ranges, each writable, protected or append-only, held as a
+ *  sorted table of range boundaries in EEPROM (the table does not fit in RAM). Every WRITE (10) is checked before any
+ *  of its data is accepted: a binary search over a small RAM index of every few boundaries picks a short run of
+ *  table entries, and a second binary search over that run in EEPROM finds the range the write starts in.
+ *
+ *  Append-only ranges accept writes only at or above their append pointer, which moves to the end of each write once
+ *  it has reached the card, so blocks once written there cannot be overwritten. The pointers live in RAM and are
+ *  written back to EEPROM a byte at a time while the device is idle, so the hot path never waits on an EEPROM write.
+ *  A pointer advanced shortly before power is lost may come back slightly lower.
+ *
+ *  Each table carries a serial number, and a new table is only taken if its serial number is above the installed one's,
+ *  so an old table cannot be put back. While the table is being replaced, and if it is ever found invalid, every
+ *  write is refused.
+ */
+
+#include "WritePolicy.h"
+
+/** Policy table: number of ranges and the ranges themselves. The EEPROM image starts with the whole card writable. */
+static uint16_t           StoredCount EEMEM = 1;
+static WritePolicyRange_t StoredRanges[WRITE_POLICY_MAX_RANGES] EEMEM = {{0, WRITE_POLICY_WRITABLE}};
+
+/** Serial number of the installed table. */
+static uint32_t           StoredSerial EEMEM = 0;
+
+/** Append pointers as of the last write-back. */
+static uint32_t           StoredAppend[WRITE_POLICY_APPEND_SLOTS] EEMEM;
+
+/** Number of ranges in the table, zero while there is no valid table. */
+static uint16_t           RangeCount;
+
+/** First block of every FenceStride-th range, the RAM index that narrows each search. */
+static uint32_t           Fence[WRITE_POLICY_FENCES];
+static uint8_t            FenceCount;
+static uint8_t            FenceStride;
+
+/** Append pointers of the append-only ranges, and which of them differ from their EEPROM copy. */
+static uint32_t           AppendPointer[WRITE_POLICY_APPEND_SLOTS];
+static uint8_t            AppendDirty;
+
+/** Append slots used by the installed table, so that writes outside any append-only range skip the advance. */
+static uint8_t            AppendUsed;
+
+/** Append pointer being written back by \ref WritePolicy_Task(), and the next byte of it to write. */
+static uint32_t           FlushValue;
+static uint8_t            FlushSlot;
+static uint8_t            FlushByte;
+
+/** First block of the last range set by the update in progress, to check that the new table is sorted, and the append
+ *  slots it has used, to check that no two ranges share one.
+ */
+static uint32_t           UpdateLastBlock;
+static uint8_t            UpdateSlots;
+
+/** Number of writes refused by the policy. */
+uint32_t WritePolicy_Rejects;
+
+/** Timer 1 cycles taken by the last call to \ref WritePolicy_Check(). */
+uint16_t WritePolicy_CheckCycles;
+
+/** Rebuilds the RAM index from the table in EEPROM. */
+static void WritePolicy_BuildFences(void)
+{
+	FenceStride = ((RangeCount + (WRITE_POLICY_FENCES - 1)) / WRITE_POLICY_FENCES);
+	if (!(FenceStride))
+	  FenceStride = 1;
+
+	FenceCount = ((RangeCount + (FenceStride - 1)) / FenceStride);
+
+	for (uint8_t i = 0; i < FenceCount; i++)
+	  Fence[i] = eeprom_read_dword(&StoredRanges[(uint16_t)i * FenceStride].FirstBlock);
+}
+
+/** Finds the range a block lies in, the last one whose first block is not above it. Requires a valid table. */
+static uint16_t WritePolicy_Find(const uint32_t Block)
+{
+	uint8_t  FenceLow  = 0;
+	uint8_t  FenceHigh = (FenceCount - 1);
+
+	while (FenceLow < FenceHigh)
+	{
+		uint8_t Middle = ((FenceLow + FenceHigh + 1) / 2);
+
+		if (Fence[Middle] <= Block)
+		  FenceLow  = Middle;
+		else
+		  FenceHigh = (Middle - 1);
+	}
+
+	uint16_t Low  = ((uint16_t)FenceLow * FenceStride);
+	uint16_t High = (Low + FenceStride - 1);
+
+	if (High >= RangeCount)
+	  High = (RangeCount - 1);
+
+	while (Low < High)
+	{
+		uint16_t Middle = ((Low + High + 1) / 2);
+
+		if (eeprom_read_dword(&StoredRanges[Middle].FirstBlock) <= Block)
+		  Low  = Middle;
+		else
+		  High = (Middle - 1);
+	}
+
+	return Low;
+}
+
+/** Returns the first block past the given range. */
+static uint32_t WritePolicy_RangeEnd(const uint16_t Index)
+{
+	if ((Index + 1) >= RangeCount)
+	  return UINT32_MAX;
+
+	return eeprom_read_dword(&StoredRanges[Index + 1].FirstBlock);
+}
+
+/** Moves the append pointers of the append-only ranges a write covers to the end of the write. Called once the write
+ *  has reached the card; \ref WritePolicy_Check() must have allowed it.
+ *
+ *  \param[in] BlockAddress  First block written
+ *  \param[in] TotalBlocks   Number of blocks written
+ */
+void WritePolicy_Advance(const uint32_t BlockAddress, const uint16_t TotalBlocks)
+{
+	uint32_t End = (BlockAddress + TotalBlocks);
+
+	if (!(RangeCount) || !(AppendUsed))
+	  return;
+
+	uint16_t Index = WritePolicy_Find(BlockAddress);
+
+	for (;;)
+	{
+		uint8_t  Policy   = eeprom_read_byte(&StoredRanges[Index].Policy);
+		uint32_t RangeEnd = WritePolicy_RangeEnd(Index);
+
+		if ((Policy & 0x0F) == WRITE_POLICY_APPEND_ONLY)
+		{
+			uint8_t  Slot     = (Policy >> 4);
+			uint32_t PieceEnd = (End < RangeEnd) ? End : RangeEnd;
+
+			if (PieceEnd > AppendPointer[Slot])
+			{
+				AppendPointer[Slot] = PieceEnd;
+				AppendDirty |= (1 << Slot);
+			}
+		}
+
+		if (End <= RangeEnd)
+		  break;
+
+		Index++;
+	}
+}
+
+/** Loads the policy table index and the append pointers from EEPROM. */
+void WritePolicy_Init(void)
+{
+	RangeCount = eeprom_read_word(&StoredCount);
+
+	if ((RangeCount > WRITE_POLICY_MAX_RANGES) || eeprom_read_dword(&StoredRanges[0].FirstBlock))
+	  RangeCount = 0;
+
+	WritePolicy_BuildFences();
+
+	for (uint16_t i = 0; i < RangeCount; i++)
+	{
+		uint8_t Policy = eeprom_read_byte(&StoredRanges[i].Policy);
+
+		if ((Policy & 0x0F) == WRITE_POLICY_APPEND_ONLY)
+		  AppendUsed |= (1 << (Policy >> 4));
+	}
+
+	eeprom_read_block(AppendPointer, StoredAppend, sizeof(AppendPointer));
+}
+
+/** Idle-time work: writes back one byte of a changed append pointer, if the EEPROM is free. */
+void WritePolicy_Task(void)
+{
+	if (!(eeprom_is_ready()))
+	  return;
+
+	if (!(FlushByte))
+	{
+		if (!(AppendDirty))
+		  return;
+
+		/* Take a copy of the lowest changed pointer; a write that moves it again marks it for another pass */
+		for (FlushSlot = 0; !(AppendDirty & (1 << FlushSlot)); FlushSlot++);
+
+		AppendDirty &= ~(1 << FlushSlot);
+		FlushValue   = AppendPointer[FlushSlot];
+	}
+
+	eeprom_update_byte(((uint8_t*)&StoredAppend[FlushSlot] + FlushByte), ((uint8_t*)&FlushValue)[FlushByte]);
+
+	if (++FlushByte == sizeof(FlushValue))
+	  FlushByte = 0;
+}
+
+/** Checks a WRITE (10) against the policy. Every range the write touches must allow it. Nothing is changed: once the
+ *  write has reached the card, \ref WritePolicy_Advance() moves the append pointers of the append-only ranges it covers.
+ *
+ *  \param[in] BlockAddress  First block to be written
+ *  \param[in] TotalBlocks   Number of blocks to be written
+ *
+ *  \return Boolean true if the policy allows the write, false otherwise
+ */
+bool WritePolicy_Check(const uint32_t BlockAddress, const uint16_t TotalBlocks)
+{
+	uint16_t Start   = TCNT1;
+	uint32_t End     = (BlockAddress + TotalBlocks);
+	bool     Allowed = (RangeCount != 0);
+
+	if (Allowed)
+	{
+		uint16_t Index = WritePolicy_Find(BlockAddress);
+		uint32_t Block = BlockAddress;
+
+		for (;;)
+		{
+			uint8_t  Policy   = eeprom_read_byte(&StoredRanges[Index].Policy);
+			uint32_t RangeEnd = WritePolicy_RangeEnd(Index);
+
+			if ((Policy & 0x0F) == WRITE_POLICY_PROTECTED)
+			{
+				Allowed = false;
+			}
+			else if ((Policy & 0x0F) == WRITE_POLICY_APPEND_ONLY)
+			{
+				Allowed = (Block >= AppendPointer[Policy >> 4]);
+			}
+
+			if (!(Allowed) || (End <= RangeEnd))
+			  break;
+
+			Block = RangeEnd;
+			Index++;
+		}
+	}
+
+	if (!(Allowed))
+	  WritePolicy_Rejects++;
+
+	WritePolicy_CheckCycles = (TCNT1 - Start);
+
+	return Allowed;
+}
+
+/** Returns the number of ranges in the policy table, zero if there is no valid table. */
+uint16_t WritePolicy_GetRangeCount(void)
+{
+	return RangeCount;
+}
+
+/** Returns the serial number of the installed policy table, which the next table must exceed. */
+uint32_t WritePolicy_GetSerial(void)
+{
+	return eeprom_read_dword(&StoredSerial);
+}
+
+/** Reads one range of the policy table in the form exchanged with the host.
+ *
+ *  \param[in]  Index  Index of the range, below \ref WritePolicy_GetRangeCount()
+ *  \param[out] Range  WRITE_POLICY_RANGE_SIZE bytes: first block (big-endian), policy
+ */
+void WritePolicy_GetRange(const uint16_t Index, uint8_t* Range)
+{
+	uint32_t FirstBlock = eeprom_read_dword(&StoredRanges[Index].FirstBlock);
+
+	Range[0] = (FirstBlock >> 24);
+	Range[1] = (FirstBlock >> 16);
+	Range[2] = (FirstBlock >> 8);
+	Range[3] = FirstBlock;
+	Range[4] = eeprom_read_byte(&StoredRanges[Index].Policy);
+}
+
+/** Starts replacing the policy table. Until \ref WritePolicy_EndUpdate() installs the new one, every write is
+ *  refused, and if the update never completes the device stays that way. Call this only once the start of the new
+ *  table has been authenticated.
+ */
+void WritePolicy_BeginUpdate(void)
+{
+	RangeCount  = 0;
+	AppendUsed  = 0;
+	UpdateSlots = 0;
+	eeprom_update_word(&StoredCount, 0);
+}
+
+/** Stores one range of the new policy table. Ranges must be set in order. The EEPROM is written straight away, which
+ *  takes a few milliseconds per changed byte.
+ *
+ *  \param[in] Index  Index of the range in the new table
+ *  \param[in] Range  WRITE_POLICY_RANGE_SIZE bytes: first block (big-endian), policy
+ *
+ *  \return Boolean true if the range is valid, false if it is out of order, its policy is unknown or its append slot
+ *          is out of range or already used
+ */
+bool WritePolicy_SetRange(const uint16_t Index, const uint8_t* Range)
+{
+	WritePolicyRange_t NewRange;
+
+	NewRange.FirstBlock = (((uint32_t)Range[0] << 24) | ((uint32_t)Range[1] << 16) | ((uint16_t)Range[2] << 8) | Range[3]);
+	NewRange.Policy     = Range[4];
+
+	if (Index >= WRITE_POLICY_MAX_RANGES)
+	  return false;
+
+	if (Index ? (NewRange.FirstBlock <= UpdateLastBlock) : (NewRange.FirstBlock != 0))
+	  return false;
+
+	switch (NewRange.Policy & 0x0F)
+	{
+		case WRITE_POLICY_APPEND_ONLY:
+			if (((NewRange.Policy >> 4) >= WRITE_POLICY_APPEND_SLOTS) || (UpdateSlots & (1 << (NewRange.Policy >> 4))))
+			  return false;
+
+			/* A new table restarts each append-only range at its first block */
+			AppendPointer[NewRange.Policy >> 4] = NewRange.FirstBlock;
+			AppendDirty |= (1 << (NewRange.Policy >> 4));
+			UpdateSlots |= (1 << (NewRange.Policy >> 4));
+			break;
+		case WRITE_POLICY_WRITABLE:
+		case WRITE_POLICY_PROTECTED:
+			if (NewRange.Policy >> 4)
+			  return false;
+
+			break;
+		default:
+			return false;
+	}
+
+	UpdateLastBlock = NewRange.FirstBlock;
+	eeprom_update_block(&NewRange, &StoredRanges[Index], sizeof(NewRange));
+
+	return true;
+}
+
+/** Installs the policy table stored by \ref WritePolicy_SetRange().
+ *
+ *  \param[in] Count   Number of ranges in the new table, all of which were set successfully
+ *  \param[in] Serial  Serial number of the new table, above \ref WritePolicy_GetSerial()
+ */
+void WritePolicy_EndUpdate(const uint16_t Count, const uint32_t Serial)
+{
+	eeprom_update_dword(&StoredSerial, Serial);
+	eeprom_update_word(&StoredCount, Count);
+
+	RangeCount = Count;
+	AppendUsed = UpdateSlots;
+	WritePolicy_BuildFences();
+}
@@ -0,0 +1,73 @@
+/** \file
+ *
+ *  Header file for WritePolicy.c.
+ */
+
+#ifndef _WRITE_POLICY_H_
+#define _WRITE_POLICY_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/eeprom.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Largest number of ranges in the policy table. Each takes 5 bytes of EEPROM and no RAM. */
+		#if !defined(WRITE_POLICY_MAX_RANGES)
+			#define WRITE_POLICY_MAX_RANGES    160
+		#endif
+
+		/** Number of ranges whose first block is kept in RAM, to narrow the search before it reaches the EEPROM. */
+		#if !defined(WRITE_POLICY_FENCES)
+			#define WRITE_POLICY_FENCES        16
+		#endif
+
+		/** Number of append-only ranges that can be configured, each with its own append pointer. */
+		#if !defined(WRITE_POLICY_APPEND_SLOTS)
+			#define WRITE_POLICY_APPEND_SLOTS  8
+		#endif
+
+		/** Policy of a range, in the low nibble of its policy byte. For WRITE_POLICY_APPEND_ONLY the high nibble
+		 *  selects the append slot.
+		 */
+		#define WRITE_POLICY_WRITABLE          0
+		#define WRITE_POLICY_PROTECTED         1
+		#define WRITE_POLICY_APPEND_ONLY       2
+
+		/** Size of one range in the table sent to and read from the host: first block (4, big-endian), policy (1). */
+		#define WRITE_POLICY_RANGE_SIZE        5
+
+		/** Number of ranges in each hash-chained chunk of a new table sent by the host, see \ref set_policy(). */
+		#define WRITE_POLICY_CHUNK_RANGES      16
+
+	/* Type Defines: */
+		/** Type define for a range of the policy table. A range runs from its first block up to the first block of the
+		 *  next range; the table is sorted and its first range starts at block 0, so every block has one policy.
+		 */
+		typedef struct
+		{
+			uint32_t FirstBlock; /**< First block the policy applies to */
+			uint8_t  Policy; /**< One of the WRITE_POLICY_* values */
+		} WritePolicyRange_t;
+
+	/* Global Variables: */
+		extern uint32_t WritePolicy_Rejects;
+		extern uint16_t WritePolicy_CheckCycles;
+
+	/* Function Prototypes: */
+		void WritePolicy_Init(void);
+		void WritePolicy_Task(void);
+		bool WritePolicy_Check(const uint32_t BlockAddress, const uint16_t TotalBlocks);
+		void WritePolicy_Advance(const uint32_t BlockAddress, const uint16_t TotalBlocks);
+		uint16_t WritePolicy_GetRangeCount(void);
+		uint32_t WritePolicy_GetSerial(void);
+		void WritePolicy_GetRange(const uint16_t Index, uint8_t* Range) ATTR_NON_NULL_PTR_ARG(2);
+		void WritePolicy_BeginUpdate(void);
+		bool WritePolicy_SetRange(const uint16_t Index, const uint8_t* Range) ATTR_NON_NULL_PTR_ARG(2);
+		void WritePolicy_EndUpdate(const uint16_t Count, const uint32_t Serial);
+
+#endif
@@ -0,0 +1,209 @@
+/** \file
+ *
+ *  LBA range write tokens. A successful WRP challenge response grants one token, which lets a whole transfer of
+ *  WRITE (10) commands through without another challenge: it covers a range of blocks, a budget of blocks that may
+ *  be written within that range, and a lifetime. The table is small and fixed, and every check visits every slot
+ *  with the same sequence of operations, so the cost added to each WRITE (10) does not depend on which token (if
+ *  any) matches.
+ *
+ *  Each grant is also given a random nonce. The token returned to the host for an authenticated write is made from
+ *  the grant's binding (its range, block count and nonce), so it is good only for writes within that grant and
+ *  only while the grant lives.
+ *
+ *  Lifetimes are counted in USB frames, which the host sends once per millisecond; the clock stops while the bus
+ *  is suspended, when no writes can arrive either.
+ */
+
+#include "WriteTokens.h"
+
+/** Live write tokens. A slot with no blocks left is free. */
+static WriteToken_t Tokens[WRITE_TOKEN_SLOTS];
+
+/** Millisecond clock, advanced by \ref WriteTokens_Tick() from the start of frame event. */
+static volatile uint32_t Milliseconds;
+
+/** Number of WRITE (10) commands checked against the token table, and how many of them no token covered. */
+uint32_t WriteTokens_Checks;
+uint32_t WriteTokens_Rejects;
+
+/** Timer 1 cycles taken by the last call to \ref WriteTokens_Check(). */
+uint16_t WriteTokens_CheckCycles;
+
+/** Reads a big-endian 32-bit field of a grant block. */
+static uint32_t WriteTokens_ReadBE32(const uint8_t* Data)
+{
+	return (((uint32_t)Data[0] << 24) | ((uint32_t)Data[1] << 16) | ((uint16_t)Data[2] << 8) | Data[3]);
+}
+
+/** Writes a big-endian 32-bit field of a binding. */
+static void WriteTokens_WriteBE32(uint8_t* Data, const uint32_t Value)
+{
+	Data[0] = (Value >> 24);
+	Data[1] = (Value >> 16);
+	Data[2] = (Value >> 8);
+	Data[3] = Value;
+}
+
+/** Reads the millisecond clock, which is updated from an interrupt. */
+static uint32_t WriteTokens_Now(void)
+{
+	uint32_t Now;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		Now = Milliseconds;
+	}
+
+	return Now;
+}
+
+/** Advances the token clock by one millisecond. Called from the USB start of frame event. */
+void WriteTokens_Tick(void)
+{
+	Milliseconds++;
+}
+
+/** Adds a token to the table, replacing a free or lapsed slot if there is one, otherwise the slot closest to lapsing.
+ *
+ *  \param[in] Grant  Grant block of WRITE_TOKEN_GRANT_SIZE bytes, all fields big-endian:
+ *                    first block (4), number of blocks in the range (4), number of blocks that may be written (4),
+ *                    lifetime in seconds (2), reserved (2)
+ *  \param[in] Nonce  Random value that tells this grant apart from any other with the same fields
+ *
+ *  \return Slot the token was placed in
+ */
+uint8_t WriteTokens_Grant(const uint8_t* Grant, const uint32_t Nonce)
+{
+	uint32_t Now       = WriteTokens_Now();
+	uint32_t First     = WriteTokens_ReadBE32(&Grant[0]);
+	uint32_t Range     = WriteTokens_ReadBE32(&Grant[4]);
+	uint16_t Lifetime  = (((uint16_t)Grant[12] << 8) | Grant[13]);
+	uint8_t  Victim    = 0;
+	uint32_t VictimTTL = UINT32_MAX;
+
+	for (uint8_t i = 0; i < WRITE_TOKEN_SLOTS; i++)
+	{
+		int32_t TTL = (int32_t)(Tokens[i].Expiry - Now);
+
+		if (!(Tokens[i].BlocksLeft) || (TTL <= 0))
+		{
+			Victim = i;
+			break;
+		}
+
+		if ((uint32_t)TTL < VictimTTL)
+		{
+			Victim    = i;
+			VictimTTL = TTL;
+		}
+	}
+
+	/* Clamp the range to the end of the address space, so that FirstBlock + TotalBlocks never wraps in the check */
+	if (Range > (UINT32_MAX - First))
+	  Range = (UINT32_MAX - First);
+
+	Tokens[Victim].FirstBlock = First;
+	Tokens[Victim].EndBlock   = (First + Range);
+	Tokens[Victim].BlocksLeft = WriteTokens_ReadBE32(&Grant[8]);
+	Tokens[Victim].Expiry     = (Now + ((uint32_t)Lifetime * 1000));
+
+	Tokens[Victim].BlocksGranted = Tokens[Victim].BlocksLeft;
+	Tokens[Victim].Nonce         = Nonce;
+
+	return Victim;
+}
+
+/** Reads the binding of a token: what the token sent to the host for an authenticated write is made from.
+ *
+ *  \param[in]  Slot     Slot of the token
+ *  \param[out] Binding  WRITE_TOKEN_BINDING_SIZE bytes, all fields big-endian: first block (4), one past the last
+ *                       block (4), number of blocks granted (4), nonce (4)
+ */
+void WriteTokens_GetBinding(const uint8_t Slot, uint8_t* Binding)
+{
+	WriteTokens_WriteBE32(&Binding[0],  Tokens[Slot].FirstBlock);
+	WriteTokens_WriteBE32(&Binding[4],  Tokens[Slot].EndBlock);
+	WriteTokens_WriteBE32(&Binding[8],  Tokens[Slot].BlocksGranted);
+	WriteTokens_WriteBE32(&Binding[12], Tokens[Slot].Nonce);
+}
+
+/** Finds the live tokens that cover a write, without charging it to any of them. Does the same work for every slot,
+ *  so the time taken does not depend on which tokens match.
+ *
+ *  \param[in] BlockAddress  First block to be written
+ *  \param[in] TotalBlocks   Number of blocks to be written
+ *
+ *  \return Mask of the slots whose tokens cover the whole write
+ */
+uint8_t WriteTokens_Covering(const uint32_t BlockAddress, const uint16_t TotalBlocks)
+{
+	uint32_t Now     = WriteTokens_Now();
+	uint32_t End     = (BlockAddress + TotalBlocks);
+	uint8_t  Matches = 0;
+
+	/* Each condition is evaluated to 0 or 1 and combined without branching */
+	for (uint8_t i = 0; i < WRITE_TOKEN_SLOTS; i++)
+	{
+		uint8_t Fits = ((BlockAddress >= Tokens[i].FirstBlock) &
+		                (End          <= Tokens[i].EndBlock)   &
+		                (End          >= BlockAddress)         &
+		                (TotalBlocks  <= Tokens[i].BlocksLeft) &
+		                ((int32_t)(Tokens[i].Expiry - Now) > 0));
+
+		Matches |= (Fits << i);
+	}
+
+	return Matches;
+}
+
+/** Charges a write to one token, which must cover it (see \ref WriteTokens_Covering()).
+ *
+ *  \param[in] Slot         Slot of the token
+ *  \param[in] TotalBlocks  Number of blocks to be written
+ */
+void WriteTokens_Charge(const uint8_t Slot, const uint16_t TotalBlocks)
+{
+	Tokens[Slot].BlocksLeft -= TotalBlocks;
+	WriteTokens_Checks++;
+}
+
+/** Checks a WRITE (10) against the token table, and picks the first token that covers it. Nothing is charged until
+ *  the blocks have reached the medium, see \ref WriteTokens_ChargeMatch().
+ *
+ *  \param[in] BlockAddress  First block to be written
+ *  \param[in] TotalBlocks   Number of blocks to be written
+ *
+ *  \return Mask with the bit of the slot the write is to be charged to, or zero if no live token covers it
+ */
+uint8_t WriteTokens_Check(const uint32_t BlockAddress, const uint16_t TotalBlocks)
+{
+	uint16_t Start   = TCNT1;
+	uint8_t  Matches = WriteTokens_Covering(BlockAddress, TotalBlocks);
+
+	/* Keep only the lowest matching slot */
+	Matches &= -Matches;
+
+	WriteTokens_Checks++;
+	if (!(Matches))
+	  WriteTokens_Rejects++;
+
+	WriteTokens_CheckCycles = (TCNT1 - Start);
+
+	return Matches;
+}
+
+/** Charges a written WRITE (10) to the token picked for it by \ref WriteTokens_Check(). Every slot is updated the same
+ *  way, so the time taken does not depend on which token it was.
+ *
+ *  \param[in] Match        Mask returned by \ref WriteTokens_Check(), zero charges nothing
+ *  \param[in] TotalBlocks  Number of blocks written
+ */
+void WriteTokens_ChargeMatch(const uint8_t Match, const uint16_t TotalBlocks)
+{
+	for (uint8_t i = 0; i < WRITE_TOKEN_SLOTS; i++)
+	{
+		uint32_t Mask = -(uint32_t)((Match >> i) & 0x01);
+
+		Tokens[i].BlocksLeft -= (TotalBlocks & Mask);
+	}
+}
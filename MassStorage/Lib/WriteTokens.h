@@ -0,0 +1,62 @@
+/** \file
+ *
+ *  Header file for WriteTokens.c.
+ */
+
+#ifndef _WRITE_TOKENS_H_
+#define _WRITE_TOKENS_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <util/atomic.h>
+
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Number of write tokens that can be live at once. Every WRITE (10) scans all of them. */
+		#if !defined(WRITE_TOKEN_SLOTS)
+			#define WRITE_TOKEN_SLOTS      4
+		#endif
+
+		#if (WRITE_TOKEN_SLOTS > 8)
+			#error WRITE_TOKEN_SLOTS must be at most 8.
+		#endif
+
+		/** Size of the grant block that requests a write token, see \ref WriteTokens_Grant(). */
+		#define WRITE_TOKEN_GRANT_SIZE     16
+
+		/** Size of the binding that names a live write token, see \ref WriteTokens_GetBinding(). */
+		#define WRITE_TOKEN_BINDING_SIZE   16
+
+	/* Type Defines: */
+		/** Type define for a live write token: permission to write up to BlocksLeft blocks in [FirstBlock, EndBlock)
+		 *  until the millisecond clock reaches Expiry. A token with no blocks left is free.
+		 */
+		typedef struct
+		{
+			uint32_t FirstBlock; /**< First block address the token covers */
+			uint32_t EndBlock; /**< One past the last block address the token covers */
+			uint32_t BlocksLeft; /**< Remaining number of blocks the token allows to be written */
+			uint32_t Expiry; /**< Value of the millisecond clock at which the token lapses */
+			uint32_t BlocksGranted; /**< Number of blocks the grant allowed, for the binding */
+			uint32_t Nonce; /**< Random value given to this grant, so that no two grants have the same binding */
+		} WriteToken_t;
+
+	/* Global Variables: */
+		extern uint32_t WriteTokens_Checks;
+		extern uint32_t WriteTokens_Rejects;
+		extern uint16_t WriteTokens_CheckCycles;
+
+	/* Function Prototypes: */
+		void WriteTokens_Tick(void);
+		uint8_t WriteTokens_Grant(const uint8_t* Grant, const uint32_t Nonce) ATTR_NON_NULL_PTR_ARG(1);
+		void WriteTokens_GetBinding(const uint8_t Slot, uint8_t* Binding) ATTR_NON_NULL_PTR_ARG(2);
+		uint8_t WriteTokens_Covering(const uint32_t BlockAddress, const uint16_t TotalBlocks);
+		void WriteTokens_Charge(const uint8_t Slot, const uint16_t TotalBlocks);
+		uint8_t WriteTokens_Check(const uint32_t BlockAddress, const uint16_t TotalBlocks);
+		void WriteTokens_ChargeMatch(const uint8_t Match, const uint16_t TotalBlocks);
+
+#endif
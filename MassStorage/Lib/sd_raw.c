@@ -146,24 +146,100 @@
 #define SD_RAW_SPEC_2 1
 #define SD_RAW_SPEC_SDHC 2
 
+/* state of each card */
+struct sd_raw_card
+{
 #if !SD_RAW_SAVE_RAM
-/* static data buffer for acceleration */
-static uint8_t raw_block[512];
-/* offset where the data within raw_block lies on the card */
-static offset_t raw_block_address;
+    /* static data buffer for acceleration */
+    uint8_t raw_block[512];
+    /* offset where the data within raw_block lies on the card */
+    offset_t raw_block_address;
 #if SD_RAW_WRITE_BUFFERING
-/* flag to remember if raw_block was written to the card */
-static uint8_t raw_block_written;
+    /* flag to remember if raw_block was written to the card */
+    uint8_t raw_block_written;
 #endif
 #endif
+    /* card type state */
+    uint8_t card_type;
+    /* flag to remember if the card may still be programming the last block written */
+    uint8_t busy;
+};
+
+static struct sd_raw_card sd_raw_cards[SD_RAW_CARDS];
 
-/* card type state */
-static uint8_t sd_raw_card_type;
+/* the card the functions work on */
+#if SD_RAW_CARDS > 1
+static struct sd_raw_card* sd_raw_current = sd_raw_cards;
+#else
+#define sd_raw_current sd_raw_cards
+#endif
+
+#define raw_block (sd_raw_current->raw_block)
+#define raw_block_address (sd_raw_current->raw_block_address)
+#define raw_block_written (sd_raw_current->raw_block_written)
+#define sd_raw_card_type (sd_raw_current->card_type)
 
 /* private helper functions */
 static void sd_raw_send_byte(uint8_t b);
 static uint8_t sd_raw_rec_byte(void);
 static uint8_t sd_raw_send_command(uint8_t command, uint32_t arg);
+static void sd_raw_select(void);
+static void sd_raw_unselect(void);
+
+#if DOXYGEN || SD_RAW_CARDS > 1
+/**
+ * \ingroup sd_raw
+ * Chooses the card the other functions work on.
+ *
+ * Each of the SD_RAW_CARDS cards has its own chip select, type and
+ * cache, and is initialized with sd_raw_init() on its own. A card
+ * left programming a written block goes on with it while another
+ * card is used.
+ *
+ * \param[in] card The index of the card, below SD_RAW_CARDS.
+ */
+void sd_raw_use(uint8_t card)
+{
+    sd_raw_current = &sd_raw_cards[card];
+}
+#endif
+
+/**
+ * \ingroup sd_raw
+ * Addresses the current card, first letting it finish programming
+ * the last block written to it.
+ */
+void sd_raw_select()
+{
+#if SD_RAW_CARDS > 1
+    if(sd_raw_current != sd_raw_cards)
+        select_card_1();
+    else
+#endif
+        select_card();
+
+    if(sd_raw_current->busy)
+    {
+        /* the card holds its output low while busy */
+        while(sd_raw_rec_byte() != 0xff)
+            sd_raw_busy_hook();
+        sd_raw_current->busy = 0;
+    }
+}
+
+/**
+ * \ingroup sd_raw
+ * Deaddresses the current card.
+ */
+void sd_raw_unselect()
+{
+#if SD_RAW_CARDS > 1
+    if(sd_raw_current != sd_raw_cards)
+        unselect_card_1();
+    else
+#endif
+        unselect_card();
+}
 
 /**
  * \ingroup sd_raw
@@ -185,6 +261,10 @@ uint8_t sd_raw_init()
     configure_pin_miso();
 
     unselect_card();
+#if SD_RAW_CARDS > 1
+    configure_pin_ss_1();
+    unselect_card_1();
+#endif
 
     /* initialize SPI with lowest frequency; max. 400kHz during identification mode of card */
     SPCR = (0 << SPIE) | /* SPI Interrupt Enable */
@@ -199,6 +279,7 @@ uint8_t sd_raw_init()
 
     /* initialization procedure */
     sd_raw_card_type = 0;
+    sd_raw_current->busy = 0;
     if(!sd_raw_available())
     {
         return 0;
@@ -212,7 +293,7 @@ uint8_t sd_raw_init()
     }
 
     /* address card */
-    select_card();
+    sd_raw_select();
 
     /* reset card */
     uint8_t response;
@@ -256,7 +337,7 @@ uint8_t sd_raw_init()
 
         if(i == 0x1ff)
         {
-            unselect_card();
+            sd_raw_unselect();
             
             return 0;
         }
@@ -323,7 +404,7 @@ uint8_t sd_raw_init()
 
         if(i == 0x7fff)
         {
-            unselect_card();
+            sd_raw_unselect();
             return 0;
         }
     }
@@ -333,7 +414,7 @@ uint8_t sd_raw_init()
     {
         if(sd_raw_send_command(CMD_READ_OCR, 0))
         {
-            unselect_card();
+            sd_raw_unselect();
             return 0;
         }
 
@@ -349,12 +430,12 @@ uint8_t sd_raw_init()
     /* set block size to 512 bytes */
     if(sd_raw_send_command(CMD_SET_BLOCKLEN, 512))
     {
-        unselect_card();
+        sd_raw_unselect();
         return 0;
     }
 
     /* deaddress card */
-    unselect_card();
+    sd_raw_unselect();
 
     /* switch to highest SPI frequency possible */
     SPCR &= ~((1 << SPR1) | (1 << SPR0)); /* Clock Frequency: f_OSC / 4 */
@@ -507,7 +588,7 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
 #endif
 
             /* address card */
-            select_card();
+            sd_raw_select();
 
             /* send single block request */
 #if SD_RAW_SDHC
@@ -516,7 +597,7 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
             if(sd_raw_send_command(CMD_READ_SINGLE_BLOCK, block_address))
 #endif
             {
-                unselect_card();
+                sd_raw_unselect();
                 return 0;
             }
 
@@ -548,7 +629,7 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
             sd_raw_rec_byte();
             
             /* deaddress card */
-            unselect_card();
+            sd_raw_unselect();
 
             /* let card some time to finish */
             sd_raw_rec_byte();
@@ -615,7 +696,7 @@ uint8_t sd_raw_read_interval(offset_t offset, uint8_t* buffer, uintptr_t interva
     return 1;
 #else
     /* address card */
-    select_card();
+    sd_raw_select();
 
     uint16_t block_offset;
     uint16_t read_length;
@@ -634,7 +715,7 @@ uint8_t sd_raw_read_interval(offset_t offset, uint8_t* buffer, uintptr_t interva
         if(sd_raw_send_command(CMD_READ_SINGLE_BLOCK, offset - block_offset))
 #endif
         {
-            unselect_card();
+            sd_raw_unselect();
             return 0;
         }
 
@@ -682,7 +763,7 @@ uint8_t sd_raw_read_interval(offset_t offset, uint8_t* buffer, uintptr_t interva
     } while(!finished);
     
     /* deaddress card */
-    unselect_card();
+    sd_raw_unselect();
 
     /* let card some time to finish */
     sd_raw_rec_byte();
@@ -754,7 +835,7 @@ uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length)
         }
 
         /* address card */
-        select_card();
+        sd_raw_select();
 
         /* send single block request */
 #if SD_RAW_SDHC
@@ -763,7 +844,7 @@ uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length)
         if(sd_raw_send_command(CMD_WRITE_SINGLE_BLOCK, block_address))
 #endif
         {
-            unselect_card();
+            sd_raw_unselect();
             return 0;
         }
 
@@ -779,12 +860,18 @@ uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length)
         sd_raw_send_byte(0xff);
         sd_raw_send_byte(0xff);
 
-        /* wait while card is busy */
-        while(sd_raw_rec_byte() != 0xff);
-        sd_raw_rec_byte();
+        /* the card answers with a data response, then programs the
+         * block; that is only waited for when the card is addressed
+         * again, so the bus is free for other cards meanwhile */
+        uint8_t response;
+        while((response = sd_raw_rec_byte()) == 0xff);
+        sd_raw_current->busy = 1;
 
         /* deaddress card */
-        unselect_card();
+        sd_raw_unselect();
+
+        if((response & 0x1f) != DR_STATUS_ACCEPTED)
+            return 0;
 
         buffer += write_length;
         offset += write_length;
@@ -866,12 +953,20 @@ uint8_t sd_raw_write_interval(offset_t offset, uint8_t* buffer, uintptr_t length
 uint8_t sd_raw_sync()
 {
 #if SD_RAW_WRITE_BUFFERING
-    if(raw_block_written)
-        return 1;
-    if(!sd_raw_write(raw_block_address, raw_block, sizeof(raw_block)))
-        return 0;
-    raw_block_written = 1;
+    if(!raw_block_written)
+    {
+        if(!sd_raw_write(raw_block_address, raw_block, sizeof(raw_block)))
+            return 0;
+        raw_block_written = 1;
+    }
 #endif
+
+    /* wait for the card to finish programming */
+    if(sd_raw_current->busy)
+    {
+        sd_raw_select();
+        sd_raw_unselect();
+    }
     return 1;
 }
 #endif
@@ -898,12 +993,12 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
 
     memset(info, 0, sizeof(*info));
 
-    select_card();
+    sd_raw_select();
 
     /* read cid register */
     if(sd_raw_send_command(CMD_SEND_CID, 0))
     {
-        unselect_card();
+        sd_raw_unselect();
         return 0;
     }
     while(sd_raw_rec_byte() != 0xfe);
@@ -956,7 +1051,7 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
 #endif
     if(sd_raw_send_command(CMD_SEND_CSD, 0))
     {
-        unselect_card();
+        sd_raw_unselect();
         return 0;
     }
     while(sd_raw_rec_byte() != 0xfe);
@@ -1030,7 +1125,7 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
         }
     }
 
-    unselect_card();
+    sd_raw_unselect();
 
     return 1;
 }
@@ -124,6 +124,9 @@ struct sd_raw_info
 typedef uint8_t (*sd_raw_read_interval_handler_t)(uint8_t* buffer, offset_t offset, void* p);
 typedef uintptr_t (*sd_raw_write_interval_handler_t)(uint8_t* buffer, offset_t offset, void* p);
 
+#if SD_RAW_CARDS > 1
+void sd_raw_use(uint8_t card);
+#endif
 uint8_t sd_raw_init(void);
 uint8_t sd_raw_available(void);
 uint8_t sd_raw_locked(void);
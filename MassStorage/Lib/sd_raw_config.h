@@ -67,6 +67,19 @@ extern "C"
  */
 #define SD_RAW_SDHC 1
 
+/**
+ * \ingroup sd_raw_config
+ * Number of cards sharing the SPI bus, each with its own chip select,
+ * type and cache; see sd_raw_use().
+ *
+ * Set to 2 for the striped storage backend, 1 otherwise.
+ */
+#if defined(WRP_STRIPED_STORAGE)
+#define SD_RAW_CARDS 2
+#else
+#define SD_RAW_CARDS 1
+#endif
+
 /**
  * @}
  */
@@ -111,6 +124,11 @@ extern "C"
 
     #define select_card() PORTB &= ~(1 << PORTB6)
     #define unselect_card() PORTB |= (1 << PORTB6)
+
+    /* second card, with SD_RAW_CARDS 2 */
+    #define configure_pin_ss_1() DDRB |= (1 << DDB7)
+    #define select_card_1() PORTB &= ~(1 << PORTB7)
+    #define unselect_card_1() PORTB |= (1 << PORTB7)
 #elif defined(__AVR_ATmega16U2__)
     #define configure_pin_mosi() DDRB |= (1 << DDB2)
     #define configure_pin_sck() DDRB |= (1 << DDB1)
@@ -135,6 +153,10 @@ extern "C"
 #define get_pin_available() (0) //Emulate that the card is present
 #define get_pin_locked() (1) //Emulate that the card is always unlocked
 
+/* polled while the card is busy programming a written block */
+void SDCardManager_CardBusy(void);
+#define sd_raw_busy_hook() SDCardManager_CardBusy()
+
 #if SD_RAW_SDHC
     typedef uint64_t offset_t;
 #else
@@ -142,6 +164,12 @@ extern "C"
 #endif
 
 /* configuration checks */
+#if SD_RAW_CARDS > 1 && !defined(select_card_1)
+    #error "no sd/mmc pin mapping available for a second card!"
+#elif SD_RAW_CARDS > 2
+    #error "at most two cards are supported!"
+#endif
+
 #if SD_RAW_WRITE_SUPPORT
 #undef SD_RAW_SAVE_RAM
 #define SD_RAW_SAVE_RAM 0
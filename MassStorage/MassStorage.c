@@ -46,6 +46,55 @@ CommandStatusWrapper_t CommandStatus = { .Signature = CSW_SIGNATURE };
 /** Flag to asynchronously abort any in-progress data transfers upon the reception of a mass storage reset command. */
 volatile bool          IsMassStoreReset = false;
 
+/** Device secret used by e(), kept in EEPROM so each device can be given its own key without rebuilding the firmware. */
+static uint8_t         DeviceKey[AES128_BLOCK_SIZE] EEMEM = WRP_DEVICE_KEY;
+
+/** User secret the response to each challenge is derived from. Unlike DeviceKey it is not kept expanded in RAM: it is
+ *  only needed while a challenge is made, which is mostly done while the device is idle.
+ */
+static uint8_t         UserKey[AES128_BLOCK_SIZE] EEMEM = WRP_USER_KEY;
+
+/** Expanded form of DeviceKey, computed once at start-up. */
+static AES128_Context_t DeviceCipher;
+
+/** Message ID of the open write session, which the hash of the written data must match on commit. */
+static uint8_t         WriteSessionID[SHA256_DIGEST_SIZE];
+
+/** Batch ID and message count of the last SCSI_WRP_BATCH_LIST, waiting for the response to its challenge. */
+static uint8_t         PendingBatchID[SHA256_DIGEST_SIZE];
+static uint8_t         PendingBatchCount;
+
+/** Open batch write session: number of messages (zero outside a batch), number committed so far, and the chain of
+ *  the committed message IDs, which must end at the batch ID held in WriteSessionID.
+ */
+static uint8_t         BatchCount;
+static uint8_t         BatchCommitted;
+static uint8_t         BatchChain[SHA256_DIGEST_SIZE];
+
+/** Binding of the last configuration authorization (a response to a challenge with an empty grant), and whether it is
+ *  still unused. Its token opens one configuration command, see receive_authorized_header().
+ */
+static uint8_t         ConfigBinding[WRITE_TOKEN_BINDING_SIZE];
+static bool            ConfigAuthorized;
+
+/** Reply to the last WRP command that has one, held until the host reads it with SCSI_WRP_GET_REPLY. */
+static PendingReply_t  PendingReply;
+
+/** Challenges precomputed while the device is idle, consumed in FIFO order from ChallengePoolHead. */
+static ChallengeEntry_t ChallengePool[CHALLENGE_POOL_SIZE];
+static uint8_t         ChallengePoolHead;
+static uint8_t         ChallengePoolCount;
+
+/** Challenges sent to the host and not yet answered, each accepted in one response only. A set bit of
+ *  IssuedChallengeMask marks a slot in use; IssuedChallengeNext is the slot the next challenge replaces.
+ */
+static uint8_t         IssuedChallenges[ISSUED_CHALLENGE_SLOTS][32];
+static uint8_t         IssuedChallengeMask;
+static uint8_t         IssuedChallengeNext;
+
+/** Counters returned to the host by SCSI_WRP_STATS. */
+WRP_Stats_t            WRPStats = { .ChallengePoolSize = CHALLENGE_POOL_SIZE };
+
 
 /** Main program entry point. This routine configures the hardware required by the application, then
  *  enters a loop to run the application tasks in sequence.
@@ -76,10 +125,29 @@ void SetupHardware(void)
 
 	/* Hardware Initialization */
 	LEDs_Init();
+	#if !defined(WRP_REMOTE_STORAGE)
 	Serial_Init(9600, false);
+	#endif
 	//SPI_Init(SPI_SPEED_FCPU_DIV_2 | SPI_ORDER_MSB_FIRST | SPI_SCK_LEAD_FALLING | SPI_SAMPLE_TRAILING | SPI_MODE_MASTER);
+	#if defined(WRP_COPROCESSOR)
+	Coprocessor_Init();
+	#endif
 	SDCardManager_Init();
 	USB_Init();
+	Random_Init();
+	WritePolicy_Init();
+	#if defined(WRP_FILE_GUARD)
+	FileGuard_Init();
+	#endif
+
+	/* Expand the WRP device key */
+	uint8_t Key[AES128_BLOCK_SIZE];
+	eeprom_read_block(Key, DeviceKey, sizeof(Key));
+	AES128_Init(&DeviceCipher, Key);
+	memset(Key, 0x00, sizeof(Key));
+
+	/* Measure the cipher for SCSI_WRP_STATS; a failed self-test is reported by SEND DIAGNOSTIC */
+	AES128_SelfTest();
 
 	/* Clear Dataflash sector protections, if enabled */
 	//DataflashManager_ResetDataflashProtections();
@@ -125,7 +193,22 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 	                                 ENDPOINT_BANK_SINGLE)))
 	{
 		LEDs_SetAllLEDs(LEDMASK_USB_ERROR);
-	}							   
+	}
+
+	/* Start of frame timing is one of the noise sources for the random generator */
+	USB_Device_EnableSOFEvents();
+}
+
+/** Event handler for the USB_StartOfFrame event. The host's frame timer and the device clock are independent, so the
+ *  low bits of a fast timer sampled at each frame carry some noise, which is fed to the random generator. The frames
+ *  also clock the lifetime of write tokens.
+ */
+void EVENT_USB_Device_StartOfFrame(void)
+{
+	Random_AddSample(TCNT1, RANDOM_SOURCE_SOF);
+
+	/* Frames arrive once per millisecond, which is the clock write tokens lapse by */
+	WriteTokens_Tick();
 }
 
 /** Event handler for the USB_UnhandledControlPacket event. This is used to catch standard and class specific
@@ -204,6 +287,17 @@ void MassStorage_Task(void)
 		/* Indicate ready */
 		LEDs_SetAllLEDs(LEDMASK_USB_READY);
 	}
+	else
+	{
+		/* No command from the host, use the time to collect entropy, top up the challenge pool, write back the
+		 * append pointers of the write policy and bring the file guard's cluster chain cache up to date */
+		Random_Task();
+		refill_challenge_pool();
+		WritePolicy_Task();
+		#if defined(WRP_FILE_GUARD)
+		FileGuard_Task();
+		#endif
+	}
 
 	/* Check if a Mass Storage Reset occurred */
 	if (IsMassStoreReset)
@@ -332,100 +426,962 @@ uint8_t StreamCallback_AbortOnMassStoreReset(void)
  * Encrypt <in> into <out>. Both <in> and <out> are n bytes in length.
  * The user should not be able to replicate this function.
  * All bytes of the output should depend on all bytes of the input.
+ *
+ * This is a keyed PRF rather than a reversible cipher: the AES-CMAC of
+ * <in> under the device key seeds an AES-CTR key stream, which is <out>.
+ * Costs 2 * ceil(n / 16) block encryptions.
  */
 void e(uint8_t* in, uint8_t* out, int n)
 {
-	//TODO: use a real encryption library
-	//currently just using the plaintext
-	memcpy(out, in, n);
+	uint8_t tag[AES128_BLOCK_SIZE];
+
+	AES128_CMAC(&DeviceCipher, in, n, tag);
+	AES128_CTR(&DeviceCipher, tag, out, n);
 }
 
 /*
- * Verify that CommandBlock contains a valid challenge request
+ * Verify that a challenge request (message ID, then grant) asks for a
+ * grant the device can honour: the reserved bytes are zero, the range
+ * lies within the medium and the number of blocks fits in the range. An
+ * empty grant, which authorizes a configuration command rather than
+ * writes, is valid.
  */
-bool verify_challenge_request()
+static bool verify_challenge_request(const uint8_t* request)
 {
-	//TODO: This
-	return true;
+	const uint8_t* grant = request + 32;
+	uint32_t first = ((uint32_t)grant[0] << 24) | ((uint32_t)grant[1] << 16) | ((uint16_t)grant[2] << 8) | grant[3];
+	uint32_t range = ((uint32_t)grant[4] << 24) | ((uint32_t)grant[5] << 16) | ((uint16_t)grant[6] << 8) | grant[7];
+	uint32_t blocks = ((uint32_t)grant[8] << 24) | ((uint32_t)grant[9] << 16) | ((uint16_t)grant[10] << 8) | grant[11];
+
+	if (grant[14] || grant[15] || blocks > range)
+	{
+		return false;
+	}
+	return !range || (first < LUN_MEDIA_BLOCKS && range <= LUN_MEDIA_BLOCKS - first);
 }
 
 /* 
  * Generate a challenge and response
- * Input: 
- * - message_id (32 bytes): can be used as a random seed for the generation
  * Output:
  * - challenge (32 bytes): this wil be sent to the user
  * - response (32 bytes): the user must solve the challenge by re-creating this value
+ * The response is e(challenge) computed under the user key instead of the
+ * device key, which the user computes the same way on the host. Challenges
+ * are made ahead of time, before the message ID they will be used for is
+ * known, so they must not depend on it.
+ */
+void generate_challenge_and_response(uint8_t* challenge, uint8_t* response)
+{
+	AES128_Context_t user_cipher;
+	uint8_t key[AES128_BLOCK_SIZE];
+	uint8_t tag[AES128_BLOCK_SIZE];
+
+	Random_Generate(challenge, 32); //callers check Random_IsSeeded() first
+
+	eeprom_read_block(key, UserKey, sizeof(key));
+	AES128_Init(&user_cipher, key);
+	AES128_CMAC(&user_cipher, challenge, 32, tag);
+	AES128_CTR(&user_cipher, tag, response, 32);
+
+	memset(key, 0, sizeof(key));
+	memset(&user_cipher, 0, sizeof(user_cipher));
+}
+
+/*
+ * The verification code for a (message ID, grant, challenge, response)
+ * tuple is e(challenge || response || message ID || grant), 96 bytes. The
+ * grant is the WRITE_TOKEN_GRANT_SIZE byte block naming the LBA range,
+ * block count and lifetime of the write token the user is asking for.
+ * The message ID and grant go last so that the CMAC over the first 64
+ * bytes can be computed before they are known; <chain> is that partial
+ * CMAC.
  */
-void generate_challenge_and_response(uint8_t* message_id, uint8_t* challenge, uint8_t* response)
+static void start_verification(const uint8_t* challenge_and_response, uint8_t* chain)
 {
-	memset(challenge, 0xab, 32); //this should be a real challenge
-	memset(response, 0xba, 32); //this should be a dynamic correct response
+	memset(chain, 0, AES128_BLOCK_SIZE);
+	AES128_CMAC_Absorb(&DeviceCipher, chain, challenge_and_response, 64 / AES128_BLOCK_SIZE);
 }
 
-/**
- * Generate a challenge and send it back to the driver
- * Input is the last 32 bytes of the SCSICommandData, which must be
- * the message ID (a hash of the bulk data payload the user wants
- * to submit)
- * Output is in the following form:
- * - Message ID (32 bytes)
- * - Challenge (32 bytes)
- * - Verification code (96 bytes)
+/*
+ * Finish a verification code started by start_verification(). Costs the
+ * same 9 block encryptions for every message ID; <chain> is consumed.
+ */
+static void finish_verification(uint8_t* chain, const uint8_t* message_id, const uint8_t* grant,
+                                uint8_t* verification)
+{
+	uint8_t tail[32 + WRITE_TOKEN_GRANT_SIZE];
+
+	memcpy(tail, message_id, 32);
+	memcpy(tail + 32, grant, WRITE_TOKEN_GRANT_SIZE);
+	AES128_CMAC_Final(&DeviceCipher, chain, tail, sizeof(tail));
+	AES128_CTR(&DeviceCipher, chain, verification, 96);
+}
+
+/*
+ * Generate a challenge and do all of its verification work that does not
+ * need the message ID. The response is not kept: it is only needed again
+ * when the user sends it back, and the verification code covers it.
+ */
+static void make_challenge(ChallengeEntry_t* entry)
+{
+	uint8_t material[64];
+
+	generate_challenge_and_response(material, material + 32);
+	memcpy(entry->challenge, material, 32);
+	start_verification(material, entry->chain);
+	memset(material, 0, sizeof(material));
+}
+
+/*
+ * Add one precomputed challenge to the pool if it is not full. Called from
+ * MassStorage_Task whenever there is no command to process; one entry per
+ * call keeps the time away from USB_USBTask short.
+ */
+void refill_challenge_pool()
+{
+	if (ChallengePoolCount == CHALLENGE_POOL_SIZE || !Random_IsSeeded())
+	{
+		return;
+	}
+	make_challenge(&ChallengePool[(ChallengePoolHead + ChallengePoolCount) % CHALLENGE_POOL_SIZE]);
+	ChallengePoolCount++;
+	WRPStats.ChallengePoolRefills++;
+}
+
+/*
+ * Take the oldest challenge from the pool, or make one on the spot if the
+ * pool is empty.
  */
-void send_challenge()
+static void take_challenge(ChallengeEntry_t* entry)
 {
-	//TODO: Real challenge
-	if (!verify_challenge_request()) 
+	if (ChallengePoolCount == 0)
 	{
+		make_challenge(entry);
+		WRPStats.ChallengePoolMisses++;
 		return;
 	}
-	uint8_t plaintext[96];
-	uint8_t ciphertext[96];
+	memcpy(entry, &ChallengePool[ChallengePoolHead], sizeof(*entry));
+	memset(&ChallengePool[ChallengePoolHead], 0, sizeof(*entry));
+	ChallengePoolHead = (ChallengePoolHead + 1) % CHALLENGE_POOL_SIZE;
+	ChallengePoolCount--;
+	WRPStats.ChallengePoolHits++;
+}
+
+/*
+ * Record a challenge as sent to the host, replacing the oldest one still
+ * unanswered if every slot is in use.
+ */
+static void issue_challenge(const uint8_t* challenge)
+{
+	memcpy(IssuedChallenges[IssuedChallengeNext], challenge, 32);
+	IssuedChallengeMask |= (1 << IssuedChallengeNext);
+	IssuedChallengeNext = (IssuedChallengeNext + 1) % ISSUED_CHALLENGE_SLOTS;
+}
+
+/*
+ * Take a challenge back from the issued set. A challenge counts as used by
+ * the first response that names it, right or wrong, so each one allows a
+ * single attempt and a response cannot be replayed.
+ * Returns false if the challenge was not issued or was already used.
+ */
+static bool consume_challenge(const uint8_t* challenge)
+{
+	for (uint8_t i = 0; i < ISSUED_CHALLENGE_SLOTS; i++)
+	{
+		if ((IssuedChallengeMask & (1 << i)) && AES128_Equal(IssuedChallenges[i], challenge, 32))
+		{
+			IssuedChallengeMask &= ~(1 << i);
+			memset(IssuedChallenges[i], 0, 32);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Read exactly <length> bytes from the data-out phase of the current
+ * command. Fails if the command does not carry that much data out, in
+ * which case the data is left for the host to be stalled on.
+ */
+static bool receive_data(uint8_t* buffer, uint16_t length)
+{
+	if ((CommandBlock.Flags & COMMAND_DIRECTION_DATA_IN) || CommandBlock.DataTransferLength != length)
+	{
+		return false;
+	}
+	Endpoint_Read_Stream_LE(buffer, length, StreamCallback_AbortOnMassStoreReset);
+	if (IsMassStoreReset)
+	{
+		return false;
+	}
+	Endpoint_ClearOUT();
+	CommandBlock.DataTransferLength = 0;
+	return true;
+}
+
+/**
+ * Take a challenge for the message ID and grant in the data-out phase
+ * Input is in the following form (48 bytes):
+ * - Message ID (32 bytes): a hash of the bulk data payload the user wants
+ *   to submit
+ * - Grant (16 bytes): the write token being asked for, see WriteTokens_Grant()
+ * The challenge is held as the pending reply, sent by the next
+ * SCSI_WRP_GET_REPLY (see send_reply()). The grant is not echoed back; the
+ * user sends it again with the response.
+ * Returns false if the request is not 48 bytes of data-out or its grant is
+ * not valid (see verify_challenge_request()).
+ */
+bool receive_challenge_request()
+{
+	uint8_t request[32 + WRITE_TOKEN_GRANT_SIZE];
+
+	if (!receive_data(request, sizeof(request)) || !verify_challenge_request(request))
+	{
+		return false;
+	}
+	PendingReply.opcode = SCSI_WRP_REQ_CHALLENGE;
+	memcpy(PendingReply.message_id, request, 32);
+	memcpy(PendingReply.grant, request + 32, WRITE_TOKEN_GRANT_SIZE);
+	take_challenge(&PendingReply.challenge);
+	issue_challenge(PendingReply.challenge.challenge);
+	return true;
+}
+
+/*
+ * Make the token sent for a message ID by a successful challenge response:
+ * e(message ID || binding), where the binding names what the response
+ * authorized (see check_response()). A token is only accepted while what it
+ * names is live, so it cannot be moved to other blocks, and it dies with
+ * its grant.
+ */
+static void response_token(const uint8_t* message_id, const uint8_t* binding, uint8_t* token)
+{
+	uint8_t material[32 + WRITE_TOKEN_BINDING_SIZE];
+
+	memcpy(material, message_id, 32);
+	memcpy(material + 32, binding, WRITE_TOKEN_BINDING_SIZE);
+	e(material, token, 32);
+}
+
+/*
+ * Check response material in the form described for
+ * verify_challenge_response(). If it is valid, grant its write token and
+ * open a write session for its message ID. The challenge must be one this
+ * device issued and no response has named yet; it is used up either way.
+ * Each grant gets a fresh random nonce; <binding> is set to the binding of
+ * its write token (see WriteTokens_GetBinding()) or, for a grant of no
+ * blocks, which authorizes one configuration command instead, to zeros and
+ * the nonce.
+ */
+static bool check_response(const uint8_t* material, uint8_t* binding)
+{
+	uint8_t response[96];
+	uint8_t chain[AES128_BLOCK_SIZE];
+	const uint8_t* grant = material + 192;
+	uint32_t nonce;
 
-	memcpy(plaintext, &CommandBlock.SCSICommandData[CommandBlock.SCSICommandLength - 32], 32);
-	generate_challenge_and_response(plaintext, plaintext + 32, plaintext + 64);
-	e(plaintext, ciphertext, 96);
+	if (!consume_challenge(material + 32))
+	{
+		return false;
+	}
+	start_verification(material + 32, chain);
+	finish_verification(chain, material, grant, response);
+	if (!AES128_Equal(response, material + 96, 96))
+	{
+		return false;
+	}
+	if (!Random_Generate((uint8_t*)&nonce, sizeof(nonce)))
+	{
+		return false;
+	}
 
-	Endpoint_Write_Byte(SCSI_WRP_REQ_CHALLENGE);
-	for (int i = 0; i < 64; i++)
+	if (grant[8] | grant[9] | grant[10] | grant[11])
 	{
-		Endpoint_Write_Byte(plaintext[i]); //needs to be made into a real challenge
+		WriteTokens_GetBinding(WriteTokens_Grant(grant, nonce), binding);
 	}
-	for (int i = 0; i < 96; i++)
+	else
 	{
-		Endpoint_Write_Byte(ciphertext[i]);
+		memset(binding, 0, WRITE_TOKEN_BINDING_SIZE);
+		memcpy(binding + WRITE_TOKEN_BINDING_SIZE - sizeof(nonce), &nonce, sizeof(nonce));
+		memcpy(ConfigBinding, binding, WRITE_TOKEN_BINDING_SIZE);
+		ConfigAuthorized = true;
 	}
+
+	memcpy(WriteSessionID, material, SHA256_DIGEST_SIZE);
+	SDCardManager_BeginWriteHash();
+	return true;
 }
 
 /**
- * Verify a challenge response, and send a token if successful
- * Input is in the following form:
+ * Verify a challenge response from the data-out phase
+ * Input is in the following form (208 bytes):
  * - Message ID (32 bytes)
  * - Challenge (32 bytes)
  * - Response (32 bytes)
  * - Verification code (96 bytes)
- * Sucessful output is in the following form:
+ * - Grant (16 bytes), as sent with the challenge request
+ * A successful response adds the grant to the write token table, so the
+ * WRITE (10) commands of the whole transfer are let through without
+ * another challenge, opens a write session for the message ID, and makes
+ * the token for the message ID the pending reply.
+ * Returns false if the response is not valid.
+ */
+bool verify_challenge_response()
+{
+	uint8_t material[208];
+	uint8_t binding[WRITE_TOKEN_BINDING_SIZE];
+
+	if (!receive_data(material, sizeof(material)) || !check_response(material, binding))
+	{
+		return false;
+	}
+	BatchCount = 0;
+
+	PendingReply.opcode = SCSI_WRP_RESPONSE;
+	memcpy(PendingReply.message_id, material, 32);
+	memcpy(PendingReply.grant, binding, WRITE_TOKEN_BINDING_SIZE);
+	return true;
+}
+
+/*
+ * Extend a batch chain by one message ID:
+ * chain = SHA-256(chain || message ID)
+ */
+static void chain_message_id(uint8_t* chain, const uint8_t* message_id)
+{
+	SHA256_Context_t context;
+
+	SHA256_Init(&context);
+	SHA256_Update(&context, chain, SHA256_DIGEST_SIZE);
+	SHA256_Update(&context, message_id, SHA256_DIGEST_SIZE);
+	SHA256_Final(&context, chain);
+}
+
+/*
+ * Make the token for message <index> of a batch:
+ * e(batch ID || 0 || index), index big-endian 16 bit
+ */
+static void batch_token(const uint8_t* batch_id, uint8_t index, uint8_t* token)
+{
+	uint8_t material[34];
+
+	memcpy(material, batch_id, 32);
+	material[32] = 0;
+	material[33] = index;
+	e(material, token, sizeof(material));
+}
+
+/**
+ * Receive the list of message IDs of a batch from the data-out phase
+ * The list is not kept: only its chain (the batch ID) and length are, to
+ * be matched by the next SCSI_WRP_BATCH_RESPONSE. The user requests the
+ * challenge for the batch with the batch ID as its message ID.
+ * Returns false if the list is empty, too long or not whole message IDs.
+ */
+bool receive_batch_list()
+{
+	uint32_t length = CommandBlock.DataTransferLength;
+	uint8_t message_id[SHA256_DIGEST_SIZE];
+	uint8_t chain[SHA256_DIGEST_SIZE];
+
+	if ((CommandBlock.Flags & COMMAND_DIRECTION_DATA_IN) || length == 0 ||
+	    (length % SHA256_DIGEST_SIZE) || (length / SHA256_DIGEST_SIZE) > BATCH_MAX_MESSAGES)
+	{
+		return false;
+	}
+
+	memset(chain, 0, sizeof(chain));
+	for (uint8_t i = 0; i < (length / SHA256_DIGEST_SIZE); i++)
+	{
+		Endpoint_Read_Stream_LE(message_id, sizeof(message_id), StreamCallback_AbortOnMassStoreReset);
+		if (IsMassStoreReset)
+		{
+			return false;
+		}
+		chain_message_id(chain, message_id);
+	}
+	Endpoint_ClearOUT();
+
+	memcpy(PendingBatchID, chain, sizeof(chain));
+	PendingBatchCount = (length / SHA256_DIGEST_SIZE);
+	return true;
+}
+
+/**
+ * Verify the challenge response for a batch from the data-out phase
+ * Input is the same as for verify_challenge_response(), with the batch ID
+ * of the last SCSI_WRP_BATCH_LIST as the message ID.
+ * A successful response grants a single write token for the whole batch,
+ * opens a batch write session, which takes one commit per message, and
+ * makes the tokens for the messages of the batch the pending reply.
+ * Returns false if the response is not valid or is not for the last batch.
+ */
+bool verify_batch_response()
+{
+	uint8_t material[208];
+	uint8_t binding[WRITE_TOKEN_BINDING_SIZE];
+
+	if (!receive_data(material, sizeof(material)) || !PendingBatchCount ||
+	    memcmp(material, PendingBatchID, SHA256_DIGEST_SIZE) != 0 || !check_response(material, binding))
+	{
+		return false;
+	}
+	BatchCount = PendingBatchCount;
+	BatchCommitted = 0;
+	memset(BatchChain, 0, sizeof(BatchChain));
+	PendingBatchCount = 0;
+
+	PendingReply.opcode = SCSI_WRP_BATCH_RESPONSE;
+	PendingReply.count = BatchCount;
+	memcpy(PendingReply.message_id, material, 32);
+	return true;
+}
+
+/**
+ * Send the reply held for the last SCSI_WRP_REQ_CHALLENGE,
+ * SCSI_WRP_RESPONSE or SCSI_WRP_BATCH_RESPONSE, then drop it
+ * Every reply starts with the opcode of the command it answers and its
+ * message ID (the batch ID, for a batch). The rest is:
+ * - SCSI_WRP_REQ_CHALLENGE: challenge (32 bytes), verification code (96 bytes)
+ * - SCSI_WRP_RESPONSE: token (32 bytes), see response_token()
+ * - SCSI_WRP_BATCH_RESPONSE: number of messages (1 byte), then the token for
+ *   each message (see batch_token()) in list order, 32 bytes each; each
+ *   token is needed to commit its message
+ * Costs of the reply (finishing the verification code, making tokens) are
+ * paid here, while the data goes out a bank at a time.
+ * Returns false if no reply is pending or the data-in phase is too short.
+ */
+bool send_reply()
+{
+	uint8_t output[96];
+	uint16_t length;
+
+	switch (PendingReply.opcode)
+	{
+		case SCSI_WRP_REQ_CHALLENGE:
+			length = 1 + 32 + 32 + 96;
+			break;
+		case SCSI_WRP_RESPONSE:
+			length = 1 + 32 + 32;
+			break;
+		case SCSI_WRP_BATCH_RESPONSE:
+			length = 1 + 32 + 1 + (uint16_t)PendingReply.count * 32;
+			break;
+		default:
+			return false;
+	}
+	if (!(CommandBlock.Flags & COMMAND_DIRECTION_DATA_IN) || CommandBlock.DataTransferLength < length)
+	{
+		return false;
+	}
+
+	Endpoint_Write_Stream_LE(&PendingReply.opcode, 1, StreamCallback_AbortOnMassStoreReset);
+	Endpoint_Write_Stream_LE(PendingReply.message_id, 32, StreamCallback_AbortOnMassStoreReset);
+
+	switch (PendingReply.opcode)
+	{
+		case SCSI_WRP_REQ_CHALLENGE:
+			finish_verification(PendingReply.challenge.chain, PendingReply.message_id, PendingReply.grant, output);
+			Endpoint_Write_Stream_LE(PendingReply.challenge.challenge, 32, StreamCallback_AbortOnMassStoreReset);
+			Endpoint_Write_Stream_LE(output, 96, StreamCallback_AbortOnMassStoreReset);
+			break;
+		case SCSI_WRP_RESPONSE:
+			response_token(PendingReply.message_id, PendingReply.grant, output);
+			Endpoint_Write_Stream_LE(output, 32, StreamCallback_AbortOnMassStoreReset);
+			break;
+		case SCSI_WRP_BATCH_RESPONSE:
+			Endpoint_Write_Stream_LE(&PendingReply.count, 1, StreamCallback_AbortOnMassStoreReset);
+
+			for (uint8_t i = 0; i < PendingReply.count && !IsMassStoreReset; i++)
+			{
+				batch_token(PendingReply.message_id, i, output);
+				Endpoint_Write_Stream_LE(output, 32, StreamCallback_AbortOnMassStoreReset);
+			}
+			break;
+	}
+	memset(&PendingReply, 0, sizeof(PendingReply));
+	memset(output, 0, sizeof(output));
+
+	if (IsMassStoreReset)
+	{
+		return false;
+	}
+	Endpoint_ClearIN();
+
+	CommandBlock.DataTransferLength -= length;
+	return true;
+}
+
+/**
+ * Check the header of an authenticated write, read from the data-out
+ * phase ahead of the <blocks> blocks to be written from <block_address>:
  * - Message ID (32 bytes)
- * - Token (32 bytes)
+ * - Token (32 bytes), as sent for the message ID by a successful
+ *   challenge response
+ * The token must be the one for the message ID and a live write token
+ * that covers the whole write; <slot> is set to that write token, which
+ * the caller charges once the blocks are written, and <message_id> to the
+ * message ID. Nothing is charged or changed here: the caller opens the
+ * write session with open_auth_write() once the write is accepted.
+ * Returns false if the data-out phase is not the header and the blocks, or
+ * the token is not valid.
  */
-void verify_challenge_response()
+bool begin_auth_write(uint32_t block_address, uint16_t blocks, uint8_t* message_id, uint8_t* slot)
 {
-	uint8_t response[96];
+	uint8_t header[64];
 	uint8_t token[32];
-	e(CommandBlock.SCSICommandData, response, 96);
-	if (memcmp(response, CommandBlock.SCSICommandData + 96, 96))
+	uint8_t binding[WRITE_TOKEN_BINDING_SIZE];
+	uint8_t covering;
+	bool found = false;
+
+	if ((CommandBlock.Flags & COMMAND_DIRECTION_DATA_IN) ||
+	    CommandBlock.DataTransferLength != (sizeof(header) + (uint32_t)blocks * VIRTUAL_MEMORY_BLOCK_SIZE))
 	{
-		return;
+		return false;
+	}
+
+	/* The header fills exactly one endpoint bank, so the blocks start on a fresh one */
+	Endpoint_Read_Stream_LE(header, sizeof(header), StreamCallback_AbortOnMassStoreReset);
+	if (IsMassStoreReset)
+	{
+		return false;
+	}
+	Endpoint_ClearOUT();
+	CommandBlock.DataTransferLength -= sizeof(header);
+
+	/* Grants can overlap, so try each one that covers the write */
+	covering = WriteTokens_Covering(block_address, blocks);
+	for (uint8_t i = 0; i < WRITE_TOKEN_SLOTS && !found; i++)
+	{
+		if (covering & (1 << i))
+		{
+			WriteTokens_GetBinding(i, binding);
+			response_token(header, binding, token);
+			found = AES128_Equal(token, header + 32, 32);
+			*slot = i;
+		}
+	}
+	if (!found)
+	{
+		return false;
+	}
+
+	memcpy(message_id, header, SHA256_DIGEST_SIZE);
+	return true;
+}
+
+/**
+ * Open the write session of an authenticated write accepted by
+ * begin_auth_write() and the write protection, in place of any open one
+ * (an open batch is abandoned); commit_write() closes it once the blocks
+ * are written.
+ */
+void open_auth_write(const uint8_t* message_id)
+{
+	memcpy(WriteSessionID, message_id, SHA256_DIGEST_SIZE);
+	BatchCount = 0;
+	SDCardManager_BeginWriteHash();
+}
+
+/**
+ * Close the write session opened by the last successful challenge response.
+ * The data written during the session was hashed as it streamed to the card,
+ * so this only has to finish the hash and compare it with the message ID.
+ * In a batch session, the message ID being committed and its token from the
+ * batch response (32 bytes each) come in the data-out phase; the token must
+ * be the one for the next message of the batch and the message ID must
+ * match the hash. The session stays open for the next message until the
+ * last one, whose commit also checks that the committed message IDs chain
+ * to the batch ID. Any failure closes the batch.
+ * Returns true if they match, false if they differ or no session was open.
+ */
+bool commit_write()
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint8_t commit[SHA256_DIGEST_SIZE + 32];
+	uint8_t token[32];
+	const uint8_t* message_id = commit;
+	bool have_commit = receive_data(commit, sizeof(commit));
+
+	if (!SDCardManager_EndWriteHash(digest))
+	{
+		return false;
 	}
-	e(CommandBlock.SCSICommandData, token, 32);
-	Endpoint_Write_Byte(SCSI_WRP_RESPONSE);
-	for (int i = 0; i < 32; i++)
+	if (!BatchCount)
 	{
-		Endpoint_Write_Byte(CommandBlock.SCSICommandData[i]);
+		return AES128_Equal(digest, WriteSessionID, SHA256_DIGEST_SIZE);
 	}
-	for (int i = 0; i < 32; i++)
+
+	if (have_commit)
+	{
+		batch_token(WriteSessionID, BatchCommitted, token);
+		have_commit = AES128_Equal(token, commit + SHA256_DIGEST_SIZE, 32);
+	}
+	if (!have_commit || !AES128_Equal(digest, message_id, SHA256_DIGEST_SIZE))
+	{
+		BatchCount = 0;
+		return false;
+	}
+	chain_message_id(BatchChain, message_id);
+	if (++BatchCommitted < BatchCount)
+	{
+		SDCardManager_BeginWriteHash();
+		return true;
+	}
+	BatchCount = 0;
+	return AES128_Equal(BatchChain, WriteSessionID, SHA256_DIGEST_SIZE);
+}
+
+/**
+ * Send the WRP tuning counters (a WRP_Stats_t, little-endian) to the driver
+ */
+void send_stats()
+{
+	uint16_t length = (CommandBlock.DataTransferLength < sizeof(WRPStats)) ? CommandBlock.DataTransferLength :
+	                                                                         sizeof(WRPStats);
+
+	WRPStats.ChallengePoolDepth = ChallengePoolCount;
+	WRPStats.EntropyPoolBits = Random_GetPoolBits();
+	WRPStats.RandomReseeds = Random_Reseeds;
+	WRPStats.RandomCycles = Random_GenerateCycles;
+	WRPStats.TokenChecks = WriteTokens_Checks;
+	WRPStats.TokenRejects = WriteTokens_Rejects;
+	WRPStats.TokenCheckCycles = WriteTokens_CheckCycles;
+	WRPStats.PolicyRejects = WritePolicy_Rejects;
+	WRPStats.PolicyCheckCycles = WritePolicy_CheckCycles;
+	#if defined(WRP_FILE_GUARD)
+	WRPStats.FileGuardRejects = FileGuard_Rejects;
+	WRPStats.FileGuardRebuilds = FileGuard_Rebuilds;
+	WRPStats.FileGuardCheckCycles = FileGuard_CheckCycles;
+	#endif
+	WRPStats.AESBlockCycles = AES128_BlockCycles;
+	#if defined(WRP_REMOTE_STORAGE)
+	WRPStats.LinkBlockBytes = RemoteStorage_BlockBytes;
+	WRPStats.LinkFrameBytes = RemoteStorage_FrameBytes;
+	#endif
+
+	Endpoint_Write_Stream_LE(&WRPStats, length, StreamCallback_AbortOnMassStoreReset);
+	Endpoint_ClearIN();
+
+	CommandBlock.DataTransferLength -= length;
+}
+
+/**
+ * Send random bytes to the driver, for statistical testing on the host
+ * Byte 1 of the command selects what is sent: 0 for generator output, or
+ * 1 + a RANDOM_SOURCE_* value for raw samples of that noise source, one
+ * per byte (these are not credited to the entropy pool). Bytes 7-8 are the
+ * allocation length.
+ */
+void send_random()
+{
+	uint8_t source = CommandBlock.SCSICommandData[1];
+	uint16_t length = ((uint16_t)CommandBlock.SCSICommandData[7] << 8) | CommandBlock.SCSICommandData[8];
+	uint16_t sent = 0;
+	uint8_t chunk[64];
+
+	if (length > CommandBlock.DataTransferLength)
+	{
+		length = CommandBlock.DataTransferLength;
+	}
+
+	while (sent < length)
+	{
+		uint8_t n = (length - sent < sizeof(chunk)) ? (length - sent) : sizeof(chunk);
+
+		if (source == 0)
+		{
+			Random_Generate(chunk, n);
+		}
+		else
+		{
+			for (uint8_t i = 0; i < n; i++)
+			{
+				while (!Random_GetRawSample(source - 1, &chunk[i]))
+				{
+					if (IsMassStoreReset)
+					  return;
+				}
+			}
+		}
+
+		for (uint8_t i = 0; i < n; i++)
+		{
+			if (!(Endpoint_IsReadWriteAllowed()))
+			{
+				Endpoint_ClearIN();
+				if (Endpoint_WaitUntilReady())
+				  return;
+			}
+			Endpoint_Write_Byte(chunk[i]);
+		}
+		sent += n;
+	}
+
+	if (Endpoint_BytesInEndpoint())
 	{
-		Endpoint_Write_Byte(token[i]);
+		Endpoint_ClearIN();
 	}
-}
\ No newline at end of file
+
+	CommandBlock.DataTransferLength -= sent;
+}
+
+/*
+ * Read the message ID and token that open the data-out phase of a command
+ * changing the device's configuration, and check the token. Leaves
+ * <length> bytes of data-out to follow; fails if the command carries any
+ * other amount or the token is not the one sent for the message ID by the
+ * last configuration authorization. That authorization is used up by the
+ * first command that tries it.
+ */
+static bool receive_authorized_header(uint8_t* message_id, uint32_t length)
+{
+	uint8_t header[64];
+	uint8_t token[32];
+
+	if ((CommandBlock.Flags & COMMAND_DIRECTION_DATA_IN) ||
+	    CommandBlock.DataTransferLength != (sizeof(header) + length))
+	{
+		return false;
+	}
+
+	/* The header fills exactly one endpoint bank */
+	Endpoint_Read_Stream_LE(header, sizeof(header), StreamCallback_AbortOnMassStoreReset);
+	if (IsMassStoreReset)
+	{
+		return false;
+	}
+	Endpoint_ClearOUT();
+	CommandBlock.DataTransferLength -= sizeof(header);
+
+	if (!ConfigAuthorized)
+	{
+		return false;
+	}
+	ConfigAuthorized = false;
+
+	response_token(header, ConfigBinding, token);
+	memcpy(message_id, header, SHA256_DIGEST_SIZE);
+	return AES128_Equal(token, header + 32, 32);
+}
+
+/*
+ * Read the next <length> bytes of a data-out phase that carries more
+ * after them, and hash them.
+ */
+static bool receive_hashed(uint8_t* buffer, uint8_t length, uint8_t* digest)
+{
+	SHA256_Context_t context;
+
+	Endpoint_Read_Stream_LE(buffer, length, StreamCallback_AbortOnMassStoreReset);
+	if (IsMassStoreReset)
+	{
+		return false;
+	}
+	CommandBlock.DataTransferLength -= length;
+
+	SHA256_Init(&context);
+	SHA256_Update(&context, buffer, length);
+	SHA256_Final(&context, digest);
+	return true;
+}
+
+/**
+ * Replace the LBA write policy table
+ * Data-out is in the following form:
+ * - Message ID (32 bytes): SHA-256 of the head that follows
+ * - Token (32 bytes), as sent for the message ID by a successful
+ *   challenge response
+ * - Head: serial number (4 bytes, big-endian), above the installed
+ *   table's; number of ranges (2 bytes, big-endian); link to the first
+ *   chunk (32 bytes)
+ * - Chunks of WRITE_POLICY_CHUNK_RANGES ranges, the last one shorter if
+ *   need be, each range as first block (4 bytes, big-endian) and policy
+ *   (1 byte), in order. Every chunk but the last ends with the link to the
+ *   next one (32 bytes). A link is the SHA-256 of the chunk it leads to,
+ *   including that chunk's own link.
+ * Each chunk is checked against its link before any of it is written, so
+ * nothing that was not authorized ever reaches the EEPROM, and nothing
+ * changes until the first chunk has been checked. From then on the old
+ * table is gone: if the transfer is cut short or a range turns out
+ * invalid, every write is refused until a good table is set. Each range is
+ * written to EEPROM as it arrives, so this is slow.
+ * Returns true if the new table was installed.
+ */
+bool set_policy()
+{
+	uint8_t message_id[SHA256_DIGEST_SIZE];
+	uint8_t head[4 + 2 + SHA256_DIGEST_SIZE];
+	uint8_t chunk[WRITE_POLICY_CHUNK_RANGES * WRITE_POLICY_RANGE_SIZE + SHA256_DIGEST_SIZE];
+	uint8_t link[SHA256_DIGEST_SIZE];
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint32_t serial;
+	uint16_t count;
+	uint16_t links;
+	bool valid = true;
+
+	if (CommandBlock.DataTransferLength < 64 + sizeof(head) ||
+	    !receive_authorized_header(message_id, CommandBlock.DataTransferLength - 64))
+	{
+		return false;
+	}
+
+	/* The head is checked before anything is changed */
+	if (!receive_hashed(head, sizeof(head), digest) ||
+	    !AES128_Equal(digest, message_id, SHA256_DIGEST_SIZE))
+	{
+		return false;
+	}
+	serial = ((uint32_t)head[0] << 24) | ((uint32_t)head[1] << 16) | ((uint32_t)head[2] << 8) | head[3];
+	count = ((uint16_t)head[4] << 8) | head[5];
+	links = (count + WRITE_POLICY_CHUNK_RANGES - 1) / WRITE_POLICY_CHUNK_RANGES - 1;
+	memcpy(link, head + 6, SHA256_DIGEST_SIZE);
+
+	if (serial <= WritePolicy_GetSerial() || !count || count > WRITE_POLICY_MAX_RANGES ||
+	    CommandBlock.DataTransferLength != (uint32_t)count * WRITE_POLICY_RANGE_SIZE + (uint32_t)links * SHA256_DIGEST_SIZE)
+	{
+		return false;
+	}
+
+	for (uint16_t first = 0; first < count; first += WRITE_POLICY_CHUNK_RANGES)
+	{
+		uint8_t ranges = (count - first < WRITE_POLICY_CHUNK_RANGES) ? (count - first) : WRITE_POLICY_CHUNK_RANGES;
+		uint8_t length = ranges * WRITE_POLICY_RANGE_SIZE;
+		bool last = (first + ranges == count);
+
+		if (!receive_hashed(chunk, last ? length : length + SHA256_DIGEST_SIZE, digest) ||
+		    !AES128_Equal(digest, link, SHA256_DIGEST_SIZE))
+		{
+			return false;
+		}
+
+		if (!first)
+		{
+			WritePolicy_BeginUpdate();
+		}
+		for (uint8_t i = 0; i < ranges; i++)
+		{
+			valid &= WritePolicy_SetRange(first + i, chunk + i * WRITE_POLICY_RANGE_SIZE);
+		}
+		memcpy(link, chunk + length, SHA256_DIGEST_SIZE);
+	}
+	Endpoint_ClearOUT();
+
+	if (!valid)
+	{
+		return false;
+	}
+	WritePolicy_EndUpdate(count, serial);
+	return true;
+}
+
+/**
+ * Send the LBA write policy table to the driver, truncated to the
+ * allocation length: serial number (4 bytes, big-endian), number of ranges
+ * (2 bytes, big-endian), then each range as in set_policy(). A count of
+ * zero means there is no valid table and every write is refused.
+ */
+void send_policy()
+{
+	uint32_t serial = WritePolicy_GetSerial();
+	uint16_t count = WritePolicy_GetRangeCount();
+	uint8_t head[6] = {serial >> 24, serial >> 16, serial >> 8, serial, count >> 8, count};
+	uint8_t range[WRITE_POLICY_RANGE_SIZE];
+	uint32_t length = sizeof(head) + (uint32_t)count * WRITE_POLICY_RANGE_SIZE;
+	uint8_t n;
+
+	if (length > CommandBlock.DataTransferLength)
+	{
+		length = CommandBlock.DataTransferLength;
+	}
+	CommandBlock.DataTransferLength -= length;
+
+	n = (length < sizeof(head)) ? length : sizeof(head);
+	Endpoint_Write_Stream_LE(head, n, StreamCallback_AbortOnMassStoreReset);
+	length -= n;
+
+	for (uint16_t i = 0; length && !IsMassStoreReset; i++)
+	{
+		n = (length < sizeof(range)) ? length : sizeof(range);
+
+		WritePolicy_GetRange(i, range);
+		Endpoint_Write_Stream_LE(range, n, StreamCallback_AbortOnMassStoreReset);
+		length -= n;
+	}
+	Endpoint_ClearIN();
+}
+
+#if defined(WRP_FILE_GUARD)
+/**
+ * Replace the files and directories protected by the file guard
+ * Data-out is in the following form:
+ * - Message ID (32 bytes): SHA-256 of the list that follows
+ * - Token (32 bytes), as sent for the message ID by a successful
+ *   challenge response
+ * - List: number of objects (1 byte), then each object as its first
+ *   cluster and the block holding its directory entry (4 bytes each,
+ *   big-endian); an empty list turns the guard off
+ * Returns true if the list was installed.
+ */
+bool set_file_guard()
+{
+	uint8_t message_id[SHA256_DIGEST_SIZE];
+	uint8_t list[1 + FILE_GUARD_MAX_OBJECTS * FILE_GUARD_OBJECT_SIZE];
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	SHA256_Context_t context;
+	uint8_t length;
+
+	if (CommandBlock.DataTransferLength <= 64 || CommandBlock.DataTransferLength > 64 + sizeof(list))
+	{
+		return false;
+	}
+	length = CommandBlock.DataTransferLength - 64;
+
+	if (!receive_authorized_header(message_id, length) || !receive_data(list, length) ||
+	    length != 1 + list[0] * FILE_GUARD_OBJECT_SIZE)
+	{
+		return false;
+	}
+
+	SHA256_Init(&context);
+	SHA256_Update(&context, list, length);
+	SHA256_Final(&context, digest);
+	if (!AES128_Equal(digest, message_id, SHA256_DIGEST_SIZE))
+	{
+		return false;
+	}
+	return FileGuard_SetObjects(list + 1, list[0]);
+}
+
+/**
+ * Send the file guard's state to the driver, truncated to the allocation
+ * length:
+ * - Number of objects (1 byte)
+ * - Cache state (1 byte), a FILE_GUARD_STATE_* value
+ * - Number of cached runs of blocks (1 byte)
+ * - Each object, as sent to set_file_guard()
+ */
+void send_file_guard()
+{
+	uint8_t reply[3 + FILE_GUARD_MAX_OBJECTS * FILE_GUARD_OBJECT_SIZE];
+	uint8_t count = FileGuard_GetObjectCount();
+	uint8_t length = 3 + count * FILE_GUARD_OBJECT_SIZE;
+
+	reply[0] = count;
+	reply[1] = FileGuard_GetState();
+	reply[2] = FileGuard_GetExtentCount();
+	for (uint8_t i = 0; i < count; i++)
+	{
+		FileGuard_GetObject(i, reply + 3 + i * FILE_GUARD_OBJECT_SIZE);
+	}
+
+	if (length > CommandBlock.DataTransferLength)
+	{
+		length = CommandBlock.DataTransferLength;
+	}
+	Endpoint_Write_Stream_LE(reply, length, StreamCallback_AbortOnMassStoreReset);
+	Endpoint_ClearIN();
+
+	CommandBlock.DataTransferLength -= length;
+}
+#endif
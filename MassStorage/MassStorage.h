@@ -41,11 +41,18 @@
 		#include <avr/wdt.h>
 		#include <avr/power.h>
 		#include <avr/interrupt.h>
+		#include <avr/eeprom.h>
 
 		#include "Descriptors.h"
 
 		#include "Lib/SCSI.h"
 		#include "Lib/SDCardManager.h"
+		#include "Lib/AES128.h"
+		#include "Lib/Random.h"
+		#include "Lib/WriteTokens.h"
+		#include "Lib/WritePolicy.h"
+		#include "Lib/FileGuard.h"
+		#include "Lib/Coprocessor.h"
 
 		#include <LUFA/Version.h>
 		#include <LUFA/Drivers/USB/USB.h>
@@ -60,6 +67,40 @@
 		/** Mass Storage Class specific request to retrieve the total number of Logical Units (drives) in the SCSI device. */
 		#define REQ_GetMaxLUN              0xFE
 
+		/** Initial contents of the WRP device key in the EEPROM image. Override this (or reprogram the EEPROM) per device. */
+		#if !defined(WRP_DEVICE_KEY)
+			#define WRP_DEVICE_KEY         {0x57, 0x52, 0x50, 0x2d, 0x64, 0x65, 0x76, 0x69, \
+			                                0x63, 0x65, 0x2d, 0x6b, 0x65, 0x79, 0x21, 0x00}
+		#endif
+
+		/** Initial contents of the WRP user key in the EEPROM image. The response to each challenge is derived from the
+		 *  challenge under this key, which the device never sends, so only a user who holds it can answer. Override this
+		 *  (or reprogram the EEPROM) per device, and give it to the host tools in WRP_USER_KEY.
+		 */
+		#if !defined(WRP_USER_KEY)
+			#define WRP_USER_KEY           {0x57, 0x52, 0x50, 0x2d, 0x75, 0x73, 0x65, 0x72, \
+			                                0x2d, 0x6b, 0x65, 0x79, 0x2d, 0x30, 0x30, 0x31}
+		#endif
+
+		/** Number of WRP challenges precomputed during idle time, see \ref refill_challenge_pool(). */
+		#if !defined(CHALLENGE_POOL_SIZE)
+			#define CHALLENGE_POOL_SIZE    4
+		#endif
+
+		/** Number of challenges sent to the host that can be awaiting a response at once. */
+		#if !defined(ISSUED_CHALLENGE_SLOTS)
+			#define ISSUED_CHALLENGE_SLOTS 4
+		#endif
+
+		#if (ISSUED_CHALLENGE_SLOTS > 8)
+			#error ISSUED_CHALLENGE_SLOTS must be at most 8.
+		#endif
+
+		/** Largest number of message IDs that one SCSI_WRP_BATCH_LIST command can authorize. */
+		#if !defined(BATCH_MAX_MESSAGES)
+			#define BATCH_MAX_MESSAGES     64
+		#endif
+
 		#define TOTAL_LUNS 				   1
 		#define LUN_MEDIA_BLOCKS           (SDCardManager_GetNbBlocks() / TOTAL_LUNS) 
 
@@ -115,6 +156,53 @@
 			uint8_t  Status; /**< Status code of the issued command - a value from the MassStorage_CommandStatusCodes_t enum */
 		} CommandStatusWrapper_t;
 		
+		/** Type define for a precomputed WRP challenge: the challenge itself and the CMAC chaining value over the
+		 *  challenge and its response, from which the verification code is finished once the message ID is known.
+		 */
+		typedef struct
+		{
+			uint8_t challenge[32]; /**< Challenge sent to the user */
+			uint8_t chain[AES128_BLOCK_SIZE]; /**< Partial CMAC over the challenge and expected response */
+		} ChallengeEntry_t;
+
+		/** Type define for the reply to a WRP command, held until the host reads it with SCSI_WRP_GET_REPLY. The
+		 *  Bulk-Only transport moves data one way per command, so commands that take data in the data-out phase
+		 *  leave their reply here; what the reply needs is kept rather than the reply itself, which is made while
+		 *  it is sent.
+		 */
+		typedef struct
+		{
+			uint8_t opcode; /**< Command the reply is for, zero when no reply is pending */
+			uint8_t count; /**< Number of messages, for a batch response */
+			uint8_t message_id[32]; /**< Message ID, or batch ID */
+			uint8_t grant[WRITE_TOKEN_GRANT_SIZE]; /**< Grant sent with a challenge request, or the binding of the token granted by a response */
+			ChallengeEntry_t challenge; /**< Challenge taken for a challenge request */
+		} PendingReply_t;
+
+		/** Type define for the counters returned by the SCSI_WRP_STATS command, for tuning the WRP implementation. */
+		typedef struct
+		{
+			uint8_t  ChallengePoolSize; /**< Capacity of the challenge pool, CHALLENGE_POOL_SIZE */
+			uint8_t  ChallengePoolDepth; /**< Number of precomputed challenges currently in the pool */
+			uint32_t ChallengePoolRefills; /**< Challenges precomputed during idle time */
+			uint32_t ChallengePoolHits; /**< Challenge requests answered from the pool */
+			uint32_t ChallengePoolMisses; /**< Challenge requests that found the pool empty and were computed on demand */
+			uint16_t EntropyPoolBits; /**< Entropy currently credited to the pool, in bits */
+			uint32_t RandomReseeds; /**< Times the random generator was seeded from the entropy pool */
+			uint16_t RandomCycles; /**< CPU cycles taken to generate the last 32 byte challenge */
+			uint32_t TokenChecks; /**< WRITE (10) commands checked against the write token table */
+			uint32_t TokenRejects; /**< Checked WRITE (10) commands that no live write token covered */
+			uint16_t TokenCheckCycles; /**< CPU cycles taken by the last write token check */
+			uint32_t PolicyRejects; /**< Writes refused by the LBA write policy */
+			uint16_t PolicyCheckCycles; /**< CPU cycles taken by the last write policy check */
+			uint32_t FileGuardRejects; /**< Writes refused by the file guard, zero unless built with WRP_FILE_GUARD */
+			uint32_t FileGuardRebuilds; /**< Times the file guard walked the protected cluster chains again */
+			uint16_t FileGuardCheckCycles; /**< CPU cycles taken by the last file guard check */
+			uint32_t LinkBlockBytes; /**< Block bytes moved over the link to atmega328 nodes, zero without WRP_REMOTE_STORAGE */
+			uint32_t LinkFrameBytes; /**< Payload bytes of the link frames those block bytes took, as compressed */
+			uint16_t AESBlockCycles; /**< CPU cycles taken by one AES-128 block encryption, measured by the self-test */
+		} WRP_Stats_t;
+		
 	/* Enums: */
 		/** Enum for the possible command status wrapper return status codes. */
 		enum MassStorage_CommandStatusCodes_t
@@ -128,6 +216,7 @@
 		extern CommandBlockWrapper_t  CommandBlock;
 		extern CommandStatusWrapper_t CommandStatus;
 		extern volatile bool          IsMassStoreReset;
+		extern WRP_Stats_t            WRPStats;
 		
 	/* Function Prototypes: */
 		void SetupHardware(void);
@@ -137,9 +226,23 @@
 		void EVENT_USB_Device_Disconnect(void);
 		void EVENT_USB_Device_ConfigurationChanged(void);
 		void EVENT_USB_Device_UnhandledControlRequest(void);
-
-		void send_challenge();
-		void verify_challenge_response();
+		void EVENT_USB_Device_StartOfFrame(void);
+
+		bool receive_challenge_request();
+		bool verify_challenge_response();
+		bool commit_write();
+		bool receive_batch_list();
+		bool verify_batch_response();
+		bool send_reply();
+		bool begin_auth_write(uint32_t block_address, uint16_t blocks, uint8_t* message_id, uint8_t* slot);
+		void open_auth_write(const uint8_t* message_id);
+		void refill_challenge_pool();
+		void send_stats();
+		void send_random();
+		bool set_policy();
+		void send_policy();
+		bool set_file_guard();
+		void send_file_guard();
 
 		#if defined(INCLUDE_FROM_MASSSTORAGE_C)
 			static bool ReadInCommandBlock(void);
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wrp_aes.h"
+#include "wrp_sg.h"
+#include "wrp_sha256.h"
+
+/*
+ * Same round trip as libusb_example, but through SG_IO on the disk the
+ * kernel already owns: no kernel driver detach, no re-enumeration.
+ */
+int main (int argc, char **argv)
+{
+	struct wrp_sg_dev dev;
+	uint8_t message_id[WRP_MESSAGE_ID_LEN];
+	uint8_t challenge_reply[WRP_CHALLENGE_REPLY_LEN];
+	uint8_t response_reply[WRP_RESPONSE_REPLY_LEN];
+	uint8_t response[WRP_RESPONSE_LEN];
+	uint8_t grant[WRP_GRANT_LEN];
+	uint8_t user_key[WRP_USER_KEY_LEN];
+	uint8_t block[WRP_BLOCK_SIZE];
+	uint32_t lba = 0;
+
+	if (argc < 2) {
+		printf("usage: sg_example /dev/sdX [lba]\n");
+		return 0;
+	}
+	if (argc > 2)
+		lba = strtoul(argv[2], NULL, 0);
+	if (wrp_user_key(user_key) < 0)
+		return 1;
+
+	if (wrp_sg_open(&dev, argv[1]) < 0)
+		return 1;
+	printf("device opened!\n");
+
+	memset(block, 0, sizeof(block));
+	strcpy((char *)block, "nootwashere");
+
+	//the message ID is the hash of everything written before the commit
+	wrp_sha256(block, sizeof(block), message_id);
+
+	//ask for a token covering just this block, for the next minute
+	wrp_build_grant(grant, lba, 1, 1, 60);
+
+	if (wrp_sg_request_challenge(&dev, message_id, grant, challenge_reply) < 0) {
+		wrp_sg_close(&dev);
+		return 1;
+	}
+	printf("challenge received!\n");
+
+	//only a holder of the user key can answer the challenge
+	wrp_respond(user_key, challenge_reply + 33, response);
+
+	if (wrp_sg_send_response(&dev, challenge_reply + 1, challenge_reply + 33, response,
+		challenge_reply + 65, grant, response_reply) < 0) {
+		wrp_sg_close(&dev);
+		return 1;
+	}
+	printf("token received!\n");
+
+	//write and commit in one command, on the token for this message ID
+	if (wrp_sg_auth_write(&dev, lba, 1, message_id, response_reply + 33, block) < 0) {
+		wrp_sg_close(&dev);
+		return 1;
+	}
+	printf("authenticated write committed!\n");
+
+	memset(block, 0, sizeof(block));
+	if (wrp_sg_read10(&dev, lba, 1, block) < 0) {
+		wrp_sg_close(&dev);
+		return 1;
+	}
+	printf("read command sent successfully! data=%.16s\n", block);
+
+	wrp_sg_close(&dev);
+	return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wrp_aes.h"
+#include "wrp_scsi.h"
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t xtime(uint8_t x)
+{
+	return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+/* Doubles a block in GF(2^128), for the CMAC subkeys */
+static void dbl(const uint8_t *in, uint8_t *out)
+{
+	int i;
+
+	for (i = 0; i < WRP_AES_BLOCK_LEN - 1; i++)
+		out[i] = (uint8_t)((in[i] << 1) | (in[i + 1] >> 7));
+	out[WRP_AES_BLOCK_LEN - 1] = (uint8_t)((in[WRP_AES_BLOCK_LEN - 1] << 1) ^ ((in[0] & 0x80) ? 0x87 : 0));
+}
+
+void wrp_aes_init(struct wrp_aes *ctx, const uint8_t *key)
+{
+	uint8_t *rk = ctx->round_keys;
+	uint8_t rcon = 1, l[WRP_AES_BLOCK_LEN];
+	int i;
+
+	memcpy(rk, key, WRP_AES_BLOCK_LEN);
+	for (i = WRP_AES_BLOCK_LEN; i < (int)sizeof(ctx->round_keys); i += 4) {
+		uint8_t t[4];
+
+		memcpy(t, rk + i - 4, 4);
+		if (i % WRP_AES_BLOCK_LEN == 0) {
+			uint8_t t0 = t[0];
+
+			t[0] = sbox[t[1]] ^ rcon;
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[t0];
+			rcon = xtime(rcon);
+		}
+		rk[i] = rk[i - 16] ^ t[0];
+		rk[i + 1] = rk[i - 15] ^ t[1];
+		rk[i + 2] = rk[i - 14] ^ t[2];
+		rk[i + 3] = rk[i - 13] ^ t[3];
+	}
+
+	memset(l, 0, sizeof(l));
+	wrp_aes_encrypt(ctx, l);
+	dbl(l, ctx->k1);
+	dbl(ctx->k1, ctx->k2);
+}
+
+void wrp_aes_encrypt(const struct wrp_aes *ctx, uint8_t *block)
+{
+	uint8_t t[WRP_AES_BLOCK_LEN];
+	int round, i, c;
+
+	for (i = 0; i < WRP_AES_BLOCK_LEN; i++)
+		block[i] ^= ctx->round_keys[i];
+
+	for (round = 1; round <= 10; round++) {
+		/* SubBytes and ShiftRows: byte r of column c comes from column c + r */
+		for (c = 0; c < 4; c++)
+			for (i = 0; i < 4; i++)
+				t[4 * c + i] = sbox[block[4 * ((c + i) % 4) + i]];
+
+		if (round < 10) {
+			for (c = 0; c < 4; c++) {
+				uint8_t *col = t + 4 * c;
+				uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3], c0 = col[0];
+
+				col[0] ^= all ^ xtime(col[0] ^ col[1]);
+				col[1] ^= all ^ xtime(col[1] ^ col[2]);
+				col[2] ^= all ^ xtime(col[2] ^ col[3]);
+				col[3] ^= all ^ xtime(col[3] ^ c0);
+			}
+		}
+
+		for (i = 0; i < WRP_AES_BLOCK_LEN; i++)
+			block[i] = t[i] ^ ctx->round_keys[16 * round + i];
+	}
+}
+
+void wrp_aes_cmac(const struct wrp_aes *ctx, const void *data, size_t len, uint8_t *mac)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	memset(mac, 0, WRP_AES_BLOCK_LEN);
+	while (len > WRP_AES_BLOCK_LEN) {
+		for (i = 0; i < WRP_AES_BLOCK_LEN; i++)
+			mac[i] ^= p[i];
+		wrp_aes_encrypt(ctx, mac);
+		p += WRP_AES_BLOCK_LEN;
+		len -= WRP_AES_BLOCK_LEN;
+	}
+
+	/* A whole last block takes k1; a short or empty one is padded with 0x80 and zeros and takes k2 */
+	for (i = 0; i < WRP_AES_BLOCK_LEN; i++) {
+		uint8_t b = i < len ? p[i] : (i == len ? 0x80 : 0);
+
+		mac[i] ^= b ^ (len == WRP_AES_BLOCK_LEN ? ctx->k1[i] : ctx->k2[i]);
+	}
+	wrp_aes_encrypt(ctx, mac);
+}
+
+void wrp_aes_ctr(const struct wrp_aes *ctx, const uint8_t *iv, uint8_t *out, size_t len)
+{
+	uint8_t block[WRP_AES_BLOCK_LEN];
+	uint16_t index = (uint16_t)((iv[14] << 8) | iv[15]);
+
+	while (len) {
+		size_t n = len < WRP_AES_BLOCK_LEN ? len : WRP_AES_BLOCK_LEN;
+
+		memcpy(block, iv, 14);
+		block[14] = (uint8_t)(index >> 8);
+		block[15] = (uint8_t)index;
+		wrp_aes_encrypt(ctx, block);
+		memcpy(out, block, n);
+
+		out += n;
+		len -= n;
+		index++;
+	}
+}
+
+void wrp_respond(const uint8_t *user_key, const uint8_t *challenge, uint8_t *response)
+{
+	struct wrp_aes ctx;
+	uint8_t tag[WRP_AES_BLOCK_LEN];
+
+	wrp_aes_init(&ctx, user_key);
+	wrp_aes_cmac(&ctx, challenge, WRP_CHALLENGE_LEN, tag);
+	wrp_aes_ctr(&ctx, tag, response, WRP_RESPONSE_LEN);
+	memset(&ctx, 0, sizeof(ctx));
+}
+
+int wrp_user_key(uint8_t *key)
+{
+	const char *hex = getenv("WRP_USER_KEY");
+	int i;
+
+	if (!hex || strlen(hex) != 2 * WRP_USER_KEY_LEN ||
+		strspn(hex, "0123456789abcdefABCDEF") != 2 * WRP_USER_KEY_LEN) {
+		fprintf(stderr, "set WRP_USER_KEY to the device's user key, %d hex digits\n",
+			2 * WRP_USER_KEY_LEN);
+		return -1;
+	}
+	for (i = 0; i < WRP_USER_KEY_LEN; i++) {
+		unsigned int b;
+
+		sscanf(hex + 2 * i, "%2x", &b);
+		key[i] = (uint8_t)b;
+	}
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef WRP_AES_H
+#define WRP_AES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRP_AES_BLOCK_LEN 16
+#define WRP_USER_KEY_LEN  16
+
+/*
+ * AES-128 with CMAC and the firmware's counter mode (the last two bytes of
+ * the IV count blocks), enough to answer a challenge on the host the same
+ * way the firmware derives its response.
+ */
+struct wrp_aes {
+	uint8_t round_keys[11 * WRP_AES_BLOCK_LEN];
+	uint8_t k1[WRP_AES_BLOCK_LEN];
+	uint8_t k2[WRP_AES_BLOCK_LEN];
+};
+
+void wrp_aes_init(struct wrp_aes *ctx, const uint8_t *key);
+void wrp_aes_encrypt(const struct wrp_aes *ctx, uint8_t *block);
+void wrp_aes_cmac(const struct wrp_aes *ctx, const void *data, size_t len, uint8_t *mac);
+void wrp_aes_ctr(const struct wrp_aes *ctx, const uint8_t *iv, uint8_t *out, size_t len);
+
+/*
+ * The response to a challenge: the CMAC of the challenge under the user
+ * key seeds a counter mode key stream, which is the response.
+ */
+void wrp_respond(const uint8_t *user_key, const uint8_t *challenge, uint8_t *response);
+
+/*
+ * Reads the user key (WRP_USER_KEY in the firmware) from the WRP_USER_KEY
+ * environment variable, 32 hex digits. Prints why and returns -1 if it is
+ * missing or malformed.
+ */
+int wrp_user_key(uint8_t *key);
+
+#endif
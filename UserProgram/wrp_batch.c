@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wrp_aes.h"
+#include "wrp_sg.h"
+#include "wrp_sha256.h"
+
+/*
+ * Writes several files back to back under a single WRP authorization:
+ * one batch list, one challenge and one response, then each file is
+ * written and committed against its own message ID and the token the
+ * response returned for it. Each file is padded
+ * with zeros to whole blocks; its message ID is the SHA-256 of the padded
+ * data, which is what the firmware hashes while it is written.
+ */
+
+struct payload {
+	const char *path;
+	uint8_t *data;
+	uint32_t blocks;
+	uint32_t lba;
+};
+
+static int load(struct payload *p)
+{
+	FILE *f = fopen(p->path, "rb");
+	long size;
+
+	if (!f) {
+		fprintf(stderr, "cannot open %s: %s\n", p->path, strerror(errno));
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+
+	p->blocks = size ? (size + WRP_BLOCK_SIZE - 1) / WRP_BLOCK_SIZE : 1;
+	p->data = calloc(p->blocks, WRP_BLOCK_SIZE);
+	if (!p->data || fread(p->data, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "cannot read %s\n", p->path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int write_payload(struct wrp_sg_dev *dev, const struct payload *p)
+{
+	uint32_t done = 0;
+
+	while (done < p->blocks) {
+		uint16_t n = p->blocks - done < 128 ? p->blocks - done : 128;
+
+		if (wrp_sg_write10(dev, p->lba + done, n, p->data + (size_t)done * WRP_BLOCK_SIZE) < 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct wrp_sg_dev dev;
+	struct payload payloads[WRP_BATCH_MAX];
+	uint8_t message_ids[WRP_BATCH_MAX * WRP_MESSAGE_ID_LEN];
+	uint8_t batch_id[WRP_MESSAGE_ID_LEN];
+	uint8_t grant[WRP_GRANT_LEN];
+	uint8_t challenge_reply[WRP_CHALLENGE_REPLY_LEN];
+	uint8_t response[WRP_RESPONSE_LEN];
+	uint8_t user_key[WRP_USER_KEY_LEN];
+	uint8_t *batch_reply;
+	uint32_t lba, total = 0;
+	int n, i;
+
+	if (argc < 4) {
+		printf("usage: wrp_batch /dev/sdX lba file...\n");
+		return 0;
+	}
+	n = argc - 3;
+	if (n > WRP_BATCH_MAX) {
+		fprintf(stderr, "at most %d files per batch\n", WRP_BATCH_MAX);
+		return 1;
+	}
+	lba = strtoul(argv[2], NULL, 0);
+	if (wrp_user_key(user_key) < 0)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		payloads[i].path = argv[3 + i];
+		if (load(&payloads[i]) < 0)
+			return 1;
+		payloads[i].lba = lba + total;
+		total += payloads[i].blocks;
+		wrp_sha256(payloads[i].data, (size_t)payloads[i].blocks * WRP_BLOCK_SIZE,
+			message_ids + i * WRP_MESSAGE_ID_LEN);
+	}
+
+	batch_reply = malloc(WRP_BATCH_REPLY_LEN(n));
+	if (!batch_reply || wrp_sg_open(&dev, argv[1]) < 0)
+		return 1;
+
+	//one token for the whole run of blocks, for ten minutes
+	wrp_batch_id(message_ids, n, batch_id);
+	wrp_build_grant(grant, lba, total, total, 600);
+
+	if (wrp_sg_send_batch_list(&dev, message_ids, n) < 0 ||
+		wrp_sg_request_challenge(&dev, batch_id, grant, challenge_reply) < 0)
+		goto fail;
+
+	wrp_respond(user_key, challenge_reply + 33, response);
+
+	if (wrp_sg_send_batch_response(&dev, batch_id, challenge_reply + 33, response,
+		challenge_reply + 65, grant, n, batch_reply) < 0)
+		goto fail;
+	printf("batch of %d authorized, %u blocks from lba %u\n", n, total, lba);
+
+	for (i = 0; i < n; i++) {
+		const uint8_t *token = batch_reply + 34 + i * WRP_TOKEN_LEN;
+
+		if (write_payload(&dev, &payloads[i]) < 0 ||
+			wrp_sg_commit_batch(&dev, message_ids + i * WRP_MESSAGE_ID_LEN, token) < 0) {
+			fprintf(stderr, "%s: write or commit failed, batch abandoned\n", payloads[i].path);
+			goto fail;
+		}
+		printf("%s: lba %u, %u blocks\n", payloads[i].path, payloads[i].lba, payloads[i].blocks);
+	}
+
+	wrp_sg_close(&dev);
+	return 0;
+
+fail:
+	wrp_sg_close(&dev);
+	return 1;
+}
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "wrp_bot.h"
+#include "wrp_sg.h"
+
+/*
+ * fio-style load generator for the WRP device. One command is in flight at
+ * a time, which is all Bulk-Only Transport allows, so per-command latency
+ * is exactly what the host observes. Results are printed as JSON.
+ */
+
+/* Latency histogram: 2^HIST_SUB_BITS linear buckets per power of two of nanoseconds */
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    (64 * HIST_SUB)
+
+#define PATTERN_SEQ     0
+#define PATTERN_RAND    1
+
+struct histogram {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	double sum_ns;
+};
+
+struct backend {
+	const char *name;
+	uint64_t blocks;
+	int (*io)(struct backend *b, int write, uint64_t lba, uint32_t blocks, void *buf);
+	void (*close)(struct backend *b);
+	int fd;
+	struct wrp_bot_dev bot;
+	struct wrp_sg_dev sg;
+};
+
+struct bench_opts {
+	const char *transport;
+	const char *path;
+	const char *label;
+	int pattern;
+	uint32_t xfer_blocks;
+	int read_pct;
+	double duration;
+	uint64_t offset;
+	uint64_t span;
+	int allow_write;
+	uint64_t seed;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64*: reproducible offsets for a given seed */
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < HIST_SUB)
+		return (unsigned int)ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		(unsigned int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Upper edge of a bucket, so reported percentiles never understate latency */
+static uint64_t hist_bucket_value(unsigned int bucket)
+{
+	unsigned int group = bucket / HIST_SUB;
+	unsigned int sub = bucket % HIST_SUB;
+
+	if (group == 0)
+		return sub;
+	return ((uint64_t)(HIST_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+static void hist_add(struct histogram *h, uint64_t ns, uint32_t bytes)
+{
+	h->count[hist_bucket(ns)]++;
+	if (h->ops == 0 || ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->ops++;
+	h->bytes += bytes;
+	h->sum_ns += ns;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double pct)
+{
+	uint64_t target = (uint64_t)(h->ops * pct / 100.0 + 0.5);
+	uint64_t seen = 0;
+
+	if (target == 0)
+		target = 1;
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= target)
+			return hist_bucket_value(i) < h->max_ns ? hist_bucket_value(i) : h->max_ns;
+	}
+	return h->max_ns;
+}
+
+static int bot_io(struct backend *b, int write, uint64_t lba, uint32_t blocks, void *buf)
+{
+	int r = write ? wrp_bot_write10(&b->bot, lba, blocks, buf) :
+		wrp_bot_read10(&b->bot, lba, blocks, buf);
+	return r == (int)(blocks * WRP_BLOCK_SIZE) ? 0 : -1;
+}
+
+static void bot_close(struct backend *b)
+{
+	wrp_bot_close(&b->bot);
+}
+
+static int sg_io(struct backend *b, int write, uint64_t lba, uint32_t blocks, void *buf)
+{
+	int r = write ? wrp_sg_write10(&b->sg, lba, blocks, buf) :
+		wrp_sg_read10(&b->sg, lba, blocks, buf);
+	return r == (int)(blocks * WRP_BLOCK_SIZE) ? 0 : -1;
+}
+
+static void sg_close(struct backend *b)
+{
+	wrp_sg_close(&b->sg);
+}
+
+static int dev_io(struct backend *b, int write, uint64_t lba, uint32_t blocks, void *buf)
+{
+	size_t len = (size_t)blocks * WRP_BLOCK_SIZE;
+	ssize_t r = write ? pwrite(b->fd, buf, len, lba * WRP_BLOCK_SIZE) :
+		pread(b->fd, buf, len, lba * WRP_BLOCK_SIZE);
+	return r == (ssize_t)len ? 0 : -1;
+}
+
+static void dev_close(struct backend *b)
+{
+	close(b->fd);
+}
+
+static int backend_open(struct backend *b, const struct bench_opts *opts)
+{
+	memset(b, 0, sizeof(*b));
+	b->name = opts->transport;
+
+	if (!strcmp(opts->transport, "bot")) {
+		uint32_t blocks;
+
+		if (wrp_bot_open(&b->bot, LUFA_VENDOR_ID, LUFA_PRODUCT_ID) < 0)
+			return -1;
+		if (wrp_bot_read_capacity(&b->bot, &blocks) < 0) {
+			wrp_bot_close(&b->bot);
+			return -1;
+		}
+		b->blocks = blocks;
+		b->io = bot_io;
+		b->close = bot_close;
+		return 0;
+	}
+
+	if (!opts->path) {
+		fprintf(stderr, "transport %s needs -d /dev/sdX\n", opts->transport);
+		return -1;
+	}
+
+	if (!strcmp(opts->transport, "sg")) {
+		uint8_t cdb[10] = { SCSI_CMD_READ_CAPACITY_10 };
+		uint8_t cap[8];
+
+		if (wrp_sg_open(&b->sg, opts->path) < 0)
+			return -1;
+		if (wrp_sg_command(&b->sg, cdb, sizeof(cdb), WRP_SG_DIR_IN, cap, sizeof(cap)) != sizeof(cap)) {
+			wrp_sg_close(&b->sg);
+			return -1;
+		}
+		b->blocks = ((uint64_t)cap[0] << 24 | (uint64_t)cap[1] << 16 | cap[2] << 8 | cap[3]) + 1;
+		b->io = sg_io;
+		b->close = sg_close;
+		return 0;
+	}
+
+	if (!strcmp(opts->transport, "dev")) {
+		uint64_t bytes;
+
+		b->fd = open(opts->path, (opts->allow_write ? O_RDWR : O_RDONLY) | O_DIRECT);
+		if (b->fd < 0) {
+			fprintf(stderr, "cannot open %s: %s\n", opts->path, strerror(errno));
+			return -1;
+		}
+		if (ioctl(b->fd, BLKGETSIZE64, &bytes) < 0) {
+			fprintf(stderr, "%s is not a block device\n", opts->path);
+			close(b->fd);
+			return -1;
+		}
+		b->blocks = bytes / WRP_BLOCK_SIZE;
+		b->io = dev_io;
+		b->close = dev_close;
+		return 0;
+	}
+
+	fprintf(stderr, "unknown transport %s (bot, sg or dev)\n", opts->transport);
+	return -1;
+}
+
+/* a string as a JSON string literal */
+static void print_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char ch = *str;
+
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch < 0x20)
+			printf("\\u%04x", ch);
+		else
+			putchar(ch);
+	}
+	putchar('"');
+}
+
+static void print_hist(const char *name, const struct histogram *h, double elapsed, int last)
+{
+	printf("    \"%s\": {\n", name);
+	printf("      \"ops\": %" PRIu64 ",\n", h->ops);
+	printf("      \"errors\": %" PRIu64 ",\n", h->errors);
+	printf("      \"bytes\": %" PRIu64 ",\n", h->bytes);
+	printf("      \"iops\": %.1f,\n", elapsed > 0 ? h->ops / elapsed : 0.0);
+	printf("      \"throughput_bytes_per_sec\": %.1f,\n", elapsed > 0 ? h->bytes / elapsed : 0.0);
+	printf("      \"latency_ns\": {\n");
+	if (h->ops) {
+		printf("        \"min\": %" PRIu64 ",\n", h->min_ns);
+		printf("        \"mean\": %.0f,\n", h->sum_ns / h->ops);
+		printf("        \"p50\": %" PRIu64 ",\n", hist_percentile(h, 50.0));
+		printf("        \"p99\": %" PRIu64 ",\n", hist_percentile(h, 99.0));
+		printf("        \"p99_9\": %" PRIu64 ",\n", hist_percentile(h, 99.9));
+		printf("        \"max\": %" PRIu64 "\n", h->max_ns);
+	}
+	printf("      }\n");
+	printf("    }%s\n", last ? "" : ",");
+}
+
+static void usage(void)
+{
+	printf("usage: wrp_bench [options]\n");
+	printf("  -t bot|sg|dev  transport: libusb Bulk-Only (default), SG_IO, or O_DIRECT block device\n");
+	printf("  -d path        device node for sg and dev transports\n");
+	printf("  -p seq|rand    access pattern (default seq)\n");
+	printf("  -b bytes       transfer size, multiple of 512 (default 4096)\n");
+	printf("  -m percent     reads in the read/write mix (default 100)\n");
+	printf("  -T seconds     run time (default 10)\n");
+	printf("  -o lba         first block of the tested region (default 0)\n");
+	printf("  -s blocks      size of the tested region (default: to end of device)\n");
+	printf("  -S seed        random seed (default 1)\n");
+	printf("  -l label       free-form label copied into the report (firmware, card model)\n");
+	printf("  -W             allow writes; they destroy the contents of the region\n");
+}
+
+int main (int argc, char **argv)
+{
+	struct bench_opts opts = {
+		.transport = "bot",
+		.label = "",
+		.pattern = PATTERN_SEQ,
+		.xfer_blocks = 8,
+		.read_pct = 100,
+		.duration = 10,
+		.seed = 1,
+	};
+	struct histogram *hist;
+	struct backend b;
+	uint64_t rng, cursor, end, slots;
+	uint8_t *buf;
+	double start, elapsed;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:d:p:b:m:T:o:s:S:l:Wh")) != -1) {
+		switch (c) {
+		case 't': opts.transport = optarg; break;
+		case 'd': opts.path = optarg; break;
+		case 'p':
+			if (!strcmp(optarg, "rand")) {
+				opts.pattern = PATTERN_RAND;
+			} else if (!strcmp(optarg, "seq")) {
+				opts.pattern = PATTERN_SEQ;
+			} else {
+				fprintf(stderr, "unknown pattern %s (seq or rand)\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b': opts.xfer_blocks = strtoul(optarg, NULL, 0) / WRP_BLOCK_SIZE; break;
+		case 'm': opts.read_pct = atoi(optarg); break;
+		case 'T': opts.duration = atof(optarg); break;
+		case 'o': opts.offset = strtoull(optarg, NULL, 0); break;
+		case 's': opts.span = strtoull(optarg, NULL, 0); break;
+		case 'S': opts.seed = strtoull(optarg, NULL, 0); break;
+		case 'l': opts.label = optarg; break;
+		case 'W': opts.allow_write = 1; break;
+		default: usage(); return 0;
+		}
+	}
+
+	if (opts.xfer_blocks == 0 || opts.xfer_blocks > 0xFFFF || opts.read_pct < 0 || opts.read_pct > 100) {
+		usage();
+		return 1;
+	}
+	if (opts.read_pct < 100 && !opts.allow_write) {
+		fprintf(stderr, "a write mix destroys data in the region; pass -W to confirm\n");
+		return 1;
+	}
+
+	if (backend_open(&b, &opts) < 0)
+		return 1;
+
+	end = opts.span ? opts.offset + opts.span : b.blocks;
+	if (end > b.blocks || opts.offset + opts.xfer_blocks > end) {
+		fprintf(stderr, "region does not fit in %" PRIu64 " blocks\n", b.blocks);
+		b.close(&b);
+		return 1;
+	}
+	slots = (end - opts.offset) / opts.xfer_blocks;
+
+	hist = calloc(2, sizeof(*hist));
+	if (!hist || posix_memalign((void **)&buf, 4096, (size_t)opts.xfer_blocks * WRP_BLOCK_SIZE)) {
+		b.close(&b);
+		return 1;
+	}
+	memset(buf, 0xA5, (size_t)opts.xfer_blocks * WRP_BLOCK_SIZE);
+
+	rng = opts.seed ? opts.seed : 1;
+	cursor = 0;
+	start = now();
+	do {
+		int write = (int)(next_random(&rng) % 100) >= opts.read_pct;
+		uint64_t slot;
+		uint64_t t0;
+
+		if (opts.pattern == PATTERN_RAND)
+			slot = next_random(&rng) % slots;
+		else
+			slot = cursor++ % slots;
+
+		t0 = now_ns();
+		if (b.io(&b, write, opts.offset + slot * opts.xfer_blocks, opts.xfer_blocks, buf) < 0)
+			hist[write].errors++;
+		else
+			hist_add(&hist[write], now_ns() - t0, opts.xfer_blocks * WRP_BLOCK_SIZE);
+	} while (now() - start < opts.duration);
+	elapsed = now() - start;
+
+	printf("{\n");
+	printf("  \"label\": ");
+	print_string(opts.label);
+	printf(",\n");
+	printf("  \"transport\": \"%s\",\n", b.name);
+	printf("  \"device_blocks\": %" PRIu64 ",\n", b.blocks);
+	printf("  \"pattern\": \"%s\",\n", opts.pattern == PATTERN_RAND ? "rand" : "seq");
+	printf("  \"transfer_bytes\": %u,\n", opts.xfer_blocks * WRP_BLOCK_SIZE);
+	printf("  \"read_percent\": %d,\n", opts.read_pct);
+	printf("  \"region\": { \"offset\": %" PRIu64 ", \"blocks\": %" PRIu64 " },\n",
+		opts.offset, end - opts.offset);
+	printf("  \"elapsed_sec\": %.3f,\n", elapsed);
+	printf("  \"results\": {\n");
+	print_hist("read", &hist[0], elapsed, 0);
+	print_hist("write", &hist[1], elapsed, 1);
+	printf("  }\n");
+	printf("}\n");
+
+	free(buf);
+	free(hist);
+	b.close(&b);
+	return 0;
+}
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "wrp_bot.h"
+
+#define RETRY_MAX        5
+#define CBW_LENGTH       31
+#define CSW_LENGTH       13
+
+#define CBW_SIGNATURE    0x43425355UL
+#define CSW_SIGNATURE    0x53425355UL
+
+/** Mask for a Command Block Wrapper's flags attribute to specify a command with data sent from device-to-host. */
+#define COMMAND_DIRECTION_DATA_IN  (1 << 7)
+
+/* Mass Storage class requests */
+#define REQ_MassStorageReset       0xFF
+
+// Section 5.1: Command Block Wrapper (CBW)
+struct __attribute__((packed)) command_block_wrapper {
+	uint32_t Signature;
+	uint32_t Tag;
+	uint32_t DataTransferLength;
+	uint8_t Flags;
+	uint8_t LUN;
+	uint8_t SCSICommandLength;
+	uint8_t SCSICommandData[16];
+};
+
+// Section 5.2: Command Status Wrapper (CSW)
+struct __attribute__((packed)) command_status_wrapper {
+	uint32_t Signature;
+	uint32_t Tag;
+	uint32_t DataResidue;
+	uint8_t Status;
+};
+
+static int find_bulk_endpoints(struct wrp_bot_dev *dev)
+{
+	struct libusb_config_descriptor *config;
+	int r;
+
+	r = libusb_get_active_config_descriptor(libusb_get_device(dev->dh), &config);
+	if (r < 0)
+		return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for (int i = 0; i < (int)config->bNumInterfaces && r < 0; i++) {
+		const struct libusb_interface_descriptor *id = &config->interface[i].altsetting[0];
+
+		dev->endpoint_in = dev->endpoint_out = 0;
+		for (int k = 0; k < (int)id->bNumEndpoints; k++) {
+			const struct libusb_endpoint_descriptor *ep = &id->endpoint[k];
+
+			if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+				continue;
+			if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+				dev->endpoint_in = ep->bEndpointAddress;
+			else
+				dev->endpoint_out = ep->bEndpointAddress;
+		}
+		if (dev->endpoint_in && dev->endpoint_out) {
+			dev->interface = id->bInterfaceNumber;
+			r = 0;
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+int wrp_bot_open(struct wrp_bot_dev *dev, uint16_t vendor_id, uint16_t product_id)
+{
+	int r;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->tag = 1;
+	dev->timeout_ms = WRP_BOT_DEFAULT_TIMEOUT_MS;
+
+	r = libusb_init(&dev->ctx);
+	if (r < 0) {
+		fprintf(stderr, "cannot init libusb: %s\n", libusb_error_name(r));
+		return -1;
+	}
+
+	dev->dh = libusb_open_device_with_vid_pid(dev->ctx, vendor_id, product_id);
+	if (!dev->dh) {
+		fprintf(stderr, "cannot open device %04x:%04x\n", vendor_id, product_id);
+		libusb_exit(dev->ctx);
+		return -1;
+	}
+
+	r = find_bulk_endpoints(dev);
+	if (r < 0) {
+		fprintf(stderr, "no bulk endpoint pair: %s\n", libusb_error_name(r));
+		wrp_bot_close(dev);
+		return -1;
+	}
+
+	if (libusb_kernel_driver_active(dev->dh, dev->interface) == 1) {
+		if (libusb_detach_kernel_driver(dev->dh, dev->interface) == 0)
+			dev->detached = 1;
+	}
+
+	r = libusb_claim_interface(dev->dh, dev->interface);
+	if (r < 0) {
+		fprintf(stderr, "cannot claim interface: %s\n", libusb_error_name(r));
+		wrp_bot_close(dev);
+		return -1;
+	}
+
+	return 0;
+}
+
+void wrp_bot_close(struct wrp_bot_dev *dev)
+{
+	if (dev->dh) {
+		libusb_release_interface(dev->dh, dev->interface);
+		if (dev->detached)
+			libusb_attach_kernel_driver(dev->dh, dev->interface);
+		libusb_close(dev->dh);
+	}
+	if (dev->ctx)
+		libusb_exit(dev->ctx);
+	dev->dh = NULL;
+	dev->ctx = NULL;
+}
+
+static int bulk(struct wrp_bot_dev *dev, uint8_t endpoint, void *data, int length, int *size)
+{
+	int r, i = 0;
+
+	// The device is allowed to STALL a transfer. If it does, clear the stall and try again.
+	do {
+		r = libusb_bulk_transfer(dev->dh, endpoint, data, length, size, dev->timeout_ms);
+		if (r == LIBUSB_ERROR_PIPE)
+			libusb_clear_halt(dev->dh, endpoint);
+		i++;
+	} while (r == LIBUSB_ERROR_PIPE && *size == 0 && i < RETRY_MAX);
+
+	return r;
+}
+
+/* Bulk-Only Mass Storage Reset followed by clearing both halts (BOT 5.3.4) */
+int wrp_bot_reset(struct wrp_bot_dev *dev)
+{
+	int r = libusb_control_transfer(dev->dh, 0x21, REQ_MassStorageReset, 0, dev->interface,
+		NULL, 0, dev->timeout_ms);
+
+	libusb_clear_halt(dev->dh, dev->endpoint_in);
+	libusb_clear_halt(dev->dh, dev->endpoint_out);
+	return r < 0 ? -1 : 0;
+}
+
+/*
+ * Run one command through CBW, data and CSW stages. Returns the number of
+ * data bytes transferred, -2 if the device reported a failed command (the
+ * host should issue REQUEST SENSE) and -1 on a transport error.
+ */
+int wrp_bot_command(struct wrp_bot_dev *dev, const uint8_t *cdb, uint8_t cdb_len,
+	int direction, void *data, uint32_t data_len)
+{
+	struct command_block_wrapper cbw;
+	struct command_status_wrapper csw;
+	int size = 0;
+	int r;
+
+	if (cdb_len == 0 || cdb_len > sizeof(cbw.SCSICommandData))
+		return -1;
+	if (direction == WRP_BOT_DIR_NONE)
+		data_len = 0;
+
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.Signature = CBW_SIGNATURE;
+	cbw.Tag = dev->tag++;
+	cbw.DataTransferLength = data_len;
+	cbw.Flags = (direction == WRP_BOT_DIR_IN) ? COMMAND_DIRECTION_DATA_IN : 0;
+	cbw.LUN = 0;
+	cbw.SCSICommandLength = cdb_len;
+	memcpy(cbw.SCSICommandData, cdb, cdb_len);
+
+	// The transfer length must always be exactly 31 bytes.
+	r = bulk(dev, dev->endpoint_out, &cbw, CBW_LENGTH, &size);
+	if (r != LIBUSB_SUCCESS || size != CBW_LENGTH) {
+		fprintf(stderr, "CBW opcode %02X: %s\n", cdb[0], libusb_error_name(r));
+		wrp_bot_reset(dev);
+		return -1;
+	}
+
+	size = 0;
+	if (data_len) {
+		uint8_t endpoint = (direction == WRP_BOT_DIR_IN) ? dev->endpoint_in : dev->endpoint_out;
+
+		r = libusb_bulk_transfer(dev->dh, endpoint, data, data_len, &size, dev->timeout_ms);
+		if (r == LIBUSB_ERROR_PIPE) {
+			/* Stalled data stage: the status is still to come */
+			libusb_clear_halt(dev->dh, endpoint);
+		} else if (r != LIBUSB_SUCCESS) {
+			fprintf(stderr, "data opcode %02X: %s\n", cdb[0], libusb_error_name(r));
+			wrp_bot_reset(dev);
+			return -1;
+		}
+	}
+
+	r = bulk(dev, dev->endpoint_in, &csw, CSW_LENGTH, &(int){0});
+	if (r != LIBUSB_SUCCESS || csw.Signature != CSW_SIGNATURE || csw.Tag != cbw.Tag) {
+		fprintf(stderr, "CSW opcode %02X: %s\n", cdb[0], libusb_error_name(r));
+		wrp_bot_reset(dev);
+		return -1;
+	}
+
+	if (csw.Status == 1)
+		return -2;
+	if (csw.Status != 0) {
+		/* Phase error: only a reset recovers */
+		wrp_bot_reset(dev);
+		return -1;
+	}
+
+	return size;
+}
+
+int wrp_bot_read_capacity(struct wrp_bot_dev *dev, uint32_t *blocks)
+{
+	uint8_t cdb[10] = { SCSI_CMD_READ_CAPACITY_10 };
+	uint8_t data[8];
+
+	if (wrp_bot_command(dev, cdb, sizeof(cdb), WRP_BOT_DIR_IN, data, sizeof(data)) != sizeof(data))
+		return -1;
+
+	*blocks = (((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+		((uint32_t)data[2] << 8) | data[3]) + 1;
+	return 0;
+}
+
+int wrp_bot_read10(struct wrp_bot_dev *dev, uint32_t lba, uint16_t blocks, void *data)
+{
+	uint8_t cdb[10];
+
+	wrp_build_rw10(cdb, SCSI_CMD_READ_10, lba, blocks);
+	return wrp_bot_command(dev, cdb, sizeof(cdb), WRP_BOT_DIR_IN, data,
+		(uint32_t)blocks * WRP_BLOCK_SIZE);
+}
+
+int wrp_bot_write10(struct wrp_bot_dev *dev, uint32_t lba, uint16_t blocks, const void *data)
+{
+	uint8_t cdb[10];
+
+	wrp_build_rw10(cdb, SCSI_CMD_WRITE_10, lba, blocks);
+	return wrp_bot_command(dev, cdb, sizeof(cdb), WRP_BOT_DIR_OUT, (void *)data,
+		(uint32_t)blocks * WRP_BLOCK_SIZE);
+}
@@ -0,0 +1,45 @@
+#ifndef WRP_BOT_H
+#define WRP_BOT_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+#include "wrp_scsi.h"
+
+#define LUFA_VENDOR_ID 1003
+#define LUFA_PRODUCT_ID 8261
+
+#define WRP_BOT_DIR_NONE 0
+#define WRP_BOT_DIR_IN   1
+#define WRP_BOT_DIR_OUT  2
+
+#define WRP_BOT_DEFAULT_TIMEOUT_MS 5000
+
+/*
+ * A WRP device driven directly over the USB Mass Storage Bulk-Only
+ * Transport with libusb. Opening it detaches usb-storage from the
+ * interface; wrp_bot_close() gives the interface back to the kernel.
+ */
+struct wrp_bot_dev {
+	libusb_context *ctx;
+	libusb_device_handle *dh;
+	int interface;
+	uint8_t endpoint_in;
+	uint8_t endpoint_out;
+	uint32_t tag;
+	int detached;
+	unsigned int timeout_ms;
+};
+
+int wrp_bot_open(struct wrp_bot_dev *dev, uint16_t vendor_id, uint16_t product_id);
+void wrp_bot_close(struct wrp_bot_dev *dev);
+
+int wrp_bot_command(struct wrp_bot_dev *dev, const uint8_t *cdb, uint8_t cdb_len,
+	int direction, void *data, uint32_t data_len);
+int wrp_bot_reset(struct wrp_bot_dev *dev);
+
+int wrp_bot_read_capacity(struct wrp_bot_dev *dev, uint32_t *blocks);
+int wrp_bot_read10(struct wrp_bot_dev *dev, uint32_t lba, uint16_t blocks, void *data);
+int wrp_bot_write10(struct wrp_bot_dev *dev, uint32_t lba, uint16_t blocks, const void *data);
+
+#endif
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "wrp_fake.h"
+
+/* Defaults: ~1 ms per Bulk-Only round trip, ~1 MB/s of payload */
+#define FAKE_COMMAND_US     1000
+#define FAKE_BYTES_PER_MS   1000
+
+#define SENSE_KEY_ILLEGAL_REQUEST   0x05
+#define SENSE_KEY_MEDIUM_ERROR      0x03
+#define ASENSE_INVALID_COMMAND      0x20
+#define ASENSE_LBA_OUT_OF_RANGE     0x21
+
+int wrp_fake_open(struct wrp_fake_dev *dev, const char *path)
+{
+	struct stat st;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->command_us = FAKE_COMMAND_US;
+	dev->bytes_per_ms = FAKE_BYTES_PER_MS;
+
+	dev->fd = open(path, O_RDWR);
+	if (dev->fd < 0 || fstat(dev->fd, &st) < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	dev->blocks = st.st_size / WRP_BLOCK_SIZE;
+	if (dev->blocks == 0) {
+		fprintf(stderr, "%s is smaller than one block\n", path);
+		close(dev->fd);
+		return -1;
+	}
+	return 0;
+}
+
+void wrp_fake_close(struct wrp_fake_dev *dev)
+{
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
+
+static int fail(struct wrp_fake_dev *dev, uint8_t key, uint8_t asc)
+{
+	dev->sense_key = key;
+	dev->asc = asc;
+	return -2;
+}
+
+int wrp_fake_command(struct wrp_fake_dev *dev, const uint8_t *cdb, uint8_t cdb_len,
+	int direction, void *data, uint32_t data_len)
+{
+	uint32_t lba;
+	uint32_t blocks;
+	uint32_t len;
+	ssize_t r;
+
+	if (cdb_len == 0 || cdb_len > WRP_MAX_CDB_LEN)
+		return -1;
+
+	usleep(dev->command_us + (dev->bytes_per_ms ? data_len * 1000ull / dev->bytes_per_ms : 0));
+
+	switch (cdb[0]) {
+	case SCSI_CMD_TEST_UNIT_READY:
+	case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+		return 0;
+
+	case SCSI_CMD_REQUEST_SENSE:
+		if (direction != WRP_FAKE_DIR_IN || data_len < 14)
+			return -1;
+		memset(data, 0, data_len);
+		((uint8_t *)data)[0] = 0x70;
+		((uint8_t *)data)[2] = dev->sense_key;
+		((uint8_t *)data)[7] = 0x0A;
+		((uint8_t *)data)[12] = dev->asc;
+		dev->sense_key = dev->asc = 0;
+		return data_len < 18 ? data_len : 18;
+
+	case SCSI_CMD_READ_CAPACITY_10:
+		if (direction != WRP_FAKE_DIR_IN || data_len < 8)
+			return -1;
+		((uint8_t *)data)[0] = (dev->blocks - 1) >> 24;
+		((uint8_t *)data)[1] = (dev->blocks - 1) >> 16;
+		((uint8_t *)data)[2] = (dev->blocks - 1) >> 8;
+		((uint8_t *)data)[3] = (dev->blocks - 1);
+		((uint8_t *)data)[4] = 0;
+		((uint8_t *)data)[5] = 0;
+		((uint8_t *)data)[6] = WRP_BLOCK_SIZE >> 8;
+		((uint8_t *)data)[7] = WRP_BLOCK_SIZE & 0xFF;
+		return 8;
+
+	case SCSI_CMD_READ_10:
+	case SCSI_CMD_WRITE_10:
+		lba = ((uint32_t)cdb[2] << 24) | ((uint32_t)cdb[3] << 16) | ((uint32_t)cdb[4] << 8) | cdb[5];
+		blocks = ((uint32_t)cdb[7] << 8) | cdb[8];
+		len = blocks * WRP_BLOCK_SIZE;
+		if (len > data_len)
+			return -1;
+		if (lba >= dev->blocks || blocks > dev->blocks - lba)
+			return fail(dev, SENSE_KEY_ILLEGAL_REQUEST, ASENSE_LBA_OUT_OF_RANGE);
+		if (cdb[0] == SCSI_CMD_READ_10)
+			r = pread(dev->fd, data, len, (off_t)lba * WRP_BLOCK_SIZE);
+		else
+			r = pwrite(dev->fd, data, len, (off_t)lba * WRP_BLOCK_SIZE);
+		if (r != (ssize_t)len)
+			return fail(dev, SENSE_KEY_MEDIUM_ERROR, 0);
+		return len;
+
+	default:
+		return fail(dev, SENSE_KEY_ILLEGAL_REQUEST, ASENSE_INVALID_COMMAND);
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef WRP_FAKE_H
+#define WRP_FAKE_H
+
+#include <stdint.h>
+
+#include "wrp_scsi.h"
+
+#define WRP_FAKE_DIR_NONE 0
+#define WRP_FAKE_DIR_IN   1
+#define WRP_FAKE_DIR_OUT  2
+
+/*
+ * File-backed stand-in for the MassStorage firmware. It answers the SCSI
+ * commands the firmware implements, with the same return convention as
+ * wrp_bot_command(), and sleeps to model the time a real command takes on
+ * a full-speed Bulk-Only link.
+ */
+struct wrp_fake_dev {
+	int fd;
+	uint32_t blocks;
+	unsigned int command_us;
+	unsigned int bytes_per_ms;
+	uint8_t sense_key;
+	uint8_t asc;
+};
+
+int wrp_fake_open(struct wrp_fake_dev *dev, const char *path);
+void wrp_fake_close(struct wrp_fake_dev *dev);
+
+int wrp_fake_command(struct wrp_fake_dev *dev, const uint8_t *cdb, uint8_t cdb_len,
+	int direction, void *data, uint32_t data_len);
+
+#endif
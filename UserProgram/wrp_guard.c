@@ -0,0 +1,287 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "wrp_aes.h"
+#include "wrp_sg.h"
+#include "wrp_sha256.h"
+
+/*
+ * Shows or sets the files and directories the firmware's file guard
+ * (built with WRP_FILE_GUARD) protects. The firmware identifies each one
+ * by its first cluster and the block holding its directory entry, so this
+ * tool resolves paths by reading the FAT32 volume through the device:
+ *
+ *   wrp_guard /dev/sdX                    show the guard's state
+ *   wrp_guard /dev/sdX /boot /keys/a.pem  protect these, replacing the list
+ *   wrp_guard -c /dev/sdX                 protect nothing
+ *
+ * Paths are relative to the volume's root and matched on long names (ASCII
+ * only) or 8.3 names, ignoring case. Resolve them again after moving or
+ * recreating a protected file; the guard follows its clusters, not its name.
+ */
+
+struct volume {
+	struct wrp_sg_dev *dev;
+	uint32_t fat_start;
+	uint32_t data_start;
+	uint32_t root_cluster;
+	uint8_t cluster_blocks;
+};
+
+struct object {
+	uint32_t cluster;
+	uint32_t entry_block;
+};
+
+static const char *states[] = { "ready", "stale, read again before the next write", "too fragmented, data region read-only",
+	"no FAT32 volume, all writes refused" };
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int read_boot_sector(struct volume *vol, uint32_t lba, const uint8_t *b)
+{
+	if (b[11] != 0x00 || b[12] != 0x02 || !b[13] || (b[13] & (b[13] - 1)) ||
+		!b[16] || b[22] || b[23] || !le32(b + 36))
+		return -1;
+
+	vol->cluster_blocks = b[13];
+	vol->fat_start = lba + (b[14] | (b[15] << 8));
+	vol->data_start = vol->fat_start + b[16] * le32(b + 36);
+	vol->root_cluster = le32(b + 44);
+	return 0;
+}
+
+/* Finds the FAT32 volume the same way the firmware does: at block 0 or in the first MBR partition */
+static int open_volume(struct volume *vol)
+{
+	uint8_t block[WRP_BLOCK_SIZE];
+	uint32_t lba;
+
+	if (wrp_sg_read10(vol->dev, 0, 1, block) < 0)
+		return -1;
+	if (read_boot_sector(vol, 0, block) == 0)
+		return 0;
+
+	if (block[450] != 0x0b && block[450] != 0x0c) {
+		fprintf(stderr, "no FAT32 volume found\n");
+		return -1;
+	}
+	lba = le32(block + 454);
+	if (wrp_sg_read10(vol->dev, lba, 1, block) < 0 || read_boot_sector(vol, lba, block) < 0) {
+		fprintf(stderr, "no FAT32 volume found\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int next_cluster(struct volume *vol, uint32_t cluster, uint32_t *next)
+{
+	uint8_t block[WRP_BLOCK_SIZE];
+
+	if (wrp_sg_read10(vol->dev, vol->fat_start + cluster / 128, 1, block) < 0)
+		return -1;
+	*next = le32(block + (cluster % 128) * 4) & 0x0fffffff;
+	return 0;
+}
+
+/* Compares a path component with an 8.3 directory entry name */
+static int short_name_matches(const char *name, size_t len, const uint8_t *entry)
+{
+	char short_name[11];
+	size_t i, j = 0;
+
+	memset(short_name, ' ', sizeof(short_name));
+	for (i = 0; i < len && name[i] != '.'; i++)
+		if (j < 8)
+			short_name[j++] = toupper((unsigned char)name[i]);
+	if (i < len)
+		for (i++, j = 8; i < len && j < 11; i++)
+			short_name[j++] = toupper((unsigned char)name[i]);
+	return !memcmp(short_name, entry, sizeof(short_name));
+}
+
+/* Looks one path component up in a directory, following its cluster chain */
+static int find_entry(struct volume *vol, uint32_t dir_cluster, const char *name, size_t len,
+	struct object *obj)
+{
+	uint8_t block[WRP_BLOCK_SIZE];
+	char long_name[256];
+	uint32_t cluster = dir_cluster;
+	int have_long_name = 0;
+
+	while (cluster >= 2 && cluster < 0x0ffffff8) {
+		uint32_t first = vol->data_start + (cluster - 2) * vol->cluster_blocks;
+		unsigned int b, e;
+
+		for (b = 0; b < vol->cluster_blocks; b++) {
+			if (wrp_sg_read10(vol->dev, first + b, 1, block) < 0)
+				return -1;
+
+			for (e = 0; e < WRP_BLOCK_SIZE; e += 32) {
+				const uint8_t *d = block + e;
+
+				if (d[0] == 0x00)
+					return 1;
+				if (d[0] == 0xe5) {
+					have_long_name = 0;
+					continue;
+				}
+				if (d[11] == 0x0f) {
+					/* long name part: 13 UCS-2 characters, kept if ASCII */
+					static const uint8_t offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+					unsigned int seq = (d[0] & 0x1f) - 1, k;
+
+					if (d[0] & 0x40)
+						memset(long_name, 0, sizeof(long_name));
+					for (k = 0; k < 13 && seq * 13 + k < sizeof(long_name) - 1; k++) {
+						uint16_t ch = d[offsets[k]] | (d[offsets[k] + 1] << 8);
+
+						long_name[seq * 13 + k] = ch == 0xffff ? 0 : ch > 0x7f ? '?' : ch;
+					}
+					have_long_name = 1;
+					continue;
+				}
+				if (!(d[11] & 0x08) &&
+					((have_long_name && strlen(long_name) == len && !strncasecmp(long_name, name, len)) ||
+					short_name_matches(name, len, d))) {
+					obj->cluster = (d[20] | (d[21] << 8)) << 16 | d[26] | (d[27] << 8);
+					obj->entry_block = first + b;
+					return 0;
+				}
+				have_long_name = 0;
+			}
+		}
+		if (next_cluster(vol, cluster, &cluster) < 0)
+			return -1;
+	}
+	return 1;
+}
+
+static int resolve(struct volume *vol, const char *path, struct object *obj)
+{
+	const char *p = path;
+
+	obj->cluster = vol->root_cluster;
+	obj->entry_block = 0;
+
+	while (*p) {
+		size_t len;
+		int r;
+
+		while (*p == '/')
+			p++;
+		len = strcspn(p, "/");
+		if (!len)
+			break;
+		r = find_entry(vol, obj->cluster, p, len, obj);
+		if (r < 0)
+			return -1;
+		if (r > 0 || obj->cluster < 2) {
+			fprintf(stderr, "%s: not found, or empty\n", path);
+			return -1;
+		}
+		p += len;
+	}
+	return 0;
+}
+
+static int show(struct wrp_sg_dev *dev)
+{
+	uint8_t reply[WRP_GUARD_REPLY_LEN(WRP_GUARD_MAX_OBJECTS)];
+	int len = wrp_sg_get_file_guard(dev, reply, sizeof(reply));
+	unsigned int i;
+
+	if (len < 3)
+		return -1;
+	printf("%u protected, cache %s, %u runs of blocks\n", reply[0],
+		reply[1] < sizeof(states) / sizeof(states[0]) ? states[reply[1]] : "unknown", reply[2]);
+	for (i = 0; i < reply[0] && WRP_GUARD_REPLY_LEN(i + 1) <= (unsigned int)len; i++) {
+		const uint8_t *o = reply + WRP_GUARD_REPLY_LEN(i);
+
+		printf("  cluster %u, entry in block %u\n", be32(o), be32(o + 4));
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct wrp_sg_dev dev;
+	struct volume vol;
+	uint8_t list[WRP_GUARD_LEN(WRP_GUARD_MAX_OBJECTS)];
+	uint8_t message_id[WRP_MESSAGE_ID_LEN];
+	uint8_t token[WRP_TOKEN_LEN];
+	uint8_t user_key[WRP_USER_KEY_LEN];
+	int clear = 0, n, i, c;
+
+	while ((c = getopt(argc, argv, "ch")) != -1) {
+		switch (c) {
+		case 'c': clear = 1; break;
+		default:
+			printf("usage: wrp_guard [-c] /dev/sdX [path...]\n");
+			return 0;
+		}
+	}
+	if (optind >= argc) {
+		printf("usage: wrp_guard [-c] /dev/sdX [path...]\n");
+		return 1;
+	}
+	n = argc - optind - 1;
+	if (n > WRP_GUARD_MAX_OBJECTS) {
+		fprintf(stderr, "at most %d files and directories\n", WRP_GUARD_MAX_OBJECTS);
+		return 1;
+	}
+	if (wrp_sg_open(&dev, argv[optind]) < 0)
+		return 1;
+
+	if (n || clear) {
+		vol.dev = &dev;
+		if (n && open_volume(&vol) < 0)
+			goto fail;
+
+		list[0] = n;
+		for (i = 0; i < n; i++) {
+			struct object obj;
+			uint8_t *o = list + WRP_GUARD_LEN(i);
+
+			if (resolve(&vol, argv[optind + 1 + i], &obj) < 0)
+				goto fail;
+			o[0] = obj.cluster >> 24;
+			o[1] = obj.cluster >> 16;
+			o[2] = obj.cluster >> 8;
+			o[3] = obj.cluster;
+			o[4] = obj.entry_block >> 24;
+			o[5] = obj.entry_block >> 16;
+			o[6] = obj.entry_block >> 8;
+			o[7] = obj.entry_block;
+		}
+
+		wrp_sha256(list, WRP_GUARD_LEN(n), message_id);
+		if (wrp_user_key(user_key) < 0 ||
+			wrp_sg_authorize(&dev, user_key, message_id, token) < 0 ||
+			wrp_sg_set_file_guard(&dev, message_id, token, list, WRP_GUARD_LEN(n)) < 0) {
+			fprintf(stderr, "file guard list refused\n");
+			goto fail;
+		}
+	}
+
+	if (show(&dev) < 0)
+		goto fail;
+	wrp_sg_close(&dev);
+	return 0;
+
+fail:
+	wrp_sg_close(&dev);
+	return 1;
+}
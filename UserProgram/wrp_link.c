@@ -0,0 +1,952 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+
+#include "wrp_link.h"
+
+static int start_session(struct wrp_link_dev *dev);
+
+/* struct sd_raw_info as the node sends it: packed, little-endian, 64-bit capacity */
+#define INFO_LEN 29
+/* the node's link_stats: four little-endian 32-bit counters */
+#define STATS_LEN 16
+
+static speed_t baud_constant(unsigned int baud)
+{
+	switch (baud) {
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 500000: return B500000;
+	case 921600: return B921600;
+	case 1000000: return B1000000;
+	case 2000000: return B2000000;
+	default: return 0;
+	}
+}
+
+int wrp_link_open(struct wrp_link_dev *dev, const char *path, unsigned int baud)
+{
+	struct termios tio;
+	struct serial_struct serial;
+	speed_t speed = baud_constant(baud);
+
+	memset(dev, 0, sizeof(*dev));
+	dev->timeout_ms = WRP_LINK_DEFAULT_TIMEOUT_MS;
+
+	if (!speed) {
+		fprintf(stderr, "unsupported baud rate %u\n", baud);
+		return -1;
+	}
+
+	dev->fd = open(path, O_RDWR | O_NOCTTY);
+	if (dev->fd < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (tcgetattr(dev->fd, &tio) < 0) {
+		fprintf(stderr, "%s is not a serial port\n", path);
+		goto fail;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CRTSCTS | CSTOPB);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	if (tcsetattr(dev->fd, TCSANOW, &tio) < 0) {
+		fprintf(stderr, "cannot configure %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	/*
+	 * A USB serial adapter otherwise holds back what it received for its
+	 * latency timer, 16 ms on FTDI parts, which stalls every request
+	 * turnaround; ports that have no such setting, such as ttyACM, ignore it
+	 */
+	if (ioctl(dev->fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(dev->fd, TIOCSSERIAL, &serial);
+	}
+	tcflush(dev->fd, TCIOFLUSH);
+	if (start_session(dev) < 0) {
+		fprintf(stderr, "no node answers on %s\n", path);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	close(dev->fd);
+	dev->fd = -1;
+	return -1;
+}
+
+void wrp_link_close(struct wrp_link_dev *dev)
+{
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
+
+static int send_all(struct wrp_link_dev *dev, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len) {
+		ssize_t n = write(dev->fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, "link write: %s\n", strerror(errno));
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* CRC-16 of the frames, as avr-libc's _crc_ccitt_update from 0xffff */
+static uint16_t crc_ccitt(const uint8_t *data, size_t len)
+{
+	uint16_t crc = 0xffff;
+
+	while (len--) {
+		uint8_t b = *data++ ^ (uint8_t)crc;
+
+		b ^= b << 4;
+		crc = (((uint16_t)b << 8) | (crc >> 8)) ^ (uint8_t)(b >> 4) ^ ((uint16_t)b << 3);
+	}
+	return crc;
+}
+
+/*
+ * COBS-encodes a payload of at most WRP_LINK_DATA_LENGTH bytes and its CRC
+ * into out, with room for WRP_LINK_FRAME_MAX, and returns the length of
+ * the frame with its delimiter.
+ */
+size_t wrp_link_encode(const uint8_t *payload, size_t len, uint8_t *out)
+{
+	uint8_t raw[WRP_LINK_DATA_LENGTH + 2];
+	uint16_t crc = crc_ccitt(payload, len);
+	size_t code = 0, n = 1, i;
+
+	memcpy(raw, payload, len);
+	raw[len++] = crc;
+	raw[len++] = crc >> 8;
+
+	/* each run of non-zero bytes goes out behind its length + 1, in place of the zero ending it */
+	for (i = 0; i < len; i++) {
+		if (raw[i]) {
+			out[n++] = raw[i];
+		} else {
+			out[code] = n - code;
+			code = n++;
+		}
+	}
+	out[code] = n - code;
+	out[n++] = 0;
+	return n;
+}
+
+static int send_frame(struct wrp_link_dev *dev, const uint8_t *payload, size_t len)
+{
+	uint8_t out[WRP_LINK_FRAME_MAX];
+
+	return send_all(dev, out, wrp_link_encode(payload, len, out));
+}
+
+/*
+ * Decodes the next frame into dev->frame and returns the length of its
+ * payload, WRP_LINK_DAMAGED for a frame failing its CRC, WRP_LINK_QUIET if
+ * nothing arrives for timeout_ms or WRP_LINK_FAILED if the port fails.
+ */
+int wrp_link_receive(struct wrp_link_dev *dev, int timeout_ms)
+{
+	for (;;) {
+		uint8_t c;
+
+		if (dev->rx_pos == dev->rx_len) {
+			struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+			ssize_t n;
+			int r = poll(&pfd, 1, timeout_ms);
+
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r == 0)
+				return WRP_LINK_QUIET;
+			n = r < 0 ? -1 : read(dev->fd, dev->rx, sizeof(dev->rx));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				fprintf(stderr, "link read: %s\n", n < 0 ? strerror(errno) : "end of file");
+				return WRP_LINK_FAILED;
+			}
+			dev->rx_len = n;
+			dev->rx_pos = 0;
+		}
+		c = dev->rx[dev->rx_pos++];
+
+		if (!c) {
+			size_t len = dev->frame_len;
+			int bad = dev->overrun || dev->code_left, started = dev->code != 0;
+
+			dev->frame_len = 0;
+			dev->code = dev->code_left = 0;
+			dev->overrun = 0;
+			if (!started)
+				continue;
+			if (bad || len < 3 || crc_ccitt(dev->frame, len - 2) !=
+			    (dev->frame[len - 2] | (dev->frame[len - 1] << 8))) {
+				dev->crc_errors++;
+				return WRP_LINK_DAMAGED;
+			}
+			return len - 2;
+		}
+
+		if (dev->code_left) {
+			dev->code_left--;
+		} else {
+			/* a code byte: the run before it ended with a zero unless it was the first or a full one */
+			int zero = dev->code && dev->code != 0xff;
+
+			dev->code = c;
+			dev->code_left = c - 1;
+			if (!zero)
+				continue;
+			c = 0;
+		}
+		if (dev->frame_len < sizeof(dev->frame))
+			dev->frame[dev->frame_len++] = c;
+		else
+			dev->overrun = 1;
+	}
+}
+
+/*
+ * Run-length codes a chunk for a PACKED frame into runs, as the node's
+ * link_pack does. Returns the coded length, or 0 if that would hardly be
+ * shorter than the chunk.
+ */
+size_t wrp_link_pack(const uint8_t *data, uint8_t *runs)
+{
+	size_t len = 0, literal = 0, i = 0;
+	int in_literal = 0;
+
+	while (i < WRP_LINK_CHUNK) {
+		size_t run = 1;
+
+		if (len >= WRP_LINK_CHUNK - 2)
+			return 0;
+		while (i + run < WRP_LINK_CHUNK && data[i + run] == data[i])
+			run++;
+		if (run >= WRP_LINK_RUN_MIN) {
+			runs[len++] = WRP_LINK_RUN + run - WRP_LINK_RUN_MIN;
+			runs[len++] = data[i];
+			in_literal = 0;
+			i += run;
+		} else {
+			if (!in_literal) {
+				literal = len;
+				runs[len++] = 0xff;	/* the first byte counts it up to 0 */
+				in_literal = 1;
+			}
+			runs[literal]++;
+			runs[len++] = data[i++];
+		}
+	}
+	return len;
+}
+
+/* decodes the runs of a PACKED frame into a chunk; -1 if they do not make up exactly one */
+int wrp_link_unpack(const uint8_t *runs, size_t len, uint8_t *data)
+{
+	size_t filled = 0, i = 0;
+
+	while (i < len) {
+		size_t n = runs[i++];
+
+		if (n >= WRP_LINK_RUN) {
+			n = n - WRP_LINK_RUN + WRP_LINK_RUN_MIN;
+			if (i == len || filled + n > WRP_LINK_CHUNK)
+				return -1;
+			memset(data + filled, runs[i++], n);
+		} else {
+			n++;
+			if (i + n > len || filled + n > WRP_LINK_CHUNK)
+				return -1;
+			memcpy(data + filled, runs + i, n);
+			i += n;
+		}
+		filled += n;
+	}
+	return filled == WRP_LINK_CHUNK ? 0 : -1;
+}
+
+/* the byte every byte of a block is, or -1 if they differ */
+static int block_fill(const uint8_t *block)
+{
+	size_t i;
+
+	for (i = 1; i < WRP_LINK_BLOCK_SIZE; i++) {
+		if (block[i] != block[0])
+			return -1;
+	}
+	return block[0];
+}
+
+static uint8_t next_tag(struct wrp_link_dev *dev)
+{
+	/* 0 is what the node starts with */
+	if (!++dev->tag)
+		dev->tag = 1;
+	return dev->tag;
+}
+
+static int send_command(struct wrp_link_dev *dev, uint8_t op, uint8_t tag, uint32_t lba, uint16_t blocks)
+{
+	uint8_t frame[8] = { op, tag, lba, lba >> 8, lba >> 16, lba >> 24, blocks, blocks >> 8 };
+
+	return send_frame(dev, frame, sizeof(frame));
+}
+
+static int send_chunk_id(struct wrp_link_dev *dev, uint8_t op, uint8_t tag, uint32_t position)
+{
+	uint16_t block = position / WRP_LINK_CHUNKS;
+	uint8_t frame[5] = { op, tag, block, block >> 8, position % WRP_LINK_CHUNKS };
+
+	return send_frame(dev, frame, sizeof(frame));
+}
+
+/*
+ * Position of the chunk named by a DATA, PACKED or NAK frame, or -1 if it is
+ * outside the request; a FILL frame names the last chunk of its block.
+ */
+static long chunk_position(const struct wrp_link_dev *dev, uint16_t blocks)
+{
+	uint16_t block = dev->frame[2] | (dev->frame[3] << 8);
+	uint8_t chunk = dev->frame[0] == WRP_LINK_FILL ? WRP_LINK_CHUNKS - 1 : dev->frame[4];
+
+	if (block >= blocks || chunk >= WRP_LINK_CHUNKS)
+		return -1;
+	return (long)block * WRP_LINK_CHUNKS + chunk;
+}
+
+static int timed_out(struct wrp_link_dev *dev, long long progress)
+{
+	if (now_ms() - progress < dev->timeout_ms)
+		return 0;
+	fprintf(stderr, "link timeout\n");
+	return 1;
+}
+
+/*
+ * Sends a request frame without blocks until the node answers it. Returns
+ * 1 with its len bytes of reply after the tag in dev->frame, 0 if the node
+ * answers with an error or -1 if it does not answer.
+ */
+static int exchange(struct wrp_link_dev *dev, const uint8_t *frame, size_t frame_len, int len)
+{
+	long long progress = now_ms();
+	int n;
+
+	if (send_frame(dev, frame, frame_len) < 0)
+		return -1;
+
+	for (;;) {
+		n = wrp_link_receive(dev, WRP_LINK_QUIET_MS);
+		if (n == WRP_LINK_FAILED)
+			return -1;
+		if (n == WRP_LINK_QUIET) {
+			if (timed_out(dev, progress) || send_frame(dev, frame, frame_len) < 0)
+				return -1;
+			continue;
+		}
+		if (n < 2 || dev->frame[1] != frame[1])
+			continue;
+		if (dev->frame[0] == WRP_LINK_SUCCESS && n == 2 + len)
+			return 1;
+		if (dev->frame[0] == WRP_LINK_ERROR)
+			return 0;
+	}
+}
+
+static int query(struct wrp_link_dev *dev, uint8_t op, int len)
+{
+	uint8_t frame[2] = { op, next_tag(dev) };
+
+	return exchange(dev, frame, sizeof(frame), len);
+}
+
+/*
+ * Tags start over with every wrp_link_open, so the node is told to forget
+ * the requests and SD_QUEUE of the last session first: otherwise it would
+ * take a new SD_QUEUE for the last one sent again, or answer a NAK from an
+ * old read with the same tag. Tag 0 is never a request's. The session
+ * number tells the reset sent again on a quiet link, which the node only
+ * answers, from the next session's.
+ */
+static int start_session(struct wrp_link_dev *dev)
+{
+	struct timespec ts;
+	uint32_t session;
+	uint8_t frame[6] = { WRP_LINK_RESET, 0 };
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	session = (uint32_t)ts.tv_nsec ^ ((uint32_t)ts.tv_sec << 12) ^ ((uint32_t)getpid() << 20);
+	if (!session)
+		session = 1;
+	frame[2] = session;
+	frame[3] = session >> 8;
+	frame[4] = session >> 16;
+	frame[5] = session >> 24;
+
+	return exchange(dev, frame, sizeof(frame), 0) > 0 ? 0 : -1;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int wrp_link_get_info(struct wrp_link_dev *dev, struct wrp_link_info *info)
+{
+	const uint8_t *b = dev->frame + 2;
+	int i, r = query(dev, WRP_LINK_GET_INFO, INFO_LEN);
+
+	if (r < 0)
+		return -1;
+	if (!r) {
+		fprintf(stderr, "node cannot read its card info\n");
+		return -1;
+	}
+
+	info->manufacturer = b[0];
+	memcpy(info->oem, b + 1, 3);
+	memcpy(info->product, b + 4, 6);
+	info->revision = b[10];
+	info->serial = le32(b + 11);
+	info->manufacturing_year = b[15];
+	info->manufacturing_month = b[16];
+	info->capacity = 0;
+	for (i = 7; i >= 0; i--)
+		info->capacity = (info->capacity << 8) | b[17 + i];
+	info->flag_copy = b[25];
+	info->flag_write_protect = b[26];
+	info->flag_write_protect_temp = b[27];
+	info->format = b[28];
+	return 0;
+}
+
+int wrp_link_get_stats(struct wrp_link_dev *dev, struct wrp_link_stats *stats)
+{
+	const uint8_t *b = dev->frame + 2;
+
+	if (query(dev, WRP_LINK_GET_STATS, STATS_LEN) <= 0) {
+		fprintf(stderr, "node does not report link statistics\n");
+		return -1;
+	}
+	stats->sent_data = le32(b);
+	stats->sent_frames = le32(b + 4);
+	stats->received_data = le32(b + 8);
+	stats->received_frames = le32(b + 12);
+	return 0;
+}
+
+/*
+ * The requests of an SD_QUEUE frame, which the node runs back to back. It
+ * streams a read as soon as it is through with the request before, so the
+ * chunks of a read can come while the one before is still missing some;
+ * they are held until the read they belong to is run.
+ */
+struct batch {
+	uint8_t frame[2 + 8 * WRP_LINK_BATCH];
+	size_t len;
+	/* a frame of one of its requests has come, so the node has taken it */
+	int taken;
+	struct held_frame {
+		size_t len;
+		uint8_t frame[WRP_LINK_FRAME_MAX];
+	} *held;
+	size_t held_count, held_size;
+};
+
+static int data_frame(const struct wrp_link_dev *dev, int n)
+{
+	return (dev->frame[0] == WRP_LINK_DATA && n == WRP_LINK_DATA_LENGTH) ||
+	       (dev->frame[0] == WRP_LINK_PACKED && n > 5) ||
+	       (dev->frame[0] == WRP_LINK_FILL && n == 5);
+}
+
+/* notes that the node has taken the batch if a frame is for one of its requests */
+static void batch_heard(struct batch *batch, const struct wrp_link_dev *dev, int n)
+{
+	size_t i;
+
+	if (!batch || n < 2)
+		return;
+	for (i = 2; i < batch->len; i += 8) {
+		if (dev->frame[1] == batch->frame[i + 1])
+			batch->taken = 1;
+	}
+}
+
+/* keeps a chunk of a later read of the batch */
+static void hold_frame(struct batch *batch, const struct wrp_link_dev *dev, int n)
+{
+	if (!batch || !data_frame(dev, n))
+		return;
+	if (batch->held_count == batch->held_size) {
+		size_t size = batch->held_size ? 2 * batch->held_size : 64;
+		struct held_frame *held = realloc(batch->held, size * sizeof(*held));
+
+		/* a chunk that is not held is asked for again */
+		if (!held)
+			return;
+		batch->held = held;
+		batch->held_size = size;
+	}
+	batch->held[batch->held_count].len = n;
+	memcpy(batch->held[batch->held_count++].frame, dev->frame, n);
+}
+
+/*
+ * Takes the chunks in whatever order they come. A gap in the chunk numbers
+ * is asked for again at once; when the link goes quiet with chunks still
+ * missing, a window's worth of them is asked for, or the whole command is
+ * sent again if nothing arrived at all. A read that came in the SD_QUEUE
+ * frame batch sends that again instead, which the node ignores once it
+ * has it, and only asks for chunks once the node has taken it: until then
+ * a NAK could only be answered by an older read with the same tag.
+ */
+static int read_blocks(struct wrp_link_dev *dev, uint8_t tag, uint32_t lba, uint16_t blocks, void *data,
+	struct batch *batch)
+{
+	uint32_t total = (uint32_t)blocks * WRP_LINK_CHUNKS, have = 0, next = 0, i;
+	size_t held = 0;
+	uint8_t *got = calloc(total, 1), *p = data;
+	long long progress = now_ms(), heard = progress;
+
+	if (!got) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	if (!batch && send_command(dev, WRP_LINK_READ_BLOCKS, tag, lba, blocks) < 0)
+		goto fail;
+
+	while (have < total) {
+		long position;
+		int n;
+
+		if (batch && held < batch->held_count) {
+			struct held_frame *frame = &batch->held[held++];
+
+			if (frame->frame[1] != tag)
+				continue;
+			n = frame->len;
+			memcpy(dev->frame, frame->frame, n);
+		} else {
+			n = wrp_link_receive(dev, WRP_LINK_QUIET_MS);
+			batch_heard(batch, dev, n);
+		}
+		if (n == WRP_LINK_FAILED)
+			goto fail;
+		/* frames of the requests queued after this one: the node has gone on to them */
+		if (n >= 2 && dev->frame[1] != tag && now_ms() - heard >= WRP_LINK_QUIET_MS)
+			n = WRP_LINK_QUIET;
+		if (n == WRP_LINK_QUIET) {
+			unsigned int asked = 0;
+
+			heard = now_ms();
+			if (timed_out(dev, progress))
+				goto fail;
+			if (!have && batch) {
+				if (send_frame(dev, batch->frame, batch->len) < 0)
+					goto fail;
+				if (!batch->taken)
+					continue;
+			} else if (!have) {
+				if (send_command(dev, WRP_LINK_READ_BLOCKS, tag, lba, blocks) < 0)
+					goto fail;
+				continue;
+			}
+			for (i = 0; i < total && asked < WRP_LINK_WINDOW; i++) {
+				if (got[i])
+					continue;
+				if (send_chunk_id(dev, WRP_LINK_NAK, tag, i) < 0)
+					goto fail;
+				dev->retransmits++;
+				asked++;
+			}
+			continue;
+		}
+		if (n >= 2 && dev->frame[1] != tag)
+			hold_frame(batch, dev, n);
+		if (n < 2 || dev->frame[1] != tag)
+			continue;
+		heard = now_ms();
+		if (dev->frame[0] == WRP_LINK_ERROR) {
+			fprintf(stderr, "node failed to read block %u\n",
+				lba + (n >= 4 ? dev->frame[2] | (dev->frame[3] << 8) : 0));
+			goto fail;
+		}
+		if (!data_frame(dev, n))
+			continue;
+		if ((position = chunk_position(dev, blocks)) < 0)
+			continue;
+
+		progress = now_ms();
+		dev->frame_bytes += n;
+		if (dev->frame[0] == WRP_LINK_FILL) {
+			uint32_t first = position - (WRP_LINK_CHUNKS - 1);
+
+			dev->block_bytes += WRP_LINK_BLOCK_SIZE;
+			memset(p + (size_t)first * WRP_LINK_CHUNK, dev->frame[4], WRP_LINK_BLOCK_SIZE);
+			for (i = first; i <= (uint32_t)position; i++) {
+				have += !got[i];
+				got[i] = 1;
+			}
+		} else {
+			dev->block_bytes += WRP_LINK_CHUNK;
+			if (!got[position]) {
+				uint8_t *chunk = p + position * WRP_LINK_CHUNK;
+
+				if (dev->frame[0] == WRP_LINK_DATA)
+					memcpy(chunk, dev->frame + 5, WRP_LINK_CHUNK);
+				else if (wrp_link_unpack(dev->frame + 5, n - 5, chunk) < 0)
+					continue;
+				got[position] = 1;
+				have++;
+			}
+		}
+		/* chunks skipped over were lost on the way */
+		for (; next < (uint32_t)position; next++) {
+			if (got[next])
+				continue;
+			if (send_chunk_id(dev, WRP_LINK_NAK, tag, next) < 0)
+				goto fail;
+			dev->retransmits++;
+		}
+		if ((uint32_t)position >= next)
+			next = position + 1;
+	}
+	free(got);
+	return 0;
+
+fail:
+	free(got);
+	return -1;
+}
+
+int wrp_link_read(struct wrp_link_dev *dev, uint32_t lba, uint16_t blocks, void *data)
+{
+	return read_blocks(dev, next_tag(dev), lba, blocks, data, NULL);
+}
+
+/*
+ * Keeps at most WRP_LINK_WINDOW frames beyond the node's count in flight,
+ * which its receive ring always has room for, so the line only idles when
+ * the card is busy. Chunks the node asks for again go out before new ones.
+ * Once everything has been sent, a quiet link means the final status was
+ * lost, so it is asked for. A write that came in the SD_QUEUE frame batch
+ * does not wait for the node's first count: the node starts it as soon as
+ * the request before has ended, which is before that request is through
+ * here, and it counts from zero.
+ */
+static int write_blocks(struct wrp_link_dev *dev, uint8_t tag, uint32_t lba, uint16_t blocks, const void *data,
+	struct batch *batch)
+{
+	uint32_t total = (uint32_t)blocks * WRP_LINK_CHUNKS, next = 0;
+	uint32_t *queue = malloc(total * sizeof(*queue));
+	uint8_t *queued = calloc(total, 1);
+	size_t queue_head = 0, queue_tail = 0;
+	const uint8_t *p = data;
+	uint16_t sent = 0, consumed = 0;
+	int started = batch != NULL, r = -1;
+	long long progress = now_ms(), heard = progress;
+
+	if (!queue || !queued) {
+		fprintf(stderr, "out of memory\n");
+		goto out;
+	}
+	if (!batch && send_command(dev, WRP_LINK_WRITE_BLOCKS, tag, lba, blocks) < 0)
+		goto out;
+
+	for (;;) {
+		int n;
+		long position;
+
+		while (started && (int16_t)(sent - consumed) < WRP_LINK_WINDOW &&
+		       (queue_head != queue_tail || next < total)) {
+			uint8_t frame[WRP_LINK_DATA_LENGTH];
+			const uint8_t *chunk;
+			uint32_t pos;
+			size_t len;
+			int fill = -1;
+
+			if (queue_head != queue_tail) {
+				pos = queue[queue_head++ % total];
+				queued[pos] = 0;
+				dev->retransmits++;
+			} else {
+				pos = next++;
+				/* a block of one byte value goes whole; chunks asked for again go one by one */
+				if (pos % WRP_LINK_CHUNKS == 0)
+					fill = block_fill(p + (size_t)pos * WRP_LINK_CHUNK);
+			}
+			chunk = p + (size_t)pos * WRP_LINK_CHUNK;
+			frame[1] = tag;
+			frame[2] = pos / WRP_LINK_CHUNKS;
+			frame[3] = pos / WRP_LINK_CHUNKS >> 8;
+			if (fill >= 0) {
+				frame[0] = WRP_LINK_FILL;
+				frame[4] = fill;
+				len = 5;
+				next += WRP_LINK_CHUNKS - 1;
+				dev->block_bytes += WRP_LINK_BLOCK_SIZE;
+			} else if ((len = wrp_link_pack(chunk, frame + 5))) {
+				frame[0] = WRP_LINK_PACKED;
+				frame[4] = pos % WRP_LINK_CHUNKS;
+				len += 5;
+				dev->block_bytes += WRP_LINK_CHUNK;
+			} else {
+				frame[0] = WRP_LINK_DATA;
+				frame[4] = pos % WRP_LINK_CHUNKS;
+				memcpy(frame + 5, chunk, WRP_LINK_CHUNK);
+				len = WRP_LINK_DATA_LENGTH;
+				dev->block_bytes += WRP_LINK_CHUNK;
+			}
+			if (send_frame(dev, frame, len) < 0)
+				goto out;
+			dev->frame_bytes += len;
+			sent++;
+		}
+
+		n = wrp_link_receive(dev, WRP_LINK_QUIET_MS);
+		batch_heard(batch, dev, n);
+		if (n == WRP_LINK_FAILED)
+			goto out;
+		/* the final status was lost if the node has gone on to the next request */
+		if (n >= 2 && dev->frame[1] != tag && now_ms() - heard >= WRP_LINK_QUIET_MS)
+			n = WRP_LINK_QUIET;
+		if (n == WRP_LINK_QUIET) {
+			uint8_t status[2] = { WRP_LINK_STATUS, tag };
+
+			heard = now_ms();
+			if (timed_out(dev, progress))
+				goto out;
+			/* the node does not count a repeated SD_QUEUE */
+			if (batch && send_frame(dev, batch->frame, batch->len) < 0)
+				goto out;
+			if (!started) {
+				if (send_command(dev, WRP_LINK_WRITE_BLOCKS, tag, lba, blocks) < 0)
+					goto out;
+			} else if (next == total && queue_head == queue_tail) {
+				if (send_frame(dev, status, sizeof(status)) < 0)
+					goto out;
+			} else {
+				continue;
+			}
+			/* the node counts every frame it takes */
+			sent++;
+			continue;
+		}
+		if (n >= 2 && dev->frame[1] != tag)
+			hold_frame(batch, dev, n);
+		if (n < 2 || dev->frame[1] != tag)
+			continue;
+		heard = now_ms();
+
+		switch (dev->frame[0]) {
+		case WRP_LINK_CREDIT:
+			/* the blocks the node holds in full are not needed here: every chunk stays in data */
+			if (n != 7)
+				break;
+			consumed = dev->frame[2] | (dev->frame[3] << 8);
+			/* with resync set the node's ring is empty, so everything sent has been counted */
+			if (!started || dev->frame[4])
+				sent = consumed;
+			started = 1;
+			progress = now_ms();
+			break;
+		case WRP_LINK_NAK:
+			if (n != 5 || (position = chunk_position(dev, blocks)) < 0 || queued[position])
+				break;
+			queue[queue_tail++ % total] = position;
+			queued[position] = 1;
+			progress = now_ms();
+			break;
+		case WRP_LINK_SUCCESS:
+			r = 0;
+			goto out;
+		case WRP_LINK_ERROR:
+			fprintf(stderr, "node failed to write blocks %u to %u\n", lba, lba + blocks - 1);
+			goto out;
+		}
+	}
+
+out:
+	free(queue);
+	free(queued);
+	return r;
+}
+
+int wrp_link_write(struct wrp_link_dev *dev, uint32_t lba, uint16_t blocks, const void *data)
+{
+	return write_blocks(dev, next_tag(dev), lba, blocks, data, NULL);
+}
+
+/*
+ * Runs the requests waiting in the queue, several of them sent to the node
+ * at once in an SD_QUEUE frame: the node goes from one to the next without
+ * waiting for another command.
+ */
+static void *queue_thread(void *arg)
+{
+	struct wrp_link_queue *queue = arg;
+	struct wrp_link_dev *dev = queue->dev;
+	struct batch batch = { .held = NULL };
+
+	for (;;) {
+		struct wrp_link_request *requests[WRP_LINK_BATCH];
+		uint8_t tags[WRP_LINK_BATCH];
+		unsigned int n, i;
+
+		pthread_mutex_lock(&queue->lock);
+		while (queue->run == queue->submitted && !queue->stop)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		if (queue->stop) {
+			pthread_mutex_unlock(&queue->lock);
+			free(batch.held);
+			return NULL;
+		}
+		n = queue->submitted - queue->run;
+		if (n > WRP_LINK_BATCH)
+			n = WRP_LINK_BATCH;
+		for (i = 0; i < n; i++)
+			requests[i] = queue->requests[(queue->run + i) % WRP_LINK_QUEUE_DEPTH];
+		pthread_mutex_unlock(&queue->lock);
+
+		if (n > 1) {
+			batch.frame[0] = WRP_LINK_QUEUE;
+			batch.frame[1] = next_tag(dev);
+			if (batch.frame[1] == dev->queue_tag)
+				batch.frame[1] = next_tag(dev);
+			dev->queue_tag = batch.frame[1];
+			batch.len = 2 + 8 * n;
+			batch.taken = 0;
+			batch.held_count = 0;
+			for (i = 0; i < n; i++) {
+				uint8_t *d = batch.frame + 2 + 8 * i;
+
+				tags[i] = next_tag(dev);
+				d[0] = requests[i]->writing ? WRP_LINK_WRITE_BLOCKS : WRP_LINK_READ_BLOCKS;
+				d[1] = tags[i];
+				d[2] = requests[i]->lba;
+				d[3] = requests[i]->lba >> 8;
+				d[4] = requests[i]->lba >> 16;
+				d[5] = requests[i]->lba >> 24;
+				d[6] = requests[i]->blocks;
+				d[7] = requests[i]->blocks >> 8;
+			}
+			if (send_frame(dev, batch.frame, batch.len) < 0)
+				n = 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct wrp_link_request *request = requests[i];
+
+			if (n == 1 && request->writing)
+				request->result = wrp_link_write(dev, request->lba, request->blocks, request->data);
+			else if (n == 1)
+				request->result = wrp_link_read(dev, request->lba, request->blocks, request->data);
+			else if (request->writing)
+				request->result = write_blocks(dev, tags[i], request->lba, request->blocks,
+							       request->data, &batch);
+			else
+				request->result = read_blocks(dev, tags[i], request->lba, request->blocks,
+							      request->data, &batch);
+
+			pthread_mutex_lock(&queue->lock);
+			queue->run++;
+			pthread_cond_broadcast(&queue->cond);
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+}
+
+int wrp_link_queue_start(struct wrp_link_queue *queue, struct wrp_link_dev *dev)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->dev = dev;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+	if (pthread_create(&queue->thread, NULL, queue_thread, queue)) {
+		fprintf(stderr, "cannot start the link thread\n");
+		pthread_mutex_destroy(&queue->lock);
+		pthread_cond_destroy(&queue->cond);
+		return -1;
+	}
+	return 0;
+}
+
+/* queues a request behind the others, once there is room for it */
+void wrp_link_submit(struct wrp_link_queue *queue, struct wrp_link_request *request)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->submitted - queue->reaped == WRP_LINK_QUEUE_DEPTH)
+		pthread_cond_wait(&queue->cond, &queue->lock);
+	queue->requests[queue->submitted++ % WRP_LINK_QUEUE_DEPTH] = request;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* waits for the oldest request to be run and returns it, or NULL if none is queued */
+struct wrp_link_request *wrp_link_reap(struct wrp_link_queue *queue)
+{
+	struct wrp_link_request *request = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->reaped != queue->submitted) {
+		while (queue->run == queue->reaped)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		request = queue->requests[queue->reaped++ % WRP_LINK_QUEUE_DEPTH];
+		pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return request;
+}
+
+/* lets the request being run finish and drops those behind it */
+void wrp_link_queue_stop(struct wrp_link_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->stop = 1;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+	pthread_join(queue->thread, NULL);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->cond);
+}
@@ -0,0 +1,156 @@
+#ifndef WRP_LINK_H
+#define WRP_LINK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes of the atmega328 link protocol; must match atmega328.ino */
+#define WRP_LINK_ERROR        0
+#define WRP_LINK_GET_INFO     3
+#define WRP_LINK_SUCCESS      4
+#define WRP_LINK_READ_BLOCKS  8
+#define WRP_LINK_WRITE_BLOCKS 9
+#define WRP_LINK_CREDIT       10
+#define WRP_LINK_DATA         11
+#define WRP_LINK_NAK          12
+#define WRP_LINK_STATUS       13
+#define WRP_LINK_PACKED       15
+#define WRP_LINK_FILL         16
+#define WRP_LINK_GET_STATS    17
+#define WRP_LINK_QUEUE        18
+#define WRP_LINK_RESET        19
+
+#define WRP_LINK_BLOCK_SIZE   512
+#define WRP_LINK_CHUNK        64
+#define WRP_LINK_CHUNKS       (WRP_LINK_BLOCK_SIZE / WRP_LINK_CHUNK)
+#define WRP_LINK_DATA_LENGTH  (WRP_LINK_CHUNK + 5)
+#define WRP_LINK_FRAME_MAX    (WRP_LINK_CHUNK + 10)
+#define WRP_LINK_WINDOW       WRP_LINK_CHUNKS
+#define WRP_LINK_MAX_BLOCKS   65535
+
+/*
+ * Run-length coding of a chunk in a PACKED frame: a byte n below
+ * WRP_LINK_RUN is followed by n + 1 bytes as they are, and one from
+ * WRP_LINK_RUN by a byte repeating n - WRP_LINK_RUN + WRP_LINK_RUN_MIN times
+ */
+#define WRP_LINK_RUN          0x80
+#define WRP_LINK_RUN_MIN      3
+
+#define WRP_LINK_DEFAULT_BAUD       1000000
+#define WRP_LINK_DEFAULT_TIMEOUT_MS 2000
+/* quiet time after which missing chunks are asked for again */
+#define WRP_LINK_QUIET_MS           50
+/* requests a wrp_link_queue holds, submitted but not yet reaped */
+#define WRP_LINK_QUEUE_DEPTH        4
+/* requests an SD_QUEUE frame carries, LINK_QUEUE in the sketch */
+#define WRP_LINK_BATCH              4
+
+/* results of wrp_link_receive besides a payload length */
+#define WRP_LINK_DAMAGED            -1
+#define WRP_LINK_QUIET              -2
+#define WRP_LINK_FAILED             -3
+
+/*
+ * An atmega328 SD bridge (atmega328.ino) on a serial port. Every message
+ * is a COBS frame with a CRC-16 and the tag of its request. Reads stream
+ * back chunk by chunk and writes are paced by the frame counts the node
+ * returns as it drains its receive ring; a damaged or lost chunk is asked
+ * for again by number, so a bit error costs one frame rather than the
+ * request. Both ends run-length code the chunks and send blocks of one byte
+ * value as a single FILL frame, so runs of zeros cost next to nothing.
+ */
+struct wrp_link_dev {
+	int fd;
+	unsigned int timeout_ms;
+	uint8_t tag;
+	/* of the last SD_QUEUE frame; the node would take another with it as that one sent again */
+	uint8_t queue_tag;
+
+	/* frame decoder */
+	uint8_t rx[256];
+	size_t rx_len, rx_pos;
+	uint8_t frame[WRP_LINK_FRAME_MAX];
+	size_t frame_len;
+	uint8_t code, code_left;
+	int overrun;
+
+	/* since wrp_link_open */
+	unsigned long crc_errors;
+	unsigned long retransmits;
+	/* block bytes sent and received in data frames, and the payload bytes of those frames */
+	unsigned long long block_bytes;
+	unsigned long long frame_bytes;
+};
+
+/* the node's counterpart of block_bytes and frame_bytes since it was reset */
+struct wrp_link_stats {
+	uint32_t sent_data;
+	uint32_t sent_frames;
+	uint32_t received_data;
+	uint32_t received_frames;
+};
+
+struct wrp_link_info {
+	uint8_t manufacturer;
+	char oem[3];
+	char product[6];
+	uint8_t revision;
+	uint32_t serial;
+	uint8_t manufacturing_year;
+	uint8_t manufacturing_month;
+	uint64_t capacity;
+	uint8_t flag_copy;
+	uint8_t flag_write_protect;
+	uint8_t flag_write_protect_temp;
+	uint8_t format;
+};
+
+/*
+ * A request for a wrp_link_queue, which runs the requests back to back on
+ * a thread of its own that has the port to itself. The caller fills or
+ * drains the data of the others meanwhile, so the link does not wait for
+ * the disk between requests. Those waiting when the thread comes to them
+ * go to the node together, so it runs them back to back. Requests are
+ * reaped in the order they were submitted, with result set as
+ * wrp_link_read or wrp_link_write would have returned.
+ */
+struct wrp_link_request {
+	int writing;
+	uint32_t lba;
+	uint16_t blocks;
+	void *data;
+	int result;
+};
+
+struct wrp_link_queue {
+	struct wrp_link_dev *dev;
+	struct wrp_link_request *requests[WRP_LINK_QUEUE_DEPTH];
+	/* counts of requests reaped, run and submitted */
+	unsigned int reaped, run, submitted;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int wrp_link_open(struct wrp_link_dev *dev, const char *path, unsigned int baud);
+void wrp_link_close(struct wrp_link_dev *dev);
+
+int wrp_link_get_info(struct wrp_link_dev *dev, struct wrp_link_info *info);
+int wrp_link_get_stats(struct wrp_link_dev *dev, struct wrp_link_stats *stats);
+int wrp_link_read(struct wrp_link_dev *dev, uint32_t lba, uint16_t blocks, void *data);
+int wrp_link_write(struct wrp_link_dev *dev, uint32_t lba, uint16_t blocks, const void *data);
+
+int wrp_link_queue_start(struct wrp_link_queue *queue, struct wrp_link_dev *dev);
+void wrp_link_submit(struct wrp_link_queue *queue, struct wrp_link_request *request);
+struct wrp_link_request *wrp_link_reap(struct wrp_link_queue *queue);
+void wrp_link_queue_stop(struct wrp_link_queue *queue);
+
+/* The frame layer on its own, for the node's side in wrp_node_emu */
+size_t wrp_link_encode(const uint8_t *payload, size_t len, uint8_t *out);
+int wrp_link_receive(struct wrp_link_dev *dev, int timeout_ms);
+size_t wrp_link_pack(const uint8_t *data, uint8_t *runs);
+int wrp_link_unpack(const uint8_t *runs, size_t len, uint8_t *data);
+
+#endif
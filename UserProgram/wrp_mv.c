@@ -1,55 +1,854 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "wrp_sha256.h"
+
+/* Size of each of the two buffers used by the threaded copy */
+#define CHUNK_SIZE      (4 << 20)
+
+/* Buffer alignment; satisfies O_DIRECT on any logical block size up to 4 KiB */
+#define CHUNK_ALIGN     4096
+
+/* Minimum time between two progress lines, in seconds */
+#define PROGRESS_PERIOD 0.5
+
+/* Tree mode: files up to this size are read whole by the worker pool */
+#define SMALL_FILE_MAX  (8 << 20)
+
+/* Tree mode: upper bound on file data read ahead of the writer */
+#define INFLIGHT_MAX    (256 << 20)
+
+/* Tree mode: read size when hashing a file for -v */
+#define HASH_CHUNK      (1 << 20)
+
+struct copy_opts {
+	int progress;
+	int direct;
+	int recursive;
+	int verify;
+};
+
+struct progress {
+	off_t total;
+	off_t done;
+	double start;
+	double last;
+};
+
+struct chunk {
+	uint8_t *data;
+	ssize_t len;
+	int full;
+};
+
+struct pipeline {
+	int in_fd;
+	struct chunk chunks[2];
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void progress_update(struct progress *p, const struct copy_opts *opts, off_t bytes, int final)
+{
+	double t;
+	double rate;
+
+	p->done += bytes;
+	if (!opts->progress)
+		return;
+
+	t = now();
+	if (!final && t - p->last < PROGRESS_PERIOD)
+		return;
+	p->last = t;
+
+	rate = (t > p->start) ? p->done / (t - p->start) : 0;
+	fprintf(stderr, "\r%lld/%lld bytes (%3.0f%%) %.1f MB/s", (long long)p->done,
+		(long long)p->total, p->total ? 100.0 * p->done / p->total : 100.0, rate / 1e6);
+	if (final)
+		fprintf(stderr, "\n");
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/* Kernel-side copy; returns 1 if the filesystems don't support it and nothing was copied */
+static int copy_in_kernel(int in_fd, int out_fd, struct progress *p, const struct copy_opts *opts)
+{
+	int use_sendfile = 0;
+
+	while (p->done < p->total) {
+		size_t want = (p->total - p->done > CHUNK_SIZE) ? CHUNK_SIZE : p->total - p->done;
+		ssize_t n;
+
+		if (!use_sendfile)
+			n = copy_file_range(in_fd, NULL, out_fd, NULL, want, 0);
+		else
+			n = sendfile(out_fd, in_fd, NULL, want);
+
+		if (n < 0 && p->done == 0 && (errno == ENOSYS || errno == EXDEV ||
+			errno == EINVAL || errno == EOPNOTSUPP)) {
+			if (use_sendfile)
+				return 1;
+			use_sendfile = 1;
+			continue;
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+
+		progress_update(p, opts, n, 0);
+	}
+	return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	int i = 0;
+
+	for (;;) {
+		struct chunk *c = &pl->chunks[i];
+		ssize_t got = 0;
+
+		pthread_mutex_lock(&pl->lock);
+		while (c->full && !pl->error)
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		pthread_mutex_unlock(&pl->lock);
+		if (pl->error)
+			return NULL;
+
+		while (got < CHUNK_SIZE) {
+			ssize_t n = read(pl->in_fd, c->data + got, CHUNK_SIZE - got);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				pthread_mutex_lock(&pl->lock);
+				pl->error = errno;
+				pthread_cond_broadcast(&pl->cond);
+				pthread_mutex_unlock(&pl->lock);
+				return NULL;
+			}
+			if (n == 0)
+				break;
+			got += n;
+		}
+
+		pthread_mutex_lock(&pl->lock);
+		c->len = got;
+		c->full = 1;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+
+		if (got < CHUNK_SIZE)
+			return NULL;
+		i ^= 1;
+	}
+}
+
+/*
+ * Double-buffered copy: a reader thread fills one aligned chunk while this
+ * thread writes the other. With O_DIRECT the page cache is bypassed, and the
+ * unaligned tail is written after turning O_DIRECT back off.
+ */
+static int copy_buffered(int in_fd, int out_fd, struct progress *p, const struct copy_opts *opts)
+{
+	struct pipeline pl;
+	pthread_t reader;
+	int i = 0;
+	int r = 0;
+
+	memset(&pl, 0, sizeof(pl));
+	pl.in_fd = in_fd;
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.cond, NULL);
+
+	for (int k = 0; k < 2; k++) {
+		if (posix_memalign((void **)&pl.chunks[k].data, CHUNK_ALIGN, CHUNK_SIZE)) {
+			free(pl.chunks[0].data);
+			return -1;
+		}
+	}
+
+	if (opts->direct && fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_DIRECT) < 0)
+		fprintf(stderr, "O_DIRECT not supported on destination, using page cache\n");
+
+	if (pthread_create(&reader, NULL, reader_thread, &pl)) {
+		free(pl.chunks[0].data);
+		free(pl.chunks[1].data);
+		return -1;
+	}
+
+	for (;;) {
+		struct chunk *c = &pl.chunks[i];
+		ssize_t len;
+		size_t aligned;
+
+		pthread_mutex_lock(&pl.lock);
+		while (!c->full && !pl.error)
+			pthread_cond_wait(&pl.cond, &pl.lock);
+		pthread_mutex_unlock(&pl.lock);
+		if (pl.error && !c->full) {
+			errno = pl.error;
+			r = -1;
+			break;
+		}
+
+		len = c->len;
+		aligned = len & ~(size_t)(CHUNK_ALIGN - 1);
+		if (write_all(out_fd, c->data, aligned) < 0) {
+			r = -1;
+		} else if (aligned < (size_t)len) {
+			fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_DIRECT);
+			if (write_all(out_fd, c->data + aligned, len - aligned) < 0)
+				r = -1;
+		}
+		if (r < 0) {
+			pthread_mutex_lock(&pl.lock);
+			pl.error = errno;
+			pthread_cond_broadcast(&pl.cond);
+			pthread_mutex_unlock(&pl.lock);
+			break;
+		}
+		progress_update(p, opts, len, 0);
+
+		pthread_mutex_lock(&pl.lock);
+		c->full = 0;
+		pthread_cond_broadcast(&pl.cond);
+		pthread_mutex_unlock(&pl.lock);
+
+		if (len < CHUNK_SIZE)
+			break;
+		i ^= 1;
+	}
+
+	pthread_join(reader, NULL);
+	pthread_mutex_destroy(&pl.lock);
+	pthread_cond_destroy(&pl.cond);
+	free(pl.chunks[0].data);
+	free(pl.chunks[1].data);
+	return r;
+}
 
 int mv_simple(const char *oldpath, const char *newpath) {
 	return rename(oldpath, newpath);
 }
 
-int mv(const char *oldpath, const char *newpath) {
-	FILE *oldptr;
-	FILE *newptr;
+/* Copy an open file into an open, empty destination and make it durable if asked */
+static int copy_fd(int in_fd, int out_fd, off_t size, struct progress *p, const struct copy_opts *opts)
+{
+	int r;
+
+	posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	memset(p, 0, sizeof(*p));
+	p->total = size;
+	p->start = p->last = now();
 
-	oldptr = fopen(oldpath, "r");
-	if (oldptr == NULL) {
+	/* O_DIRECT was asked for explicitly, so skip the page-cache based kernel copy */
+	r = opts->direct ? 1 : copy_in_kernel(in_fd, out_fd, p, opts);
+	if (r == 1)
+		r = copy_buffered(in_fd, out_fd, p, opts);
+	if (r == 0)
+		progress_update(p, opts, 0, 1);
+	return r;
+}
+
+int mv(const char *oldpath, const char *newpath, const struct copy_opts *opts) {
+	struct stat st;
+	struct progress p;
+	int in_fd, out_fd;
+	int r;
+
+	if (stat(oldpath, &st) < 0 || !S_ISREG(st.st_mode)) {
 		printf("%s does not exist\n", oldpath);
 		return 1;
-	} 
+	}
+
+	if (access(newpath, F_OK) == 0) {
+		printf("%s already exists\n", newpath);
+		return 1;
+	}
+
+	/* Same filesystem: no data needs to move at all */
+	if (mv_simple(oldpath, newpath) == 0)
+		return 0;
+	if (errno != EXDEV) {
+		printf("cannot move %s: %s\n", oldpath, strerror(errno));
+		return 1;
+	}
 
-	newptr = fopen(newpath, "r");
-	if (newptr != NULL) {
-		printf("%s already exists", newpath);
+	in_fd = open(oldpath, O_RDONLY);
+	if (in_fd < 0) {
+		printf("%s cannot be opened\n", oldpath);
 		return 1;
 	}
 
-	newptr = fopen(newpath, "wb");
-	if (newptr == NULL) {
+	out_fd = open(newpath, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+	if (out_fd < 0) {
 		printf("%s cannot be created\n", newpath);
+		close(in_fd);
+		return 1;
+	}
+
+	r = copy_fd(in_fd, out_fd, st.st_size, &p, opts);
+
+	/* The source is only removed once the copy is known to be on the device */
+	if (r == 0 && fsync(out_fd) < 0)
+		r = -1;
+	if (close(out_fd) < 0)
+		r = -1;
+	close(in_fd);
+
+	if (r < 0) {
+		printf("copy failed: %s\n", strerror(errno));
+		unlink(newpath);
 		return 1;
 	}
 
-	char c;
-	while ( (c = fgetc(oldptr)) != EOF ) {
-		fputc(c, newptr);
+	if (unlink(oldpath) < 0) {
+		printf("copied, but cannot remove %s: %s\n", oldpath, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Tree mode. Every file and directory under the sources becomes a job,
+ * sorted by destination path. A pool of one worker per core reads small
+ * files whole, ahead of a single writer that creates the destinations
+ * strictly in job order: the device sees one sequential stream, so the FAT
+ * allocator hands out consecutive clusters. There is no per-file fsync; one
+ * syncfs() covers the whole batch before any source is removed. Symbolic
+ * links are recreated, not followed; any other kind of file, or a directory
+ * that cannot be read, fails its whole source before anything is moved.
+ * With -v the workers also hash what they read, and after the sync every
+ * copy is read back from the device and must hash the same before its
+ * source is removed.
+ */
+struct job {
+	char *src;
+	char *dst;
+	off_t size;
+	mode_t mode;
+	int is_dir;
+	char *link;	/* target of a symbolic link */
+	uint8_t *data;
+	uint8_t digest[WRP_SHA256_LEN];	/* of the source, if hashed */
+	int hashed;
+	int ready;
+	int error;
+};
+
+struct job_list {
+	struct job *jobs;
+	size_t count;
+	size_t cap;
+	const char *dst_root;
+	size_t src_root_len;
+};
+
+struct pool {
+	struct job_list *list;
+	int verify;
+	size_t next_read;
+	size_t next_write;
+	size_t inflight;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* nftw() has no user pointer */
+static struct job_list *walk_list;
+
+static int walk_add(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct job_list *l = walk_list;
+	struct job *j;
+
+	(void)ftw;
+	if (type == FTW_DNR || type == FTW_NS) {
+		printf("cannot read %s\n", path);
+		return -1;
+	}
+	if (type == FTW_F && !S_ISREG(st->st_mode)) {
+		printf("%s is not a regular file, directory or symbolic link\n", path);
+		return -1;
+	}
+
+	if (l->count == l->cap) {
+		size_t cap = l->cap ? l->cap * 2 : 256;
+		struct job *jobs = realloc(l->jobs, cap * sizeof(*jobs));
+
+		if (!jobs)
+			return -1;
+		l->jobs = jobs;
+		l->cap = cap;
+	}
+
+	j = &l->jobs[l->count++];
+	memset(j, 0, sizeof(*j));
+	j->src = strdup(path);
+	j->dst = malloc(strlen(l->dst_root) + strlen(path + l->src_root_len) + 2);
+	if (!j->src || !j->dst)
+		return -1;
+	sprintf(j->dst, "%s%s", l->dst_root, path + l->src_root_len);
+	j->size = st->st_size;
+	j->mode = st->st_mode & 07777;
+	j->is_dir = (type == FTW_D);
+	if (type == FTW_SL) {
+		/* st_size is the target's length, except on a few filesystems that report 0 */
+		size_t cap = st->st_size > 0 ? (size_t)st->st_size + 1 : 4096;
+		ssize_t n;
+
+		j->link = malloc(cap);
+		if (!j->link || (n = readlink(path, j->link, cap)) < 0 || (size_t)n == cap) {
+			printf("cannot read link %s\n", path);
+			return -1;
+		}
+		j->link[n] = '\0';
+		j->size = 0;
+	}
+	return 0;
+}
+
+static int job_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct job *)a)->dst, ((const struct job *)b)->dst);
+}
+
+/* 0, or the errno of the failure; a file that shrank since the walk is EIO */
+static int read_whole(const char *path, uint8_t *buf, off_t size)
+{
+	int fd = open(path, O_RDONLY);
+	off_t got = 0;
+
+	if (fd < 0)
+		return errno;
+	while (got < size) {
+		ssize_t n = read(fd, buf + got, size - got);
+		int error;
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			error = n < 0 ? errno : EIO;
+			close(fd);
+			return error;
+		}
+		got += n;
+	}
+	close(fd);
+	return 0;
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool *pl = arg;
+	struct job_list *l = pl->list;
+
+	for (;;) {
+		struct job *j;
+		size_t idx;
+
+		pthread_mutex_lock(&pl->lock);
+		/* Jobs the writer handles itself; it may already be waiting for one of them */
+		while (pl->next_read < l->count &&
+			(l->jobs[pl->next_read].is_dir || l->jobs[pl->next_read].link ||
+			 l->jobs[pl->next_read].size > SMALL_FILE_MAX)) {
+			l->jobs[pl->next_read++].ready = 1;
+			pthread_cond_broadcast(&pl->cond);
+		}
+		if (pl->next_read == l->count) {
+			pthread_mutex_unlock(&pl->lock);
+			return NULL;
+		}
+		idx = pl->next_read++;
+		j = &l->jobs[idx];
+
+		/* The job the writer waits for may always proceed, so the bound can't deadlock */
+		while (pl->inflight + j->size > INFLIGHT_MAX && idx != pl->next_write)
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		pl->inflight += j->size;
+		pthread_mutex_unlock(&pl->lock);
+
+		j->data = malloc(j->size ? j->size : 1);
+		j->error = j->data ? read_whole(j->src, j->data, j->size) : ENOMEM;
+		if (!j->error && pl->verify) {
+			wrp_sha256(j->data, j->size, j->digest);
+			j->hashed = 1;
+		}
+
+		pthread_mutex_lock(&pl->lock);
+		j->ready = 1;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+	}
+}
+
+/*
+ * 0, or the errno of the failure. With drop, the file's cached pages are
+ * dropped first so that it is read from the device; after a sync they are
+ * all clean, so none is lost.
+ */
+static int hash_file(const char *path, int drop, uint8_t *digest)
+{
+	struct wrp_sha256 ctx;
+	uint8_t *buf = malloc(HASH_CHUNK);
+	int fd = open(path, O_RDONLY);
+	int error = 0;
+
+	if (!buf || fd < 0) {
+		error = buf ? errno : ENOMEM;
+		free(buf);
+		if (fd >= 0)
+			close(fd);
+		return error;
 	}
+	if (drop)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	wrp_sha256_init(&ctx);
+	for (;;) {
+		ssize_t n = read(fd, buf, HASH_CHUNK);
 
-	fclose(oldptr);
-	fclose(newptr);
-	remove(oldpath);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			error = errno;
+			break;
+		}
+		if (n == 0)
+			break;
+		wrp_sha256_update(&ctx, buf, n);
+	}
+	wrp_sha256_final(&ctx, digest);
+	close(fd);
+	free(buf);
+	return error;
+}
 
+/* Read a synced copy back and compare it with its source; large files were not hashed by the pool */
+static int verify_job(struct job *j)
+{
+	uint8_t copy[WRP_SHA256_LEN];
+	int error;
+
+	if (!j->hashed && (error = hash_file(j->src, 0, j->digest)) != 0) {
+		printf("cannot verify %s: %s\n", j->src, strerror(error));
+		return -1;
+	}
+	if ((error = hash_file(j->dst, 1, copy)) != 0) {
+		printf("cannot verify %s: %s\n", j->dst, strerror(error));
+		return -1;
+	}
+	if (memcmp(copy, j->digest, sizeof(copy))) {
+		printf("%s differs from %s\n", j->dst, j->src);
+		return -1;
+	}
 	return 0;
 }
 
+static int write_job(struct job *j, struct progress *total, const struct copy_opts *opts)
+{
+	struct copy_opts quiet = *opts;
+	struct progress p;
+	int in_fd, out_fd;
+	int r = 0;
+
+	if (j->is_dir) {
+		if (mkdir(j->dst, j->mode | S_IRWXU) < 0 && errno != EEXIST)
+			return -1;
+		return 0;
+	}
+	if (j->link)
+		return symlink(j->link, j->dst);
+
+	out_fd = open(j->dst, O_WRONLY | O_CREAT | O_EXCL, j->mode);
+	if (out_fd < 0)
+		return -1;
+
+	if (j->data) {
+		r = write_all(out_fd, j->data, j->size);
+	} else {
+		/* Large file: stream it with the single-file engine, inline in job order */
+		quiet.progress = 0;
+		in_fd = open(j->src, O_RDONLY);
+		if (in_fd < 0)
+			r = -1;
+		else {
+			r = copy_fd(in_fd, out_fd, j->size, &p, &quiet);
+			close(in_fd);
+		}
+	}
+
+	if (close(out_fd) < 0)
+		r = -1;
+	if (r == 0)
+		progress_update(total, opts, j->size, 0);
+	return r;
+}
+
+static int add_source(struct job_list *l, const char *src, const char *dst_dir)
+{
+	char *copy = strdup(src);
+	char *base;
+	char *target;
+	size_t first = l->count;
+	int r;
+
+	if (!copy)
+		return -1;
+	/* basename() ignores trailing slashes, nftw() would keep them */
+	for (size_t n = strlen(copy); n > 1 && copy[n - 1] == '/'; n--)
+		copy[n - 1] = '\0';
+	src = copy;
+	base = basename(strdupa(copy));
+	target = malloc(strlen(dst_dir) + strlen(base) + 2);
+	if (!target) {
+		free(copy);
+		return -1;
+	}
+	sprintf(target, "%s/%s", dst_dir, base);
+
+	if (access(target, F_OK) == 0) {
+		printf("%s already exists\n", target);
+		r = -1;
+	} else if (mv_simple(src, target) == 0) {
+		/* Same filesystem: renamed in place, nothing to copy */
+		r = 0;
+	} else if (errno != EXDEV) {
+		printf("cannot move %s: %s\n", src, strerror(errno));
+		r = -1;
+	} else {
+		walk_list = l;
+		l->dst_root = target;
+		/* nftw passes paths that start with the source path itself */
+		l->src_root_len = strlen(src);
+		r = nftw(src, walk_add, 64, FTW_PHYS);
+		l->dst_root = NULL;
+		if (r != 0) {
+			/* none of this source is moved, rather than part of it */
+			while (l->count > first) {
+				struct job *j = &l->jobs[--l->count];
+
+				free(j->src);
+				free(j->dst);
+				free(j->link);
+			}
+			printf("cannot move %s\n", src);
+			r = -1;
+		}
+	}
+
+	free(target);
+	free(copy);
+	return r;
+}
+
+int mv_tree(char **sources, int nsources, const char *dst_dir, const struct copy_opts *opts)
+{
+	struct job_list list;
+	struct progress total;
+	struct pool pl;
+	pthread_t *workers;
+	long nworkers;
+	struct stat st;
+	int failed = 0;
+	int synced = 0;
+	int dst_fd;
+
+	if (stat(dst_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		printf("%s is not a directory\n", dst_dir);
+		return 1;
+	}
+
+	memset(&list, 0, sizeof(list));
+	for (int i = 0; i < nsources; i++) {
+		if (add_source(&list, sources[i], dst_dir) < 0)
+			failed = 1;
+	}
+	if (list.count == 0)
+		return failed;
+
+	qsort(list.jobs, list.count, sizeof(*list.jobs), job_cmp);
+
+	memset(&total, 0, sizeof(total));
+	for (size_t i = 0; i < list.count; i++)
+		total.total += list.jobs[i].is_dir ? 0 : list.jobs[i].size;
+	total.start = total.last = now();
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	memset(&pl, 0, sizeof(pl));
+	pl.list = &list;
+	pl.verify = opts->verify;
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.cond, NULL);
+	for (long i = 0; i < nworkers; i++)
+		pthread_create(&workers[i], NULL, pool_worker, &pl);
+
+	for (size_t i = 0; i < list.count; i++) {
+		struct job *j = &list.jobs[i];
+
+		pthread_mutex_lock(&pl.lock);
+		pl.next_write = i;
+		pthread_cond_broadcast(&pl.cond);
+		while (!j->ready)
+			pthread_cond_wait(&pl.cond, &pl.lock);
+		pthread_mutex_unlock(&pl.lock);
+
+		if (j->error || write_job(j, &total, opts) < 0) {
+			printf("cannot move %s: %s\n", j->src, strerror(j->error ? j->error : errno));
+			j->error = 1;
+			failed = 1;
+		}
+
+		if (j->data) {
+			free(j->data);
+			j->data = NULL;
+			pthread_mutex_lock(&pl.lock);
+			pl.inflight -= j->size;
+			pthread_cond_broadcast(&pl.cond);
+			pthread_mutex_unlock(&pl.lock);
+		}
+	}
+
+	for (long i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	progress_update(&total, opts, 0, 1);
+
+	/* One flush for the whole batch instead of one fsync per file */
+	dst_fd = open(dst_dir, O_RDONLY | O_DIRECTORY);
+	if (dst_fd >= 0 && syncfs(dst_fd) == 0)
+		synced = 1;
+	else {
+		printf("cannot sync %s: %s\n", dst_dir, strerror(errno));
+		failed = 1;
+	}
+	if (dst_fd >= 0)
+		close(dst_fd);
+
+	if (synced && opts->verify) {
+		for (size_t i = 0; i < list.count; i++) {
+			struct job *j = &list.jobs[i];
+
+			if (!j->error && !j->is_dir && !j->link && verify_job(j) < 0) {
+				j->error = 1;
+				failed = 1;
+			}
+		}
+	}
+
+	/* Remove sources children-first; keep anything that did not make it across */
+	for (size_t i = list.count; i-- > 0; ) {
+		struct job *j = &list.jobs[i];
+
+		if (synced && !j->error) {
+			if ((j->is_dir ? rmdir(j->src) : unlink(j->src)) < 0 && !failed)
+				printf("copied, but cannot remove %s: %s\n", j->src, strerror(errno));
+		}
+		free(j->src);
+		free(j->dst);
+		free(j->link);
+	}
+	free(list.jobs);
+	pthread_mutex_destroy(&pl.lock);
+	pthread_cond_destroy(&pl.cond);
+
+	return failed;
+}
+
 int main (int argc, char **argv)
 {
-	if (argc != 3) {
-		printf("usage: wrp_mv /path/to/file/source /path/to/file/destination\n");
+	struct copy_opts opts = { 0 };
+	int c;
+
+	while ((c = getopt(argc, argv, "pdrv")) != -1) {
+		switch (c) {
+		case 'r':
+			opts.recursive = 1;
+			break;
+		case 'p':
+			opts.progress = 1;
+			break;
+		case 'd':
+			opts.direct = 1;
+			break;
+		case 'v':
+			opts.verify = 1;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+
+	if (argc - optind < 2 || (argc - optind > 2 && !opts.recursive) || (opts.verify && !opts.recursive)) {
+		printf("usage: wrp_mv [-p] [-d] /path/to/file/source /path/to/file/destination\n");
+		printf("       wrp_mv -r [-p] [-d] [-v] source... /path/to/directory\n");
+		printf("  -p  report progress and throughput\n");
+		printf("  -d  write with O_DIRECT when a copy is needed\n");
+		printf("  -r  move files and directory trees into an existing directory\n");
+		printf("  -v  with -r, read every copy back and compare its SHA-256 before removing the sources\n");
 		return 0;
 	}
 
-	if (mv(argv[1], argv[2]) == 0) {
-		printf("moved %s to %s\n", argv[1], argv[2]);
+	if (opts.recursive) {
+		if (mv_tree(argv + optind, argc - optind - 1, argv[argc - 1], &opts) == 0)
+			printf("moved %d item(s) to %s\n", argc - optind - 1, argv[argc - 1]);
+		else
+			printf("failed to move\n");
+	} else if (mv(argv[optind], argv[optind + 1], &opts) == 0) {
+		printf("moved %s to %s\n", argv[optind], argv[optind + 1]);
 	} else {
 		printf("failed to move\n");
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
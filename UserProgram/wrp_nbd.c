@@ -0,0 +1,962 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/nbd.h>
+
+#include "wrp_bot.h"
+#include "wrp_fake.h"
+
+/*
+ * Userspace NBD server for the WRP device. The device is driven over the
+ * Bulk-Only transport with libusb (or a file-backed fake of it), so the
+ * kernel usb-storage driver never owns it, yet the host can still mount
+ * it through /dev/nbdX:
+ *
+ *   wrp_nbd [-f image [-l us] [-r bytes_per_ms]] [-p port] [-c cache_mib] [-w workers]
+ *   nbd-client localhost 10809 /dev/nbd0
+ *
+ * Requests are handled by a pool of workers against a write-back block
+ * cache. Bulk-Only allows one command in flight, so device access is
+ * serialized; the cache turns many small NBD requests into few large
+ * READ(10)/WRITE(10) commands: misses fetch whole lines, sequential reads
+ * trigger read-ahead, and dirty sectors are flushed in LBA order with
+ * adjacent runs merged into one command.
+ */
+
+#define DEFAULT_PORT        10809
+#define DEFAULT_CACHE_MIB   16
+#define DEFAULT_WORKERS     4
+
+/* Cache line: 128 sectors (64 KiB) */
+#define LINE_SHIFT          7
+#define LINE_BLOCKS         (1 << LINE_SHIFT)
+#define LINE_BYTES          (LINE_BLOCKS * WRP_BLOCK_SIZE)
+#define LINE_WORDS          (LINE_BLOCKS / 64)
+
+/* Largest single WRITE(10) issued by the flusher, in lines */
+#define FLUSH_MAX_LINES     8
+
+/* Lines prefetched ahead of a sequential reader */
+#define READ_AHEAD_LINES    4
+
+/* Background flush starts once this fraction of lines is dirty, or after FLUSH_PERIOD_MS */
+#define DIRTY_HIGH_PCT      50
+#define FLUSH_PERIOD_MS     1000
+
+/* Handshake constants (NBD protocol, fixed newstyle) */
+#define NBD_INIT_MAGIC      0x4e42444d41474943ull
+#define NBD_OPTS_MAGIC      0x49484156454F5054ull
+#define NBD_REP_MAGIC       0x0003e889045565a9ull
+#define NBD_FLAG_FIXED_NEWSTYLE 1
+#define NBD_FLAG_NO_ZEROES  2
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT       2
+#define NBD_OPT_INFO        6
+#define NBD_OPT_GO          7
+#define NBD_REP_ACK         1
+#define NBD_REP_INFO        3
+#define NBD_REP_ERR_UNSUP   0x80000001u
+#define NBD_INFO_EXPORT     0
+
+struct line {
+	uint64_t tag;
+	int valid;
+	int busy;
+	uint64_t lru;
+	uint64_t present[LINE_WORDS];
+	uint64_t dirty[LINE_WORDS];
+	uint8_t *data;
+	struct line *hash_next;
+};
+
+struct cache {
+	struct line *lines;
+	struct line **hash;
+	size_t nlines;
+	size_t nhash;
+	size_t ndirty;
+	uint64_t clock;
+	uint64_t dev_blocks;
+	uint64_t next_seq;
+	uint64_t ra_from;
+	uint64_t ra_to;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t background;
+
+	/* One Bulk-Only command at a time */
+	pthread_mutex_t dev_lock;
+
+	/* Owner of the staging buffer */
+	pthread_mutex_t flush_lock;
+	int (*command)(void *dev, const uint8_t *cdb, uint8_t cdb_len, int direction,
+		void *data, uint32_t data_len);
+	void *dev;
+	uint8_t *staging;
+
+	uint64_t hits, misses, prefetches, flush_cmds, flushed_blocks;
+};
+
+struct request {
+	uint16_t type;
+	uint16_t flags;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t length;
+	uint8_t *data;
+	struct request *next;
+};
+
+struct server {
+	int sock;
+	struct cache *cache;
+	pthread_mutex_t send_lock;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	struct request *head;
+	struct request *tail;
+	int closing;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int bit_test(const uint64_t *map, unsigned int i)
+{
+	return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static void bit_set_range(uint64_t *map, unsigned int from, unsigned int count)
+{
+	for (unsigned int i = from; i < from + count; i++)
+		map[i / 64] |= 1ull << (i % 64);
+}
+
+static int map_full(const uint64_t *map, unsigned int from, unsigned int count)
+{
+	for (unsigned int i = from; i < from + count; i++)
+		if (!bit_test(map, i))
+			return 0;
+	return 1;
+}
+
+static int map_any(const uint64_t *map)
+{
+	for (int i = 0; i < LINE_WORDS; i++)
+		if (map[i])
+			return 1;
+	return 0;
+}
+
+/* --- device access ------------------------------------------------------ */
+
+static int dev_rw(struct cache *c, int write, uint64_t lba, uint32_t blocks, void *buf)
+{
+	uint8_t cdb[10];
+	int r;
+
+	wrp_build_rw10(cdb, write ? SCSI_CMD_WRITE_10 : SCSI_CMD_READ_10, (uint32_t)lba, blocks);
+	pthread_mutex_lock(&c->dev_lock);
+	r = c->command(c->dev, cdb, sizeof(cdb), write ? WRP_BOT_DIR_OUT : WRP_BOT_DIR_IN,
+		buf, blocks * WRP_BLOCK_SIZE);
+	pthread_mutex_unlock(&c->dev_lock);
+	return r == (int)(blocks * WRP_BLOCK_SIZE) ? 0 : -1;
+}
+
+static int bot_command(void *dev, const uint8_t *cdb, uint8_t cdb_len, int direction,
+	void *data, uint32_t data_len)
+{
+	return wrp_bot_command(dev, cdb, cdb_len, direction, data, data_len);
+}
+
+static int fake_command(void *dev, const uint8_t *cdb, uint8_t cdb_len, int direction,
+	void *data, uint32_t data_len)
+{
+	return wrp_fake_command(dev, cdb, cdb_len, direction, data, data_len);
+}
+
+/* --- cache -------------------------------------------------------------- */
+
+static size_t hash_of(struct cache *c, uint64_t tag)
+{
+	return (tag * 0x9E3779B97F4A7C15ull >> 32) % c->nhash;
+}
+
+static struct line *cache_find(struct cache *c, uint64_t tag)
+{
+	for (struct line *l = c->hash[hash_of(c, tag)]; l; l = l->hash_next)
+		if (l->tag == tag)
+			return l;
+	return NULL;
+}
+
+static void hash_remove(struct cache *c, struct line *victim)
+{
+	struct line **p = &c->hash[hash_of(c, victim->tag)];
+
+	while (*p != victim)
+		p = &(*p)->hash_next;
+	*p = victim->hash_next;
+}
+
+static uint32_t line_blocks(struct cache *c, uint64_t tag)
+{
+	uint64_t first = tag << LINE_SHIFT;
+
+	return (c->dev_blocks - first < LINE_BLOCKS) ? c->dev_blocks - first : LINE_BLOCKS;
+}
+
+/*
+ * Write the dirty sectors of a set of lines, in LBA order, merging runs
+ * that continue across line boundaries. Lines must be marked busy by the
+ * caller; called without the cache lock.
+ */
+static int flush_lines(struct cache *c, struct line **lines, size_t n)
+{
+	uint64_t run_start = 0;
+	uint32_t run_len = 0;
+	int r = 0;
+
+	for (size_t k = 0; k <= n; k++) {
+		struct line *l = (k < n) ? lines[k] : NULL;
+
+		for (unsigned int i = 0; i < LINE_BLOCKS || !l; i++) {
+			uint64_t lba = l ? (l->tag << LINE_SHIFT) + i : UINT64_MAX;
+			int dirty = l && bit_test(l->dirty, i);
+
+			if (run_len && (!dirty || lba != run_start + run_len ||
+				run_len == FLUSH_MAX_LINES * LINE_BLOCKS)) {
+				if (dev_rw(c, 1, run_start, run_len, c->staging) < 0)
+					r = -1;
+				c->flush_cmds++;
+				c->flushed_blocks += run_len;
+				run_len = 0;
+			}
+			if (!l)
+				break;
+			if (dirty) {
+				if (!run_len)
+					run_start = lba;
+				memcpy(c->staging + (size_t)run_len * WRP_BLOCK_SIZE,
+					l->data + (size_t)i * WRP_BLOCK_SIZE, WRP_BLOCK_SIZE);
+				run_len++;
+			}
+		}
+	}
+	return r;
+}
+
+static int tag_cmp(const void *a, const void *b)
+{
+	uint64_t x = (*(struct line * const *)a)->tag;
+	uint64_t y = (*(struct line * const *)b)->tag;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Flush every dirty line that is not busy. With wait_all, keep going until
+ * lines that were busy (being filled or flushed elsewhere) are clean too,
+ * as NBD_CMD_FLUSH requires: after each flush the lines are scanned again,
+ * and only a scan that finds nothing to flush while lines are still busy
+ * waits. Called and returns with the cache lock held.
+ */
+static int cache_flush_all(struct cache *c, int wait_all)
+{
+	struct line **list = malloc(c->nlines * sizeof(*list));
+	int r = 0;
+
+	if (!list)
+		return -1;
+
+	for (;;) {
+		size_t n = 0;
+		int pending = 0;
+
+		for (size_t i = 0; i < c->nlines; i++) {
+			struct line *l = &c->lines[i];
+
+			if (!l->valid || !map_any(l->dirty))
+				continue;
+			if (l->busy) {
+				pending = 1;
+				continue;
+			}
+			l->busy = 1;
+			list[n++] = l;
+		}
+		if (!n) {
+			/* the lock is held since the scan, so the busy lines' broadcast cannot be missed */
+			if (!wait_all || !pending)
+				break;
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+		qsort(list, n, sizeof(*list), tag_cmp);
+
+		pthread_mutex_unlock(&c->lock);
+		pthread_mutex_lock(&c->flush_lock);
+		r = flush_lines(c, list, n);
+		pthread_mutex_unlock(&c->flush_lock);
+		pthread_mutex_lock(&c->lock);
+
+		for (size_t i = 0; i < n; i++) {
+			if (r == 0) {
+				memset(list[i]->dirty, 0, sizeof(list[i]->dirty));
+				c->ndirty--;
+			}
+			list[i]->busy = 0;
+		}
+		pthread_cond_broadcast(&c->cond);
+
+		if (r < 0 || !wait_all)
+			break;
+	}
+
+	free(list);
+	return r;
+}
+
+/*
+ * Return the line for a tag, allocating (and if needed evicting) one. The
+ * returned line is not busy. NULL if a dirty victim could not be written
+ * back. Called and returns with the cache lock held.
+ */
+static struct line *cache_get(struct cache *c, uint64_t tag)
+{
+	for (;;) {
+		struct line *l = cache_find(c, tag);
+		struct line *victim = NULL;
+
+		if (l) {
+			if (l->busy) {
+				pthread_cond_wait(&c->cond, &c->lock);
+				continue;
+			}
+			l->lru = ++c->clock;
+			return l;
+		}
+
+		for (size_t i = 0; i < c->nlines; i++) {
+			struct line *v = &c->lines[i];
+
+			if (v->busy)
+				continue;
+			if (!v->valid) {
+				victim = v;
+				break;
+			}
+			if (!victim || v->lru < victim->lru)
+				victim = v;
+		}
+		if (!victim) {
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+
+		if (victim->valid && map_any(victim->dirty)) {
+			/* Write back the victim along with every other dirty line, then retry */
+			if (cache_flush_all(c, 0) < 0)
+				return NULL;
+			continue;
+		}
+
+		if (victim->valid)
+			hash_remove(c, victim);
+		victim->tag = tag;
+		victim->valid = 1;
+		victim->lru = ++c->clock;
+		memset(victim->present, 0, sizeof(victim->present));
+		memset(victim->dirty, 0, sizeof(victim->dirty));
+		victim->hash_next = c->hash[hash_of(c, tag)];
+		c->hash[hash_of(c, tag)] = victim;
+		return victim;
+	}
+}
+
+/* Fill the missing sectors of a line from the device. Lock held on entry and exit. */
+static int cache_fill(struct cache *c, struct line *l)
+{
+	uint32_t blocks = line_blocks(c, l->tag);
+	uint8_t *tmp = malloc(LINE_BYTES);
+	int r;
+
+	if (!tmp)
+		return -1;
+	l->busy = 1;
+	pthread_mutex_unlock(&c->lock);
+	r = dev_rw(c, 0, l->tag << LINE_SHIFT, blocks, tmp);
+	pthread_mutex_lock(&c->lock);
+
+	if (r == 0) {
+		/* Sectors written while the line was not present stay as they are */
+		for (unsigned int i = 0; i < blocks; i++) {
+			if (!bit_test(l->present, i))
+				memcpy(l->data + (size_t)i * WRP_BLOCK_SIZE, tmp + (size_t)i * WRP_BLOCK_SIZE,
+					WRP_BLOCK_SIZE);
+		}
+		bit_set_range(l->present, 0, blocks);
+	}
+	l->busy = 0;
+	pthread_cond_broadcast(&c->cond);
+	free(tmp);
+	return r;
+}
+
+static int cache_read(struct cache *c, uint64_t lba, uint32_t blocks, uint8_t *buf)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&c->lock);
+
+	/* Sequential stream: queue read-ahead for the background thread */
+	if (lba == c->next_seq) {
+		uint64_t last = (lba + blocks - 1) >> LINE_SHIFT;
+		uint64_t limit = (c->dev_blocks - 1) >> LINE_SHIFT;
+
+		c->ra_from = last + 1;
+		c->ra_to = (last + READ_AHEAD_LINES < limit) ? last + READ_AHEAD_LINES : limit;
+		pthread_cond_signal(&c->background);
+	}
+	c->next_seq = lba + blocks;
+
+	while (blocks && r == 0) {
+		uint64_t tag = lba >> LINE_SHIFT;
+		unsigned int off = lba & (LINE_BLOCKS - 1);
+		unsigned int n = (blocks < LINE_BLOCKS - off) ? blocks : LINE_BLOCKS - off;
+		struct line *l = cache_get(c, tag);
+
+		if (!l) {
+			r = -1;
+			break;
+		}
+		if (map_full(l->present, off, n)) {
+			c->hits++;
+		} else {
+			c->misses++;
+			r = cache_fill(c, l);
+			if (r < 0)
+				break;
+			/* The line may have been evicted while the lock was dropped */
+			continue;
+		}
+
+		memcpy(buf, l->data + (size_t)off * WRP_BLOCK_SIZE, (size_t)n * WRP_BLOCK_SIZE);
+		buf += (size_t)n * WRP_BLOCK_SIZE;
+		lba += n;
+		blocks -= n;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	return r;
+}
+
+static int cache_write(struct cache *c, uint64_t lba, uint32_t blocks, const uint8_t *buf)
+{
+	pthread_mutex_lock(&c->lock);
+
+	while (blocks) {
+		uint64_t tag = lba >> LINE_SHIFT;
+		unsigned int off = lba & (LINE_BLOCKS - 1);
+		unsigned int n = (blocks < LINE_BLOCKS - off) ? blocks : LINE_BLOCKS - off;
+		struct line *l = cache_get(c, tag);
+
+		if (!l) {
+			pthread_mutex_unlock(&c->lock);
+			return -1;
+		}
+		if (!map_any(l->dirty))
+			c->ndirty++;
+		memcpy(l->data + (size_t)off * WRP_BLOCK_SIZE, buf, (size_t)n * WRP_BLOCK_SIZE);
+		bit_set_range(l->present, off, n);
+		bit_set_range(l->dirty, off, n);
+
+		buf += (size_t)n * WRP_BLOCK_SIZE;
+		lba += n;
+		blocks -= n;
+	}
+
+	if (c->ndirty * 100 > c->nlines * DIRTY_HIGH_PCT)
+		pthread_cond_signal(&c->background);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+static int cache_flush(struct cache *c)
+{
+	int r;
+
+	pthread_mutex_lock(&c->lock);
+	r = cache_flush_all(c, 1);
+	pthread_mutex_unlock(&c->lock);
+	return r;
+}
+
+/* Background thread: write-back on a timer or high watermark, and read-ahead */
+static void *cache_background(void *arg)
+{
+	struct cache *c = arg;
+	uint64_t last_flush = now_ms();
+
+	pthread_mutex_lock(&c->lock);
+	while (!c->stop) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100 * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		/*
+		 * Past the high watermark the dirty lines may all be busy
+		 * flushing elsewhere, which then needs the lock, so this waits
+		 * too; writers signal it as soon as more lines turn dirty
+		 */
+		if (c->ra_from > c->ra_to)
+			pthread_cond_timedwait(&c->background, &c->lock, &ts);
+
+		while (c->ra_from <= c->ra_to && !c->stop) {
+			uint64_t tag = c->ra_from++;
+			struct line *l = cache_find(c, tag);
+
+			if (l && (l->busy || map_full(l->present, 0, line_blocks(c, tag))))
+				continue;
+			/* the read-ahead is dropped if a victim cannot be written back */
+			if (!(l = cache_get(c, tag))) {
+				c->ra_from = c->ra_to + 1;
+				break;
+			}
+			c->prefetches++;
+			cache_fill(c, l);
+		}
+
+		if (c->ndirty && (c->ndirty * 100 > c->nlines * DIRTY_HIGH_PCT ||
+			now_ms() - last_flush >= FLUSH_PERIOD_MS)) {
+			cache_flush_all(c, 0);
+			last_flush = now_ms();
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+static int cache_init(struct cache *c, size_t cache_mib, uint64_t dev_blocks)
+{
+	memset(c, 0, sizeof(*c));
+	c->nlines = cache_mib * (1 << 20) / LINE_BYTES;
+	if (c->nlines < READ_AHEAD_LINES * 2)
+		c->nlines = READ_AHEAD_LINES * 2;
+	c->nhash = c->nlines * 2;
+	c->dev_blocks = dev_blocks;
+	c->ra_from = 1;
+	c->ra_to = 0;
+
+	c->lines = calloc(c->nlines, sizeof(*c->lines));
+	c->hash = calloc(c->nhash, sizeof(*c->hash));
+	c->staging = malloc((size_t)FLUSH_MAX_LINES * LINE_BYTES);
+	if (!c->lines || !c->hash || !c->staging)
+		return -1;
+	for (size_t i = 0; i < c->nlines; i++) {
+		c->lines[i].data = malloc(LINE_BYTES);
+		if (!c->lines[i].data)
+			return -1;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_mutex_init(&c->dev_lock, NULL);
+	pthread_mutex_init(&c->flush_lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_cond_init(&c->background, NULL);
+	return 0;
+}
+
+/* --- NBD protocol ------------------------------------------------------- */
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_option_reply(int fd, uint32_t option, uint32_t type, const void *data, uint32_t len)
+{
+	struct __attribute__((packed)) {
+		uint64_t magic;
+		uint32_t option;
+		uint32_t type;
+		uint32_t length;
+	} rep = { htobe64(NBD_REP_MAGIC), htobe32(option), htobe32(type), htobe32(len) };
+
+	if (write_full(fd, &rep, sizeof(rep)) < 0)
+		return -1;
+	return len ? write_full(fd, data, len) : 0;
+}
+
+static uint16_t transmission_flags(void)
+{
+	return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA;
+}
+
+/* Fixed newstyle negotiation; returns 0 once the client enters transmission */
+static int negotiate(int fd, uint64_t size)
+{
+	struct __attribute__((packed)) {
+		uint64_t init;
+		uint64_t opts;
+		uint16_t flags;
+	} hello = { htobe64(NBD_INIT_MAGIC), htobe64(NBD_OPTS_MAGIC),
+		htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES) };
+	uint32_t client_flags;
+
+	if (write_full(fd, &hello, sizeof(hello)) < 0 || read_full(fd, &client_flags, 4) < 0)
+		return -1;
+	client_flags = be32toh(client_flags);
+
+	for (;;) {
+		struct __attribute__((packed)) {
+			uint64_t magic;
+			uint32_t option;
+			uint32_t length;
+		} opt;
+		uint8_t zeroes[124] = { 0 };
+		uint8_t *payload = NULL;
+
+		if (read_full(fd, &opt, sizeof(opt)) < 0 || be64toh(opt.magic) != NBD_OPTS_MAGIC)
+			return -1;
+		opt.option = be32toh(opt.option);
+		opt.length = be32toh(opt.length);
+		if (opt.length > 4096)
+			return -1;
+		if (opt.length) {
+			payload = malloc(opt.length);
+			if (!payload || read_full(fd, payload, opt.length) < 0) {
+				free(payload);
+				return -1;
+			}
+		}
+		free(payload);
+
+		switch (opt.option) {
+		case NBD_OPT_EXPORT_NAME: {
+			struct __attribute__((packed)) {
+				uint64_t size;
+				uint16_t flags;
+			} reply = { htobe64(size), htobe16(transmission_flags()) };
+
+			if (write_full(fd, &reply, sizeof(reply)) < 0)
+				return -1;
+			if (!(client_flags & NBD_FLAG_NO_ZEROES) && write_full(fd, zeroes, sizeof(zeroes)) < 0)
+				return -1;
+			return 0;
+		}
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO: {
+			struct __attribute__((packed)) {
+				uint16_t type;
+				uint64_t size;
+				uint16_t flags;
+			} info = { htobe16(NBD_INFO_EXPORT), htobe64(size), htobe16(transmission_flags()) };
+
+			if (send_option_reply(fd, opt.option, NBD_REP_INFO, &info, sizeof(info)) < 0 ||
+				send_option_reply(fd, opt.option, NBD_REP_ACK, NULL, 0) < 0)
+				return -1;
+			if (opt.option == NBD_OPT_GO)
+				return 0;
+			break;
+		}
+		case NBD_OPT_ABORT:
+			send_option_reply(fd, opt.option, NBD_REP_ACK, NULL, 0);
+			return -1;
+		default:
+			if (send_option_reply(fd, opt.option, NBD_REP_ERR_UNSUP, NULL, 0) < 0)
+				return -1;
+			break;
+		}
+	}
+}
+
+static void send_reply(struct server *s, uint64_t handle, uint32_t error, const void *data, uint32_t len)
+{
+	struct nbd_reply reply;
+
+	reply.magic = htobe32(NBD_REPLY_MAGIC);
+	reply.error = htobe32(error);
+	memcpy(reply.handle, &handle, sizeof(reply.handle));
+
+	pthread_mutex_lock(&s->send_lock);
+	if (write_full(s->sock, &reply, sizeof(reply)) == 0 && data && !error)
+		write_full(s->sock, data, len);
+	pthread_mutex_unlock(&s->send_lock);
+}
+
+static void handle_request(struct server *s, struct request *rq)
+{
+	struct cache *c = s->cache;
+	uint64_t lba = rq->offset / WRP_BLOCK_SIZE;
+	uint32_t blocks = rq->length / WRP_BLOCK_SIZE;
+	uint32_t error = 0;
+
+	if ((rq->type == NBD_CMD_READ || rq->type == NBD_CMD_WRITE) &&
+		((rq->offset | rq->length) % WRP_BLOCK_SIZE || lba + blocks > c->dev_blocks)) {
+		send_reply(s, rq->handle, EINVAL, NULL, 0);
+		return;
+	}
+
+	switch (rq->type) {
+	case NBD_CMD_READ:
+		if (cache_read(c, lba, blocks, rq->data) < 0)
+			error = EIO;
+		send_reply(s, rq->handle, error, rq->data, rq->length);
+		return;
+	case NBD_CMD_WRITE:
+		if (cache_write(c, lba, blocks, rq->data) < 0)
+			error = EIO;
+		else if ((rq->flags & (NBD_CMD_FLAG_FUA >> 16)) && cache_flush(c) < 0)
+			error = EIO;
+		break;
+	case NBD_CMD_FLUSH:
+		if (cache_flush(c) < 0)
+			error = EIO;
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+	send_reply(s, rq->handle, error, NULL, 0);
+}
+
+static void *request_worker(void *arg)
+{
+	struct server *s = arg;
+
+	for (;;) {
+		struct request *rq;
+
+		pthread_mutex_lock(&s->queue_lock);
+		while (!s->head && !s->closing)
+			pthread_cond_wait(&s->queue_cond, &s->queue_lock);
+		rq = s->head;
+		if (rq) {
+			s->head = rq->next;
+			if (!s->head)
+				s->tail = NULL;
+		}
+		pthread_mutex_unlock(&s->queue_lock);
+		if (!rq)
+			return NULL;
+
+		handle_request(s, rq);
+		free(rq->data);
+		free(rq);
+	}
+}
+
+/* Receive requests and hand them to the workers until the client disconnects */
+static void serve(struct server *s, int nworkers)
+{
+	pthread_t *workers = calloc(nworkers, sizeof(*workers));
+
+	if (!workers)
+		return;
+	for (int i = 0; i < nworkers; i++)
+		pthread_create(&workers[i], NULL, request_worker, s);
+
+	for (;;) {
+		struct nbd_request req;
+		struct request *rq;
+
+		if (read_full(s->sock, &req, sizeof(req)) < 0 || be32toh(req.magic) != NBD_REQUEST_MAGIC)
+			break;
+
+		rq = calloc(1, sizeof(*rq));
+		if (!rq)
+			break;
+		rq->flags = be32toh(req.type) >> 16;
+		rq->type = be32toh(req.type) & 0xFFFF;
+		memcpy(&rq->handle, req.handle, sizeof(rq->handle));
+		rq->offset = be64toh(req.from);
+		rq->length = be32toh(req.len);
+
+		if (rq->type == NBD_CMD_DISC) {
+			free(rq);
+			break;
+		}
+		if ((rq->type == NBD_CMD_READ || rq->type == NBD_CMD_WRITE) && rq->length > (32 << 20)) {
+			free(rq);
+			break;
+		}
+		if (rq->type == NBD_CMD_READ || rq->type == NBD_CMD_WRITE) {
+			rq->data = malloc(rq->length ? rq->length : 1);
+			if (!rq->data) {
+				free(rq);
+				break;
+			}
+		}
+		/* Write payloads follow the header on the socket, so they are read here */
+		if (rq->type == NBD_CMD_WRITE && read_full(s->sock, rq->data, rq->length) < 0) {
+			free(rq->data);
+			free(rq);
+			break;
+		}
+
+		pthread_mutex_lock(&s->queue_lock);
+		if (s->tail)
+			s->tail->next = rq;
+		else
+			s->head = rq;
+		s->tail = rq;
+		pthread_cond_signal(&s->queue_cond);
+		pthread_mutex_unlock(&s->queue_lock);
+	}
+
+	pthread_mutex_lock(&s->queue_lock);
+	s->closing = 1;
+	pthread_cond_broadcast(&s->queue_cond);
+	pthread_mutex_unlock(&s->queue_lock);
+	for (int i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+}
+
+int main (int argc, char **argv)
+{
+	struct wrp_bot_dev bot;
+	struct wrp_fake_dev fake;
+	struct cache cache;
+	struct server s;
+	struct sockaddr_in addr;
+	pthread_t background;
+	const char *image = NULL;
+	int port = DEFAULT_PORT;
+	int cache_mib = DEFAULT_CACHE_MIB;
+	int nworkers = DEFAULT_WORKERS;
+	int fake_us = -1;
+	int fake_rate = -1;
+	uint32_t blocks;
+	int listen_fd;
+	int one = 1;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:l:r:p:c:w:h")) != -1) {
+		switch (c) {
+		case 'f': image = optarg; break;
+		case 'l': fake_us = atoi(optarg); break;
+		case 'r': fake_rate = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		case 'c': cache_mib = atoi(optarg); break;
+		case 'w': nworkers = atoi(optarg); break;
+		default:
+			printf("usage: wrp_nbd [-f image [-l us] [-r bytes_per_ms]] [-p port] [-c cache_mib] [-w workers]\n");
+			printf("  -f image  serve a file through the fake Bulk-Only device instead of USB\n");
+			printf("  -l us     fake device: time per command\n");
+			printf("  -r rate   fake device: payload bytes per millisecond, 0 for unlimited\n");
+			return 0;
+		}
+	}
+	if (cache_mib < 1 || nworkers < 1)
+		return 1;
+
+	if (image) {
+		if (wrp_fake_open(&fake, image) < 0)
+			return 1;
+		if (fake_us >= 0)
+			fake.command_us = fake_us;
+		if (fake_rate >= 0)
+			fake.bytes_per_ms = fake_rate;
+		blocks = fake.blocks;
+	} else {
+		if (wrp_bot_open(&bot, LUFA_VENDOR_ID, LUFA_PRODUCT_ID) < 0)
+			return 1;
+		if (wrp_bot_read_capacity(&bot, &blocks) < 0) {
+			wrp_bot_close(&bot);
+			return 1;
+		}
+	}
+
+	if (cache_init(&cache, cache_mib, blocks) < 0) {
+		fprintf(stderr, "cannot allocate the cache\n");
+		return 1;
+	}
+	cache.command = image ? fake_command : bot_command;
+	cache.dev = image ? (void *)&fake : (void *)&bot;
+	pthread_create(&background, NULL, cache_background, &cache);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0) {
+		fprintf(stderr, "cannot listen on port %d: %s\n", port, strerror(errno));
+		return 1;
+	}
+	printf("serving %u blocks on localhost:%d\n", blocks, port);
+
+	/* One client at a time: a block device must not have two writers */
+	for (;;) {
+		memset(&s, 0, sizeof(s));
+		s.cache = &cache;
+		s.sock = accept(listen_fd, NULL, NULL);
+		if (s.sock < 0)
+			continue;
+		setsockopt(s.sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		pthread_mutex_init(&s.send_lock, NULL);
+		pthread_mutex_init(&s.queue_lock, NULL);
+		pthread_cond_init(&s.queue_cond, NULL);
+
+		if (negotiate(s.sock, (uint64_t)blocks * WRP_BLOCK_SIZE) == 0)
+			serve(&s, nworkers);
+		close(s.sock);
+
+		cache_flush(&cache);
+		printf("client gone: %llu hits, %llu misses, %llu prefetches, %llu blocks in %llu writes\n",
+			(unsigned long long)cache.hits, (unsigned long long)cache.misses,
+			(unsigned long long)cache.prefetches, (unsigned long long)cache.flushed_blocks,
+			(unsigned long long)cache.flush_cmds);
+	}
+}
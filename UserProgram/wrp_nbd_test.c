@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+ * Drives wrp_nbd over a fake device with a small cache and several
+ * workers, the way a busy client does: batches of writes, reads, FUA
+ * writes and flushes in flight together, so flushes run while other
+ * workers fill and flush lines. Every read is checked against a model of
+ * the image, and so is the image file once the server has flushed it. A
+ * request that gets no reply for REPLY_TIMEOUT_MS fails the test, as a
+ * flush stuck waiting for lines would.
+ *
+ *   wrp_nbd_test [-s seed] [-n batches] ./wrp_nbd
+ */
+
+#define TEST_PORT           10899
+#define TEST_BLOCKS         8192
+#define BLOCK_SIZE          512
+#define BATCH_MAX           8
+#define REPLY_TIMEOUT_MS    10000
+
+#define NBD_INIT_MAGIC      0x4e42444d41474943ull
+#define NBD_OPTS_MAGIC      0x49484156454F5054ull
+#define NBD_REQUEST_MAGIC   0x25609513
+#define NBD_REPLY_MAGIC     0x67446698
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_CMD_READ        0
+#define NBD_CMD_WRITE       1
+#define NBD_CMD_DISC        2
+#define NBD_CMD_FLUSH       3
+#define NBD_CMD_FLAG_FUA    1
+
+struct pending {
+	uint64_t handle;
+	int type;
+	uint64_t lba;
+	uint32_t blocks;
+};
+
+static uint8_t *model;
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		ssize_t n;
+
+		if (poll(&pfd, 1, REPLY_TIMEOUT_MS) == 0) {
+			fprintf(stderr, "no reply from the server in %d ms\n", REPLY_TIMEOUT_MS);
+			return -1;
+		}
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_request(int fd, int type, uint16_t flags, uint64_t handle, uint64_t lba, uint32_t blocks)
+{
+	struct __attribute__((packed)) {
+		uint32_t magic;
+		uint16_t flags;
+		uint16_t type;
+		uint64_t handle;
+		uint64_t from;
+		uint32_t len;
+	} rq = { htobe32(NBD_REQUEST_MAGIC), htobe16(flags), htobe16(type), handle,
+		htobe64(lba * BLOCK_SIZE), htobe32(blocks * BLOCK_SIZE) };
+
+	if (write_full(fd, &rq, sizeof(rq)) < 0)
+		return -1;
+	if (type == NBD_CMD_WRITE)
+		return write_full(fd, model + lba * BLOCK_SIZE, (size_t)blocks * BLOCK_SIZE);
+	return 0;
+}
+
+static int connect_server(void)
+{
+	struct sockaddr_in addr;
+	struct __attribute__((packed)) {
+		uint64_t init;
+		uint64_t opts;
+		uint16_t flags;
+	} hello;
+	struct __attribute__((packed)) {
+		uint64_t size;
+		uint16_t flags;
+	} export;
+	struct __attribute__((packed)) {
+		uint32_t client_flags;
+		uint64_t magic;
+		uint32_t option;
+		uint32_t length;
+	} opt = { htobe32(3), htobe64(NBD_OPTS_MAGIC), htobe32(NBD_OPT_EXPORT_NAME), 0 };
+	int one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(TEST_PORT);
+
+	/* the server needs a moment to start listening */
+	for (int tries = 0; tries < 50; tries++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			if (read_full(fd, &hello, sizeof(hello)) < 0 || be64toh(hello.init) != NBD_INIT_MAGIC ||
+				write_full(fd, &opt, sizeof(opt)) < 0 || read_full(fd, &export, sizeof(export)) < 0) {
+				close(fd);
+				return -1;
+			}
+			if (be64toh(export.size) != (uint64_t)TEST_BLOCKS * BLOCK_SIZE) {
+				fprintf(stderr, "export is %llu bytes\n", (unsigned long long)be64toh(export.size));
+				close(fd);
+				return -1;
+			}
+			return fd;
+		}
+		close(fd);
+		usleep(100000);
+	}
+	fprintf(stderr, "cannot connect to the server\n");
+	return -1;
+}
+
+/* reads the replies of a batch in whatever order they come and checks them */
+static int reap(int fd, struct pending *batch, int n)
+{
+	static uint8_t data[256 * BLOCK_SIZE];
+	int errors = 0;
+
+	while (n) {
+		struct __attribute__((packed)) {
+			uint32_t magic;
+			uint32_t error;
+			uint64_t handle;
+		} reply;
+		int i;
+
+		if (read_full(fd, &reply, sizeof(reply)) < 0 || be32toh(reply.magic) != NBD_REPLY_MAGIC)
+			return -1;
+		for (i = 0; i < n && batch[i].handle != reply.handle; i++)
+			;
+		if (i == n) {
+			fprintf(stderr, "reply to a request not sent\n");
+			return -1;
+		}
+		if (reply.error) {
+			fprintf(stderr, "request failed: %u\n", be32toh(reply.error));
+			errors++;
+		} else if (batch[i].type == NBD_CMD_READ) {
+			size_t len = (size_t)batch[i].blocks * BLOCK_SIZE;
+
+			if (read_full(fd, data, len) < 0)
+				return -1;
+			if (memcmp(data, model + batch[i].lba * BLOCK_SIZE, len)) {
+				fprintf(stderr, "read of %u blocks at %llu differs\n", batch[i].blocks,
+					(unsigned long long)batch[i].lba);
+				errors++;
+			}
+		}
+		batch[i] = batch[--n];
+	}
+	return errors ? -1 : 0;
+}
+
+/* one batch of requests to block ranges that do not overlap, so their order does not matter */
+static int run_batch(int fd, uint64_t *handle)
+{
+	static const uint32_t sizes[] = { 1, 2, 8, 64, 200, 256 };
+	struct pending batch[BATCH_MAX + 1];
+	int n = 0, count = 1 + rand() % BATCH_MAX;
+
+	for (int k = 0; k < count; k++) {
+		uint32_t blocks = sizes[rand() % (sizeof(sizes) / sizeof(sizes[0]))];
+		uint64_t lba = rand() % (TEST_BLOCKS - blocks);
+		int write = rand() % 2, overlap = 0;
+		uint16_t flags = 0;
+
+		for (int i = 0; i < n; i++)
+			overlap |= lba < batch[i].lba + batch[i].blocks && batch[i].lba < lba + blocks;
+		if (overlap)
+			continue;
+		if (write) {
+			for (size_t i = 0; i < (size_t)blocks * BLOCK_SIZE; i++)
+				model[lba * BLOCK_SIZE + i] = rand();
+			if (rand() % 20 == 0)
+				flags = NBD_CMD_FLAG_FUA;
+		}
+		batch[n] = (struct pending){ ++*handle, write ? NBD_CMD_WRITE : NBD_CMD_READ, lba, blocks };
+		if (send_request(fd, batch[n].type, flags, batch[n].handle, lba, blocks) < 0)
+			return -1;
+		n++;
+	}
+	if (rand() % 4 == 0) {
+		batch[n] = (struct pending){ ++*handle, NBD_CMD_FLUSH, 0, 0 };
+		if (send_request(fd, NBD_CMD_FLUSH, 0, batch[n].handle, 0, 0) < 0)
+			return -1;
+		n++;
+	}
+	return reap(fd, batch, n);
+}
+
+int main(int argc, char **argv)
+{
+	char image[] = "/tmp/wrp_nbd_test.XXXXXX";
+	unsigned int seed = 1, batches = 2000;
+	uint64_t handle = 0;
+	struct pending flush;
+	uint8_t *written;
+	pid_t server;
+	int fd, image_fd, status, c, r = 1;
+
+	while ((c = getopt(argc, argv, "s:n:h")) != -1) {
+		switch (c) {
+		case 's': seed = strtoul(optarg, NULL, 0); break;
+		case 'n': batches = strtoul(optarg, NULL, 0); break;
+		default:
+			printf("usage: wrp_nbd_test [-s seed] [-n batches] ./wrp_nbd\n");
+			return 0;
+		}
+	}
+	if (optind + 1 != argc) {
+		printf("usage: wrp_nbd_test [-s seed] [-n batches] ./wrp_nbd\n");
+		return 1;
+	}
+
+	srand(seed);
+	model = calloc(TEST_BLOCKS, BLOCK_SIZE);
+	written = malloc((size_t)TEST_BLOCKS * BLOCK_SIZE);
+	image_fd = mkstemp(image);
+	if (!model || !written || image_fd < 0 || ftruncate(image_fd, (off_t)TEST_BLOCKS * BLOCK_SIZE) < 0) {
+		fprintf(stderr, "cannot set up the image\n");
+		return 1;
+	}
+
+	/* a 1 MiB cache is 16 lines, so the workers keep evicting and flushing each other's lines */
+	server = fork();
+	if (server == 0) {
+		char port[16];
+
+		snprintf(port, sizeof(port), "%d", TEST_PORT);
+		freopen("/dev/null", "w", stdout);
+		execl(argv[optind], argv[optind], "-f", image, "-l", "200", "-r", "0", "-p", port,
+			"-c", "1", "-w", "4", (char *)NULL);
+		fprintf(stderr, "cannot run %s: %s\n", argv[optind], strerror(errno));
+		_exit(1);
+	}
+
+	fd = connect_server();
+	if (fd < 0)
+		goto out;
+	for (unsigned int i = 0; i < batches; i++) {
+		if (run_batch(fd, &handle) < 0) {
+			fprintf(stderr, "batch %u of seed %u failed\n", i, seed);
+			goto out;
+		}
+	}
+
+	flush = (struct pending){ ++handle, NBD_CMD_FLUSH, 0, 0 };
+	if (send_request(fd, NBD_CMD_FLUSH, 0, flush.handle, 0, 0) < 0 || reap(fd, &flush, 1) < 0)
+		goto out;
+	send_request(fd, NBD_CMD_DISC, 0, ++handle, 0, 0);
+	close(fd);
+
+	if (pread(image_fd, written, (size_t)TEST_BLOCKS * BLOCK_SIZE, 0) != (ssize_t)TEST_BLOCKS * BLOCK_SIZE ||
+		memcmp(written, model, (size_t)TEST_BLOCKS * BLOCK_SIZE)) {
+		fprintf(stderr, "image differs from what was written\n");
+		goto out;
+	}
+	printf("%u batches of seed %u passed\n", batches, seed);
+	r = 0;
+
+out:
+	kill(server, SIGTERM);
+	waitpid(server, &status, 0);
+	close(image_fd);
+	unlink(image);
+	free(model);
+	free(written);
+	return r;
+}
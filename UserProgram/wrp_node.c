@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wrp_link.h"
+
+/*
+ * Talks to an atmega328 SD bridge (atmega328.ino) over its serial port:
+ *
+ *   wrp_node /dev/ttyUSB0 info                   show the node's card
+ *   wrp_node /dev/ttyUSB0 read 2048 100 out.img  copy 100 blocks to a file
+ *   wrp_node /dev/ttyUSB0 write 2048 in.img      copy a file to the card
+ *   wrp_node /dev/ttyUSB0 stats                  show how well the node compressed
+ *
+ * -b sets the baud rate, which must match LINK_BAUD in the sketch. Transfers
+ * are split into requests of at most -n blocks, queued a few ahead so the
+ * link never waits on the file; the rate is reported, and so are the frames
+ * that had to be sent again and how much smaller the run-length coding made
+ * the data. The port may also be the one wrp_node_emu prints.
+ */
+
+#define DEFAULT_REQUEST_BLOCKS 64
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+	printf("usage: wrp_node [-b baud] [-n blocks] /dev/ttyX info\n"
+		"       wrp_node [-b baud] [-n blocks] /dev/ttyX read lba count file\n"
+		"       wrp_node [-b baud] [-n blocks] /dev/ttyX write lba file\n"
+		"       wrp_node [-b baud] [-n blocks] /dev/ttyX stats\n");
+}
+
+static void print_ratio(const char *what, unsigned long long data, unsigned long long frames)
+{
+	printf("%s %llu bytes of blocks in %llu bytes of frames (%.1f:1)\n", what, data, frames,
+		frames ? (double)data / frames : 0.0);
+}
+
+static int info(struct wrp_link_dev *dev)
+{
+	struct wrp_link_info info;
+
+	if (wrp_link_get_info(dev, &info) < 0)
+		return -1;
+	printf("card:      %.6s rev %u.%u, manufacturer %02x, oem %.3s\n", info.product,
+		info.revision >> 4, info.revision & 0x0f, info.manufacturer, info.oem);
+	printf("serial:    %08x, made 20%02u-%02u\n", info.serial, info.manufacturing_year,
+		info.manufacturing_month);
+	printf("capacity:  %llu bytes (%llu blocks)\n", (unsigned long long)info.capacity,
+		(unsigned long long)(info.capacity / WRP_LINK_BLOCK_SIZE));
+	printf("protected: %s\n", info.flag_write_protect || info.flag_write_protect_temp ? "yes" : "no");
+	return 0;
+}
+
+static int stats(struct wrp_link_dev *dev)
+{
+	struct wrp_link_stats stats;
+
+	if (wrp_link_get_stats(dev, &stats) < 0)
+		return -1;
+	print_ratio("node sent:    ", stats.sent_data, stats.sent_frames);
+	print_ratio("node received:", stats.received_data, stats.received_frames);
+	return 0;
+}
+
+/*
+ * Sets up request as the next one of a transfer of count blocks from lba,
+ * of which submitted have been queued already, reading its data from f
+ * for a write. Returns 1, or 0 once there is nothing left to transfer.
+ */
+static int next_request(struct wrp_link_request *request, int writing, uint32_t lba, uint32_t count,
+	uint32_t *submitted, FILE *f, unsigned int request_blocks)
+{
+	uint32_t n = count - *submitted < request_blocks ? count - *submitted : request_blocks;
+	size_t bytes = (size_t)n * WRP_LINK_BLOCK_SIZE;
+
+	if (!n)
+		return 0;
+	if (writing) {
+		size_t got = fread(request->data, 1, bytes, f);
+
+		if (!got)
+			return 0;
+		/* pad the last block of the file with zeros */
+		memset((uint8_t *)request->data + got, 0, bytes - got);
+		n = (got + WRP_LINK_BLOCK_SIZE - 1) / WRP_LINK_BLOCK_SIZE;
+	}
+	request->writing = writing;
+	request->lba = lba + *submitted;
+	request->blocks = n;
+	*submitted += n;
+	return 1;
+}
+
+/*
+ * The requests go through a wrp_link_queue, so the next ones are sent to
+ * the node while this thread writes out what the last one read, or reads
+ * in what the one after will write.
+ */
+static int transfer(struct wrp_link_dev *dev, int writing, uint32_t lba, uint32_t count,
+	FILE *f, unsigned int request_blocks)
+{
+	struct wrp_link_request requests[WRP_LINK_QUEUE_DEPTH], *request;
+	struct wrp_link_queue queue;
+	uint32_t submitted = 0, done = 0;
+	double start, elapsed;
+	int i, r = -1;
+
+	memset(requests, 0, sizeof(requests));
+	for (i = 0; i < WRP_LINK_QUEUE_DEPTH; i++) {
+		requests[i].data = malloc((size_t)request_blocks * WRP_LINK_BLOCK_SIZE);
+		if (!requests[i].data) {
+			fprintf(stderr, "out of memory\n");
+			goto out;
+		}
+	}
+	if (wrp_link_queue_start(&queue, dev) < 0)
+		goto out;
+
+	start = now();
+	for (i = 0; i < WRP_LINK_QUEUE_DEPTH; i++) {
+		if (!next_request(&requests[i], writing, lba, count, &submitted, f, request_blocks))
+			break;
+		wrp_link_submit(&queue, &requests[i]);
+	}
+	while ((request = wrp_link_reap(&queue))) {
+		if (request->result < 0)
+			goto stop;
+		if (!writing && fwrite(request->data, WRP_LINK_BLOCK_SIZE, request->blocks, f) != request->blocks) {
+			fprintf(stderr, "cannot write output: %s\n", strerror(errno));
+			goto stop;
+		}
+		done += request->blocks;
+		if (next_request(request, writing, lba, count, &submitted, f, request_blocks))
+			wrp_link_submit(&queue, request);
+	}
+	r = 0;
+
+stop:
+	wrp_link_queue_stop(&queue);
+	if (r < 0)
+		goto out;
+	elapsed = now() - start;
+	printf("%s %u blocks in %.2f s, %.1f KiB/s\n", writing ? "wrote" : "read", done, elapsed,
+		elapsed > 0 ? done * (WRP_LINK_BLOCK_SIZE / 1024.0) / elapsed : 0.0);
+	if (dev->crc_errors || dev->retransmits)
+		printf("%lu damaged frames, %lu chunks sent again\n", dev->crc_errors, dev->retransmits);
+	print_ratio("link:", dev->block_bytes, dev->frame_bytes);
+
+out:
+	for (i = 0; i < WRP_LINK_QUEUE_DEPTH; i++)
+		free(requests[i].data);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	struct wrp_link_dev dev;
+	unsigned int baud = WRP_LINK_DEFAULT_BAUD, request_blocks = DEFAULT_REQUEST_BLOCKS;
+	const char *cmd;
+	FILE *f = NULL;
+	int c, r = -1;
+
+	while ((c = getopt(argc, argv, "b:n:h")) != -1) {
+		switch (c) {
+		case 'b': baud = strtoul(optarg, NULL, 0); break;
+		case 'n': request_blocks = strtoul(optarg, NULL, 0); break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	if (argc - optind < 2 || !request_blocks || request_blocks > WRP_LINK_MAX_BLOCKS) {
+		usage();
+		return 1;
+	}
+	cmd = argv[optind + 1];
+
+	if (!strcmp(cmd, "read") && argc - optind == 5)
+		f = fopen(argv[optind + 4], "wb");
+	else if (!strcmp(cmd, "write") && argc - optind == 4)
+		f = fopen(argv[optind + 3], "rb");
+	else if ((strcmp(cmd, "info") && strcmp(cmd, "stats")) || argc - optind != 2) {
+		usage();
+		return 1;
+	}
+	if (argc - optind != 2 && !f) {
+		fprintf(stderr, "cannot open %s: %s\n", argv[argc - 1], strerror(errno));
+		return 1;
+	}
+
+	if (wrp_link_open(&dev, argv[optind], baud) < 0)
+		goto out;
+
+	if (!strcmp(cmd, "info"))
+		r = info(&dev);
+	else if (!strcmp(cmd, "stats"))
+		r = stats(&dev);
+	else if (!strcmp(cmd, "read"))
+		r = transfer(&dev, 0, strtoul(argv[optind + 2], NULL, 0), strtoul(argv[optind + 3], NULL, 0),
+			f, request_blocks);
+	else
+		r = transfer(&dev, 1, strtoul(argv[optind + 2], NULL, 0), UINT32_MAX, f, request_blocks);
+
+	wrp_link_close(&dev);
+out:
+	if (f)
+		fclose(f);
+	return r < 0 ? 1 : 0;
+}
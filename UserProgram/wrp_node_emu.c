@@ -0,0 +1,688 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "wrp_link.h"
+
+/*
+ * Stands in for an atmega328 SD bridge (atmega328.ino) on a pseudo-terminal,
+ * with a file for its card, so protocol changes can be measured without the
+ * hardware:
+ *
+ *   wrp_node_emu card.img &                 prints the port to use, e.g. /dev/pts/5
+ *   wrp_node /dev/pts/5 read 0 2048 out.img
+ *
+ * It answers the requests the way the sketch's loop() does, SD_QUEUE and
+ * SD_RESET included, for a node on a link of its own (no LINK_NODE bus). A pty
+ * delivers bytes as fast as they are written, so the line is modelled
+ * instead: at -b baud every byte takes ten bit times each way, a frame
+ * reaches the host as it starts going out and is only taken in once its
+ * last byte would have arrived. -r and -w add the card's time per block
+ * read and written, and -e damages or drops that fraction of the frames in
+ * each direction. -b 0 runs at pty speed.
+ */
+
+#define DEFAULT_BAUD       1000000
+#define DEFAULT_READ_US    200
+#define DEFAULT_WRITE_US   1000
+
+/* the sketch's LINK_TIMEOUT_MS and LINK_RETRIES */
+#define NODE_TIMEOUT_MS    20
+#define NODE_RETRIES       50
+
+/* struct sd_raw_info as the node sends it, and its link_stats */
+#define INFO_LEN           29
+#define STATS_LEN          16
+
+#define ALL_CHUNKS         ((1 << WRP_LINK_CHUNKS) - 1)
+
+/* as struct link_request: a read or write, and its status once it has ended */
+struct request {
+	uint8_t type, tag, status;
+	uint32_t lba;
+	uint16_t count;
+};
+
+struct node {
+	struct wrp_link_dev link;
+	int card_fd;
+	uint32_t card_blocks;
+
+	/* the line model: nanoseconds a byte takes, and when each direction is next free */
+	long long byte_ns;
+	long long tx_free, rx_free;
+	unsigned int read_us, write_us;
+	double error_rate;
+
+	struct request current_read;
+	uint8_t write_tag, write_status;
+	int pending;
+
+	/* the last SD_QUEUE frame's requests; those before queue_next have run */
+	struct request queue[WRP_LINK_BATCH];
+	uint8_t queue_tag;
+	unsigned int queue_length, queue_next;
+	/* of the last SD_RESET */
+	uint32_t session;
+	/* sd_raw's cache: a block of the card, and its lba or UINT32_MAX */
+	uint8_t block[WRP_LINK_BLOCK_SIZE];
+	uint32_t cached;
+
+	uint32_t sent_data, sent_frames, received_data, received_frames;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int hit(const struct node *node)
+{
+	return node->error_rate > 0 && rand() < node->error_rate * RAND_MAX;
+}
+
+static void send_frame(struct node *node, const uint8_t *payload, size_t len)
+{
+	uint8_t out[WRP_LINK_FRAME_MAX];
+	size_t n = wrp_link_encode(payload, len, out);
+	long long t = now_ns();
+
+	/* the line is busy with the frames before this one */
+	if (node->tx_free > t)
+		sleep_until(node->tx_free);
+	else
+		node->tx_free = t;
+	node->tx_free += n * node->byte_ns;
+
+	if (hit(node))
+		return;
+	if (hit(node))
+		out[rand() % (n - 1)] ^= 1 << (rand() % 8);
+	if (write(node->link.fd, out, n) < 0 && errno != EAGAIN)
+		fprintf(stderr, "pty write: %s\n", strerror(errno));
+}
+
+static void reply(struct node *node, uint8_t type, uint8_t tag)
+{
+	uint8_t frame[2] = { type, tag };
+
+	send_frame(node, frame, sizeof(frame));
+}
+
+static void send_chunk_id(struct node *node, uint8_t type, uint8_t tag, uint16_t block, uint8_t chunk)
+{
+	uint8_t frame[5] = { type, tag, block, block >> 8, chunk };
+
+	send_frame(node, frame, sizeof(frame));
+}
+
+static void read_error(struct node *node, uint8_t tag, uint16_t block)
+{
+	uint8_t frame[4] = { WRP_LINK_ERROR, tag, block, block >> 8 };
+
+	send_frame(node, frame, sizeof(frame));
+}
+
+static void send_credit(struct node *node, uint8_t tag, uint16_t frames, uint8_t resync, uint16_t blocks)
+{
+	uint8_t frame[7] = { WRP_LINK_CREDIT, tag, frames, frames >> 8, resync, blocks, blocks >> 8 };
+
+	send_frame(node, frame, sizeof(frame));
+}
+
+/* as link_receive: the payload length of the next frame, or WRP_LINK_DAMAGED or WRP_LINK_QUIET */
+static int receive(struct node *node, int timeout_ms)
+{
+	int n = wrp_link_receive(&node->link, timeout_ms);
+	long long t, frame_ns;
+
+	if (n == WRP_LINK_FAILED) {
+		/* the host closed the port; wait for the next one to open it */
+		usleep(timeout_ms * 1000);
+		return WRP_LINK_QUIET;
+	}
+	if (n == WRP_LINK_QUIET)
+		return n;
+
+	/*
+	 * taken in once its last byte would have arrived behind the frames
+	 * before it: payload, CRC, COBS code and delimiter
+	 */
+	t = now_ns();
+	frame_ns = (n > 0 ? n + 4 : 4) * node->byte_ns;
+	node->rx_free = node->rx_free + frame_ns > t ? node->rx_free + frame_ns : t;
+	sleep_until(node->rx_free);
+
+	return n >= 0 && hit(node) ? WRP_LINK_DAMAGED : n;
+}
+
+/* whether a frame is waiting, as uart_available */
+static int available(struct node *node)
+{
+	struct pollfd pfd = { .fd = node->link.fd, .events = POLLIN };
+
+	return node->link.rx_pos < node->link.rx_len || poll(&pfd, 1, 0) > 0;
+}
+
+/* as link_reset_session */
+static uint32_t reset_session(const struct node *node, int n)
+{
+	const uint8_t *frame = node->link.frame;
+
+	if (n != 6 || frame[0] != WRP_LINK_RESET)
+		return node->session;
+	return frame[2] | (frame[3] << 8) | (frame[4] << 16) | ((uint32_t)frame[5] << 24);
+}
+
+static int new_request(struct node *node, int n, uint8_t tag)
+{
+	uint8_t *frame = node->link.frame;
+
+	return n >= 2 && frame[1] != tag &&
+	       (frame[0] == WRP_LINK_READ_BLOCKS || frame[0] == WRP_LINK_WRITE_BLOCKS ||
+		frame[0] == WRP_LINK_GET_INFO || frame[0] == WRP_LINK_GET_STATS ||
+		(frame[0] == WRP_LINK_QUEUE && frame[1] != node->queue_tag) ||
+		reset_session(node, n) != node->session);
+}
+
+/* reads a block of the card into node->block unless it is there, taking the card's time for it */
+static int card_read(struct node *node, uint32_t lba)
+{
+	if (lba == node->cached)
+		return 1;
+	node->cached = UINT32_MAX;
+	usleep(node->read_us);
+	if (lba >= node->card_blocks ||
+	    pread(node->card_fd, node->block, WRP_LINK_BLOCK_SIZE,
+		  (off_t)lba * WRP_LINK_BLOCK_SIZE) != WRP_LINK_BLOCK_SIZE)
+		return 0;
+	node->cached = lba;
+	return 1;
+}
+
+static int card_write(struct node *node, uint32_t lba)
+{
+	node->cached = UINT32_MAX;
+	usleep(node->write_us);
+	return lba < node->card_blocks &&
+	       pwrite(node->card_fd, node->block, WRP_LINK_BLOCK_SIZE,
+		      (off_t)lba * WRP_LINK_BLOCK_SIZE) == WRP_LINK_BLOCK_SIZE;
+}
+
+static void get_info(struct node *node, uint8_t tag)
+{
+	uint8_t frame[2 + INFO_LEN] = { WRP_LINK_SUCCESS, tag };
+	uint64_t capacity = (uint64_t)node->card_blocks * WRP_LINK_BLOCK_SIZE;
+	int i;
+
+	/* manufacturer 0, oem "EM", product "EMUL", revision 1.0, made 2024-01 */
+	memcpy(frame + 3, "EM", 2);
+	memcpy(frame + 6, "EMUL", 4);
+	frame[12] = 0x10;
+	frame[17] = 24;
+	frame[18] = 1;
+	for (i = 0; i < 8; i++)
+		frame[19 + i] = capacity >> (8 * i);
+	send_frame(node, frame, sizeof(frame));
+}
+
+static void get_stats(struct node *node, uint8_t tag)
+{
+	uint32_t counters[4] = { node->sent_data, node->sent_frames, node->received_data,
+				 node->received_frames };
+	uint8_t frame[2 + STATS_LEN] = { WRP_LINK_SUCCESS, tag };
+	int i;
+
+	for (i = 0; i < STATS_LEN; i++)
+		frame[2 + i] = counters[i / 4] >> (8 * (i % 4));
+	send_frame(node, frame, sizeof(frame));
+}
+
+/* as send_read_chunk: one chunk of a read, packed when that is shorter */
+static int send_read_chunk(struct node *node, const struct request *read, uint16_t block, uint8_t chunk)
+{
+	uint8_t frame[WRP_LINK_DATA_LENGTH] = { WRP_LINK_DATA, read->tag, block, block >> 8, chunk };
+	const uint8_t *data = node->block + chunk * WRP_LINK_CHUNK;
+	size_t len;
+
+	if (block >= read->count || chunk >= WRP_LINK_CHUNKS)
+		return 1;
+	if (!card_read(node, read->lba + block)) {
+		read_error(node, read->tag, block);
+		return 0;
+	}
+	if ((len = wrp_link_pack(data, frame + 5))) {
+		frame[0] = WRP_LINK_PACKED;
+	} else {
+		memcpy(frame + 5, data, WRP_LINK_CHUNK);
+		len = WRP_LINK_CHUNK;
+	}
+	send_frame(node, frame, 5 + len);
+	node->sent_data += WRP_LINK_CHUNK;
+	node->sent_frames += 5 + len;
+	return 1;
+}
+
+/* as send_read_fill: the block in node->block as one FILL frame, if it is all one byte */
+static int send_read_fill(struct node *node, uint16_t block)
+{
+	uint8_t frame[5] = { WRP_LINK_FILL, node->current_read.tag, block, block >> 8, node->block[0] };
+	int i;
+
+	for (i = 1; i < WRP_LINK_BLOCK_SIZE; i++) {
+		if (node->block[i] != node->block[0])
+			return 0;
+	}
+	send_frame(node, frame, sizeof(frame));
+	node->sent_data += WRP_LINK_BLOCK_SIZE;
+	node->sent_frames += sizeof(frame);
+	return 1;
+}
+
+/* as link_find: the read or write with tag among the last read and the queue's that have run */
+static struct request *find(struct node *node, uint8_t type, uint8_t tag)
+{
+	unsigned int i;
+
+	if (type == WRP_LINK_READ_BLOCKS && tag == node->current_read.tag)
+		return &node->current_read;
+	for (i = 0; i < node->queue_next; i++) {
+		if (node->queue[i].type == type && node->queue[i].tag == tag)
+			return &node->queue[i];
+	}
+	return NULL;
+}
+
+/* as link_answer: NAKs of reads, SD_STATUS of requests that have ended and the SD_QUEUE taken already */
+static int answer(struct node *node, int n)
+{
+	uint8_t *frame = node->link.frame;
+	struct request *request;
+
+	if (n == 5 && frame[0] == WRP_LINK_NAK) {
+		if ((request = find(node, WRP_LINK_READ_BLOCKS, frame[1])))
+			send_read_chunk(node, request, frame[2] | (frame[3] << 8), frame[4]);
+		return 1;
+	}
+	if (n == 2 && frame[0] == WRP_LINK_STATUS) {
+		if (frame[1] == node->write_tag)
+			reply(node, node->write_status, node->write_tag);
+		else if (((request = find(node, WRP_LINK_WRITE_BLOCKS, frame[1])) ||
+			  (request = find(node, WRP_LINK_READ_BLOCKS, frame[1]))) && request->status)
+			reply(node, request->status, request->tag);
+		return 1;
+	}
+	return n >= 2 && frame[0] == WRP_LINK_QUEUE && frame[1] == node->queue_tag;
+}
+
+/* as handle_read_blocks: SD_SUCCESS, SD_ERROR if the card failed, or 0 if a new request ended it */
+static uint8_t read_blocks(struct node *node, uint8_t tag, uint32_t lba, uint16_t count)
+{
+	struct request *read = &node->current_read;
+	uint16_t block = 0;
+	uint8_t chunk = 0;
+
+	read->type = WRP_LINK_READ_BLOCKS;
+	read->tag = tag;
+	read->status = 0;
+	read->lba = lba;
+	read->count = count;
+
+	while (block < count) {
+		/* chunks the host missed go out again as soon as it asks */
+		while (available(node)) {
+			int n = receive(node, NODE_TIMEOUT_MS);
+
+			if (new_request(node, n, tag)) {
+				node->pending = n;
+				return 0;
+			}
+			answer(node, n);
+		}
+		if (chunk == 0) {
+			if (!card_read(node, lba + block)) {
+				read_error(node, tag, block);
+				return read->status = WRP_LINK_ERROR;
+			}
+			if (send_read_fill(node, block))
+				chunk = WRP_LINK_CHUNKS;
+		}
+		if (chunk < WRP_LINK_CHUNKS && !send_read_chunk(node, read, block, chunk++))
+			return read->status = WRP_LINK_ERROR;
+		if (chunk == WRP_LINK_CHUNKS) {
+			block++;
+			chunk = 0;
+		}
+	}
+	return read->status = WRP_LINK_SUCCESS;
+}
+
+/* as write_data: whether the frame holds data for one of the count blocks of the write */
+static int write_data(struct node *node, int n, uint8_t tag, uint16_t count)
+{
+	uint8_t *frame = node->link.frame;
+
+	if (n < 5 || frame[1] != tag || (frame[2] | (frame[3] << 8)) >= count)
+		return 0;
+	switch (frame[0]) {
+	case WRP_LINK_DATA:
+		return n == WRP_LINK_DATA_LENGTH && frame[4] < WRP_LINK_CHUNKS;
+	case WRP_LINK_PACKED:
+		return frame[4] < WRP_LINK_CHUNKS;
+	case WRP_LINK_FILL:
+		return n == 5;
+	}
+	return 0;
+}
+
+static unsigned int take_write_data(struct node *node, int n)
+{
+	uint8_t *frame = node->link.frame, chunk = frame[4];
+
+	switch (frame[0]) {
+	case WRP_LINK_FILL:
+		memset(node->block, frame[4], WRP_LINK_BLOCK_SIZE);
+		return ALL_CHUNKS;
+	case WRP_LINK_PACKED:
+		return wrp_link_unpack(frame + 5, n - 5, node->block + chunk * WRP_LINK_CHUNK) < 0 ? 0 : 1 << chunk;
+	}
+	memcpy(node->block + chunk * WRP_LINK_CHUNK, frame + 5, WRP_LINK_CHUNK);
+	return 1 << chunk;
+}
+
+static void nak_missing(struct node *node, uint8_t tag, uint16_t block, unsigned int received)
+{
+	uint8_t chunk;
+
+	for (chunk = 0; chunk < WRP_LINK_CHUNKS; chunk++) {
+		if (!(received & (1 << chunk)))
+			send_chunk_id(node, WRP_LINK_NAK, tag, block, chunk);
+	}
+}
+
+/* as handle_write_blocks, with the receive ring in the pty's buffer */
+static uint8_t write_blocks(struct node *node, uint8_t tag, uint32_t lba, uint16_t count)
+{
+	uint16_t frames = 0, asked = 0, block = 0;
+	uint32_t seen = 0;
+	unsigned int received = 0, quiet = 0;
+	int ok = 1;
+
+	node->write_tag = tag;
+	node->cached = UINT32_MAX;
+	send_credit(node, tag, frames, 1, block);
+
+	while (block < count) {
+		int n = receive(node, NODE_TIMEOUT_MS);
+		uint8_t *frame = node->link.frame;
+		uint32_t block_start = (uint32_t)block * WRP_LINK_CHUNKS;
+		int full;
+
+		if (new_request(node, n, tag)) {
+			node->pending = n;
+			ok = 0;
+			break;
+		}
+		/* what the host asks about earlier requests is not part of this write's frames */
+		if (n >= 2 && frame[1] != tag && answer(node, n))
+			continue;
+		if (n == WRP_LINK_QUIET) {
+			if (++quiet == NODE_RETRIES) {
+				ok = 0;
+				break;
+			}
+			nak_missing(node, tag, block, received);
+			asked = frames;
+			send_credit(node, tag, frames, 1, block);
+			continue;
+		}
+		quiet = 0;
+		frames++;
+
+		if (write_data(node, n, tag, count)) {
+			uint16_t b = frame[2] | (frame[3] << 8);
+			uint8_t chunk = frame[0] == WRP_LINK_FILL ? WRP_LINK_CHUNKS - 1 : frame[4];
+			uint32_t position = (uint32_t)b * WRP_LINK_CHUNKS + chunk;
+
+			node->received_data += frame[0] == WRP_LINK_FILL ? WRP_LINK_BLOCK_SIZE : WRP_LINK_CHUNK;
+			node->received_frames += n;
+			if (b == block && !(received & (1 << chunk)))
+				received |= take_write_data(node, n);
+			/* chunks skipped over were lost on the way */
+			for (; seen < position && seen < block_start + WRP_LINK_CHUNKS; seen++) {
+				if (seen >= block_start && !(received & (1 << (seen - block_start)))) {
+					send_chunk_id(node, WRP_LINK_NAK, tag, block, seen - block_start);
+					asked = frames;
+				}
+			}
+			if (b > block) {
+				send_chunk_id(node, WRP_LINK_NAK, tag, b, chunk);
+				if ((uint16_t)(frames - asked) > 2 * WRP_LINK_WINDOW) {
+					nak_missing(node, tag, block, received);
+					asked = frames;
+				}
+			} else if (position >= seen) {
+				seen = position + 1;
+			}
+		}
+		full = received == ALL_CHUNKS;
+		send_credit(node, tag, frames, 0, block + full);
+
+		if (full) {
+			if (ok && !card_write(node, lba + block))
+				ok = 0;
+			block++;
+			received = 0;
+		}
+	}
+	node->write_status = ok ? WRP_LINK_SUCCESS : WRP_LINK_ERROR;
+	reply(node, node->write_status, tag);
+	return node->write_status;
+}
+
+/* as handle_queue */
+static void take_queue(struct node *node, uint8_t tag, int n)
+{
+	uint8_t *frame = node->link.frame;
+	unsigned int count = (n - 2) / 8, i;
+
+	if (tag == node->queue_tag)
+		return;
+	if (count == 0 || count > WRP_LINK_BATCH || n != 2 + 8 * (int)count) {
+		reply(node, WRP_LINK_ERROR, tag);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		const uint8_t *d = frame + 2 + 8 * i;
+		struct request *request = &node->queue[i];
+
+		request->type = d[0];
+		request->tag = d[1];
+		request->status = 0;
+		request->lba = d[2] | (d[3] << 8) | (d[4] << 16) | ((uint32_t)d[5] << 24);
+		request->count = d[6] | (d[7] << 8);
+	}
+	node->queue_tag = tag;
+	node->queue_length = count;
+	node->queue_next = 0;
+}
+
+/* as handle_reset */
+static void take_reset(struct node *node, uint8_t tag, int n)
+{
+	uint32_t session = reset_session(node, n);
+
+	if (n != 6)
+		return;
+	if (session != node->session) {
+		node->session = session;
+		node->queue_tag = 0;
+		node->queue_length = node->queue_next = 0;
+		node->current_read.tag = 0;
+		node->current_read.count = 0;
+		node->write_tag = 0;
+	}
+	reply(node, WRP_LINK_SUCCESS, tag);
+}
+
+/* as run_queued */
+static void run_queued(struct node *node)
+{
+	struct request *request = &node->queue[node->queue_next++];
+
+	if (request->type == WRP_LINK_READ_BLOCKS) {
+		request->status = read_blocks(node, request->tag, request->lba, request->count);
+		if (request->status == WRP_LINK_SUCCESS)
+			reply(node, WRP_LINK_SUCCESS, request->tag);
+	} else if (request->type == WRP_LINK_WRITE_BLOCKS) {
+		request->status = write_blocks(node, request->tag, request->lba, request->count);
+	} else {
+		request->status = WRP_LINK_ERROR;
+		reply(node, WRP_LINK_ERROR, request->tag);
+	}
+	if (node->pending)
+		node->queue_next = node->queue_length;
+}
+
+/* as loop(): runs the next request of the queue, or takes the next request and answers it */
+static void serve(struct node *node)
+{
+	uint8_t *frame = node->link.frame, tag;
+	uint32_t lba;
+	uint16_t count;
+	int n;
+
+	/* the frames waiting are for the next request of the queue, which the host has gone on to */
+	if (!node->pending && node->queue_next < node->queue_length) {
+		run_queued(node);
+		return;
+	}
+	n = node->pending ? node->pending : receive(node, 1000);
+	tag = frame[1];
+	lba = frame[2] | (frame[3] << 8) | (frame[4] << 16) | ((uint32_t)frame[5] << 24);
+	count = frame[6] | (frame[7] << 8);
+	node->pending = 0;
+	if (n < 2)
+		return;
+	switch (frame[0]) {
+	case WRP_LINK_READ_BLOCKS:
+		if (n == 8)
+			read_blocks(node, tag, lba, count);
+		break;
+	case WRP_LINK_WRITE_BLOCKS:
+		if (n == 8)
+			write_blocks(node, tag, lba, count);
+		break;
+	case WRP_LINK_GET_INFO:
+		get_info(node, tag);
+		break;
+	case WRP_LINK_GET_STATS:
+		get_stats(node, tag);
+		break;
+	case WRP_LINK_NAK:
+	case WRP_LINK_STATUS:
+		answer(node, n);
+		break;
+	case WRP_LINK_QUEUE:
+		take_queue(node, tag, n);
+		break;
+	case WRP_LINK_RESET:
+		take_reset(node, tag, n);
+		break;
+	}
+}
+
+/* a pty in raw mode; the other side stays open so the host can come and go */
+static int open_pty(void)
+{
+	struct termios tio;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY), pts;
+
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		fprintf(stderr, "cannot open a pty: %s\n", strerror(errno));
+		return -1;
+	}
+	pts = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if (pts < 0 || tcgetattr(pts, &tio) < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", ptsname(fd), strerror(errno));
+		close(fd);
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(pts, TCSANOW, &tio);
+	return fd;
+}
+
+static void usage(void)
+{
+	printf("usage: wrp_node_emu [-b baud] [-r read_us] [-w write_us] [-e error_rate] card.img\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct node node;
+	unsigned int baud = DEFAULT_BAUD;
+	struct stat st;
+	int c;
+
+	node.read_us = DEFAULT_READ_US;
+	node.write_us = DEFAULT_WRITE_US;
+	while ((c = getopt(argc, argv, "b:r:w:e:h")) != -1) {
+		switch (c) {
+		case 'b': baud = strtoul(optarg, NULL, 0); break;
+		case 'r': node.read_us = strtoul(optarg, NULL, 0); break;
+		case 'w': node.write_us = strtoul(optarg, NULL, 0); break;
+		case 'e': node.error_rate = strtod(optarg, NULL); break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	if (argc - optind != 1) {
+		usage();
+		return 1;
+	}
+
+	node.card_fd = open(argv[optind], O_RDWR);
+	if (node.card_fd < 0 || fstat(node.card_fd, &st) < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	node.card_blocks = st.st_size / WRP_LINK_BLOCK_SIZE;
+	if (!node.card_blocks) {
+		fprintf(stderr, "%s is smaller than one block\n", argv[optind]);
+		return 1;
+	}
+	/* ten bits a byte: start, eight data bits and stop */
+	node.byte_ns = baud ? 10 * 1000000000LL / baud : 0;
+	node.write_status = WRP_LINK_ERROR;
+	node.cached = UINT32_MAX;
+
+	node.link.fd = open_pty();
+	if (node.link.fd < 0)
+		return 1;
+	printf("%s\n", ptsname(node.link.fd));
+	fflush(stdout);
+
+	for (;;)
+		serve(&node);
+}
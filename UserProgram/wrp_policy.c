@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wrp_aes.h"
+#include "wrp_sg.h"
+#include "wrp_sha256.h"
+
+/*
+ * Shows or replaces the firmware's LBA write policy table. A table file
+ * has one range per line, in increasing order of first block, the first
+ * starting at block 0; each range runs up to the next:
+ *
+ *   # lba   policy
+ *   0       protected
+ *   2048    writable
+ *   1000000 append:0
+ *
+ * append:N makes the range append-only using append slot N (0 to
+ * WRP_POLICY_APPEND_SLOTS - 1, one range per slot). Setting a table is
+ * authorized like a write: the table goes out as a chain of hashed chunks
+ * (see wrp_scsi.h), its message ID is the SHA-256 of the chain's head, and
+ * the token comes from a challenge response on that ID. The new table
+ * takes the serial number after the installed one's, so an older table
+ * can never be set again.
+ */
+
+static const char *policy_name(uint8_t policy)
+{
+	switch (policy & 0x0f) {
+	case WRP_POLICY_WRITABLE: return "writable";
+	case WRP_POLICY_PROTECTED: return "protected";
+	case WRP_POLICY_APPEND_ONLY: return "append";
+	default: return "unknown";
+	}
+}
+
+static int show(struct wrp_sg_dev *dev)
+{
+	uint8_t table[WRP_POLICY_LEN(WRP_POLICY_MAX_RANGES)];
+	int len = wrp_sg_get_policy(dev, table, sizeof(table));
+	unsigned int n, i;
+
+	if (len < 6)
+		return -1;
+	n = (table[4] << 8) | table[5];
+	if (!n)
+		printf("no valid policy table, all writes refused\n");
+	else
+		printf("serial %u\n", ((uint32_t)table[0] << 24) | (table[1] << 16) | (table[2] << 8) | table[3]);
+
+	for (i = 0; i < n && WRP_POLICY_LEN(i + 1) <= (unsigned int)len; i++) {
+		const uint8_t *r = table + WRP_POLICY_LEN(i);
+		uint32_t lba = ((uint32_t)r[0] << 24) | (r[1] << 16) | (r[2] << 8) | r[3];
+
+		if ((r[4] & 0x0f) == WRP_POLICY_APPEND_ONLY)
+			printf("%-10u %s:%u\n", lba, policy_name(r[4]), r[4] >> 4);
+		else
+			printf("%-10u %s\n", lba, policy_name(r[4]));
+	}
+	return 0;
+}
+
+/* Parses a table file into the ranges of table; returns the number of ranges, or -1 */
+static int load(const char *path, uint8_t *table)
+{
+	FILE *f = fopen(path, "r");
+	char line[128], name[32];
+	unsigned int n = 0, line_no = 0, slot;
+	unsigned long lba;
+
+	if (!f) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		uint8_t *r = table + WRP_POLICY_LEN(n);
+		char *hash = strchr(line, '#');
+		uint8_t policy;
+
+		line_no++;
+		if (hash)
+			*hash = 0;
+		if (sscanf(line, "%lu %31s", &lba, name) != 2)
+			continue;
+
+		if (!strcmp(name, "writable"))
+			policy = WRP_POLICY_WRITABLE;
+		else if (!strcmp(name, "protected"))
+			policy = WRP_POLICY_PROTECTED;
+		else if (sscanf(name, "append:%u", &slot) == 1 && slot < WRP_POLICY_APPEND_SLOTS)
+			policy = WRP_POLICY_APPEND_ONLY | (slot << 4);
+		else {
+			fprintf(stderr, "%s:%u: unknown policy %s\n", path, line_no, name);
+			goto fail;
+		}
+		if (n == WRP_POLICY_MAX_RANGES) {
+			fprintf(stderr, "%s: at most %d ranges\n", path, WRP_POLICY_MAX_RANGES);
+			goto fail;
+		}
+
+		r[0] = (uint8_t)(lba >> 24);
+		r[1] = (uint8_t)(lba >> 16);
+		r[2] = (uint8_t)(lba >> 8);
+		r[3] = (uint8_t)lba;
+		r[4] = policy;
+		n++;
+	}
+	fclose(f);
+
+	if (!n) {
+		fprintf(stderr, "%s: no ranges\n", path);
+		return -1;
+	}
+	return n;
+
+fail:
+	fclose(f);
+	return -1;
+}
+
+static int set(struct wrp_sg_dev *dev, const uint8_t *table, unsigned int n)
+{
+	uint8_t material[WRP_POLICY_SET_LEN(WRP_POLICY_MAX_RANGES)];
+	uint8_t installed[WRP_POLICY_LEN(0)];
+	uint8_t link[WRP_MESSAGE_ID_LEN];
+	uint8_t message_id[WRP_MESSAGE_ID_LEN];
+	uint8_t token[WRP_TOKEN_LEN];
+	uint8_t user_key[WRP_USER_KEY_LEN];
+	unsigned int chunks = WRP_POLICY_CHUNKS(n), k;
+	uint32_t serial;
+
+	if (wrp_sg_get_policy(dev, installed, sizeof(installed)) < (int)sizeof(installed))
+		return -1;
+	serial = (((uint32_t)installed[0] << 24) | (installed[1] << 16) | (installed[2] << 8) | installed[3]) + 1;
+
+	material[0] = (uint8_t)(serial >> 24);
+	material[1] = (uint8_t)(serial >> 16);
+	material[2] = (uint8_t)(serial >> 8);
+	material[3] = (uint8_t)serial;
+	material[4] = (uint8_t)(n >> 8);
+	material[5] = (uint8_t)n;
+
+	/* Chain the chunks from the last back, so each can carry the hash of the one after it */
+	for (k = chunks; k-- > 0;) {
+		unsigned int first = k * WRP_POLICY_CHUNK_RANGES;
+		unsigned int ranges = n - first < WRP_POLICY_CHUNK_RANGES ? n - first : WRP_POLICY_CHUNK_RANGES;
+		uint8_t *chunk = material + WRP_POLICY_HEAD_LEN + first * WRP_POLICY_RANGE_LEN + k * WRP_MESSAGE_ID_LEN;
+		size_t len = ranges * WRP_POLICY_RANGE_LEN;
+
+		memcpy(chunk, table + WRP_POLICY_LEN(first), len);
+		if (k + 1 < chunks) {
+			memcpy(chunk + len, link, sizeof(link));
+			len += sizeof(link);
+		}
+		wrp_sha256(chunk, len, link);
+	}
+	memcpy(material + 6, link, sizeof(link));
+	wrp_sha256(material, WRP_POLICY_HEAD_LEN, message_id);
+
+	if (wrp_user_key(user_key) < 0 || wrp_sg_authorize(dev, user_key, message_id, token) < 0)
+		return -1;
+	if (wrp_sg_set_policy(dev, message_id, token, material, WRP_POLICY_SET_LEN(n)) < 0) {
+		fprintf(stderr, "policy table refused\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct wrp_sg_dev dev;
+	uint8_t table[WRP_POLICY_LEN(WRP_POLICY_MAX_RANGES)];
+	int n = 0, r;
+
+	if (argc < 2) {
+		printf("usage: wrp_policy /dev/sdX [table]\n");
+		return 0;
+	}
+	if (argc > 2 && (n = load(argv[2], table)) < 0)
+		return 1;
+	if (wrp_sg_open(&dev, argv[1]) < 0)
+		return 1;
+
+	r = n ? set(&dev, table, n) : 0;
+	if (r == 0)
+		r = show(&dev);
+
+	wrp_sg_close(&dev);
+	return r < 0 ? 1 : 0;
+}
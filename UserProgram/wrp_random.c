@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wrp_sg.h"
+
+/*
+ * Dumps the firmware's random generator output, or raw samples of one of
+ * its noise sources, and runs statistical tests over the stream:
+ *
+ *   monobit and runs   NIST SP 800-22 sections 2.1 and 2.3, p >= 0.01
+ *   chi-square         byte frequencies, 255 degrees of freedom, p >= 0.01
+ *   serial correlation of adjacent bytes, |r| < 4 / sqrt(n)
+ *   min-entropy        SP 800-90B most common value estimate, per byte
+ *
+ * Generator output is expected to pass everything. Raw noise is not
+ * uniform and is not expected to; what matters there is the min-entropy
+ * estimate, which should stay above the credit the firmware gives each
+ * sample (RANDOM_CREDIT_* in MassStorage/Lib/Random.h, in 1/16 bits).
+ */
+
+struct source {
+	const char *name;
+	uint8_t id;
+	uint16_t chunk;		/* bytes per command, so slow sources fit in the timeout */
+};
+
+static const struct source sources[] = {
+	{ "drbg", WRP_RANDOM_DRBG, 4096 },
+	{ "wdt", WRP_RANDOM_RAW_WDT, 128 },
+	{ "sof", WRP_RANDOM_RAW_SOF, 2048 },
+	{ "adc", WRP_RANDOM_RAW_ADC, 2048 },
+};
+
+static int failures;
+
+static void report(const char *test, double value, const char *unit, int pass)
+{
+	printf("%-20s %12.6f %-8s %s\n", test, value, unit, pass ? "pass" : "FAIL");
+	if (!pass)
+		failures++;
+}
+
+static void test_monobit(const uint8_t *data, size_t n)
+{
+	long ones = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		ones += __builtin_popcount(data[i]);
+
+	double bits = (double)n * 8;
+	double s = fabs(2.0 * ones - bits) / sqrt(bits);
+	double p = erfc(s / sqrt(2.0));
+
+	report("monobit", p, "p", p >= 0.01);
+}
+
+static void test_runs(const uint8_t *data, size_t n)
+{
+	long ones = 0, runs = 1;
+	size_t bits = n * 8, i;
+	int prev = data[0] >> 7;
+
+	for (i = 0; i < bits; i++) {
+		int bit = (data[i / 8] >> (7 - i % 8)) & 1;
+
+		ones += bit;
+		if (i && bit != prev)
+			runs++;
+		prev = bit;
+	}
+
+	double pi = (double)ones / bits;
+	if (fabs(pi - 0.5) >= 2.0 / sqrt((double)bits)) {
+		/* the runs test is not applicable when the monobit test already fails */
+		report("runs", 0, "p", 0);
+		return;
+	}
+
+	double num = fabs(runs - 2.0 * bits * pi * (1 - pi));
+	double den = 2.0 * sqrt(2.0 * bits) * pi * (1 - pi);
+	double p = erfc(num / den);
+
+	report("runs", p, "p", p >= 0.01);
+}
+
+static void test_chi_square(const uint64_t *counts, size_t n)
+{
+	double expected = n / 256.0, chi = 0, k = 255;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		chi += (counts[i] - expected) * (counts[i] - expected) / expected;
+
+	/* Wilson-Hilferty approximation of the chi-square upper tail */
+	double z = (cbrt(chi / k) - (1 - 2 / (9 * k))) / sqrt(2 / (9 * k));
+	double p = 0.5 * erfc(z / sqrt(2.0));
+
+	report("chi-square", chi, "", p >= 0.01);
+	printf("%-20s %12.6f %-8s\n", "", p, "p");
+}
+
+static void test_serial_correlation(const uint8_t *data, size_t n)
+{
+	double sx = 0, sxx = 0, sxy = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		double x = data[i], y = data[(i + 1) % n];
+
+		sx += x;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	double r = (n * sxy - sx * sx) / (n * sxx - sx * sx);
+
+	report("serial correlation", r, "r", fabs(r) < 4 / sqrt((double)n));
+}
+
+static void test_entropy(const uint64_t *counts, size_t n)
+{
+	double shannon = 0, p_max = 0;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		double p = (double)counts[i] / n;
+
+		if (p > 0)
+			shannon -= p * log2(p);
+		if (p > p_max)
+			p_max = p;
+	}
+
+	/* upper 99% confidence bound on the most common value's probability */
+	double p_u = p_max + 2.576 * sqrt(p_max * (1 - p_max) / (n - 1));
+	if (p_u > 1)
+		p_u = 1;
+
+	printf("%-20s %12.6f %-8s\n", "shannon entropy", shannon, "bits/B");
+	printf("%-20s %12.6f %-8s\n", "min-entropy (MCV)", -log2(p_u), "bits/B");
+}
+
+static void usage(void)
+{
+	printf("usage: wrp_random [options] [/dev/sdX]\n");
+	printf("  -s drbg|wdt|sof|adc  generator output (default) or raw samples of one noise source\n");
+	printf("  -n bytes             bytes to read from the device (default 1048576, 4096 for raw sources)\n");
+	printf("  -o file              also save the stream\n");
+	printf("  -f file              test a saved stream instead of reading the device\n");
+}
+
+int main(int argc, char **argv)
+{
+	const struct source *src = &sources[0];
+	const char *out_path = NULL, *in_path = NULL;
+	size_t n = 0, i;
+	uint8_t *data;
+	uint64_t counts[256];
+	int c;
+
+	while ((c = getopt(argc, argv, "s:n:o:f:h")) != -1) {
+		switch (c) {
+		case 's':
+			for (src = NULL, i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+				if (!strcmp(optarg, sources[i].name))
+					src = &sources[i];
+			if (!src) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'n': n = strtoul(optarg, NULL, 0); break;
+		case 'o': out_path = optarg; break;
+		case 'f': in_path = optarg; break;
+		default: usage(); return 0;
+		}
+	}
+
+	if (in_path) {
+		FILE *f = fopen(in_path, "rb");
+
+		if (!f) {
+			fprintf(stderr, "cannot open %s: %s\n", in_path, strerror(errno));
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		n = ftell(f);
+		rewind(f);
+		data = malloc(n ? n : 1);
+		if (!data || fread(data, 1, n, f) != n) {
+			fprintf(stderr, "cannot read %s\n", in_path);
+			return 1;
+		}
+		fclose(f);
+	} else {
+		struct wrp_sg_dev dev;
+
+		if (optind >= argc) {
+			usage();
+			return 1;
+		}
+		if (!n)
+			n = src->id == WRP_RANDOM_DRBG ? 1048576 : 4096;
+		data = malloc(n);
+		if (!data || wrp_sg_open(&dev, argv[optind]) < 0)
+			return 1;
+		dev.timeout_ms = 30000;
+
+		for (i = 0; i < n; ) {
+			uint16_t len = n - i < src->chunk ? n - i : src->chunk;
+			int r = wrp_sg_get_random(&dev, src->id, data + i, len);
+
+			if (r <= 0) {
+				fprintf(stderr, "random read failed at byte %zu\n", i);
+				wrp_sg_close(&dev);
+				return 1;
+			}
+			i += r;
+		}
+		wrp_sg_close(&dev);
+	}
+
+	if (out_path) {
+		FILE *f = fopen(out_path, "wb");
+
+		if (!f || fwrite(data, 1, n, f) != n || fclose(f)) {
+			fprintf(stderr, "cannot write %s\n", out_path);
+			return 1;
+		}
+	}
+
+	if (n < 128) {
+		fprintf(stderr, "need at least 128 bytes to test, have %zu\n", n);
+		return 1;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < n; i++)
+		counts[data[i]]++;
+
+	printf("%zu bytes\n", n);
+	test_monobit(data, n);
+	test_runs(data, n);
+	test_chi_square(counts, n);
+	test_serial_correlation(data, n);
+	test_entropy(counts, n);
+
+	free(data);
+	return failures && src->id == WRP_RANDOM_DRBG ? 2 : 0;
+}
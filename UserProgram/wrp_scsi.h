@@ -0,0 +1,186 @@
+#ifndef WRP_SCSI_H
+#define WRP_SCSI_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* SCSI operation codes understood by the MassStorage firmware (see MassStorage/Lib/SCSI_Codes.h) */
+#define SCSI_CMD_INQUIRY                               0x12
+#define SCSI_CMD_REQUEST_SENSE                         0x03
+#define SCSI_CMD_TEST_UNIT_READY                       0x00
+#define SCSI_CMD_READ_CAPACITY_10                      0x25
+#define SCSI_CMD_SEND_DIAGNOSTIC                       0x1D
+#define SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL          0x1E
+#define SCSI_CMD_WRITE_10                              0x2A
+#define SCSI_CMD_READ_10                               0x28
+
+#define SCSI_WRP_REQ_CHALLENGE                         0xAA
+#define SCSI_WRP_RESPONSE                              0xCC
+#define SCSI_WRP_COMMIT                                0xCD
+#define SCSI_WRP_STATS                                 0xCE
+#define SCSI_WRP_RANDOM                                0xCF
+#define SCSI_WRP_BATCH_LIST                            0xAB
+#define SCSI_WRP_BATCH_RESPONSE                        0xCB
+#define SCSI_WRP_GET_REPLY                             0xAC
+#define SCSI_WRP_AUTH_WRITE                            0xCA
+#define SCSI_WRP_SET_POLICY                            0xC9
+#define SCSI_WRP_GET_POLICY                            0xC8
+#define SCSI_WRP_SET_FILE_GUARD                        0xC7
+#define SCSI_WRP_GET_FILE_GUARD                        0xC6
+
+#define WRP_BLOCK_SIZE          512
+#define WRP_MESSAGE_ID_LEN      32
+#define WRP_CHALLENGE_LEN       32
+#define WRP_RESPONSE_LEN        32
+#define WRP_VERIFICATION_LEN    96
+#define WRP_TOKEN_LEN           32
+#define WRP_GRANT_LEN           16
+
+/*
+ * WRP material travels in the data phase. Commands that send some read
+ * their reply with SCSI_WRP_GET_REPLY; each reply starts with the opcode
+ * it answers.
+ */
+
+/* Data-out of SCSI_WRP_REQ_CHALLENGE: message ID, grant */
+#define WRP_CHALLENGE_REQUEST_LEN (WRP_MESSAGE_ID_LEN + WRP_GRANT_LEN)
+
+/* Data-out of SCSI_WRP_RESPONSE and SCSI_WRP_BATCH_RESPONSE: message ID, challenge, response, verification code, grant */
+#define WRP_RESPONSE_MATERIAL_LEN (WRP_MESSAGE_ID_LEN + WRP_CHALLENGE_LEN + WRP_RESPONSE_LEN + \
+	WRP_VERIFICATION_LEN + WRP_GRANT_LEN)
+
+/* Data-out of SCSI_WRP_AUTH_WRITE ahead of the blocks: message ID, token */
+#define WRP_AUTH_WRITE_HEADER_LEN (WRP_MESSAGE_ID_LEN + WRP_TOKEN_LEN)
+
+/* Reply to SCSI_WRP_REQ_CHALLENGE: opcode echo, message ID, challenge, verification code */
+#define WRP_CHALLENGE_REPLY_LEN (1 + WRP_MESSAGE_ID_LEN + WRP_CHALLENGE_LEN + WRP_VERIFICATION_LEN)
+
+/* Reply to SCSI_WRP_RESPONSE: opcode echo, message ID, token */
+#define WRP_RESPONSE_REPLY_LEN  (1 + WRP_MESSAGE_ID_LEN + WRP_TOKEN_LEN)
+
+/* Most message IDs one SCSI_WRP_BATCH_LIST can carry (BATCH_MAX_MESSAGES in the firmware) */
+#define WRP_BATCH_MAX           64
+
+/* Reply to SCSI_WRP_BATCH_RESPONSE: opcode echo, batch ID, count, one token per message */
+#define WRP_BATCH_REPLY_LEN(n)  (1 + WRP_MESSAGE_ID_LEN + 1 + (n) * WRP_TOKEN_LEN)
+
+/* Data-out of SCSI_WRP_COMMIT in a batch session: message ID, its token from the batch reply */
+#define WRP_COMMIT_BATCH_LEN    (WRP_MESSAGE_ID_LEN + WRP_TOKEN_LEN)
+
+/*
+ * Reply to SCSI_WRP_STATS: the firmware's WRP_Stats_t, packed and
+ * little-endian. Offsets of each counter in the reply:
+ */
+#define WRP_STATS_POOL_SIZE      0	/* uint8_t */
+#define WRP_STATS_POOL_DEPTH     1	/* uint8_t */
+#define WRP_STATS_POOL_REFILLS   2	/* uint32_t */
+#define WRP_STATS_POOL_HITS      6	/* uint32_t */
+#define WRP_STATS_POOL_MISSES    10	/* uint32_t */
+#define WRP_STATS_ENTROPY_BITS   14	/* uint16_t */
+#define WRP_STATS_RESEEDS        16	/* uint32_t */
+#define WRP_STATS_RANDOM_CYCLES  20	/* uint16_t */
+#define WRP_STATS_TOKEN_CHECKS   22	/* uint32_t */
+#define WRP_STATS_TOKEN_REJECTS  26	/* uint32_t */
+#define WRP_STATS_TOKEN_CYCLES   30	/* uint16_t */
+#define WRP_STATS_POLICY_REJECTS 32	/* uint32_t */
+#define WRP_STATS_POLICY_CYCLES  36	/* uint16_t */
+#define WRP_STATS_GUARD_REJECTS  38	/* uint32_t */
+#define WRP_STATS_GUARD_REBUILDS 42	/* uint32_t */
+#define WRP_STATS_GUARD_CYCLES   46	/* uint16_t */
+#define WRP_STATS_LINK_BLOCKS    48	/* uint32_t */
+#define WRP_STATS_LINK_FRAMES    52	/* uint32_t */
+#define WRP_STATS_AES_CYCLES     56	/* uint16_t */
+#define WRP_STATS_LEN            58
+
+/*
+ * LBA write policy table, as read with SCSI_WRP_GET_POLICY: the table's
+ * serial number (4 bytes) and number of ranges (2 bytes), then each range
+ * as its first block (4 bytes) and policy (1 byte). Ranges are sorted and
+ * the first starts at block 0; each runs up to the next. Fields are
+ * big-endian.
+ *
+ * SCSI_WRP_SET_POLICY sends, after a message ID and token, a head of the
+ * serial number, which must be above the installed table's, the number of
+ * ranges and the SHA-256 of the first chunk; then the ranges in chunks of
+ * WRP_POLICY_CHUNK_RANGES, every chunk but the last followed by the SHA-256
+ * of the next (which covers that chunk's own trailing hash). The message ID
+ * is the SHA-256 of the head. The firmware checks each chunk before writing
+ * any of it.
+ */
+#define WRP_POLICY_MAX_RANGES    160	/* WRITE_POLICY_MAX_RANGES in the firmware */
+#define WRP_POLICY_APPEND_SLOTS  8	/* WRITE_POLICY_APPEND_SLOTS in the firmware */
+#define WRP_POLICY_CHUNK_RANGES  16	/* WRITE_POLICY_CHUNK_RANGES in the firmware */
+#define WRP_POLICY_RANGE_LEN     5
+#define WRP_POLICY_LEN(n)        (6 + (n) * WRP_POLICY_RANGE_LEN)
+#define WRP_POLICY_HEAD_LEN      (6 + WRP_MESSAGE_ID_LEN)
+#define WRP_POLICY_CHUNKS(n)     (((n) + WRP_POLICY_CHUNK_RANGES - 1) / WRP_POLICY_CHUNK_RANGES)
+#define WRP_POLICY_SET_LEN(n)    (WRP_POLICY_HEAD_LEN + (n) * WRP_POLICY_RANGE_LEN + \
+				  (WRP_POLICY_CHUNKS(n) - 1) * WRP_MESSAGE_ID_LEN)
+
+/* Policy of a range; an append-only range carries its append slot in the high nibble */
+#define WRP_POLICY_WRITABLE      0
+#define WRP_POLICY_PROTECTED     1
+#define WRP_POLICY_APPEND_ONLY   2
+
+/*
+ * File guard list, as sent with SCSI_WRP_SET_FILE_GUARD (after a message
+ * ID and token): the number of objects (1 byte), then each protected file
+ * or directory as its first cluster and the block holding its directory
+ * entry (4 bytes each, big-endian). SCSI_WRP_GET_FILE_GUARD returns the
+ * count, the cache state and the number of cached runs of blocks (1 byte
+ * each), then the objects.
+ */
+#define WRP_GUARD_MAX_OBJECTS    4	/* FILE_GUARD_MAX_OBJECTS in the firmware */
+#define WRP_GUARD_OBJECT_LEN     8
+#define WRP_GUARD_LEN(n)         (1 + (n) * WRP_GUARD_OBJECT_LEN)
+#define WRP_GUARD_REPLY_LEN(n)   (3 + (n) * WRP_GUARD_OBJECT_LEN)
+
+/* Byte 1 of SCSI_WRP_RANDOM: generator output, or raw samples of one noise source */
+#define WRP_RANDOM_DRBG          0
+#define WRP_RANDOM_RAW_WDT       1	/* watchdog oscillator jitter */
+#define WRP_RANDOM_RAW_SOF       2	/* USB start-of-frame timing */
+#define WRP_RANDOM_RAW_ADC       3	/* temperature sensor LSBs */
+
+/* Largest CDB a Bulk-Only Transport command block can carry */
+#define WRP_MAX_CDB_LEN         16
+
+/* Fill a 10-byte READ(10)/WRITE(10) CDB; SCSI fields are big-endian */
+static inline void wrp_build_rw10(uint8_t *cdb, uint8_t opcode, uint32_t lba, uint16_t blocks)
+{
+	memset(cdb, 0, 10);
+	cdb[0] = opcode;
+	cdb[2] = (uint8_t)(lba >> 24);
+	cdb[3] = (uint8_t)(lba >> 16);
+	cdb[4] = (uint8_t)(lba >> 8);
+	cdb[5] = (uint8_t)lba;
+	cdb[7] = (uint8_t)(blocks >> 8);
+	cdb[8] = (uint8_t)blocks;
+}
+
+/*
+ * Fill the grant sent with a challenge request and again with its
+ * response: a successful response lets WRITE(10) write up to <blocks>
+ * blocks within [lba, lba + range) for <lifetime_s> seconds. Fields are
+ * big-endian.
+ */
+static inline void wrp_build_grant(uint8_t *grant, uint32_t lba, uint32_t range, uint32_t blocks,
+	uint16_t lifetime_s)
+{
+	memset(grant, 0, WRP_GRANT_LEN);
+	grant[0] = (uint8_t)(lba >> 24);
+	grant[1] = (uint8_t)(lba >> 16);
+	grant[2] = (uint8_t)(lba >> 8);
+	grant[3] = (uint8_t)lba;
+	grant[4] = (uint8_t)(range >> 24);
+	grant[5] = (uint8_t)(range >> 16);
+	grant[6] = (uint8_t)(range >> 8);
+	grant[7] = (uint8_t)range;
+	grant[8] = (uint8_t)(blocks >> 24);
+	grant[9] = (uint8_t)(blocks >> 16);
+	grant[10] = (uint8_t)(blocks >> 8);
+	grant[11] = (uint8_t)blocks;
+	grant[12] = (uint8_t)(lifetime_s >> 8);
+	grant[13] = (uint8_t)lifetime_s;
+}
+
+#endif
@@ -0,0 +1,414 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <scsi/sg.h>
+
+#include "wrp_aes.h"
+#include "wrp_sg.h"
+
+int wrp_sg_open(struct wrp_sg_dev *dev, const char *path)
+{
+	int version;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->timeout_ms = WRP_SG_DEFAULT_TIMEOUT_MS;
+
+	/* O_NONBLOCK keeps open() from waiting on the medium; SG_IO itself still blocks */
+	dev->fd = open(path, O_RDWR | O_NONBLOCK);
+	if (dev->fd < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (ioctl(dev->fd, SG_GET_VERSION_NUM, &version) < 0 || version < 30000) {
+		fprintf(stderr, "%s does not support SG_IO v3\n", path);
+		close(dev->fd);
+		dev->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void wrp_sg_close(struct wrp_sg_dev *dev)
+{
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
+
+int wrp_sg_command(struct wrp_sg_dev *dev, const uint8_t *cdb, uint8_t cdb_len,
+	int direction, void *data, uint32_t data_len)
+{
+	sg_io_hdr_t io;
+
+	if (cdb_len == 0 || cdb_len > WRP_MAX_CDB_LEN)
+		return -1;
+
+	memset(&io, 0, sizeof(io));
+	io.interface_id = 'S';
+	io.cmdp = (unsigned char *)cdb;
+	io.cmd_len = cdb_len;
+	io.sbp = dev->sense;
+	io.mx_sb_len = sizeof(dev->sense);
+	io.dxferp = data;
+	io.dxfer_len = data_len;
+	io.timeout = dev->timeout_ms;
+
+	switch (direction) {
+	case WRP_SG_DIR_IN:
+		io.dxfer_direction = SG_DXFER_FROM_DEV;
+		break;
+	case WRP_SG_DIR_OUT:
+		io.dxfer_direction = SG_DXFER_TO_DEV;
+		break;
+	default:
+		io.dxfer_direction = SG_DXFER_NONE;
+		io.dxferp = NULL;
+		io.dxfer_len = 0;
+		break;
+	}
+
+	if (ioctl(dev->fd, SG_IO, &io) < 0) {
+		fprintf(stderr, "SG_IO opcode %02X: %s\n", cdb[0], strerror(errno));
+		return -1;
+	}
+
+	dev->sense_len = io.sb_len_wr;
+	if ((io.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+		fprintf(stderr, "SG_IO opcode %02X: status=%02X host=%04X driver=%04X",
+			cdb[0], io.status, io.host_status, io.driver_status);
+		if (io.sb_len_wr >= 14)
+			fprintf(stderr, " sense=%X/%02X/%02X", dev->sense[2] & 0x0F,
+				dev->sense[12], dev->sense[13]);
+		fprintf(stderr, "\n");
+		return -2;
+	}
+
+	return (int)(data_len - io.resid);
+}
+
+int wrp_sg_read10(struct wrp_sg_dev *dev, uint32_t lba, uint16_t blocks, void *data)
+{
+	uint8_t cdb[10];
+
+	wrp_build_rw10(cdb, SCSI_CMD_READ_10, lba, blocks);
+	return wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_IN, data,
+		(uint32_t)blocks * WRP_BLOCK_SIZE);
+}
+
+int wrp_sg_write10(struct wrp_sg_dev *dev, uint32_t lba, uint16_t blocks, const void *data)
+{
+	uint8_t cdb[10];
+
+	wrp_build_rw10(cdb, SCSI_CMD_WRITE_10, lba, blocks);
+	return wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_OUT, (void *)data,
+		(uint32_t)blocks * WRP_BLOCK_SIZE);
+}
+
+/*
+ * Sends the data-out phase of a WRP command that leaves a reply, then
+ * reads the reply with SCSI_WRP_GET_REPLY. The Bulk-Only transport moves
+ * data one way per command, so every WRP exchange takes these two.
+ */
+static int exchange(struct wrp_sg_dev *dev, uint8_t opcode, const uint8_t *material,
+	uint32_t material_len, uint8_t *reply, uint32_t reply_len)
+{
+	uint8_t cdb[10];
+	int r;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = opcode;
+	r = wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_OUT, (void *)material, material_len);
+	if (r < 0)
+		return r;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_GET_REPLY;
+	cdb[7] = (uint8_t)(reply_len >> 8);
+	cdb[8] = (uint8_t)reply_len;
+	r = wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_IN, reply, reply_len);
+	if (r < 0)
+		return r;
+	if (r != (int)reply_len || reply[0] != opcode) {
+		fprintf(stderr, "short or malformed reply to opcode %02X (%d bytes)\n", opcode, r);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * <grant> is built with wrp_build_grant and must be sent again with the
+ * response.
+ */
+int wrp_sg_request_challenge(struct wrp_sg_dev *dev, const uint8_t *message_id,
+	const uint8_t *grant, uint8_t *reply)
+{
+	uint8_t material[WRP_CHALLENGE_REQUEST_LEN];
+
+	memcpy(material, message_id, WRP_MESSAGE_ID_LEN);
+	memcpy(material + WRP_MESSAGE_ID_LEN, grant, WRP_GRANT_LEN);
+
+	return exchange(dev, SCSI_WRP_REQ_CHALLENGE, material, sizeof(material), reply,
+		WRP_CHALLENGE_REPLY_LEN);
+}
+
+/* A wrong response fails the first command with MISCOMPARE sense (-2) */
+static int send_response(struct wrp_sg_dev *dev, uint8_t opcode, const uint8_t *message_id,
+	const uint8_t *challenge, const uint8_t *response, const uint8_t *verification,
+	const uint8_t *grant, uint8_t *reply, uint32_t reply_len)
+{
+	uint8_t material[WRP_RESPONSE_MATERIAL_LEN];
+
+	memcpy(material, message_id, WRP_MESSAGE_ID_LEN);
+	memcpy(material + 32, challenge, WRP_CHALLENGE_LEN);
+	memcpy(material + 64, response, WRP_RESPONSE_LEN);
+	memcpy(material + 96, verification, WRP_VERIFICATION_LEN);
+	memcpy(material + 192, grant, WRP_GRANT_LEN);
+
+	return exchange(dev, opcode, material, sizeof(material), reply, reply_len);
+}
+
+int wrp_sg_send_response(struct wrp_sg_dev *dev, const uint8_t *message_id,
+	const uint8_t *challenge, const uint8_t *response, const uint8_t *verification,
+	const uint8_t *grant, uint8_t *reply)
+{
+	return send_response(dev, SCSI_WRP_RESPONSE, message_id, challenge, response, verification,
+		grant, reply, WRP_RESPONSE_REPLY_LEN);
+}
+
+/*
+ * Runs a challenge and response on message_id with an empty grant, for
+ * configuration commands that write no blocks, and stores the token the
+ * response returns. The response is made from the challenge under
+ * user_key (see wrp_respond).
+ */
+int wrp_sg_authorize(struct wrp_sg_dev *dev, const uint8_t *user_key, const uint8_t *message_id,
+	uint8_t *token)
+{
+	uint8_t grant[WRP_GRANT_LEN];
+	uint8_t challenge_reply[WRP_CHALLENGE_REPLY_LEN];
+	uint8_t response_reply[WRP_RESPONSE_REPLY_LEN];
+	uint8_t response[WRP_RESPONSE_LEN];
+
+	memset(grant, 0, sizeof(grant));
+
+	if (wrp_sg_request_challenge(dev, message_id, grant, challenge_reply) < 0)
+		return -1;
+	wrp_respond(user_key, challenge_reply + 33, response);
+
+	if (wrp_sg_send_response(dev, message_id, challenge_reply + 33, response,
+			challenge_reply + 65, grant, response_reply) < 0)
+		return -1;
+
+	memset(response, 0, sizeof(response));
+	memcpy(token, response_reply + 33, WRP_TOKEN_LEN);
+	return 0;
+}
+
+/*
+ * Sends the n message IDs of a batch. The challenge for the batch is then
+ * requested with wrp_sg_request_challenge, using wrp_batch_id of the same
+ * list as the message ID.
+ */
+int wrp_sg_send_batch_list(struct wrp_sg_dev *dev, const uint8_t *message_ids, unsigned int n)
+{
+	uint8_t cdb[10];
+	int r;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_BATCH_LIST;
+	r = wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_OUT, (void *)message_ids,
+		n * WRP_MESSAGE_ID_LEN);
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Answers the challenge for a batch; on success reply holds
+ * WRP_BATCH_REPLY_LEN(n) bytes, with the token for message i at
+ * reply + 34 + 32 * i. The write session that opens takes one
+ * wrp_sg_commit_batch per message, in list order.
+ */
+int wrp_sg_send_batch_response(struct wrp_sg_dev *dev, const uint8_t *batch_id,
+	const uint8_t *challenge, const uint8_t *response, const uint8_t *verification,
+	const uint8_t *grant, unsigned int n, uint8_t *reply)
+{
+	return send_response(dev, SCSI_WRP_BATCH_RESPONSE, batch_id, challenge, response, verification,
+		grant, reply, WRP_BATCH_REPLY_LEN(n));
+}
+
+/*
+ * Ends the write session opened by wrp_sg_send_response. Fails with
+ * MISCOMPARE sense (-2) unless the SHA-256 of the data written since then
+ * equals the message ID.
+ */
+int wrp_sg_commit(struct wrp_sg_dev *dev)
+{
+	uint8_t cdb[6];
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_COMMIT;
+	return wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_NONE, NULL, 0);
+}
+
+/*
+ * Commits one message of a batch session: the data written since the
+ * previous commit must hash to message_id, and token must be the one the
+ * batch reply gave for it. The last commit of the batch also fails unless
+ * the committed IDs match the list the batch was authorized for.
+ */
+int wrp_sg_commit_batch(struct wrp_sg_dev *dev, const uint8_t *message_id, const uint8_t *token)
+{
+	uint8_t material[WRP_COMMIT_BATCH_LEN];
+	uint8_t cdb[6];
+	int r;
+
+	memcpy(material, message_id, WRP_MESSAGE_ID_LEN);
+	memcpy(material + WRP_MESSAGE_ID_LEN, token, WRP_TOKEN_LEN);
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_COMMIT;
+	r = wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_OUT, material, sizeof(material));
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Writes blocks and commits them in one command: the data is preceded by
+ * the message ID and the token wrp_sg_send_response returned for it, and
+ * must hash to the message ID. The token is only good for writes within
+ * the grant of that response, while the grant lives. Fails with DATA
+ * PROTECT sense (-2) before anything is written if the token is wrong,
+ * and with MISCOMPARE sense (-2) if the data does not match.
+ */
+int wrp_sg_auth_write(struct wrp_sg_dev *dev, uint32_t lba, uint16_t blocks,
+	const uint8_t *message_id, const uint8_t *token, const void *data)
+{
+	uint32_t len = WRP_AUTH_WRITE_HEADER_LEN + (uint32_t)blocks * WRP_BLOCK_SIZE;
+	uint8_t *buf = malloc(len);
+	uint8_t cdb[10];
+	int r;
+
+	if (!buf)
+		return -1;
+	memcpy(buf, message_id, WRP_MESSAGE_ID_LEN);
+	memcpy(buf + WRP_MESSAGE_ID_LEN, token, WRP_TOKEN_LEN);
+	memcpy(buf + WRP_AUTH_WRITE_HEADER_LEN, data, (size_t)blocks * WRP_BLOCK_SIZE);
+
+	wrp_build_rw10(cdb, SCSI_WRP_AUTH_WRITE, lba, blocks);
+	r = wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_OUT, buf, len);
+	free(buf);
+	return r < 0 ? r : 0;
+}
+
+/* Sends an authorized configuration: message ID, token, then the material the message ID hashes */
+static int send_authorized(struct wrp_sg_dev *dev, uint8_t opcode, const uint8_t *message_id,
+	const uint8_t *token, const uint8_t *material, uint32_t len)
+{
+	uint32_t total = WRP_MESSAGE_ID_LEN + WRP_TOKEN_LEN + len;
+	uint8_t *buf = malloc(total);
+	uint8_t cdb[10];
+	int r;
+
+	if (!buf)
+		return -1;
+	memcpy(buf, message_id, WRP_MESSAGE_ID_LEN);
+	memcpy(buf + WRP_MESSAGE_ID_LEN, token, WRP_TOKEN_LEN);
+	memcpy(buf + WRP_MESSAGE_ID_LEN + WRP_TOKEN_LEN, material, len);
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = opcode;
+	r = wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_OUT, buf, total);
+	free(buf);
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Replaces the firmware's write policy table with a WRP_POLICY_SET_LEN
+ * head and chunk chain whose head hashes to message_id; token is what a
+ * challenge response returned for it. The firmware writes the table to
+ * EEPROM as it arrives, which can take seconds, so the timeout is
+ * stretched for this command.
+ */
+int wrp_sg_set_policy(struct wrp_sg_dev *dev, const uint8_t *message_id, const uint8_t *token,
+	const uint8_t *table, uint32_t len)
+{
+	unsigned int timeout_ms = dev->timeout_ms;
+	int r;
+
+	if (dev->timeout_ms < 30000)
+		dev->timeout_ms = 30000;
+	r = send_authorized(dev, SCSI_WRP_SET_POLICY, message_id, token, table, len);
+	dev->timeout_ms = timeout_ms;
+	return r;
+}
+
+/* Reads up to len bytes of the firmware's write policy table; returns the byte count */
+int wrp_sg_get_policy(struct wrp_sg_dev *dev, uint8_t *table, uint16_t len)
+{
+	uint8_t cdb[10];
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_GET_POLICY;
+	cdb[7] = (uint8_t)(len >> 8);
+	cdb[8] = (uint8_t)len;
+	return wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_IN, table, len);
+}
+
+/*
+ * Replaces the files and directories the firmware's file guard protects
+ * with a WRP_GUARD_LEN list whose SHA-256 is message_id. The firmware walks
+ * their cluster chains before it answers, so the timeout is stretched.
+ */
+int wrp_sg_set_file_guard(struct wrp_sg_dev *dev, const uint8_t *message_id, const uint8_t *token,
+	const uint8_t *list, uint32_t len)
+{
+	unsigned int timeout_ms = dev->timeout_ms;
+	int r;
+
+	if (dev->timeout_ms < 30000)
+		dev->timeout_ms = 30000;
+	r = send_authorized(dev, SCSI_WRP_SET_FILE_GUARD, message_id, token, list, len);
+	dev->timeout_ms = timeout_ms;
+	return r;
+}
+
+/* Reads up to len bytes of the file guard's state; returns the byte count */
+int wrp_sg_get_file_guard(struct wrp_sg_dev *dev, uint8_t *reply, uint16_t len)
+{
+	uint8_t cdb[10];
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_GET_FILE_GUARD;
+	cdb[7] = (uint8_t)(len >> 8);
+	cdb[8] = (uint8_t)len;
+	return wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_IN, reply, len);
+}
+
+/* Reads up to len bytes of the firmware's WRP counters; returns the byte count */
+int wrp_sg_get_stats(struct wrp_sg_dev *dev, uint8_t *stats, uint16_t len)
+{
+	uint8_t cdb[10];
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_STATS;
+	cdb[7] = (uint8_t)(len >> 8);
+	cdb[8] = (uint8_t)len;
+	return wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_IN, stats, len);
+}
+
+/* Reads len bytes of generator output or raw noise (WRP_RANDOM_*) */
+int wrp_sg_get_random(struct wrp_sg_dev *dev, uint8_t source, uint8_t *data, uint16_t len)
+{
+	uint8_t cdb[10];
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SCSI_WRP_RANDOM;
+	cdb[1] = source;
+	cdb[7] = (uint8_t)(len >> 8);
+	cdb[8] = (uint8_t)len;
+	return wrp_sg_command(dev, cdb, sizeof(cdb), WRP_SG_DIR_IN, data, len);
+}
@@ -0,0 +1,60 @@
+#ifndef WRP_SG_H
+#define WRP_SG_H
+
+#include <stdint.h>
+
+#include "wrp_scsi.h"
+
+#define WRP_SG_DIR_NONE  0
+#define WRP_SG_DIR_IN    1
+#define WRP_SG_DIR_OUT   2
+
+#define WRP_SG_DEFAULT_TIMEOUT_MS 5000
+
+/*
+ * A WRP device reached through the Linux SG_IO ioctl. The path may be the
+ * block device the kernel already mounted (/dev/sdX), its /dev/sgN or a
+ * bsg node; the usb-storage driver stays bound either way, so filesystem
+ * I/O continues while vendor commands are in flight.
+ */
+struct wrp_sg_dev {
+	int fd;
+	unsigned int timeout_ms;
+	uint8_t sense[32];
+	uint8_t sense_len;
+};
+
+int wrp_sg_open(struct wrp_sg_dev *dev, const char *path);
+void wrp_sg_close(struct wrp_sg_dev *dev);
+
+int wrp_sg_command(struct wrp_sg_dev *dev, const uint8_t *cdb, uint8_t cdb_len,
+	int direction, void *data, uint32_t data_len);
+
+int wrp_sg_read10(struct wrp_sg_dev *dev, uint32_t lba, uint16_t blocks, void *data);
+int wrp_sg_write10(struct wrp_sg_dev *dev, uint32_t lba, uint16_t blocks, const void *data);
+
+int wrp_sg_request_challenge(struct wrp_sg_dev *dev, const uint8_t *message_id,
+	const uint8_t *grant, uint8_t *reply);
+int wrp_sg_send_response(struct wrp_sg_dev *dev, const uint8_t *message_id,
+	const uint8_t *challenge, const uint8_t *response, const uint8_t *verification,
+	const uint8_t *grant, uint8_t *reply);
+int wrp_sg_authorize(struct wrp_sg_dev *dev, const uint8_t *user_key, const uint8_t *message_id,
+	uint8_t *token);
+int wrp_sg_commit(struct wrp_sg_dev *dev);
+int wrp_sg_send_batch_list(struct wrp_sg_dev *dev, const uint8_t *message_ids, unsigned int n);
+int wrp_sg_send_batch_response(struct wrp_sg_dev *dev, const uint8_t *batch_id,
+	const uint8_t *challenge, const uint8_t *response, const uint8_t *verification,
+	const uint8_t *grant, unsigned int n, uint8_t *reply);
+int wrp_sg_commit_batch(struct wrp_sg_dev *dev, const uint8_t *message_id, const uint8_t *token);
+int wrp_sg_auth_write(struct wrp_sg_dev *dev, uint32_t lba, uint16_t blocks,
+	const uint8_t *message_id, const uint8_t *token, const void *data);
+int wrp_sg_set_policy(struct wrp_sg_dev *dev, const uint8_t *message_id, const uint8_t *token,
+	const uint8_t *table, uint32_t len);
+int wrp_sg_get_policy(struct wrp_sg_dev *dev, uint8_t *table, uint16_t len);
+int wrp_sg_set_file_guard(struct wrp_sg_dev *dev, const uint8_t *message_id, const uint8_t *token,
+	const uint8_t *list, uint32_t len);
+int wrp_sg_get_file_guard(struct wrp_sg_dev *dev, uint8_t *reply, uint16_t len);
+int wrp_sg_get_stats(struct wrp_sg_dev *dev, uint8_t *stats, uint16_t len);
+int wrp_sg_get_random(struct wrp_sg_dev *dev, uint8_t source, uint8_t *data, uint16_t len);
+
+#endif
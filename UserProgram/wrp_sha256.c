@@ -0,0 +1,120 @@
+#include <string.h>
+
+#include "wrp_sha256.h"
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void compress(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+			((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void wrp_sha256_init(struct wrp_sha256 *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->length = 0;
+	ctx->fill = 0;
+}
+
+void wrp_sha256_update(struct wrp_sha256 *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	ctx->length += len;
+	while (len) {
+		size_t n = sizeof(ctx->buf) - ctx->fill;
+
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->fill, p, n);
+		ctx->fill += n;
+		p += n;
+		len -= n;
+		if (ctx->fill == sizeof(ctx->buf)) {
+			compress(ctx->state, ctx->buf);
+			ctx->fill = 0;
+		}
+	}
+}
+
+void wrp_sha256_final(struct wrp_sha256 *ctx, uint8_t *digest)
+{
+	static const uint8_t pad[64] = { 0x80 };
+	uint64_t bits = ctx->length * 8;
+	uint8_t len_be[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		len_be[i] = (uint8_t)(bits >> (56 - 8 * i));
+
+	wrp_sha256_update(ctx, pad, ctx->fill < 56 ? 56 - ctx->fill : 120 - ctx->fill);
+	wrp_sha256_update(ctx, len_be, sizeof(len_be));
+
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = (uint8_t)(ctx->state[i] >> 24);
+		digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+		digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+		digest[4 * i + 3] = (uint8_t)ctx->state[i];
+	}
+}
+
+void wrp_sha256(const void *data, size_t len, uint8_t *digest)
+{
+	struct wrp_sha256 ctx;
+
+	wrp_sha256_init(&ctx);
+	wrp_sha256_update(&ctx, data, len);
+	wrp_sha256_final(&ctx, digest);
+}
+
+void wrp_batch_id(const uint8_t *message_ids, size_t n, uint8_t *batch_id)
+{
+	uint8_t link[2 * WRP_SHA256_LEN];
+	size_t i;
+
+	memset(link, 0, WRP_SHA256_LEN);
+	for (i = 0; i < n; i++) {
+		memcpy(link + WRP_SHA256_LEN, message_ids + i * WRP_SHA256_LEN, WRP_SHA256_LEN);
+		wrp_sha256(link, sizeof(link), link);
+	}
+	memcpy(batch_id, link, WRP_SHA256_LEN);
+}
@@ -0,0 +1,31 @@
+#ifndef WRP_SHA256_H
+#define WRP_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRP_SHA256_LEN 32
+
+/*
+ * Incremental SHA-256, used to compute the message ID of a payload the
+ * same way the firmware hashes it while it is written.
+ */
+struct wrp_sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t buf[64];
+	size_t fill;
+};
+
+void wrp_sha256_init(struct wrp_sha256 *ctx);
+void wrp_sha256_update(struct wrp_sha256 *ctx, const void *data, size_t len);
+void wrp_sha256_final(struct wrp_sha256 *ctx, uint8_t *digest);
+void wrp_sha256(const void *data, size_t len, uint8_t *digest);
+
+/*
+ * Batch ID of a list of n message IDs, the message ID a batch challenge is
+ * requested for: B(i) = SHA-256(B(i-1) || id i), B(0) = 0, batch ID = B(n).
+ */
+void wrp_batch_id(const uint8_t *message_ids, size_t n, uint8_t *batch_id);
+
+#endif
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "wrp_sg.h"
+
+/*
+ * Prints the firmware's WRP tuning counters (SCSI_WRP_STATS). Counters a
+ * firmware build does not report are left out.
+ */
+
+static uint16_t le16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int main(int argc, char **argv)
+{
+	struct wrp_sg_dev dev;
+	uint8_t stats[256];
+	int len;
+
+	if (argc < 2) {
+		printf("usage: wrp_stats /dev/sdX\n");
+		return 0;
+	}
+
+	if (wrp_sg_open(&dev, argv[1]) < 0)
+		return 1;
+
+	memset(stats, 0, sizeof(stats));
+	len = wrp_sg_get_stats(&dev, stats, sizeof(stats));
+	wrp_sg_close(&dev);
+	if (len < 0)
+		return 1;
+
+	if (len >= WRP_STATS_POOL_MISSES + 4) {
+		printf("challenge pool:   %u/%u\n", stats[WRP_STATS_POOL_DEPTH], stats[WRP_STATS_POOL_SIZE]);
+		printf("  refills:        %u\n", le32(stats + WRP_STATS_POOL_REFILLS));
+		printf("  hits:           %u\n", le32(stats + WRP_STATS_POOL_HITS));
+		printf("  misses:         %u\n", le32(stats + WRP_STATS_POOL_MISSES));
+	}
+	if (len >= WRP_STATS_RANDOM_CYCLES + 2) {
+		printf("entropy pool:     %u bits\n", le16(stats + WRP_STATS_ENTROPY_BITS));
+		printf("  reseeds:        %u\n", le32(stats + WRP_STATS_RESEEDS));
+		printf("challenge cycles: %u\n", le16(stats + WRP_STATS_RANDOM_CYCLES));
+	}
+	if (len >= WRP_STATS_TOKEN_CYCLES + 2) {
+		printf("token checks:     %u\n", le32(stats + WRP_STATS_TOKEN_CHECKS));
+		printf("  rejects:        %u\n", le32(stats + WRP_STATS_TOKEN_REJECTS));
+		printf("  check cycles:   %u\n", le16(stats + WRP_STATS_TOKEN_CYCLES));
+	}
+	if (len >= WRP_STATS_POLICY_CYCLES + 2) {
+		printf("policy rejects:   %u\n", le32(stats + WRP_STATS_POLICY_REJECTS));
+		printf("  check cycles:   %u\n", le16(stats + WRP_STATS_POLICY_CYCLES));
+	}
+	if (len >= WRP_STATS_GUARD_CYCLES + 2) {
+		printf("guard rejects:    %u\n", le32(stats + WRP_STATS_GUARD_REJECTS));
+		printf("  rebuilds:       %u\n", le32(stats + WRP_STATS_GUARD_REBUILDS));
+		printf("  check cycles:   %u\n", le16(stats + WRP_STATS_GUARD_CYCLES));
+	}
+	if (len >= WRP_STATS_LINK_FRAMES + 4 && le32(stats + WRP_STATS_LINK_FRAMES)) {
+		printf("node link:        %u bytes of blocks\n", le32(stats + WRP_STATS_LINK_BLOCKS));
+		printf("  in frames of:   %u bytes (%.1f:1)\n", le32(stats + WRP_STATS_LINK_FRAMES),
+			(double)le32(stats + WRP_STATS_LINK_BLOCKS) / le32(stats + WRP_STATS_LINK_FRAMES));
+	}
+	if (len >= WRP_STATS_AES_CYCLES + 2)
+		printf("aes cycles/block: %u\n", le16(stats + WRP_STATS_AES_CYCLES));
+
+	return 0;
+}
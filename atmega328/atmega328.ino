@@ -1,4 +1,8 @@
+#include <util/atomic.h>
+#include <util/crc16.h>
+
 //#define SERIAL_DEBUG
+//#define COPROCESSOR_MODE // hash for the 32U4 over SPI instead of bridging an SD card
 
 #define SD_ERROR 0
 #define SD_READ 1
@@ -9,8 +13,101 @@
 #define SD_SET_BLKS 6
 #define SD_ABORT 7
 
+#define SD_READ_BLOCKS 8
+#define SD_WRITE_BLOCKS 9
+#define SD_CREDIT 10
+#define SD_DATA 11
+#define SD_NAK 12
+#define SD_STATUS 13
+#define SD_GRANT 14
+#define SD_PACKED 15
+#define SD_FILL 16
+#define SD_GET_STATS 17
+#define SD_QUEUE 18
+#define SD_RESET 19
+
 #define BLK_SIZE 512
 #define TRANSMIT_LENGTH 16
+
+// Link protocol (normal operation). Every message is a frame: its bytes and
+// their CRC-16 (as _crc_ccitt_update from 0xffff, appended little-endian),
+// COBS-encoded and ended by a 0x00. A damaged frame fails its CRC and is
+// dropped alone; the next one starts after the next 0x00. Host to node:
+//   SD_GET_INFO <tag>                          -> SD_SUCCESS <tag> <sd_raw_info>, or SD_ERROR <tag>
+//   SD_READ_BLOCKS <tag> <lba:4> <count:2>     -> SD_DATA frames, or SD_ERROR <tag> <block:2>
+//   SD_WRITE_BLOCKS <tag> <lba:4> <count:2>    -> SD_CREDIT frames, then SD_SUCCESS or SD_ERROR <tag>
+//   SD_DATA <tag> <block:2> <chunk> <data>     LINK_CHUNK bytes of write data
+//   SD_NAK <tag> <block:2> <chunk>             send this chunk of the last read again
+//   SD_STATUS <tag>                            -> SD_SUCCESS or SD_ERROR <tag> of the last write
+//   SD_GET_STATS <tag>                         -> SD_SUCCESS <tag> <link_stats>
+//   SD_QUEUE <tag> { <type> <tag> <lba:4> <count:2> }
+//                                              up to LINK_QUEUE reads and writes, run back
+//                                              to back as if each request had just come
+//                                              in, each ending with SD_SUCCESS or SD_ERROR
+//                                              <tag>; a repeated SD_QUEUE is ignored
+//   SD_RESET <tag> <session:4>                 -> SD_SUCCESS <tag>; starts a session, ending
+//                                              the request in progress and forgetting the
+//                                              last session's requests and SD_QUEUE, whose
+//                                              tags the new one uses again; a repeated
+//                                              SD_RESET (same session) is only answered
+// and node to host, besides the replies:
+//   SD_DATA <tag> <block:2> <chunk> <data>     LINK_CHUNK bytes of read data
+//   SD_CREDIT <tag> <frames:2> <resync> <blocks:2>
+//                                              frames taken from the receive ring so far,
+//                                              and blocks of the write held in full
+//   SD_NAK <tag> <block:2> <chunk>             send this chunk of the write again
+// Either way, block data may also go as
+//   SD_PACKED <tag> <block:2> <chunk> <runs>   a chunk, run-length coded (see link_pack)
+//   SD_FILL <tag> <block:2> <byte>             a whole block of one byte, such as zeros
+// in place of SD_DATA frames when those are longer; a filled block counts as
+// its last chunk, and missing chunks are asked for and sent again one by one.
+// Fields are little-endian; blocks count from the request's lba, and the tag
+// of every reply is the tag of its request, so late frames of an earlier
+// request are told apart. The host keeps at most LINK_WINDOW frames beyond
+// the node's count in flight, which the receive ring always has room for;
+// with resync set the ring is empty and the host takes the count as the
+// number of frames it has sent. Either side asks for missing chunks when it
+// sees a gap in the chunk numbers or when the link has been quiet for
+// LINK_TIMEOUT_MS, so a bit error costs the one frame it hit. A write the
+// host stops sending for LINK_RETRIES such periods fails. See
+// UserProgram/wrp_link.c and MassStorage/Lib/RemoteStorage.c for hosts.
+// SERIAL_DEBUG keeps the one-character SD_READ/SD_WRITE/SD_SET_* commands.
+//
+// With LINK_NODE defined the node shares the link with up to seven others,
+// for a host striping blocks across them: every node's RX on the host's TX,
+// and every node's TX on the host's RX, which a node only drives while it is
+// sending (the line needs a pull-up). The top three bits of a tag are the
+// address of the node it is for, and frames for other nodes are ignored. A
+// request starts quietly and the host hands out the bus one node at a time:
+//   SD_GRANT <tag> <from:2> <to:2>             send, or take in, blocks from..to-1
+// A read fetches its next block from the card while it waits for the bus; a
+// write answers its grant with a resync credit and programs its card after
+// the last credit, while the host goes on with the next node. Its result is
+// only sent when the host asks with SD_STATUS, or grants it again once it
+// has ended. A request for this node with a new tag ends the one in
+// progress, and the rest of a queue with it. SD_QUEUE and SD_RESET are not
+// taken on a bus, where a node only speaks when granted.
+//#define LINK_NODE 0
+#define LINK_NODE_SHIFT 5
+#define LINK_BAUD 1000000 // run with U2X; 1000000 and 2000000 are exact at 16MHz
+#define LINK_CHUNK 64
+#define LINK_CHUNKS (BLK_SIZE / LINK_CHUNK)
+#define LINK_DATA_LENGTH (LINK_CHUNK + 5) // type, tag, block, chunk, data
+#define LINK_FRAME_MAX (LINK_CHUNK + 10) // data frame with CRC, COBS code byte and delimiter
+#define LINK_WINDOW LINK_CHUNKS // a block beyond the one being written
+#define LINK_TIMEOUT_MS 20
+#define LINK_RETRIES 50
+#define LINK_QUEUE 4 // requests an SD_QUEUE frame may carry
+
+// a read or write, as a request frame or an SD_QUEUE entry carries it
+struct link_request
+{
+  uint8_t type;
+  uint8_t tag;
+  uint8_t status; // SD_SUCCESS or SD_ERROR once it has ended, else 0
+  uint32_t lba;
+  uint16_t count;
+};
   
  //FROM SD_RAW_CONFIG_H//////////////////////////////////////////
   /**
@@ -303,6 +400,9 @@ static uint8_t raw_block_written;
 /* card type state */
 static uint8_t sd_raw_card_type;
 
+/* offset of the block a running multiple block read delivers next */
+static offset_t raw_stream_address = (offset_t) -1;
+
 /* private helper functions */
 static void sd_raw_send_byte(uint8_t b);
 static uint8_t sd_raw_rec_byte(void);
@@ -344,7 +444,9 @@ uint8_t sd_raw_init()
     
     if(!sd_raw_available())
     {
+        #ifdef SERIAL_DEBUG
         Serial.println("not available");
+        #endif
         return 0;
     }
     /* card needs 74 cycles minimum to start up */
@@ -368,7 +470,9 @@ uint8_t sd_raw_init()
         if(i == 0x1ff)
         {
             unselect_card();
+            #ifdef SERIAL_DEBUG
             Serial.println("couldn't get response");
+            #endif
             return 0;
         }
     }
@@ -382,12 +486,16 @@ uint8_t sd_raw_init()
         sd_raw_rec_byte();
         if((sd_raw_rec_byte() & 0x01) == 0)
         {
+            #ifdef SERIAL_DEBUG
             Serial.println("voltage doesn't match");
+            #endif
             return 0; /* card operation voltage range doesn't match */
         }
         if(sd_raw_rec_byte() != 0xaa)
         {
+            #ifdef SERIAL_DEBUG
             Serial.println("wrong test pattern");
+            #endif
             return 0; /* wrong test pattern */
         }
 
@@ -435,7 +543,9 @@ uint8_t sd_raw_init()
         if(i == 0x7fff)
         {
             unselect_card();
+            #ifdef SERIAL_DEBUG
             Serial.println("Card didn't get ready");
+            #endif
             return 0;
         }
     }
@@ -446,7 +556,9 @@ uint8_t sd_raw_init()
         if(sd_raw_send_command(CMD_READ_OCR, 0))
         {
             unselect_card();
+            #ifdef SERIAL_DEBUG
             Serial.println("Couldn't read info");
+            #endif
             return 0;
         }
 
@@ -463,7 +575,9 @@ uint8_t sd_raw_init()
     if(sd_raw_send_command(CMD_SET_BLOCKLEN, 512))
     {
         unselect_card();
+        #ifdef SERIAL_DEBUG
         Serial.println("Couldn't set blk size");
+        #endif
         return 0;
     }
 
@@ -474,6 +588,8 @@ uint8_t sd_raw_init()
     SPCR &= ~((1 << SPR1) | (1 << SPR0)); /* Clock Frequency: f_OSC / 4 */
     SPSR |= (1 << SPI2X); /* Doubled Clock Frequency: f_OSC / 2 */
 
+    raw_stream_address = (offset_t) -1;
+
 #if !SD_RAW_SAVE_RAM
     /* the first block is likely to be accessed first, so precache it here */
     raw_block_address = (offset_t) -1;
@@ -482,7 +598,9 @@ uint8_t sd_raw_init()
 #endif
     if(!sd_raw_read(0, raw_block, sizeof(raw_block)))
     {
+        #ifdef SERIAL_DEBUG
         Serial.println("couldn't read a blk");
+        #endif
         return 0;
     }
 #endif
@@ -623,18 +741,25 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
                 return 0;
 #endif
 
-            /* address card */
-            select_card();
+            /* a running multiple block read brings the block without a command */
+            if(block_address != raw_stream_address)
+            {
+                if(!sd_raw_stop_stream())
+                    return 0;
 
-            /* send single block request */
+                /* address card */
+                select_card();
+
+                /* send single block request */
 #if SD_RAW_SDHC
-            if(sd_raw_send_command(CMD_READ_SINGLE_BLOCK, (sd_raw_card_type & (1 << SD_RAW_SPEC_SDHC) ? block_address / 512 : block_address)))
+                if(sd_raw_send_command(CMD_READ_SINGLE_BLOCK, (sd_raw_card_type & (1 << SD_RAW_SPEC_SDHC) ? block_address / 512 : block_address)))
 #else
-            if(sd_raw_send_command(CMD_READ_SINGLE_BLOCK, block_address))
+                if(sd_raw_send_command(CMD_READ_SINGLE_BLOCK, block_address))
 #endif
-            {
-                unselect_card();
-                return 0;
+                {
+                    unselect_card();
+                    return 0;
+                }
             }
 
             /* wait for data block (start byte 0xfe) */
@@ -664,11 +789,19 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
             sd_raw_rec_byte();
             sd_raw_rec_byte();
             
-            /* deaddress card */
-            unselect_card();
+            if(block_address == raw_stream_address)
+            {
+                /* keep the card addressed for the next block of the stream */
+                raw_stream_address += 512;
+            }
+            else
+            {
+                /* deaddress card */
+                unselect_card();
 
-            /* let card some time to finish */
-            sd_raw_rec_byte();
+                /* let card some time to finish */
+                sd_raw_rec_byte();
+            }
         }
 #if !SD_RAW_SAVE_RAM
         else
@@ -686,6 +819,102 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
     return 1;
 }
 
+/**
+ * \ingroup sd_raw
+ * Starts a multiple block read from the block at the given offset.
+ *
+ * The card then sends one block after the other without a command for each,
+ * and sd_raw_read() takes them from the stream as long as they are asked for
+ * in order. If the block is cached, the stream starts behind it. Any other
+ * access to the card ends the stream first.
+ *
+ * \param[in] offset The offset of the block, or of a byte within it.
+ * \returns 0 on failure, 1 on success.
+ * \see sd_raw_stop_stream, sd_raw_read
+ */
+uint8_t sd_raw_read_stream(offset_t offset)
+{
+    offset_t block_address = offset - (offset & 0x01ff);
+
+#if !SD_RAW_SAVE_RAM
+    if(block_address == raw_block_address)
+        block_address += 512;
+#endif
+    if(block_address == raw_stream_address)
+        return 1;
+
+    if(!sd_raw_stop_stream())
+        return 0;
+#if SD_RAW_WRITE_BUFFERING
+    if(!sd_raw_sync())
+        return 0;
+#endif
+
+    /* address card */
+    select_card();
+
+    /* send multiple block request */
+#if SD_RAW_SDHC
+    if(sd_raw_send_command(CMD_READ_MULTIPLE_BLOCK, (sd_raw_card_type & (1 << SD_RAW_SPEC_SDHC) ? block_address / 512 : block_address)))
+#else
+    if(sd_raw_send_command(CMD_READ_MULTIPLE_BLOCK, block_address))
+#endif
+    {
+        unselect_card();
+        return 0;
+    }
+
+    /* the card stays addressed while the stream runs */
+    raw_stream_address = block_address;
+
+    return 1;
+}
+
+/**
+ * \ingroup sd_raw
+ * Ends a multiple block read started by sd_raw_read_stream().
+ *
+ * \returns 0 on failure, 1 on success.
+ * \see sd_raw_read_stream
+ */
+uint8_t sd_raw_stop_stream()
+{
+    if(raw_stream_address == (offset_t) -1)
+        return 1;
+    raw_stream_address = (offset_t) -1;
+
+    /* send the stop command by hand, as the card keeps sending data until
+     * it is through, and the byte behind the command is a stuff byte
+     */
+    sd_raw_send_byte(0x40 | CMD_STOP_TRANSMISSION);
+    sd_raw_send_byte(0x00);
+    sd_raw_send_byte(0x00);
+    sd_raw_send_byte(0x00);
+    sd_raw_send_byte(0x00);
+    sd_raw_send_byte(0xff);
+    sd_raw_rec_byte();
+
+    /* receive response */
+    uint8_t response = 0xff;
+    for(uint8_t i = 0; i < 10; ++i)
+    {
+        response = sd_raw_rec_byte();
+        if(!(response & 0x80))
+            break;
+    }
+
+    /* wait while the card is busy */
+    while(sd_raw_rec_byte() != 0xff);
+
+    /* deaddress card */
+    unselect_card();
+
+    /* let card some time to finish */
+    sd_raw_rec_byte();
+
+    return !(response & 0x80);
+}
+
 /**
  * \ingroup sd_raw
  * Continuously reads units of \c interval bytes and calls a callback function.
@@ -884,6 +1113,9 @@ uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length)
 #endif
         }
 
+        if(!sd_raw_stop_stream())
+            return 0;
+
         /* address card */
         select_card();
 
@@ -1032,6 +1264,9 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
 
     memset(info, 0, sizeof(*info));
 
+    if(!sd_raw_stop_stream())
+        return 0;
+
     select_card();
 
     /* read cid register */
@@ -1170,16 +1405,617 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
 }
 /////////////////////////////////////////////////////////////////////////
 
+#ifdef COPROCESSOR_MODE
+//COPROCESSOR MODE///////////////////////////////////////////////////////
+// In this mode the board hashes WRP write sessions for the 32U4 instead of
+// bridging an SD card (see MassStorage/Lib/Coprocessor.h). It is an SPI
+// slave on the 32U4's SD card bus, selected by the 32U4's PB5 on SS (PB2),
+// and tells the 32U4 it can take the next frame by raising READY (PD2),
+// wired to the 32U4's PB4. This board's own SD card is not used.
+//
+// Frames: 0x01 starts a hash, 0x02 <len> <len bytes> adds up to 64 bytes,
+// 0x03 finishes it; once READY rises after 0x03, the next frame clocks the
+// 32 byte digest out. A frame is received while the previous one is hashed.
+
+#define COPROCESSOR_CMD_HASH_INIT 0x01
+#define COPROCESSOR_CMD_HASH_DATA 0x02
+#define COPROCESSOR_CMD_HASH_FINAL 0x03
+#define COPROCESSOR_FRAME_SIZE 64
+
+#define ready_high() PORTD |= (1 << PD2)
+#define ready_low() PORTD &= ~(1 << PD2)
+
+static volatile uint8_t frames[2][COPROCESSOR_FRAME_SIZE + 2];
+static volatile uint8_t rx_frame;
+static volatile uint8_t rx_length;
+static volatile uint8_t frame_done;
+static volatile uint8_t sending_digest;
+static volatile uint8_t tx_index;
+
+static const uint32_t sha_k[64] PROGMEM = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t sha_state[8];
+static uint8_t sha_block[64];
+static uint8_t sha_fill;
+static uint32_t sha_bytes;
+static uint8_t sha_failed;
+static uint8_t digest[32];
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha_compress()
+{
+  uint32_t w[16], v[8];
+
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    w[i] = ((uint32_t)sha_block[4 * i] << 24) | ((uint32_t)sha_block[4 * i + 1] << 16) |
+           ((uint16_t)sha_block[4 * i + 2] << 8) | sha_block[4 * i + 3];
+  }
+  memcpy(v, sha_state, sizeof(v));
+
+  for (uint8_t i = 0; i < 64; i++)
+  {
+    if (i >= 16) // message schedule, kept in a ring of 16 words
+    {
+      uint32_t s0 = w[(i + 1) & 15], s1 = w[(i + 14) & 15];
+      w[i & 15] += (ROTR(s0, 7) ^ ROTR(s0, 18) ^ (s0 >> 3)) + w[(i + 9) & 15] +
+                   (ROTR(s1, 17) ^ ROTR(s1, 19) ^ (s1 >> 10));
+    }
+    uint32_t t1 = v[7] + (ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) +
+                  pgm_read_dword(&sha_k[i]) + w[i & 15];
+    uint32_t t2 = (ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
+
+  for (uint8_t i = 0; i < 8; i++)
+    sha_state[i] += v[i];
+  sha_fill = 0;
+}
+
+static void sha_init()
+{
+  static const uint32_t iv[8] PROGMEM = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy_P(sha_state, iv, sizeof(sha_state));
+  sha_fill = 0;
+  sha_bytes = 0;
+  sha_failed = 0;
+}
+
+static void sha_update(const uint8_t* data, uint8_t length)
+{
+  sha_bytes += length;
+  while (length--)
+  {
+    sha_block[sha_fill++] = *data++;
+    if (sha_fill == sizeof(sha_block))
+      sha_compress();
+  }
+}
+
+static void sha_final()
+{
+  uint32_t bits = sha_bytes << 3;
+
+  sha_block[sha_fill++] = 0x80;
+  if (sha_fill > 56)
+  {
+    memset(sha_block + sha_fill, 0, sizeof(sha_block) - sha_fill);
+    sha_compress();
+  }
+  memset(sha_block + sha_fill, 0, 59 - sha_fill);
+  sha_block[59] = sha_bytes >> 29;
+  sha_block[60] = bits >> 24;
+  sha_block[61] = bits >> 16;
+  sha_block[62] = bits >> 8;
+  sha_block[63] = bits;
+  sha_compress();
+
+  // a malformed frame leaves a digest the 32U4's session can never match
+  for (uint8_t i = 0; i < 32; i++)
+    digest[i] = sha_failed ? 0 : sha_state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+ISR(SPI_STC_vect)
+{
+  uint8_t b = SPDR;
+
+  if (sending_digest)
+  {
+    if (++tx_index < sizeof(digest))
+      SPDR = digest[tx_index];
+  }
+  else if (rx_length < sizeof(frames[0]))
+  {
+    frames[rx_frame][rx_length++] = b;
+  }
+}
+
+// SS edges: MISO is only driven while selected, as the bus is shared
+ISR(PCINT0_vect)
+{
+  if (!(PINB & (1 << PB2)))
+  {
+    ready_low();
+    DDRB |= (1 << DDB4);
+  }
+  else
+  {
+    DDRB &= ~(1 << DDB4);
+    if (sending_digest)
+    {
+      sending_digest = 0;
+      ready_high();
+    }
+    else
+    {
+      frame_done = 1;
+    }
+  }
+}
+
+void coprocessor_setup()
+{
+  DDRB &= ~((1 << DDB2) | (1 << DDB3) | (1 << DDB4) | (1 << DDB5));
+  DDRD |= (1 << DDD2);
+  SPCR = (1 << SPE) | (1 << SPIE);
+  PCMSK0 |= (1 << PCINT2);
+  PCICR |= (1 << PCIE0);
+  sha_init();
+  ready_high();
+}
+
+void coprocessor_loop()
+{
+  if (!frame_done)
+    return;
+
+  // swap buffers, so that the next frame can come in while this one is hashed
+  uint8_t* frame = (uint8_t*)frames[rx_frame];
+  uint8_t length = rx_length;
+  rx_frame ^= 1;
+  rx_length = 0;
+  frame_done = 0;
+  if (!length || frame[0] != COPROCESSOR_CMD_HASH_FINAL)
+    ready_high();
+  if (!length)
+    return;
+
+  switch (frame[0])
+  {
+    case COPROCESSOR_CMD_HASH_INIT:
+      sha_init();
+      break;
+    case COPROCESSOR_CMD_HASH_DATA:
+      if (length >= 2 && frame[1] <= COPROCESSOR_FRAME_SIZE && frame[1] == length - 2)
+        sha_update(frame + 2, frame[1]);
+      else
+        sha_failed = 1;
+      break;
+    case COPROCESSOR_CMD_HASH_FINAL:
+      sha_final();
+      tx_index = 0;
+      SPDR = digest[0];
+      sending_digest = 1;
+      ready_high();
+      break;
+    default:
+      sha_failed = 1;
+  }
+}
+#endif
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef COPROCESSOR_MODE
+#ifndef SERIAL_DEBUG
+//UART///////////////////////////////////////////////////////////////////
+// Interrupt-driven serial port for normal operation, in place of Serial.
+// The receive ring holds a full block of frames beyond the one being
+// written, so the host keeps sending while the card programs. During reads
+// the transmit ring moves into buf, which is free then, and holds most of
+// a block of frames, so the next block is read from the card meanwhile.
+//
+// SRAM: receive ring 608 + transmit ring 64 + buf 512 + frame 74 + sd_raw's
+// raw_block 512 + link_stats 16 + link_queue 36 = 1822 of the 2048 bytes;
+// the rest is left to the other globals, some 60 bytes, and the stack.
+// There is no room for a second block buffer, so reads stream the card
+// with CMD18 instead: the card sends the next block without a command of
+// its own, and buf, as the transmit ring, keeps the last block's frames
+// going out meanwhile.
+#define UART_RX_SIZE (LINK_WINDOW * LINK_FRAME_MAX + 16)
+#define UART_TX_SIZE 64 // power of two
+
+static volatile uint8_t rx_ring[UART_RX_SIZE];
+static volatile uint16_t rx_head;
+static volatile uint16_t rx_tail;
+static volatile uint8_t tx_small[UART_TX_SIZE];
+static volatile uint8_t* volatile tx_ring = tx_small;
+static volatile uint16_t tx_mask = UART_TX_SIZE - 1;
+static volatile uint16_t tx_head;
+static volatile uint16_t tx_tail;
+
+ISR(USART_RX_vect)
+{
+  uint8_t b = UDR0;
+  uint16_t next = rx_head + 1 == UART_RX_SIZE ? 0 : rx_head + 1;
+
+  // only a host ignoring its credits can overrun the ring
+  if (next != rx_tail)
+  {
+    rx_ring[rx_head] = b;
+    rx_head = next;
+  }
+}
+
+ISR(USART_UDRE_vect)
+{
+  if (tx_tail != tx_head)
+  {
+    UDR0 = tx_ring[tx_tail];
+    tx_tail = (tx_tail + 1) & tx_mask;
+  }
+  else
+  {
+    UCSR0B &= ~(1 << UDRIE0);
+  }
+}
+
+#ifdef LINK_NODE
+// lets go of the shared line once the last byte is out
+ISR(USART_TX_vect)
+{
+  if (tx_tail == tx_head)
+    UCSR0B &= ~(1 << TXEN0);
+}
+#endif
+
+void uart_init(uint32_t baud)
+{
+  UCSR0A = (1 << U2X0);
+  UBRR0 = (F_CPU / 8 + baud / 2) / baud - 1;
+  UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+  #ifdef LINK_NODE
+    UCSR0B = (1 << RXEN0) | (1 << RXCIE0) | (1 << TXCIE0);
+  #else
+    UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+  #endif
+}
+
+uint16_t uart_available()
+{
+  uint16_t head;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    head = rx_head;
+  }
+  return head >= rx_tail ? head - rx_tail : head + UART_RX_SIZE - rx_tail;
+}
+
+// returns the next received byte, or -1 if none comes within timeout_ms
+int16_t uart_get(uint16_t timeout_ms)
+{
+  uint32_t start = millis();
+
+  while (!uart_available())
+  {
+    if (millis() - start >= timeout_ms)
+      return -1;
+  }
+
+  uint8_t b = rx_ring[rx_tail];
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    rx_tail = rx_tail + 1 == UART_RX_SIZE ? 0 : rx_tail + 1;
+  }
+  return b;
+}
+
+uint16_t uart_tx_tail()
+{
+  uint16_t tail;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tail = tx_tail;
+  }
+  return tail;
+}
+
+void uart_write(uint8_t b)
+{
+  uint16_t next = (tx_head + 1) & tx_mask;
+
+  while (next == uart_tx_tail()) {}
+  tx_ring[tx_head] = b;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tx_head = next;
+  }
+  UCSR0B |= (1 << TXEN0) | (1 << UDRIE0);
+}
+
+// moves the transmit ring to size bytes (a power of two) at storage, once it has drained
+void uart_tx_storage(volatile uint8_t* storage, uint16_t size)
+{
+  while (tx_head != uart_tx_tail()) {}
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tx_ring = storage;
+    tx_mask = size - 1;
+    tx_head = 0;
+    tx_tail = 0;
+  }
+}
+
+//LINK FRAMES////////////////////////////////////////////////////////////
+static uint8_t frame[LINK_FRAME_MAX];
+static uint8_t frame_length;
+static uint8_t frame_code;
+static uint8_t frame_code_left;
+static uint8_t frame_overrun;
+static int16_t frame_pending; // length of a request in frame[] that ended the one before it
+
+// the requests of the last SD_QUEUE frame; those before queue_next have
+// been run, and their NAKs and SD_STATUS are still answered
+static struct link_request link_queue[LINK_QUEUE];
+static uint8_t queue_tag;
+static uint8_t queue_length;
+static uint8_t queue_next;
+static uint32_t link_session; // of the last SD_RESET
+
+// block bytes sent and received in data frames since power-up, and the
+// payload bytes of those frames, for the compression SD_GET_STATS reports
+static struct
+{
+  uint32_t sent_data;
+  uint32_t sent_frames;
+  uint32_t received_data;
+  uint32_t received_frames;
+} link_stats;
+
+// whether a tag is for this node
+uint8_t link_for_me(uint8_t tag)
+{
+  #ifdef LINK_NODE
+    return (tag >> LINK_NODE_SHIFT) == LINK_NODE;
+  #else
+    return 1;
+  #endif
+}
+
+// the session an SD_RESET of length bytes in frame[] starts, or the current one for any other frame
+uint32_t link_reset_session(int16_t length)
+{
+  #ifndef LINK_NODE
+    if (length == 6 && frame[0] == SD_RESET)
+      return frame[2] | ((uint32_t)frame[3] << 8) | ((uint32_t)frame[4] << 16) | ((uint32_t)frame[5] << 24);
+  #endif
+  return link_session;
+}
+
+// whether a frame for this node starts a new request rather than belonging to the one with tag
+uint8_t link_new_request(int16_t length, uint8_t tag)
+{
+  return length >= 2 && frame[1] != tag && link_for_me(frame[1]) &&
+         (frame[0] == SD_READ_BLOCKS || frame[0] == SD_WRITE_BLOCKS || frame[0] == SD_GET_INFO ||
+          frame[0] == SD_GET_STATS || (frame[0] == SD_QUEUE && frame[1] != queue_tag) ||
+          link_reset_session(length) != link_session);
+}
+
+// Run-length coding of the chunks in SD_PACKED frames: a byte n below
+// LINK_RUN is followed by n + 1 bytes as they are, and one from LINK_RUN by
+// a byte that repeats n - LINK_RUN + LINK_RUN_MIN times. The runs of a frame
+// make up exactly one chunk.
+#define LINK_RUN 0x80
+#define LINK_RUN_MIN 3
+
+// codes the chunk at data into out, which may start up to 5 bytes before
+// it: a repeat always saves the byte the next literal run costs, so the
+// coding never gets more than one byte ahead. Returns the coded length, or
+// 0 if that would hardly be shorter than the chunk (out is spoilt then).
+uint8_t link_pack(const uint8_t* data, uint8_t* out)
+{
+  uint8_t length = 0;
+  uint8_t literal = 0xff; // count byte of the literal run being added to
+  uint8_t i = 0;
+
+  while (i < LINK_CHUNK)
+  {
+    uint8_t b = data[i];
+    uint8_t run = 1;
+
+    if (length >= LINK_CHUNK - 2)
+      return 0;
+    while (i + run < LINK_CHUNK && data[i + run] == b)
+      run++;
+    if (run >= LINK_RUN_MIN)
+    {
+      out[length++] = LINK_RUN + run - LINK_RUN_MIN;
+      out[length++] = b;
+      literal = 0xff;
+      i += run;
+    }
+    else
+    {
+      if (literal == 0xff)
+      {
+        literal = length;
+        out[length++] = 0xff; // counts up to 0 with the first byte
+      }
+      out[literal]++;
+      out[length++] = b;
+      i++;
+    }
+  }
+  return length;
+}
+
+// decodes length bytes of runs into a chunk at out; returns 0 if they do
+// not make up exactly one chunk
+uint8_t link_unpack(const uint8_t* runs, uint8_t length, uint8_t* out)
+{
+  uint8_t filled = 0;
+  uint8_t i = 0;
+
+  while (i < length)
+  {
+    uint8_t n = runs[i++];
+
+    if (n >= LINK_RUN)
+    {
+      n = n - LINK_RUN + LINK_RUN_MIN;
+      if (i == length || filled + n > LINK_CHUNK)
+        return 0;
+      memset(out + filled, runs[i++], n);
+    }
+    else
+    {
+      n++;
+      if (i + n > length || filled + n > LINK_CHUNK)
+        return 0;
+      memcpy(out + filled, runs + i, n);
+      i += n;
+    }
+    filled += n;
+  }
+  return filled == LINK_CHUNK;
+}
+
+// COBS-encodes payload and its CRC into the transmit ring and ends the
+// frame; payload must have room for the two CRC bytes after length
+void link_send(uint8_t* payload, uint8_t length)
+{
+  uint16_t crc = 0xffff;
+
+  for (uint8_t i = 0; i < length; i++)
+    crc = _crc_ccitt_update(crc, payload[i]);
+  payload[length++] = crc;
+  payload[length++] = crc >> 8;
+
+  // each run of non-zero bytes goes out behind its length + 1, in place of the zero ending it
+  uint8_t start = 0;
+  for (;;)
+  {
+    uint8_t end = start;
+    while (end < length && payload[end] != 0)
+      end++;
+    uart_write(end - start + 1);
+    for (uint8_t i = start; i < end; i++)
+      uart_write(payload[i]);
+    if (end == length)
+      break;
+    start = end + 1;
+  }
+  uart_write(0);
+}
+
+void link_reply(uint8_t type, uint8_t tag)
+{
+  uint8_t reply[4] = { type, tag };
+  link_send(reply, 2);
+}
+
+void link_send_chunk_id(uint8_t type, uint8_t tag, uint16_t block, uint8_t chunk)
+{
+  uint8_t reply[6] = { type, tag, (uint8_t)block, (uint8_t)(block >> 8), chunk };
+  link_send(reply, 4);
+}
+
+void link_send_credit(uint8_t tag, uint16_t frames, uint8_t resync, uint16_t blocks)
+{
+  uint8_t reply[9] = { SD_CREDIT, tag, (uint8_t)frames, (uint8_t)(frames >> 8), resync,
+                       (uint8_t)blocks, (uint8_t)(blocks >> 8) };
+  link_send(reply, 7);
+}
+
+// decodes the next frame into frame[]; returns the length of its payload,
+// -1 for a damaged frame, or -2 if the link stays quiet for timeout_ms (a
+// frame cut short by the timeout carries on with the next call)
+int16_t link_receive(uint16_t timeout_ms)
+{
+  for (;;)
+  {
+    int16_t c = uart_get(timeout_ms);
+    if (c < 0)
+      return -2;
+
+    if (c == 0)
+    {
+      uint8_t length = frame_length, bad = frame_overrun || frame_code_left;
+      uint8_t started = frame_code != 0;
+
+      frame_length = 0;
+      frame_code = 0;
+      frame_code_left = 0;
+      frame_overrun = 0;
+      if (!started)
+        continue; // stray delimiter
+      if (bad || length < 3)
+        return -1;
+
+      uint16_t crc = 0xffff;
+      for (uint8_t i = 0; i < length - 2; i++)
+        crc = _crc_ccitt_update(crc, frame[i]);
+      if (frame[length - 2] != (uint8_t)crc || frame[length - 1] != (uint8_t)(crc >> 8))
+        return -1;
+      return length - 2;
+    }
+
+    if (frame_code_left)
+    {
+      frame_code_left--;
+    }
+    else
+    {
+      // a code byte: the run before it ended with a zero unless it was the first or a full one
+      uint8_t zero = frame_code && frame_code != 0xff;
+      frame_code = c;
+      frame_code_left = c - 1;
+      if (!zero)
+        continue;
+      c = 0;
+    }
+    if (frame_length < sizeof(frame))
+      frame[frame_length++] = c;
+    else
+      frame_overrun = 1;
+  }
+}
+#endif
+/////////////////////////////////////////////////////////////////////////
+
 uint32_t addr;
 uint32_t offset;
 uint16_t blks;
 uint8_t buf[BLK_SIZE];
+#endif
 
 void setup() {
   // put your setup code here, to run once:
+  #ifdef COPROCESSOR_MODE
+    coprocessor_setup();
+  #else
   offset = 0;
   blks = 0;
-  Serial.begin(9600);
+  #ifdef SERIAL_DEBUG
+    Serial.begin(9600);
+  #else
+    uart_init(LINK_BAUD);
+  #endif
   #ifdef SERIAL_DEBUG
   while(!Serial.available()){}
   Serial.println("About to try initializing SD card");
@@ -1193,17 +2029,16 @@ void setup() {
   #ifdef SERIAL_DEBUG
     Serial.println("Initialized SD card!");
   #endif
+  #endif
 }
 
+#ifndef COPROCESSOR_MODE
+#ifdef SERIAL_DEBUG
 void send_over_uart(char* v, int bytes)
 {
   for (int i = 0; i < bytes; i++)
   {
-    #ifdef SERIAL_DEBUG
-      Serial.print(*(v+i));
-    #else
-      Serial.write(*(v+i));
-    #endif
+    Serial.print(*(v+i));
   }
 }
 
@@ -1218,9 +2053,7 @@ void receive_over_uart(uint8_t* v, int bytes)
 
 void handle_get_info()
 {
-    #ifdef SERIAL_DEBUG
-      Serial.println("Getting info");
-    #endif
+    Serial.println("Getting info");
     struct sd_raw_info disk_info;
     if(sd_raw_get_info(&disk_info))
     {
@@ -1232,11 +2065,484 @@ void handle_get_info()
       Serial.write(SD_ERROR);
     }
 }
+#else
+static struct link_request current_read; // the last read started, which NAKs are answered for
+static uint8_t write_tag;
+static uint8_t write_status;
 
-void loop() {
+void handle_get_info(uint8_t tag)
+{
+  struct sd_raw_info disk_info;
+
+  if (!sd_raw_get_info(&disk_info))
+  {
+    link_reply(SD_ERROR, tag);
+    return;
+  }
+  frame[0] = SD_SUCCESS;
+  frame[1] = tag;
+  memcpy(frame + 2, &disk_info, sizeof(disk_info));
+  link_send(frame, 2 + sizeof(disk_info));
+}
+
+void handle_get_stats(uint8_t tag)
+{
+  frame[0] = SD_SUCCESS;
+  frame[1] = tag;
+  memcpy(frame + 2, &link_stats, sizeof(link_stats));
+  link_send(frame, 2 + sizeof(link_stats));
+}
+
+// sends one chunk of a read, taken from sd_raw's cache when it holds the block
+uint8_t send_read_chunk(const struct link_request* read, uint16_t block, uint8_t chunk)
+{
+  if (block >= read->count || chunk >= LINK_CHUNKS)
+    return 1;
+
+  offset_t offset = (offset_t)(read->lba + block) * BLK_SIZE + chunk * LINK_CHUNK;
+  uint8_t length = 0;
+
+  // coded in place, from the end of frame[] to behind the header
+  if (sd_raw_read(offset, frame + LINK_FRAME_MAX - LINK_CHUNK, LINK_CHUNK))
+    length = link_pack(frame + LINK_FRAME_MAX - LINK_CHUNK, frame + 5);
+  if (length)
+  {
+    frame[0] = SD_PACKED;
+  }
+  else if (sd_raw_read(offset, frame + 5, LINK_CHUNK))
+  {
+    frame[0] = SD_DATA;
+    length = LINK_CHUNK;
+  }
+  else
+  {
+    uint8_t reply[6] = { SD_ERROR, read->tag, (uint8_t)block, (uint8_t)(block >> 8) };
+    link_send(reply, 4);
+    return 0;
+  }
+  frame[1] = read->tag;
+  frame[2] = block;
+  frame[3] = block >> 8;
+  frame[4] = chunk;
+  link_send(frame, 5 + length);
+  link_stats.sent_data += LINK_CHUNK;
+  link_stats.sent_frames += 5 + length;
+  return 1;
+}
+
+// sends a block of the current read as SD_FILL if all its bytes are the
+// same; returns 0 if they are not, or the card fails, for the chunks to go
+uint8_t send_read_fill(uint16_t block)
+{
+  offset_t offset = (offset_t)(current_read.lba + block) * BLK_SIZE;
+  uint8_t fill = 0;
+
+  for (uint8_t chunk = 0; chunk < LINK_CHUNKS; chunk++)
+  {
+    if (!sd_raw_read(offset + chunk * LINK_CHUNK, frame + 5, LINK_CHUNK))
+      return 0;
+    if (chunk == 0)
+      fill = frame[5];
+    for (uint8_t i = 0; i < LINK_CHUNK; i++)
+    {
+      if (frame[5 + i] != fill)
+        return 0;
+    }
+  }
+
+  uint8_t reply[7] = { SD_FILL, current_read.tag, (uint8_t)block, (uint8_t)(block >> 8), fill };
+  link_send(reply, 5);
+  link_stats.sent_data += BLK_SIZE;
+  link_stats.sent_frames += 5;
+  return 1;
+}
+
+// the read or write with tag among the last one started and those of the queue that have run
+struct link_request* link_find(uint8_t type, uint8_t tag)
+{
+  if (type == SD_READ_BLOCKS && tag == current_read.tag)
+    return &current_read;
+  for (uint8_t i = 0; i < queue_next; i++)
+  {
+    if (link_queue[i].type == type && link_queue[i].tag == tag)
+      return &link_queue[i];
+  }
+  return 0;
+}
+
+// answers a frame for an earlier request: a NAK of a read, SD_STATUS of a
+// request that has ended, or the SD_QUEUE taken already, which is ignored;
+// returns 0 if the frame is none of these
+uint8_t link_answer(int16_t length)
+{
+  struct link_request* request;
+
+  if (length == 5 && frame[0] == SD_NAK)
+  {
+    if ((request = link_find(SD_READ_BLOCKS, frame[1])))
+      send_read_chunk(request, frame[2] | (frame[3] << 8), frame[4]);
+    return 1;
+  }
+  #ifndef LINK_NODE
+    if (length == 2 && frame[0] == SD_STATUS)
+    {
+      if (frame[1] == write_tag)
+        link_reply(write_status, write_tag);
+      else if ((request = link_find(SD_WRITE_BLOCKS, frame[1])) || (request = link_find(SD_READ_BLOCKS, frame[1])))
+      {
+        if (request->status)
+          link_reply(request->status, request->tag);
+      }
+      return 1;
+    }
+  #endif
+  return length >= 2 && frame[0] == SD_QUEUE && frame[1] == queue_tag;
+}
+
+// returns SD_SUCCESS once every block has gone out, SD_ERROR if the card
+// failed, or 0 if a new request ended the read
+uint8_t handle_read_blocks(uint8_t tag, uint32_t lba, uint16_t count)
+{
+  uint16_t block = 0;
+  uint8_t chunk = 0;
+  uint8_t status = SD_SUCCESS;
+  #ifdef LINK_NODE
+    uint16_t granted = 0;
+    uint8_t cached = 0;
+  #else
+    uint16_t granted = count;
+  #endif
+
+  current_read.type = SD_READ_BLOCKS;
+  current_read.tag = tag;
+  current_read.status = 0;
+  current_read.lba = lba;
+  current_read.count = count;
+
+  // buf holds most of a block of frames, so the card reads the next block while they go out
+  uart_tx_storage(buf, BLK_SIZE);
+  while (block < count)
+  {
+    // chunks the host missed go out again as soon as it asks
+    while (uart_available() || block >= granted)
+    {
+      #ifdef LINK_NODE
+        // the next block waits for the bus in sd_raw's cache
+        if (block >= granted && !cached)
+        {
+          uint8_t first;
+          offset_t offset = (offset_t)(lba + block) * BLK_SIZE;
+          sd_raw_read_stream(offset);
+          sd_raw_read(offset, &first, 1);
+          cached = 1;
+        }
+      #endif
+      int16_t length = link_receive(LINK_TIMEOUT_MS);
+
+      if (link_new_request(length, tag))
+      {
+        frame_pending = length;
+        status = 0;
+        goto done;
+      }
+      if (length < 2 || link_answer(length) || frame[1] != tag)
+        continue;
+      #ifdef LINK_NODE
+        if (length == 6 && frame[0] == SD_GRANT)
+        {
+          uint16_t from = frame[2] | (frame[3] << 8);
+          granted = frame[4] | (frame[5] << 8);
+          if (granted > count)
+            granted = count;
+          // a grant from a block already sent means the host lost it,
+          // such as a filled block in its one frame
+          if (block != from)
+          {
+            block = from;
+            chunk = 0;
+            cached = 0;
+          }
+        }
+      #endif
+    }
+    // the card streams the blocks with one CMD18, each read into sd_raw's
+    // cache while buf still holds frames of the one before; the stream is
+    // left running, so the next request picks it up if it follows on
+    if (chunk == 0)
+      sd_raw_read_stream((offset_t)(lba + block) * BLK_SIZE);
+    if (chunk == 0 && send_read_fill(block))
+      chunk = LINK_CHUNKS;
+    else if (!send_read_chunk(&current_read, block, chunk++))
+    {
+      status = SD_ERROR;
+      break;
+    }
+    if (chunk == LINK_CHUNKS)
+    {
+      block++;
+      chunk = 0;
+      #ifdef LINK_NODE
+        cached = 0;
+      #endif
+    }
+  }
+done:
+  uart_tx_storage(tx_small, UART_TX_SIZE);
+  current_read.status = status;
+  return status;
+}
+
+// whether frame[] holds data for one of the count blocks of the write with tag
+uint8_t write_data(int16_t length, uint8_t tag, uint16_t count)
+{
+  if (length < 5 || frame[1] != tag || (frame[2] | (frame[3] << 8)) >= count)
+    return 0;
+  switch (frame[0])
+  {
+    case SD_DATA:
+      return length == LINK_DATA_LENGTH && frame[4] < LINK_CHUNKS;
+    case SD_PACKED:
+      return frame[4] < LINK_CHUNKS;
+    case SD_FILL:
+      return length == 5;
+  }
+  return 0;
+}
+
+// stores the data of a frame passing write_data in buf; returns the chunks it held
+uint16_t take_write_data(int16_t length)
+{
+  uint8_t chunk = frame[4];
+
+  switch (frame[0])
+  {
+    case SD_FILL:
+      memset(buf, frame[4], BLK_SIZE);
+      return (1 << LINK_CHUNKS) - 1;
+    case SD_PACKED:
+      return link_unpack(frame + 5, length - 5, buf + chunk * LINK_CHUNK) ? 1 << chunk : 0;
+  }
+  memcpy(buf + chunk * LINK_CHUNK, frame + 5, LINK_CHUNK);
+  return 1 << chunk;
+}
+
+void nak_missing(uint8_t tag, uint16_t block, uint16_t received)
+{
+  for (uint8_t chunk = 0; chunk < LINK_CHUNKS; chunk++)
+  {
+    if (!(received & (1 << chunk)))
+      link_send_chunk_id(SD_NAK, tag, block, chunk);
+  }
+}
+
+// returns the write's status, SD_ERROR if a new request ended it
+uint8_t handle_write_blocks(uint8_t tag, uint32_t lba, uint16_t count)
+{
+  uint16_t frames = 0;
+  uint16_t asked = 0; // frames at the last time missing chunks were asked for
+  uint16_t block = 0;
+  uint16_t received = 0; // chunks of block in buf
+  uint32_t seen = 0; // chunks before this one were either received or asked for again
+  uint8_t quiet = 0;
+  uint8_t ok = 1;
+  #ifdef LINK_NODE
+    uint16_t granted = 0;
+  #else
+    uint16_t granted = count;
+  #endif
+
+  write_tag = tag;
+  #ifndef LINK_NODE
+    link_send_credit(tag, frames, 1, block);
+  #endif
+
+  while (block < count)
+  {
+    int16_t length = link_receive(LINK_TIMEOUT_MS);
+    uint32_t block_start = (uint32_t)block * LINK_CHUNKS;
+
+    if (link_new_request(length, tag))
+    {
+      frame_pending = length;
+      ok = 0;
+      break;
+    }
+    if (length >= 2 && !link_for_me(frame[1]))
+      continue;
+    // what the host asks about earlier requests is not part of this write's frames
+    if (length >= 2 && frame[1] != tag && link_answer(length))
+      continue;
+    if (length == -2)
+    {
+      // the bus is with another node
+      if (block >= granted)
+        continue;
+      // the host has gone away; whatever it sent so far is still synced below
+      if (++quiet == LINK_RETRIES)
+      {
+        ok = 0;
+        break;
+      }
+      // quiet: ask again for the rest of the block, and let the host resync its window
+      nak_missing(tag, block, received);
+      asked = frames;
+      link_send_credit(tag, frames, 1, block);
+      continue;
+    }
+    quiet = 0;
+    frames++;
+
+    #ifdef LINK_NODE
+      if (length == 6 && frame[0] == SD_GRANT && frame[1] == tag)
+      {
+        granted = frame[4] | (frame[5] << 8);
+        if (granted > count)
+          granted = count;
+        link_send_credit(tag, frames, !uart_available(), block);
+        continue;
+      }
+    #endif
+    if (write_data(length, tag, count))
+    {
+      uint16_t b = frame[2] | (frame[3] << 8);
+      uint8_t chunk = frame[0] == SD_FILL ? LINK_CHUNKS - 1 : frame[4];
+      uint32_t position = (uint32_t)b * LINK_CHUNKS + chunk;
+
+      link_stats.received_data += frame[0] == SD_FILL ? BLK_SIZE : LINK_CHUNK;
+      link_stats.received_frames += length;
+      if (b == block && !(received & (1 << chunk)))
+        received |= take_write_data(length);
+      // chunks skipped over were lost on the way
+      for (; seen < position && seen < block_start + LINK_CHUNKS; seen++)
+      {
+        if (seen >= block_start && !(received & (1 << (seen - block_start))))
+        {
+          link_send_chunk_id(SD_NAK, tag, block, seen - block_start);
+          asked = frames;
+        }
+      }
+      if (b > block)
+      {
+        link_send_chunk_id(SD_NAK, tag, b, chunk); // no room for the next block yet
+        // the host is still going past a hole here, so what it resent was lost too
+        if ((uint16_t)(frames - asked) > 2 * LINK_WINDOW)
+        {
+          nak_missing(tag, block, received);
+          asked = frames;
+        }
+      }
+      else if (position >= seen)
+        seen = position + 1;
+    }
+    // a full block counts as held before it is written, so the next one can start coming in
+    // (and the last one granted is the last word until the next grant)
+    uint8_t full = received == (1 << LINK_CHUNKS) - 1;
+    if (block < granted)
+      link_send_credit(tag, frames, 0, block + full);
+
+    if (full)
+    {
+      // the card programs the previous block while the ring takes in the next one
+      if (ok && !sd_raw_write((offset_t)(lba + block) * BLK_SIZE, buf, BLK_SIZE))
+        ok = 0;
+      block++;
+      received = 0;
+    }
+  }
+  if (!sd_raw_sync())
+    ok = 0;
+  write_status = ok ? SD_SUCCESS : SD_ERROR;
+  #ifndef LINK_NODE
+    link_reply(write_status, tag);
+  #endif
+  return write_status;
+}
+
+#ifndef LINK_NODE
+// takes the requests of an SD_QUEUE frame of length bytes, unless they are the ones taken already
+void handle_queue(uint8_t tag, int16_t length)
+{
+  uint8_t n = (length - 2) / 8;
+
+  if (tag == queue_tag)
+    return;
+  if (n == 0 || n > LINK_QUEUE || length != 2 + n * 8)
+  {
+    link_reply(SD_ERROR, tag);
+    return;
+  }
+  for (uint8_t i = 0; i < n; i++)
+  {
+    const uint8_t* d = frame + 2 + i * 8;
+    struct link_request* request = &link_queue[i];
+
+    request->type = d[0];
+    request->tag = d[1];
+    request->status = 0;
+    request->lba = d[2] | ((uint32_t)d[3] << 8) | ((uint32_t)d[4] << 16) | ((uint32_t)d[5] << 24);
+    request->count = d[6] | (d[7] << 8);
+  }
+  queue_tag = tag;
+  queue_length = n;
+  queue_next = 0;
+}
+
+// starts the session of an SD_RESET frame of length bytes, unless it is
+// the one started already: the requests of the last session are
+// forgotten, so their tags can come again
+void handle_reset(uint8_t tag, int16_t length)
+{
+  uint32_t session = link_reset_session(length);
+
+  if (length != 6)
+    return;
+  if (session != link_session)
+  {
+    link_session = session;
+    queue_tag = 0;
+    queue_length = 0;
+    queue_next = 0;
+    current_read.tag = 0;
+    current_read.count = 0;
+    write_tag = 0;
+  }
+  link_reply(SD_SUCCESS, tag);
+}
+
+// runs the next request of the queue and sends its completion record; a
+// read that fails has sent SD_ERROR with its block, and a write its status
+void run_queued()
+{
+  struct link_request* request = &link_queue[queue_next++];
+
+  if (request->type == SD_READ_BLOCKS)
+  {
+    request->status = handle_read_blocks(request->tag, request->lba, request->count);
+    if (request->status == SD_SUCCESS)
+      link_reply(SD_SUCCESS, request->tag);
+  }
+  else if (request->type == SD_WRITE_BLOCKS)
+  {
+    request->status = handle_write_blocks(request->tag, request->lba, request->count);
+  }
+  else
+  {
+    request->status = SD_ERROR;
+    link_reply(SD_ERROR, request->tag);
+  }
+  // a new request ended this one, and the rest of the queue with it
+  if (frame_pending)
+    queue_next = queue_length;
+}
+#endif
+#endif
+#endif
 
+void loop() {
   // put your main code here, to run repeatedly:
-  #ifdef SERIAL_DEBUG //do things in response to serial commands, for debug purposes
+  #if defined(COPROCESSOR_MODE)
+    coprocessor_loop();
+  #elif defined(SERIAL_DEBUG) //do things in response to serial commands, for debug purposes
     char cmd [10];
     if (Serial.available())
     {  
@@ -1290,49 +2596,60 @@ void loop() {
       }
     }
   #else               //normal operation, respond to non-human requests over UART
-    if (Serial.available())
+    #ifndef LINK_NODE
+    // what waits in the ring is for the next request of the queue, which the host has gone on to
+    if (!frame_pending && queue_next < queue_length)
     {
-      switch(Serial.read())
+      run_queued();
+      return;
+    }
+    #endif
+    if (frame_pending || uart_available())
+    {
+      int16_t length = frame_pending ? frame_pending : link_receive(LINK_TIMEOUT_MS);
+      uint8_t tag = frame[1];
+      uint32_t lba = frame[2] | ((uint32_t)frame[3] << 8) | ((uint32_t)frame[4] << 16) | ((uint32_t)frame[5] << 24);
+      uint16_t count = frame[6] | (frame[7] << 8);
+
+      frame_pending = 0;
+      if (length < 2 || !link_for_me(tag))
+        return;
+      switch(frame[0])
       {
-        case SD_READ: 
-          if (blks == 0) break;
-          if (offset == 0)
-          {
-            sd_raw_read(addr*BLK_SIZE, buf, BLK_SIZE);
-            addr++;
-            blks--; 
-          }
-          Serial.write(SD_SUCCESS);
-          send_over_uart(buf + offset, TRANSMIT_LENGTH);
-          offset = (offset + TRANSMIT_LENGTH) % BLK_SIZE;
+        case SD_READ_BLOCKS:
+          if (length == 8)
+            handle_read_blocks(tag, lba, count);
           break;
-        case SD_WRITE:
-          if (blks == 0) break;
-          receive_over_uart(buf + offset, TRANSMIT_LENGTH);
-          offset += TRANSMIT_LENGTH;
-          if (offset == BLK_SIZE)
-          {
-            sd_raw_write(addr*BLK_SIZE, buf, BLK_SIZE);
-            addr++;
-            blks--;
-            offset = 0;
-          } 
-          Serial.write(SD_SUCCESS);
+        case SD_WRITE_BLOCKS:
+          if (length == 8)
+            handle_write_blocks(tag, lba, count);
           break;
         case SD_GET_INFO:
-          handle_get_info();
+          handle_get_info(tag);
           break;
-        case SD_SET_ADDR:
-          receive_over_uart((uint8_t*)&addr, sizeof(uint32_t));
-          blks = 0;
+        case SD_GET_STATS:
+          handle_get_stats(tag);
           break;
-        case SD_SET_BLKS:
-           receive_over_uart((uint8_t*)&blks, sizeof(uint16_t));
+        case SD_NAK:
+          link_answer(length);
           break;
-        case SD_ABORT:
-          blks = 0;
-          offset = 0;
+        case SD_STATUS:
+        case SD_GRANT: // the last credit of a write that has ended was lost
+          if (tag == write_tag)
+            link_reply(write_status, tag);
+          #ifndef LINK_NODE
+          else
+            link_answer(length);
+          #endif
+          break;
+        #ifndef LINK_NODE
+        case SD_QUEUE:
+          handle_queue(tag, length);
+          break;
+        case SD_RESET:
+          handle_reset(tag, length);
           break;
+        #endif
       }
     }
   #endif